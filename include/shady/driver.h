@@ -16,6 +16,9 @@ typedef enum {
     IncorrectLogLevel = 16,
     InvalidTarget,
     ClangInvocationFailed,
+    MissingEntryPointsArg,
+    MissingCacheArg,
+    ServerSetupFailed = 32,
 } ShadyErrorCodes;
 
 typedef enum {
@@ -52,11 +55,21 @@ typedef struct {
     CompilerConfig config;
     CEmitterConfig c_emitter_config;
     struct List* input_filenames;
+    /// when not empty, the module is compiled for each of these entry points, sharing the work that does not depend on them
+    struct List* entry_points;
     CodegenTarget target;
     const char*     output_filename;
     const char* shd_output_filename;
     const char* cfg_output_filename;
     const char* loop_tree_output_filename;
+    struct {
+        /// opt-in on-disk cache of the outputs, see driver_fetch_cached_outputs
+        const char* dir;
+        size_t max_size;
+        /// set on a cache miss, driver_compile then stores the outputs under it
+        bool has_key;
+        uint64_t key[2];
+    } cache;
 } DriverConfig;
 
 DriverConfig default_driver_config();
@@ -65,6 +78,16 @@ void destroy_driver_config(DriverConfig*);
 void cli_parse_driver_arguments(DriverConfig* args, int* pargc, char** argv);
 
 ShadyErrorCodes driver_load_source_files(DriverConfig* args, Module* mod);
+/// Looks the outputs for these input files up in the cache directory, if there is one, and writes them out on a hit.
+/// Returns true if that happened, then there is nothing left to do: the sources don't even need to be loaded.
+bool driver_fetch_cached_outputs(DriverConfig* args, size_t inputs_count, const char** input_filenames);
 ShadyErrorCodes driver_compile(DriverConfig* args, Module* mod);
 
+typedef int (*DriverMainFn)(int argc, char** argv);
+
+// parses '--server <socket>', returns the socket path if the process should act as a compile server
+String cli_parse_server_args(int* pargc, char** argv);
+// serves compile requests sent by shady_client over a local socket, each request runs `fn` in a forked copy of this process
+ShadyErrorCodes driver_serve(String socket_path, DriverMainFn fn);
+
 #endif
@@ -72,6 +72,8 @@ ExecutionModel execution_model_from_string(const char*);
 
 String get_primop_name(Op op);
 bool has_primop_got_side_effects(Op op);
+/// The result only depends on the operands, so the instruction can be moved, merged or evaluated ahead of time
+bool is_primop_pure(Op op);
 
 // see grammar.json
 #include "grammar_generated.h"
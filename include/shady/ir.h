@@ -267,8 +267,22 @@ const Node* bind_last_instruction_and_wrap_in_block(BodyBuilder*, const Node*);
 
 //////////////////////////////// Compilation ////////////////////////////////
 
+/// How the dynamic scheduler picks the next branch to run among the ones that diverged.
+/// Keep the numbering in sync with SCHEDULER_POLICY in the scheduler's source !
+typedef enum {
+    /// Takes turns between the threads of the subgroup
+    SchedulerRoundRobin,
+    /// Runs the branch resuming into the function with the lowest id
+    SchedulerLowestFnId,
+    /// Runs the branch with the most threads in it
+    SchedulerLargestPopulation,
+    /// Runs the most deeply nested branch, so join points get resumed sooner
+    SchedulerDepthFirst,
+} SchedulerPolicy;
+
 typedef struct CompilerConfig_ {
     bool dynamic_scheduling;
+    SchedulerPolicy scheduler_policy;
     uint32_t per_thread_stack_size;
 
     struct {
@@ -282,9 +296,13 @@ typedef struct CompilerConfig_ {
 
         bool emulate_subgroup_ops;
         bool emulate_subgroup_ops_extended_types;
+        /// Builds the emulated subgroup operations out of native shuffles, instead of exchanging values through subgroup memory
+        bool native_subgroup_shuffles;
         bool simt_to_explicit_simd;
         bool int64;
         bool decay_ptrs;
+        /// Leaves switches alone instead of turning them into tables, bit tests and trees of ifs, for targets that have their own
+        bool native_switches;
     } lower;
 
     struct {
@@ -300,6 +318,10 @@ typedef struct CompilerConfig_ {
             bool delete_unused_instructions;
         } cleanup;
         bool inline_everything;
+        /// The top dispatcher runs the only possible successor of a function right away instead of going back around its loop
+        bool fall_through_dispatch;
+        /// Moves values through emulated memory as one block of words at constant offsets, instead of one field at a time
+        bool coalesce_emulated_memory;
     } optimisations;
 
     struct {
@@ -314,8 +336,17 @@ typedef struct CompilerConfig_ {
         int max_top_iterations;
     } shader_diagnostics;
 
+    struct {
+        /// How many threads the LLVM and SPIR-V front-ends convert function bodies with, 0 means one per hardware thread
+        uint32_t threads;
+    } frontend;
+
     struct {
         bool print_generated, print_builtin, print_internal;
+        /// Passes report what they did, ie which calls got inlined
+        bool pass_stats;
+        /// lower_alloca reports the size of the stack frame it lays out for each function
+        bool dump_frames;
     } logging;
 
     struct {
@@ -338,6 +369,16 @@ typedef enum CompilationResult_ {
 } CompilationResult;
 
 CompilationResult run_compiler_passes(CompilerConfig* config, Module** mod);
+/// run_compiler_passes is split in two halves: the shared one does not depend on `specialization.entry_point`,
+/// so its result can be specialized for several entry points. Its arena is frozen: nothing gets added to it anymore,
+/// so that can happen in parallel.
+CompilationResult run_shared_compiler_passes(CompilerConfig* config, Module** mod);
+/// Specializes the result of run_shared_compiler_passes for `specialization.entry_point` and finishes the pipeline,
+/// the module passed in is left untouched.
+CompilationResult run_specialized_compiler_passes(CompilerConfig* config, Module** mod);
+/// Parses the internal modules the pipeline links in (ie the builtin scheduler) once and keeps them around,
+/// so later compilations with the same target config can skip that work. Meant for long-lived processes.
+void prewarm_compiler(const CompilerConfig* config);
 void link_module(Module* dst, Module* src);
 
 //////////////////////////////// Emission ////////////////////////////////
@@ -0,0 +1,145 @@
+#ifndef _WIN32
+// for PTHREAD_MUTEX_RECURSIVE
+#define _XOPEN_SOURCE 700
+#endif
+
+#include "threading.h"
+#include "portability.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef struct Mutex_ {
+    CRITICAL_SECTION cs;
+} Mutex;
+
+Mutex* new_mutex() {
+    Mutex* m = malloc(sizeof(Mutex));
+    InitializeCriticalSection(&m->cs);
+    return m;
+}
+
+void destroy_mutex(Mutex* m) {
+    DeleteCriticalSection(&m->cs);
+    free(m);
+}
+
+void lock_mutex(Mutex* m) { EnterCriticalSection(&m->cs); }
+void unlock_mutex(Mutex* m) { LeaveCriticalSection(&m->cs); }
+
+size_t get_hardware_threads_count() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+typedef HANDLE Thread;
+#define THREAD_ENTRY_POINT(name) static DWORD WINAPI name(LPVOID uptr)
+#define THREAD_RETURN return 0
+static bool start_thread(Thread* t, LPTHREAD_START_ROUTINE fn, void* uptr) {
+    *t = CreateThread(NULL, 0, fn, uptr, 0, NULL);
+    return *t != NULL;
+}
+static void join_thread(Thread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct Mutex_ {
+    pthread_mutex_t mutex;
+} Mutex;
+
+Mutex* new_mutex() {
+    Mutex* m = malloc(sizeof(Mutex));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return m;
+}
+
+void destroy_mutex(Mutex* m) {
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+}
+
+void lock_mutex(Mutex* m) { pthread_mutex_lock(&m->mutex); }
+void unlock_mutex(Mutex* m) { pthread_mutex_unlock(&m->mutex); }
+
+size_t get_hardware_threads_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t) n : 1;
+}
+
+typedef pthread_t Thread;
+#define THREAD_ENTRY_POINT(name) static void* name(void* uptr)
+#define THREAD_RETURN return NULL
+static bool start_thread(Thread* t, void* (*fn)(void*), void* uptr) {
+    return pthread_create(t, NULL, fn, uptr) == 0;
+}
+static void join_thread(Thread t) {
+    pthread_join(t, NULL);
+}
+#endif
+
+typedef struct {
+    Mutex* lock;
+    size_t next;
+    size_t count;
+    ParallelForFn fn;
+    void* uptr;
+} ParallelFor;
+
+THREAD_ENTRY_POINT(parallel_for_worker) {
+    ParallelFor* job = uptr;
+    while (true) {
+        lock_mutex(job->lock);
+        size_t i = job->next++;
+        unlock_mutex(job->lock);
+        if (i >= job->count)
+            break;
+        job->fn(job->uptr, i);
+    }
+    THREAD_RETURN;
+}
+
+void parallel_for(size_t count, size_t threads_count, ParallelForFn fn, void* uptr) {
+    if (threads_count == 0)
+        threads_count = get_hardware_threads_count();
+    if (threads_count > count)
+        threads_count = count;
+    if (threads_count <= 1) {
+        for (size_t i = 0; i < count; i++)
+            fn(uptr, i);
+        return;
+    }
+
+    ParallelFor job = {
+        .lock = new_mutex(),
+        .next = 0,
+        .count = count,
+        .fn = fn,
+        .uptr = uptr,
+    };
+    // the calling thread does its share of the work too
+    size_t extra_threads = threads_count - 1;
+    Thread* threads = calloc(extra_threads, sizeof(Thread));
+    size_t started = 0;
+    for (; started < extra_threads; started++) {
+        if (!start_thread(&threads[started], parallel_for_worker, &job))
+            break;
+    }
+    parallel_for_worker(&job);
+    for (size_t i = 0; i < started; i++)
+        join_thread(threads[i]);
+    free(threads);
+    destroy_mutex(job.lock);
+}
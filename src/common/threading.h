@@ -0,0 +1,22 @@
+#ifndef SHADY_THREADING_H
+#define SHADY_THREADING_H
+
+#include <stddef.h>
+
+/// Recursive: the thread holding it may lock it again
+typedef struct Mutex_ Mutex;
+
+Mutex* new_mutex();
+void destroy_mutex(Mutex*);
+void lock_mutex(Mutex*);
+void unlock_mutex(Mutex*);
+
+size_t get_hardware_threads_count();
+
+typedef void (*ParallelForFn)(void* uptr, size_t i);
+
+/// Calls fn(uptr, i) for every i in [0, count), spread over up to threads_count threads (the calling one included).
+/// A threads_count of 0 uses one thread per hardware thread. Returns once every call has returned.
+void parallel_for(size_t count, size_t threads_count, ParallelForFn fn, void* uptr);
+
+#endif
@@ -105,6 +105,61 @@ err_post_open:
     return false;
 }
 
+#ifdef _WIN32
+
+bool map_file(const char* filename, size_t* size, const char** output) {
+    char* contents;
+    if (!read_file(filename, size, &contents))
+        return false;
+    *output = contents;
+    return true;
+}
+
+void unmap_file(const char* data, size_t size) {
+    free((void*) data);
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool map_file(const char* filename, size_t* size, const char** output) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        goto err_post_open;
+
+    void* mapped = NULL;
+    if (st.st_size > 0) {
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED)
+            goto err_post_open;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    *output = mapped;
+    *size = st.st_size;
+    return true;
+
+err_post_open:
+    close(fd);
+    return false;
+}
+
+void unmap_file(const char* data, size_t size) {
+    if (data)
+        munmap((void*) data, size);
+}
+
+#endif
+
 bool write_file(const char* filename, size_t size, const char* data) {
     FILE* f = fopen(filename, "wb");
     if (f == NULL)
@@ -126,7 +181,7 @@ enum {
     ThreadLocalStaticBufferSize = 256
 };
 
-static char static_buffer[ThreadLocalStaticBufferSize];
+static _Thread_local char static_buffer[ThreadLocalStaticBufferSize];
 
 void format_string_internal(const char* str, va_list args, void* uptr, void callback(void*, size_t, char*)) {
     size_t buffer_size = ThreadLocalStaticBufferSize;
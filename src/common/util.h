@@ -8,6 +8,9 @@ size_t apply_escape_codes(const char* src, size_t og_len, char* dst);
 size_t unapply_escape_codes(const char* src, size_t og_len, char* dst);
 
 bool read_file(const char* filename, size_t* size, char** output);
+/// Maps a file read-only into memory where the platform allows it, unlike read_file the contents are not zero-terminated
+bool map_file(const char* filename, size_t* size, const char** output);
+void unmap_file(const char* data, size_t size);
 bool write_file(const char* filename, size_t size, const char* data);
 
 typedef struct Arena_ Arena;
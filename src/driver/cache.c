@@ -0,0 +1,301 @@
+// for dladdr()
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#include "growy.h"
+#include "list.h"
+#include "log.h"
+#include "util.h"
+#include "portability.h"
+
+#include "murmur3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Bump this whenever the layout of the key material or of the entries changes
+#define SHADY_CACHE_FORMAT_VERSION 1
+#define CACHE_ENTRY_SUFFIX ".shdcache"
+
+static CacheKey hash_bytes(size_t size, const char* data) {
+    CacheKey key;
+    // MurmurHash3 takes an int length, so huge inputs are hashed by chunks and the chunk digests hashed again
+    const size_t chunk = 1 << 30;
+    if (size <= chunk) {
+        MurmurHash3_x64_128(data, (int) size, SHADY_CACHE_FORMAT_VERSION, &key.hash);
+        return key;
+    }
+    Growy* g = new_growy();
+    for (size_t offset = 0; offset < size; offset += chunk) {
+        CacheKey part = hash_bytes(size - offset < chunk ? size - offset : chunk, data + offset);
+        growy_append_object(g, part);
+    }
+    key = hash_bytes(growy_size(g), growy_data(g));
+    destroy_growy(g);
+    return key;
+}
+
+static void append_u64(Growy* g, uint64_t v) {
+    growy_append_object(g, v);
+}
+
+static void append_string(Growy* g, const char* str) {
+    // strings are length-prefixed so concatenations can't collide
+    if (!str) {
+        append_u64(g, UINT64_MAX);
+        return;
+    }
+    append_u64(g, strlen(str));
+    growy_append_bytes(g, strlen(str), str);
+}
+
+/// Only the fields that can change the output go in, and they go in one by one so struct padding doesn't leak into the key.
+/// Keep this in sync with CompilerConfig !
+static void append_compiler_config(Growy* g, const CompilerConfig* config) {
+    append_u64(g, config->dynamic_scheduling);
+    append_u64(g, config->scheduler_policy);
+    append_u64(g, config->per_thread_stack_size);
+    append_u64(g, config->target_spirv_version.major);
+    append_u64(g, config->target_spirv_version.minor);
+
+    append_u64(g, config->lower.emulate_generic_ptrs);
+    append_u64(g, config->lower.emulate_physical_memory);
+    append_u64(g, config->lower.emulate_subgroup_ops);
+    append_u64(g, config->lower.emulate_subgroup_ops_extended_types);
+    append_u64(g, config->lower.native_subgroup_shuffles);
+    append_u64(g, config->lower.simt_to_explicit_simd);
+    append_u64(g, config->lower.int64);
+    append_u64(g, config->lower.decay_ptrs);
+    append_u64(g, config->lower.native_switches);
+
+    append_u64(g, config->hacks.spv_shuffle_instead_of_broadcast_first);
+    append_u64(g, config->hacks.force_join_point_lifting);
+    append_u64(g, config->hacks.restructure_everything);
+    append_u64(g, config->hacks.recover_structure);
+
+    append_u64(g, config->optimisations.cleanup.after_every_pass);
+    append_u64(g, config->optimisations.cleanup.delete_unused_instructions);
+    append_u64(g, config->optimisations.inline_everything);
+    append_u64(g, config->optimisations.fall_through_dispatch);
+    append_u64(g, config->optimisations.coalesce_emulated_memory);
+
+    append_u64(g, config->printf_trace.memory_accesses);
+    append_u64(g, config->printf_trace.stack_accesses);
+    append_u64(g, config->printf_trace.god_function);
+    append_u64(g, config->printf_trace.stack_size);
+    append_u64(g, config->printf_trace.subgroup_ops);
+
+    append_u64(g, (uint64_t) config->shader_diagnostics.max_top_iterations);
+
+    // frontend.threads is left out on purpose: the front-ends produce the same module regardless
+
+    append_u64(g, config->logging.print_generated);
+    append_u64(g, config->logging.print_builtin);
+    append_u64(g, config->logging.print_internal);
+
+    append_string(g, config->specialization.entry_point);
+    append_u64(g, config->specialization.execution_model);
+    append_u64(g, config->specialization.subgroup_size);
+
+    append_u64(g, config->target.memory.ptr_size);
+    append_u64(g, config->target.memory.word_size);
+}
+
+static void append_c_emitter_config(Growy* g, const CEmitterConfig* config) {
+    append_u64(g, config->dialect);
+    append_u64(g, config->explicitly_sized_types);
+    append_u64(g, config->allow_compound_literals);
+    append_u64(g, config->decay_unsized_arrays);
+}
+
+static bool append_input_file(Growy* g, const char* filename) {
+    size_t size;
+    const char* contents;
+    if (!map_file(filename, &size, &contents))
+        return false;
+    // the file name can end up in the output (module and debug names), so it is part of the key too
+    append_string(g, filename);
+    append_u64(g, size);
+    CacheKey digest = hash_bytes(size, contents);
+    growy_append_object(g, digest);
+    unmap_file(contents, size);
+    return true;
+}
+
+#ifdef _WIN32
+
+static bool append_build_id(SHADY_UNUSED Growy* g) {
+    return false;
+}
+
+bool cache_fetch(SHADY_UNUSED const char* dir, SHADY_UNUSED CacheKey key, SHADY_UNUSED size_t* size, SHADY_UNUSED char** data) {
+    return false;
+}
+
+void cache_store(SHADY_UNUSED const char* dir, SHADY_UNUSED size_t max_size, SHADY_UNUSED CacheKey key, SHADY_UNUSED size_t size, SHADY_UNUSED const char* data) {}
+
+#else
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static bool append_binary_id(Growy* g, const char* path) {
+    struct stat s;
+    if (stat(path, &s) != 0)
+        return false;
+    append_u64(g, (uint64_t) s.st_size);
+    append_u64(g, (uint64_t) s.st_mtime);
+    append_u64(g, (uint64_t) s.st_ino);
+    return true;
+}
+
+/// There is no version number worth trusting while hacking on the compiler, so the binaries are identified by their
+/// size and modification time instead: the library with the passes in it (or the executable, when linked statically)
+/// and the one with the driver in it.
+static bool append_build_id(Growy* g) {
+    Dl_info info;
+    const void* functions[] = { (const void*) run_compiler_passes, (const void*) compute_cache_key };
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (dladdr(functions[i], &info) && info.dli_fname && append_binary_id(g, info.dli_fname))
+            continue;
+        const char* exe = get_executable_location();
+        bool ok = append_binary_id(g, exe);
+        free((void*) exe);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static char* get_entry_path(const char* dir, CacheKey key) {
+    return format_string_new("%s/%016llx%016llx" CACHE_ENTRY_SUFFIX, dir, (unsigned long long) key.hash[0], (unsigned long long) key.hash[1]);
+}
+
+bool cache_fetch(const char* dir, CacheKey key, size_t* size, char** data) {
+    char* path = get_entry_path(dir, key);
+    bool found = read_file(path, size, data);
+    // this is what makes eviction LRU rather than FIFO
+    if (found)
+        utimes(path, NULL);
+    free(path);
+    return found;
+}
+
+typedef struct {
+    char* path;
+    size_t size;
+    time_t last_use;
+} CacheEntry;
+
+static int compare_entries_by_last_use(const void* a, const void* b) {
+    time_t ta = ((const CacheEntry*) a)->last_use;
+    time_t tb = ((const CacheEntry*) b)->last_use;
+    return (ta > tb) - (ta < tb);
+}
+
+/// Deletes the least recently used entries until the directory fits in `max_size` again.
+/// Other processes might be evicting at the same time, so files vanishing under our feet are fine.
+static void evict_entries(const char* dir, size_t max_size) {
+    DIR* d = opendir(dir);
+    if (!d)
+        return;
+
+    struct List* entries = new_list(CacheEntry);
+    size_t total_size = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(d))) {
+        // leave alone anything that isn't ours, including the temporary files of in-flight stores
+        if (!string_ends_with(dirent->d_name, CACHE_ENTRY_SUFFIX))
+            continue;
+        char* path = format_string_new("%s/%s", dir, dirent->d_name);
+        struct stat s;
+        if (stat(path, &s) != 0 || !S_ISREG(s.st_mode)) {
+            free(path);
+            continue;
+        }
+        CacheEntry entry = { .path = path, .size = (size_t) s.st_size, .last_use = s.st_mtime };
+        append_list(CacheEntry, entries, entry);
+        total_size += entry.size;
+    }
+    closedir(d);
+
+    size_t count = entries_count_list(entries);
+    CacheEntry* sorted = read_list(CacheEntry, entries);
+    if (total_size > max_size) {
+        qsort(sorted, count, sizeof(CacheEntry), compare_entries_by_last_use);
+        for (size_t i = 0; i < count && total_size > max_size; i++) {
+            if (unlink(sorted[i].path) == 0 || errno == ENOENT)
+                total_size -= sorted[i].size;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+        free(sorted[i].path);
+    destroy_list(entries);
+}
+
+void cache_store(const char* dir, size_t max_size, CacheKey key, size_t size, const char* data) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        warn_print("Could not create cache directory '%s'\n", dir);
+        return;
+    }
+
+    char* path = get_entry_path(dir, key);
+    // entry points are emitted in parallel, so the temporary file is unique to this thread (by way of its stack) too
+    char* tmp_path = format_string_new("%s.%d.%p.tmp", path, (int) getpid(), (void*) &path);
+    if (!write_file(tmp_path, size, data) || rename(tmp_path, path) != 0) {
+        warn_print("Could not store cache entry '%s'\n", path);
+        unlink(tmp_path);
+    } else {
+        debug_print("Stored cache entry '%s'\n", path);
+    }
+    free(tmp_path);
+    free(path);
+
+    evict_entries(dir, max_size);
+}
+
+#endif
+
+bool compute_cache_key(const DriverConfig* args, size_t inputs_count, const char** input_filenames, CacheKey* key) {
+    // the dumps and pass statistics are only produced by running the pipeline, and hooks expect to see it run
+    if (!args->output_filename || args->shd_output_filename || args->cfg_output_filename || args->loop_tree_output_filename)
+        return false;
+    if (args->config.hooks.after_pass.fn || args->config.logging.pass_stats || args->config.logging.dump_frames)
+        return false;
+
+    Growy* g = new_growy();
+    bool ok = append_build_id(g);
+
+    append_compiler_config(g, &args->config);
+    append_c_emitter_config(g, &args->c_emitter_config);
+    append_u64(g, args->target);
+    size_t entry_points_count = entries_count_list(args->entry_points);
+    append_u64(g, entry_points_count);
+    for (size_t i = 0; i < entry_points_count; i++)
+        append_string(g, read_list(const char*, args->entry_points)[i]);
+
+    append_u64(g, inputs_count);
+    for (size_t i = 0; i < inputs_count && ok; i++)
+        ok &= append_input_file(g, input_filenames[i]);
+
+    if (ok)
+        *key = hash_bytes(growy_size(g), growy_data(g));
+    destroy_growy(g);
+    return ok;
+}
+
+CacheKey derive_cache_key(CacheKey key, const char* entry_point) {
+    Growy* g = new_growy();
+    growy_append_object(g, key);
+    append_string(g, entry_point);
+    CacheKey derived = hash_bytes(growy_size(g), growy_data(g));
+    destroy_growy(g);
+    return derived;
+}
@@ -0,0 +1,29 @@
+#ifndef SHADY_DRIVER_CACHE_H
+#define SHADY_DRIVER_CACHE_H
+
+// Content-addressed on-disk store for the driver outputs (cache.c)
+//
+// Every entry is a single file named after its key, written to a temporary file first and then renamed in place,
+// so concurrent compiler processes sharing a directory never observe a partial entry.
+// Reading an entry refreshes its timestamp, and the least recently used ones are evicted once the directory grows past its budget.
+
+#include "shady/driver.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    uint64_t hash[2];
+} CacheKey;
+
+/// Hashes everything the outputs depend on: the inputs, the driver & compiler configuration and the compiler binaries themselves.
+/// Returns false when the invocation can't be cached (no output, dumps or hooks requested, unreadable inputs...)
+bool compute_cache_key(const DriverConfig* args, size_t inputs_count, const char** input_filenames, CacheKey* key);
+/// Each entry point compiled with --entry-points gets its own entry
+CacheKey derive_cache_key(CacheKey key, const char* entry_point);
+
+bool cache_fetch(const char* dir, CacheKey key, size_t* size, char** data);
+void cache_store(const char* dir, size_t max_size, CacheKey key, size_t size, const char* data);
+
+#endif
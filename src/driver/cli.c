@@ -91,9 +91,16 @@ F(config->logging.print_internal, print-internal) \
 F(config->logging.print_generated, print-builtin) \
 F(config->logging.print_generated, print-generated) \
 F(config->lower.simt_to_explicit_simd, lower-simt-to-simd) \
+F(config->lower.native_switches, native-switches) \
+F(config->lower.emulate_subgroup_ops, emulate-subgroup-ops) \
+F(config->lower.native_subgroup_shuffles, native-subgroup-shuffles) \
 F(config->optimisations.inline_everything, inline-everything) \
+F(config->optimisations.fall_through_dispatch, fall-through-dispatch) \
+F(config->optimisations.coalesce_emulated_memory, coalesce-emulated-memory) \
 F(config->hacks.restructure_everything, restructure-everything) \
 F(config->hacks.recover_structure, recover-structure) \
+F(config->logging.pass_stats, pass-stats) \
+F(config->logging.dump_frames, dump-frames) \
 
 static IntSizes parse_int_size(String argv) {
     if (strcmp(argv, "8") == 0)
@@ -135,6 +142,12 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
             if (i == argc)
                 error("Missing stack size");
             config->per_thread_stack_size = atoi(argv[i]);
+        } else if (strcmp(argv[i], "--frontend-threads") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing thread count");
+            config->frontend.threads = atoi(argv[i]);
         } else if (strcmp(argv[i], "--execution-model") == 0) {
             argv[i] = NULL;
             i++;
@@ -154,6 +167,21 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
                 default: break;
             }
             config->specialization.execution_model = em;
+        } else if (strcmp(argv[i], "--scheduler-policy") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc)
+                error("Missing scheduler policy");
+            if (strcmp(argv[i], "round-robin") == 0)
+                config->scheduler_policy = SchedulerRoundRobin;
+            else if (strcmp(argv[i], "lowest-fn-id") == 0)
+                config->scheduler_policy = SchedulerLowestFnId;
+            else if (strcmp(argv[i], "largest-population") == 0)
+                config->scheduler_policy = SchedulerLargestPopulation;
+            else if (strcmp(argv[i], "depth-first") == 0)
+                config->scheduler_policy = SchedulerDepthFirst;
+            else
+                error("Unknown scheduler policy: %s", argv[i]);
         } else if (strcmp(argv[i], "--word-size") == 0) {
             argv[i] = NULL;
             i++;
@@ -177,6 +205,7 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
         error_print("  --no-dynamic-scheduling                   Disable the built-in dynamic scheduler, restricts code to only leaf functions\n");
         error_print("  --simt2d                                  Emits SIMD code instead of SIMT, only effective with the C backend.\n");
         error_print("  --entry-point <foo>                       Selects an entry point for the program to be specialized on.\n");
+        error_print("  --scheduler-policy <policy>               How the dynamic scheduler picks between diverged branches, one of: round-robin (default), lowest-fn-id, largest-population, depth-first\n");
         error_print("  --word-size <8|16|32|64>                  Sets the word size for physical memory emulation (default=32)\n");
         error_print("  --pointer-size <8|16|32|64>               Sets the pointer size for physical pointers (default=64)\n");
 #define EM(name, _) #name", "
@@ -184,6 +213,14 @@ void cli_parse_compiler_config_args(CompilerConfig* config, int* pargc, char** a
 #undef EM
         error_print("  --subgroup-size N                         Sets the subgroup size the program will be specialized for.\n");
         error_print("  --lift-join-points                        Forcefully lambda-lifts all join points. Can help with reconvergence issues.\n");
+        error_print("  --native-switches                         Leaves switches for the backend to lower\n");
+        error_print("  --emulate-subgroup-ops                    Emulates subgroup reductions, scans and shuffles, for targets without them\n");
+        error_print("  --native-subgroup-shuffles                Builds the emulated subgroup ops out of native shuffles instead of subgroup memory\n");
+        error_print("  --no-fall-through-dispatch                Always goes back to the top of the dispatcher loop after running a function\n");
+        error_print("  --no-coalesce-emulated-memory             Loads and stores emulated memory one field at a time\n");
+        error_print("  --pass-stats                              Prints what the optimisation passes did, ie which calls got inlined and why\n");
+        error_print("  --dump-frames                             Prints the size of the stack frame of every function, and how much sharing slots saved\n");
+        error_print("  --frontend-threads N                      Converts LLVM/SPIR-V function bodies on N threads, 0 uses all hardware threads (default=1)\n");
     }
 
     cli_pack_remaining_args(pargc, argv);
@@ -208,14 +245,20 @@ DriverConfig default_driver_config() {
         .config = default_compiler_config(),
         .target = TgtAuto,
         .input_filenames = new_list(const char*),
+        .entry_points = new_list(const char*),
         .output_filename = NULL,
         .cfg_output_filename = NULL,
         .shd_output_filename = NULL,
+        .cache = {
+            .dir = NULL,
+            .max_size = (size_t) 256 * 1024 * 1024,
+        },
     };
 }
 
 void destroy_driver_config(DriverConfig* config) {
     destroy_list(config->input_filenames);
+    destroy_list(config->entry_points);
 }
 
 void cli_parse_driver_arguments(DriverConfig* args, int* pargc, char** argv) {
@@ -255,6 +298,39 @@ void cli_parse_driver_arguments(DriverConfig* args, int* pargc, char** argv) {
                 exit(MissingDumpIrArg);
             }
             args->shd_output_filename = argv[i];
+        } else if (strcmp(argv[i], "--entry-points") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc) {
+                error_print("--entry-points must be followed with a comma-separated list of entry points");
+                exit(MissingEntryPointsArg);
+            }
+            // split in place, the list points into argv
+            char* entry_point = argv[i];
+            while (entry_point) {
+                char* next = strchr(entry_point, ',');
+                if (next)
+                    *(next++) = '\0';
+                if (*entry_point)
+                    append_list(const char*, args->entry_points, entry_point);
+                entry_point = next;
+            }
+        } else if (strcmp(argv[i], "--cache-dir") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc) {
+                error_print("--cache-dir must be followed with a directory");
+                exit(MissingCacheArg);
+            }
+            args->cache.dir = argv[i];
+        } else if (strcmp(argv[i], "--cache-max-size") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc) {
+                error_print("--cache-max-size must be followed with a size in MiB");
+                exit(MissingCacheArg);
+            }
+            args->cache.max_size = (size_t) strtoull(argv[i], NULL, 10) * 1024 * 1024;
         } else if (strcmp(argv[i], "--target") == 0) {
             argv[i] = NULL;
             i++;
@@ -292,6 +368,9 @@ void cli_parse_driver_arguments(DriverConfig* args, int* pargc, char** argv) {
         error_print("  --dump-cfg <filename>                     Dumps the control flow graph of the final IR\n");
         error_print("  --dump-loop-tree <filename>\n");
         error_print("  --dump-ir <filename>                      Dumps the final IR\n");
+        error_print("  --entry-points <a,b,c>                    Compiles each entry point separately, sharing the common part of the pipeline (outputs are named foo.a.spv, foo.b.spv...)\n");
+        error_print("  --cache-dir <dir>                         Reuses the outputs of identical earlier compilations stored in <dir>, and stores new ones there\n");
+        error_print("  --cache-max-size <MiB>                    Evicts the least recently used outputs once the cache grows past this size (default: 256)\n");
     }
 
     cli_pack_remaining_args(pargc, argv);
@@ -0,0 +1,161 @@
+// Forwards a compiler invocation to a compile server started with `slim --server <socket>` or `vcc --server <socket>`
+// Usage: shady_client <compiler> [args...]
+// The socket is taken from the SHADY_SERVER_SOCKET environment variable. If it is not set, no server answers, or the
+// server is not the very compiler binary that would run otherwise, the compiler is simply executed locally instead,
+// so this can be used as a drop-in launcher in build systems. Once the server took the request, its outcome is final.
+
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool send_string(int conn, const char* str) {
+    uint32_t len = (uint32_t) strlen(str);
+    return server_send_all(conn, &len, sizeof(len)) && server_send_all(conn, str, len);
+}
+
+static int connect_to_server(const char* socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0)
+        return -1;
+    if (connect(conn, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(conn);
+        return -1;
+    }
+    return conn;
+}
+
+/// Finds the file execvp() would run
+static char* find_executable(const char* name) {
+    if (strchr(name, '/'))
+        return strdup(name);
+    const char* path = getenv("PATH");
+    if (!path)
+        return NULL;
+    while (true) {
+        const char* end = strchr(path, ':');
+        size_t len = end ? (size_t) (end - path) : strlen(path);
+        // an empty entry means the current directory
+        char* candidate = malloc(len + strlen(name) + 3);
+        sprintf(candidate, "%.*s/%s", (int) len, len ? path : ".", name);
+        if (access(candidate, X_OK) == 0)
+            return candidate;
+        free(candidate);
+        if (!end)
+            return NULL;
+        path = end + 1;
+    }
+}
+
+static bool is_expected_server(int conn, const char* compiler) {
+    ServerHello hello;
+    if (!server_recv_all(conn, &hello, sizeof(hello)))
+        return false;
+    if (hello.magic != SHADY_SERVER_MAGIC || hello.version != SHADY_SERVER_PROTOCOL_VERSION)
+        return false;
+
+    char* executable = find_executable(compiler);
+    ServerIdentity identity;
+    bool identified = server_identify(executable, &identity);
+    free(executable);
+    return identified && memcmp(&identity, &hello.identity, sizeof(identity)) == 0;
+}
+
+/// Sends the header along with our stdin, stdout and stderr
+static bool send_header(int conn, uint32_t argc) {
+    ServerRequestHeader header = {
+        .magic = SHADY_SERVER_MAGIC,
+        .version = SHADY_SERVER_PROTOCOL_VERSION,
+        .argc = argc,
+    };
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    while ((sent = sendmsg(conn, &msg, 0)) < 0 && errno == EINTR);
+    if (sent < 0)
+        return false;
+    return server_send_all(conn, (char*) &header + sent, sizeof(header) - sent);
+}
+
+/// Returns false if the request could not be handed over to the server, in which case we can still compile locally.
+/// Past that point the server might have run the compiler already, so whatever happens is reported instead.
+static bool forward_request(const char* socket_path, int argc, char** argv, int* exit_code) {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return false;
+
+    int conn = connect_to_server(socket_path);
+    if (conn < 0)
+        return false;
+    if (!is_expected_server(conn, argv[0])) {
+        close(conn);
+        return false;
+    }
+
+    // the server sees our working directory in place of argv[0]
+    bool sent = send_header(conn, (uint32_t) argc) && send_string(conn, cwd);
+    for (int i = 1; i < argc && sent; i++)
+        sent &= send_string(conn, argv[i]);
+    if (!sent) {
+        close(conn);
+        return false;
+    }
+
+    ServerResponse response;
+    bool answered = server_recv_all(conn, &response, sizeof(response));
+    close(conn);
+
+    if (!answered) {
+        fprintf(stderr, "shady_client: lost the connection to the compile server\n");
+        *exit_code = 1;
+    } else if (response.exit_code < 0) {
+        fprintf(stderr, "shady_client: the compile server could not run '%s'\n", argv[0]);
+        *exit_code = 1;
+    } else
+        *exit_code = response.exit_code;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: shady_client <compiler> [args...]\n");
+        return 1;
+    }
+
+    const char* socket_path = getenv(SHADY_SERVER_SOCKET_ENV);
+    int exit_code;
+    if (socket_path && forward_request(socket_path, argc - 1, argv + 1, &exit_code))
+        return exit_code;
+
+    execvp(argv[1], argv + 1);
+    fprintf(stderr, "shady_client: could not run '%s'\n", argv[1]);
+    return 127;
+}
@@ -5,9 +5,13 @@
 
 #include "frontends/slim/parser.h"
 
+#include "cache.h"
+
 #include "list.h"
 #include "util.h"
 #include "log.h"
+#include "threading.h"
+#include "portability.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -72,9 +76,11 @@ ShadyErrorCodes driver_load_source_file_from_filename(const CompilerConfig* conf
     ShadyErrorCodes err;
     SourceLanguage lang = guess_source_language(filename);
     size_t len;
-    char* contents;
+    const char* contents;
     assert(filename);
-    bool ok = read_file(filename, &len, &contents);
+    // SPIR-V modules can get big and the front-end reads them in place, so there is no need to copy them around
+    bool mapped = lang == SrcSPIRV;
+    bool ok = mapped ? map_file(filename, &len, &contents) : read_file(filename, &len, (char**) &contents);
     if (!ok) {
         error_print("Failed to read file '%s'\n", filename);
         err = InputFileIOError;
@@ -86,7 +92,10 @@ ShadyErrorCodes driver_load_source_file_from_filename(const CompilerConfig* conf
         goto exit;
     }
     err = driver_load_source_file(config, lang, len, contents, name, mod);
-    free((void*) contents);
+    if (mapped)
+        unmap_file(contents, len);
+    else
+        free((void*) contents);
     exit:
     return err;
 }
@@ -110,36 +119,41 @@ ShadyErrorCodes driver_load_source_files(DriverConfig* args, Module* mod) {
     return NoError;
 }
 
-ShadyErrorCodes driver_compile(DriverConfig* args, Module* mod) {
-    debugv_print("Parsed program successfully: \n");
-    log_module(DEBUGV, &args->config, mod);
-
-    CompilationResult result = run_compiler_passes(&args->config, &mod);
-    if (result != CompilationNoError) {
-        error_print("Compilation pipeline failed, errcode=%d\n", (int) result);
-        exit(result);
-    }
-    debug_print("Ran all passes successfully\n");
-    log_module(DEBUG, &args->config, mod);
+/// With several entry points, every output gets the entry point name inserted before its extension: foo.spv -> foo.main.spv
+static char* get_output_filename(String filename, String entry_point) {
+    if (!entry_point)
+        return format_string_new("%s", filename);
+    const char* extension = strrchr(filename, '.');
+    const char* last_separator = strrchr(filename, '/');
+    if (!extension || (last_separator && extension < last_separator))
+        return format_string_new("%s.%s", filename, entry_point);
+    return format_string_new("%.*s.%s%s", (int) (extension - filename), filename, entry_point, extension);
+}
 
+static void driver_output(const DriverConfig* args, CompilerConfig* config, Module* mod, String entry_point) {
     if (args->cfg_output_filename) {
-        FILE* f = fopen(args->cfg_output_filename, "wb");
+        char* filename = get_output_filename(args->cfg_output_filename, entry_point);
+        FILE* f = fopen(filename, "wb");
         assert(f);
         dump_cfgs(f, mod);
         fclose(f);
+        free(filename);
         debug_print("CFG dumped\n");
     }
 
     if (args->loop_tree_output_filename) {
-        FILE* f = fopen(args->loop_tree_output_filename, "wb");
+        char* filename = get_output_filename(args->loop_tree_output_filename, entry_point);
+        FILE* f = fopen(filename, "wb");
         assert(f);
         dump_loop_trees(f, mod);
         fclose(f);
+        free(filename);
         debug_print("Loop tree dumped\n");
     }
 
     if (args->shd_output_filename) {
-        FILE* f = fopen(args->shd_output_filename, "wb");
+        char* filename = get_output_filename(args->shd_output_filename, entry_point);
+        FILE* f = fopen(filename, "wb");
         assert(f);
         size_t output_size;
         char* output_buffer;
@@ -147,36 +161,151 @@ ShadyErrorCodes driver_compile(DriverConfig* args, Module* mod) {
         fwrite(output_buffer, output_size, 1, f);
         free((void*) output_buffer);
         fclose(f);
+        free(filename);
         debug_print("IR dumped\n");
     }
 
     if (args->output_filename) {
-        if (args->target == TgtAuto)
-            args->target = guess_target(args->output_filename);
-        FILE* f = fopen(args->output_filename, "wb");
+        char* filename = get_output_filename(args->output_filename, entry_point);
+        FILE* f = fopen(filename, "wb");
         size_t output_size;
         char* output_buffer;
+        CEmitterConfig c_emitter_config = args->c_emitter_config;
         switch (args->target) {
             case TgtAuto: SHADY_UNREACHABLE;
-            case TgtSPV: emit_spirv(&args->config, mod, &output_size, &output_buffer, NULL); break;
+            case TgtSPV: emit_spirv(config, mod, &output_size, &output_buffer, NULL); break;
             case TgtC:
-                args->c_emitter_config.dialect = CDialect_C11;
-                emit_c(args->config, args->c_emitter_config, mod, &output_size, &output_buffer, NULL);
+                c_emitter_config.dialect = CDialect_C11;
+                emit_c(*config, c_emitter_config, mod, &output_size, &output_buffer, NULL);
                 break;
             case TgtGLSL:
-                args->c_emitter_config.dialect = CDialect_GLSL;
-                emit_c(args->config, args->c_emitter_config, mod, &output_size, &output_buffer, NULL);
+                c_emitter_config.dialect = CDialect_GLSL;
+                emit_c(*config, c_emitter_config, mod, &output_size, &output_buffer, NULL);
                 break;
             case TgtISPC:
-                args->c_emitter_config.dialect = CDialect_ISPC;
-                emit_c(args->config, args->c_emitter_config, mod, &output_size, &output_buffer, NULL);
+                c_emitter_config.dialect = CDialect_ISPC;
+                emit_c(*config, c_emitter_config, mod, &output_size, &output_buffer, NULL);
                 break;
         }
-        debug_print("Wrote result to %s\n", args->output_filename);
+        debug_print("Wrote result to %s\n", filename);
         fwrite(output_buffer, output_size, 1, f);
-        free((void*) output_buffer);
         fclose(f);
+        free(filename);
+
+        if (args->cache.has_key) {
+            CacheKey key = derive_cache_key((CacheKey) { .hash = { args->cache.key[0], args->cache.key[1] } }, entry_point);
+            cache_store(args->cache.dir, args->cache.max_size, key, output_size, output_buffer);
+        }
+        free((void*) output_buffer);
+    }
+}
+
+bool driver_fetch_cached_outputs(DriverConfig* args, size_t inputs_count, const char** input_filenames) {
+    args->cache.has_key = false;
+    if (!args->cache.dir)
+        return false;
+    if (args->output_filename && args->target == TgtAuto)
+        args->target = guess_target(args->output_filename);
+
+    CacheKey key;
+    if (!compute_cache_key(args, inputs_count, input_filenames, &key)) {
+        debug_print("This compilation can't be cached\n");
+        return false;
+    }
+    args->cache.has_key = true;
+    args->cache.key[0] = key.hash[0];
+    args->cache.key[1] = key.hash[1];
+
+    // with several entry points, it's all or nothing
+    size_t entry_points_count = entries_count_list(args->entry_points);
+    size_t outputs_count = entry_points_count > 0 ? entry_points_count : 1;
+    LARRAY(char*, outputs, outputs_count);
+    LARRAY(size_t, outputs_sizes, outputs_count);
+    size_t found = 0;
+    for (; found < outputs_count; found++) {
+        String entry_point = entry_points_count > 0 ? read_list(const char*, args->entry_points)[found] : NULL;
+        if (!cache_fetch(args->cache.dir, derive_cache_key(key, entry_point), &outputs_sizes[found], &outputs[found]))
+            break;
     }
+
+    bool hit = found == outputs_count;
+    for (size_t i = 0; i < found; i++) {
+        if (hit) {
+            String entry_point = entry_points_count > 0 ? read_list(const char*, args->entry_points)[i] : NULL;
+            char* filename = get_output_filename(args->output_filename, entry_point);
+            if (!write_file(filename, outputs_sizes[i], outputs[i])) {
+                error_print("Failed to write file '%s'\n", filename);
+                exit(InputFileIOError);
+            }
+            debug_print("Wrote cached result to %s\n", filename);
+            free(filename);
+        }
+        free(outputs[i]);
+    }
+    debug_print(hit ? "Cache hit\n" : "Cache miss\n");
+    return hit;
+}
+
+typedef struct {
+    const DriverConfig* args;
+    Module* shared;
+} EntryPointsBatch;
+
+static void compile_entry_point(EntryPointsBatch* batch, size_t i) {
+    CompilerConfig config = batch->args->config;
+    config.specialization.entry_point = read_list(const char*, batch->args->entry_points)[i];
+
+    Module* mod = batch->shared;
+    CompilationResult result = run_specialized_compiler_passes(&config, &mod);
+    if (result != CompilationNoError) {
+        error_print("Compilation pipeline failed for entry point '%s', errcode=%d\n", config.specialization.entry_point, (int) result);
+        exit(result);
+    }
+    debug_print("Ran all passes successfully for entry point '%s'\n", config.specialization.entry_point);
+
+    driver_output(batch->args, &config, mod, config.specialization.entry_point);
+    destroy_ir_arena(get_module_arena(mod));
+}
+
+/// Runs the entry-point independent part of the pipeline once, then specializes and emits every entry point in parallel
+static ShadyErrorCodes driver_compile_entry_points(DriverConfig* args, Module* mod) {
+    IrArena* initial_arena = get_module_arena(mod);
+    CompilationResult result = run_shared_compiler_passes(&args->config, &mod);
+    if (result != CompilationNoError) {
+        error_print("Compilation pipeline failed, errcode=%d\n", (int) result);
+        exit(result);
+    }
+
+    EntryPointsBatch batch = {
+        .args = args,
+        .shared = mod,
+    };
+    parallel_for(entries_count_list(args->entry_points), 0, (ParallelForFn) compile_entry_point, &batch);
+
+    if (get_module_arena(mod) != initial_arena)
+        destroy_ir_arena(get_module_arena(mod));
+    return NoError;
+}
+
+ShadyErrorCodes driver_compile(DriverConfig* args, Module* mod) {
+    debugv_print("Parsed program successfully: \n");
+    log_module(DEBUGV, &args->config, mod);
+
+    if (args->output_filename && args->target == TgtAuto)
+        args->target = guess_target(args->output_filename);
+
+    if (entries_count_list(args->entry_points) > 0)
+        return driver_compile_entry_points(args, mod);
+
+    CompilationResult result = run_compiler_passes(&args->config, &mod);
+    if (result != CompilationNoError) {
+        error_print("Compilation pipeline failed, errcode=%d\n", (int) result);
+        exit(result);
+    }
+    debug_print("Ran all passes successfully\n");
+    log_module(DEBUG, &args->config, mod);
+
+    driver_output(args, &args->config, mod, NULL);
     destroy_ir_arena(get_module_arena(mod));
     return NoError;
 }
@@ -0,0 +1,277 @@
+// for struct ucred
+#define _GNU_SOURCE
+
+#include "shady/driver.h"
+
+#include "server.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+String cli_parse_server_args(int* pargc, char** argv) {
+    int argc = *pargc;
+
+    String socket_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i] == NULL)
+            continue;
+        if (strcmp(argv[i], "--server") == 0) {
+            argv[i] = NULL;
+            i++;
+            if (i == argc) {
+                error_print("--server must be followed with a socket path");
+                exit(ServerSetupFailed);
+            }
+            socket_path = argv[i];
+            argv[i] = NULL;
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            error_print("  --server <socket>                         Runs as a compile server listening on <socket>, see shady_client\n");
+        }
+    }
+
+    cli_pack_remaining_args(pargc, argv);
+    return socket_path;
+}
+
+#ifdef _WIN32
+
+ShadyErrorCodes driver_serve(SHADY_UNUSED String socket_path, SHADY_UNUSED DriverMainFn fn) {
+    error_print("Compile server mode is not supported on this platform.\n");
+    return ServerSetupFailed;
+}
+
+#else
+
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+enum {
+    ForwardedFdsCount = 3,
+    MaxRequestArgs = 4096,
+    MaxRequestArgSize = 64 * 1024,
+};
+
+/// Receives the request header together with the client's stdio file descriptors
+/// Sets `hung_up` if the client went away instead, which it does when it doesn't want this server.
+static bool recv_header(int conn, ServerRequestHeader* header, int fds[ForwardedFdsCount], bool* hung_up) {
+    struct iovec iov = { .iov_base = header, .iov_len = sizeof(ServerRequestHeader) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * ForwardedFdsCount)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t got;
+    while ((got = recvmsg(conn, &msg, 0)) < 0 && errno == EINTR);
+    *hung_up = got == 0;
+    if (got <= 0)
+        return false;
+    // the rest of the header can trail behind the ancillary data
+    if ((size_t) got < sizeof(ServerRequestHeader) && !server_recv_all(conn, (char*) header + got, sizeof(ServerRequestHeader) - got))
+        return false;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * ForwardedFdsCount))
+        return false;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * ForwardedFdsCount);
+    return header->magic == SHADY_SERVER_MAGIC && header->version == SHADY_SERVER_PROTOCOL_VERSION;
+}
+
+static char* recv_string(int conn) {
+    uint32_t len;
+    if (!server_recv_all(conn, &len, sizeof(len)) || len > MaxRequestArgSize)
+        return NULL;
+    char* str = calloc(len + 1, 1);
+    if (!server_recv_all(conn, str, len)) {
+        free(str);
+        return NULL;
+    }
+    return str;
+}
+
+/// Runs in the forked worker: becomes the client as far as the compiler is concerned, then runs the driver
+static void run_request(DriverMainFn fn, int fds[ForwardedFdsCount], int argc, char** argv) {
+    for (int i = 0; i < ForwardedFdsCount; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    // argv[0] carries the client's working directory
+    if (chdir(argv[0]) != 0) {
+        error_print("Compile server: could not enter directory '%s'\n", argv[0]);
+        _exit(InputFileIOError);
+    }
+    int r = fn(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    _exit(r);
+}
+
+/// Only the user running the server gets to have it compile things, with its permissions
+static bool is_peer_trusted(int conn) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || len != sizeof(cred))
+        return false;
+    uid_t uid = cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(conn, &uid, &gid) != 0)
+        return false;
+#endif
+    return uid == geteuid();
+}
+
+/// Clears the way for the socket, which only ever means removing the one a previous server left behind
+static bool remove_stale_socket(String socket_path) {
+    struct stat st;
+    if (lstat(socket_path, &st) != 0)
+        return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) {
+        error_print("Compile server: '%s' already exists and is not a socket\n", socket_path);
+        return false;
+    }
+    return unlink(socket_path) == 0;
+}
+
+static void serve_connection(DriverMainFn fn, const ServerIdentity* identity, int conn) {
+    ServerHello hello = {
+        .magic = SHADY_SERVER_MAGIC,
+        .version = SHADY_SERVER_PROTOCOL_VERSION,
+        .identity = *identity,
+    };
+    if (!server_send_all(conn, &hello, sizeof(hello)))
+        return;
+
+    int32_t exit_code = -1;
+    int fds[ForwardedFdsCount] = { -1, -1, -1 };
+    ServerRequestHeader header;
+    bool hung_up = false;
+    if (!recv_header(conn, &header, fds, &hung_up) || header.argc == 0 || header.argc > MaxRequestArgs) {
+        if (hung_up)
+            return;
+        error_print("Compile server: malformed request\n");
+        goto finish;
+    }
+
+    char** argv = calloc(header.argc + 1, sizeof(char*));
+    bool ok = true;
+    for (size_t i = 0; i < header.argc && ok; i++) {
+        argv[i] = recv_string(conn);
+        ok &= argv[i] != NULL;
+    }
+
+    if (ok) {
+        pid_t worker = fork();
+        if (worker == 0) {
+            close(conn);
+            run_request(fn, fds, (int) header.argc, argv);
+        } else if (worker > 0) {
+            int status;
+            while (waitpid(worker, &status, 0) < 0 && errno == EINTR);
+            if (WIFEXITED(status))
+                exit_code = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                exit_code = 128 + WTERMSIG(status);
+        }
+    }
+
+    for (size_t i = 0; i < header.argc; i++)
+        free(argv[i]);
+    free(argv);
+
+    finish:
+    for (int i = 0; i < ForwardedFdsCount; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    ServerResponse response = { .exit_code = exit_code };
+    server_send_all(conn, &response, sizeof(response));
+}
+
+ShadyErrorCodes driver_serve(String socket_path, DriverMainFn fn) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error_print("Compile server: socket path '%s' is too long\n", socket_path);
+        return ServerSetupFailed;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // clients check this to make sure they are talking to the same compiler they would otherwise run themselves
+    ServerIdentity identity;
+    const char* executable = get_executable_location();
+    bool identified = server_identify(executable, &identity);
+    free((void*) executable);
+    if (!identified) {
+        error_print("Compile server: could not identify the compiler executable\n");
+        return ServerSetupFailed;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        error_print("Compile server: failed to create socket\n");
+        return ServerSetupFailed;
+    }
+    if (!remove_stale_socket(socket_path)) {
+        close(listener);
+        return ServerSetupFailed;
+    }
+    // the socket must never be reachable by other users, not even between bind() and chmod()
+    mode_t old_umask = umask(0177);
+    bool bound = bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+    umask(old_umask);
+    if (!bound || chmod(socket_path, 0600) != 0 || listen(listener, 64) != 0) {
+        error_print("Compile server: failed to listen on '%s'\n", socket_path);
+        close(listener);
+        return ServerSetupFailed;
+    }
+
+    // connection handlers are never waited on by the server itself
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    info_print("Compile server listening on '%s'\n", socket_path);
+
+    while (true) {
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            error_print("Compile server: accept() failed\n");
+            break;
+        }
+
+        // Every connection gets its own handler, so that parallel build jobs are served in parallel,
+        // and the handler forks the actual worker so it can report crashes (error() aborts!) back to the client.
+        pid_t handler = fork();
+        if (handler == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            close(listener);
+            if (is_peer_trusted(conn))
+                serve_connection(fn, &identity, conn);
+            else
+                error_print("Compile server: rejected a connection from another user\n");
+            close(conn);
+            _exit(0);
+        }
+        close(conn);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return ServerSetupFailed;
+}
+
+#endif
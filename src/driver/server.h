@@ -0,0 +1,92 @@
+#ifndef SHADY_SERVER_H
+#define SHADY_SERVER_H
+
+// Wire format shared by the compile server (server.c) and shady_client (client.c)
+//
+// Hello:    ServerHello, sent by the server as soon as a client connects. The client only goes on if the server is
+//           the very compiler binary it would have run itself, otherwise it hangs up and runs that one locally.
+// Request:  ServerRequestHeader, then `argc` strings, each sent as a uint32_t length followed by the bytes.
+//           The first string is the working directory of the client, the rest are the compiler arguments.
+//           The client's stdin, stdout and stderr are passed along with the header (SCM_RIGHTS).
+// Response: ServerResponse, once the request has been processed. The exit code is negative if it could not be run.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define SHADY_SERVER_MAGIC 0x59444853 /* 'SHDY' */
+#define SHADY_SERVER_PROTOCOL_VERSION 2
+#define SHADY_SERVER_SOCKET_ENV "SHADY_SERVER_SOCKET"
+
+/// Tells compiler binaries apart: there is no version number worth trusting while hacking on the compiler
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+} ServerIdentity;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    ServerIdentity identity;
+} ServerHello;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t argc;
+} ServerRequestHeader;
+
+typedef struct {
+    int32_t exit_code;
+} ServerResponse;
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static inline bool server_identify(const char* executable, ServerIdentity* identity) {
+    struct stat s;
+    if (!executable || stat(executable, &s) != 0)
+        return false;
+    memset(identity, 0, sizeof(*identity));
+    identity->device = (uint64_t) s.st_dev;
+    identity->inode = (uint64_t) s.st_ino;
+    identity->size = (uint64_t) s.st_size;
+    identity->mtime = (uint64_t) s.st_mtime;
+    return true;
+}
+
+static inline bool server_send_all(int fd, const void* data, size_t size) {
+    const char* p = data;
+    while (size > 0) {
+        ssize_t written = write(fd, p, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        p += written;
+        size -= written;
+    }
+    return true;
+}
+
+static inline bool server_recv_all(int fd, void* data, size_t size) {
+    char* p = data;
+    while (size > 0) {
+        ssize_t got = read(fd, p, size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        size -= got;
+    }
+    return true;
+}
+#endif
+
+#endif
@@ -12,9 +12,7 @@
 #define HOOK_STUFF
 #endif
 
-int main(int argc, char** argv) {
-    platform_specific_terminal_init_extras();
-
+static int slim_main(int argc, char** argv) {
     DriverConfig args = default_driver_config();
     HOOK_STUFF
     cli_parse_driver_arguments(&args, &argc, argv);
@@ -22,6 +20,12 @@ int main(int argc, char** argv) {
     cli_parse_compiler_config_args(&args.config, &argc, argv);
     cli_parse_input_files(args.input_filenames, &argc, argv);
 
+    if (driver_fetch_cached_outputs(&args, entries_count_list(args.input_filenames), read_list(const char*, args.input_filenames))) {
+        info_print("Done (cached)\n");
+        destroy_driver_config(&args);
+        return NoError;
+    }
+
     IrArena* arena = new_ir_arena(default_arena_config(&args.config.target));
     Module* mod = new_module(arena, "my_module"); // TODO name module after first filename, or perhaps the last one
 
@@ -32,4 +36,17 @@ int main(int argc, char** argv) {
 
     destroy_ir_arena(arena);
     destroy_driver_config(&args);
+    return NoError;
+}
+
+int main(int argc, char** argv) {
+    platform_specific_terminal_init_extras();
+
+    String socket_path = cli_parse_server_args(&argc, argv);
+    if (socket_path) {
+        CompilerConfig warmup = default_compiler_config();
+        prewarm_compiler(&warmup);
+        return driver_serve(socket_path, slim_main);
+    }
+    return slim_main(argc, argv);
 }
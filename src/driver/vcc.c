@@ -49,9 +49,20 @@ uint32_t hash_murmur(const void* data, size_t size);
 
 int vcc_get_linked_major_llvm_version();
 
-int main(int argc, char** argv) {
-    platform_specific_terminal_init_extras();
+/// Makes sure the matching clang is around, only once per process so compile server workers skip it
+static void check_clang(String clangname) {
+    static bool clang_checked = false;
+    if (clang_checked)
+        return;
+    char* cmd = format_string_new("%s --version", clangname);
+    int clang_retval = system(cmd);
+    free(cmd);
+    if (clang_retval != 0)
+        error("%s not present in path or otherwise broken (retval=%d)", clangname, clang_retval);
+    clang_checked = true;
+}
 
+static int vcc_main(int argc, char** argv) {
     DriverConfig args = default_driver_config();
     VccOptions vcc_options = {
         .tmp_filename = NULL,
@@ -74,9 +85,7 @@ int main(int argc, char** argv) {
     IrArena* arena = new_ir_arena(aconfig);
 
     String clangname = format_string_interned(arena, "clang-%d", vcc_get_linked_major_llvm_version());
-    int clang_retval = system(format_string_interned(arena, "%s --version", clangname));
-    if (clang_retval != 0)
-    error("%s not present in path or otherwise broken (retval=%d)", clangname, clang_retval);
+    check_clang(clangname);
 
     size_t num_source_files = entries_count_list(args.input_filenames);
 
@@ -143,7 +152,10 @@ int main(int argc, char** argv) {
         exit(ClangInvocationFailed);
 
     Module* mod;
-    if (!vcc_options.only_run_clang) {
+    if (!vcc_options.only_run_clang && driver_fetch_cached_outputs(&args, 1, (const char**) &vcc_options.tmp_filename)) {
+        if (vcc_options.delete_tmp_file)
+            remove(vcc_options.tmp_filename);
+    } else if (!vcc_options.only_run_clang) {
         size_t len;
         char* llvm_ir;
         if (!read_file(vcc_options.tmp_filename, &len, &llvm_ir))
@@ -162,4 +174,21 @@ int main(int argc, char** argv) {
 
     destroy_ir_arena(arena);
     destroy_driver_config(&args);
+    return NoError;
+}
+
+int main(int argc, char** argv) {
+    platform_specific_terminal_init_extras();
+
+    String socket_path = cli_parse_server_args(&argc, argv);
+    if (socket_path) {
+        char clangname[32];
+        snprintf(clangname, sizeof(clangname), "clang-%d", vcc_get_linked_major_llvm_version());
+        check_clang(clangname);
+        CompilerConfig warmup = default_compiler_config();
+        warmup.hacks.recover_structure = true;
+        prewarm_compiler(&warmup);
+        return driver_serve(socket_path, vcc_main);
+    }
+    return vcc_main(argc, argv);
 }
@@ -62,7 +62,7 @@ static const Node* write_bb_tail(Parser* p, FnParseCtx* fn_ctx, Node* fn_or_bb,
         Nodes results = bind_instruction_explicit_result_types(b, emitted.instruction, emitted.result_types, names);
         if (emitted.result_types.count == 1) {
             const Node* result = first(results);
-            insert_dict(LLVMValueRef, const Node*, p->map, instr, result);
+            insert_dict(LLVMValueRef, const Node*, p->local_map, instr, result);
         }
     }
     assert(false);
@@ -87,7 +87,7 @@ static TodoBB prepare_bb(Parser* p, FnParseCtx* fn_ctx, LLVMBasicBlockRef bb) {
         switch (LLVMGetInstructionOpcode(instr)) {
             case LLVMPHI: {
                 const Node* nparam = param(a, qualified_type_helper(convert_type(p, LLVMTypeOf(instr)), false), "phi");
-                insert_dict(LLVMValueRef, const Node*, p->map, instr, nparam);
+                insert_dict(LLVMValueRef, const Node*, p->local_map, instr, nparam);
                 append_list(LLVMValueRef, phis, instr);
                 params = append_nodes(a, params, nparam);
                 break;
@@ -102,7 +102,7 @@ static TodoBB prepare_bb(Parser* p, FnParseCtx* fn_ctx, LLVMBasicBlockRef bb) {
         if (strlen(name) == 0)
             name = NULL;
         Node* nbb = basic_block(a, fn_ctx->fn, params, name);
-        insert_dict(LLVMValueRef, const Node*, p->map, bb, nbb);
+        insert_dict(LLVMValueRef, const Node*, p->local_map, bb, nbb);
         insert_dict(const Node*, struct List*, fn_ctx->phis, nbb, phis);
         TodoBB todo = {
             .bb = bb,
@@ -117,7 +117,7 @@ static TodoBB prepare_bb(Parser* p, FnParseCtx* fn_ctx, LLVMBasicBlockRef bb) {
 
 const Node* convert_basic_block(Parser* p, FnParseCtx* fn_ctx, LLVMBasicBlockRef bb) {
     IrArena* a = get_module_arena(p->dst);
-    const Node** found = find_value_dict(LLVMValueRef, const Node*, p->map, bb);
+    const Node** found = find_value_dict(LLVMValueRef, const Node*, p->local_map, bb);
     if (found) return *found;
     // assert(false);
 
@@ -126,6 +126,12 @@ const Node* convert_basic_block(Parser* p, FnParseCtx* fn_ctx, LLVMBasicBlockRef
     return todo.nbb;
 }
 
+typedef struct {
+    LLVMValueRef fn;
+    Node* decl;
+} PendingBody;
+
+/// Only declares the function, the body is converted later (see convert_pending_bodies)
 const Node* convert_function(Parser* p, LLVMValueRef fn) {
     if (is_llvm_intrinsic(fn)) {
         warn_print("Skipping unknown LLVM intrinsic function: %s\n", LLVMGetValueName(fn));
@@ -136,8 +142,13 @@ const Node* convert_function(Parser* p, LLVMValueRef fn) {
         return NULL;
     }
 
+    lock_mutex(p->lock);
     const Node** found = find_value_dict(LLVMValueRef, const Node*, p->map, fn);
-    if (found) return *found;
+    if (found) {
+        const Node* r = *found;
+        unlock_mutex(p->lock);
+        return r;
+    }
     IrArena* a = get_module_arena(p->dst);
     debug_print("Converting function: %s\n", LLVMGetValueName(fn));
 
@@ -165,19 +176,35 @@ const Node* convert_function(Parser* p, LLVMValueRef fn) {
             break;
     }
     Node* f = function(p->dst, params, LLVMGetValueName(fn), annotations, fn_type->payload.fn_type.return_types);
+    const Node* r = fn_addr_helper(a, f);
+    insert_dict(LLVMValueRef, const Node*, p->map, fn, r);
+
+    if (LLVMCountBasicBlocks(fn) > 0) {
+        PendingBody pending = { .fn = fn, .decl = f };
+        append_list(PendingBody, p->pending_bodies, pending);
+    }
+    unlock_mutex(p->lock);
+
+    return r;
+}
+
+/// Runs on any thread: values local to the function go in a map of its own, and only module-level things are shared
+static void convert_function_body(Parser* p, PendingBody pending) {
+    Parser fn_p = *p;
+    fn_p.local_map = new_dict(LLVMValueRef, const Node*, (HashFn) hash_opaque_ptr, (CmpFn) cmp_opaque_ptr);
+    p = &fn_p;
+
+    LLVMValueRef fn = pending.fn;
+    Node* f = pending.decl;
     FnParseCtx fn_parse_ctx = {
         .fn = f,
         .phis = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node),
         .jumps_todo = new_list(JumpTodo),
     };
-    const Node* r = fn_addr_helper(a, f);
-    insert_dict(LLVMValueRef, const Node*, p->map, fn, r);
 
-    if (LLVMCountBasicBlocks(fn) > 0) {
-        LLVMBasicBlockRef first_bb = LLVMGetEntryBasicBlock(fn);
-        insert_dict(LLVMValueRef, const Node*, p->map, first_bb, f);
-        f->payload.fun.body = write_bb_tail(p, &fn_parse_ctx, f, first_bb, LLVMGetFirstInstruction(first_bb));
-    }
+    LLVMBasicBlockRef first_bb = LLVMGetEntryBasicBlock(fn);
+    insert_dict(LLVMValueRef, const Node*, p->local_map, first_bb, f);
+    f->payload.fun.body = write_bb_tail(p, &fn_parse_ctx, f, first_bb, LLVMGetFirstInstruction(first_bb));
 
     while (entries_count_list(fn_parse_ctx.jumps_todo) > 0) {
         JumpTodo todo = pop_last_list(JumpTodo, fn_parse_ctx.jumps_todo);
@@ -192,8 +219,31 @@ const Node* convert_function(Parser* p, LLVMValueRef fn) {
     }
     destroy_dict(fn_parse_ctx.phis);
     destroy_list(fn_parse_ctx.jumps_todo);
+    destroy_dict(fn_p.local_map);
+}
 
-    return r;
+typedef struct {
+    Parser* p;
+    PendingBody* bodies;
+} BodiesBatch;
+
+static void convert_body_in_batch(BodiesBatch* batch, size_t i) {
+    convert_function_body(batch->p, batch->bodies[i]);
+}
+
+/// Bodies can reference functions we haven't seen yet, which queues their own bodies, so this goes in waves
+static void convert_pending_bodies(Parser* p) {
+    while (entries_count_list(p->pending_bodies) > 0) {
+        size_t count = entries_count_list(p->pending_bodies);
+        PendingBody* bodies = malloc(sizeof(PendingBody) * count);
+        memcpy(bodies, read_list(PendingBody, p->pending_bodies), sizeof(PendingBody) * count);
+        clear_list(p->pending_bodies);
+
+        debug_print("l2s: converting %zu function bodies\n", count);
+        BodiesBatch batch = { .p = p, .bodies = bodies };
+        parallel_for(count, p->config->frontend.threads, (ParallelForFn) convert_body_in_batch, &batch);
+        free(bodies);
+    }
 }
 
 const Node* convert_global(Parser* p, LLVMValueRef global) {
@@ -261,6 +311,8 @@ bool parse_llvm_into_shady(const CompilerConfig* config, size_t len, const char*
     aconfig.allow_fold = false;
 
     IrArena* arena = new_ir_arena(aconfig);
+    if (config->frontend.threads != 1)
+        set_ir_arena_thread_safe(arena, true);
     Module* dirty = new_module(arena, "dirty");
     Parser p = {
         .ctx = context,
@@ -272,8 +324,11 @@ bool parse_llvm_into_shady(const CompilerConfig* config, size_t len, const char*
         .annotations_arena = new_arena(),
         .src = src,
         .dst = dirty,
+        .pending_bodies = new_list(PendingBody),
+        .lock = new_mutex(),
     };
 
+    // declarations are done serially...
     LLVMValueRef global_annotations = LLVMGetNamedGlobal(src, "llvm.global.annotations");
     if (global_annotations)
         process_llvm_annotations(&p, global_annotations);
@@ -289,6 +344,9 @@ bool parse_llvm_into_shady(const CompilerConfig* config, size_t len, const char*
             break;
         global = LLVMGetNextGlobal(global);
     }
+
+    // ... while the function bodies, where most of the work is, get converted in parallel
+    convert_pending_bodies(&p);
     log_module(DEBUG, config, dirty);
 
     aconfig.check_types = true;
@@ -305,6 +363,8 @@ bool parse_llvm_into_shady(const CompilerConfig* config, size_t len, const char*
     destroy_dict(p.scopes);
     destroy_dict(p.wrappers_map);
     destroy_arena(p.annotations_arena);
+    destroy_list(p.pending_bodies);
+    destroy_mutex(p.lock);
 
     LLVMContextDispose(context);
 
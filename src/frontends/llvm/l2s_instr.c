@@ -65,7 +65,9 @@ static const Node* convert_jump_lazy(Parser* p, FnParseCtx* fn_ctx, Node* fn_or_
     };
     append_list(JumpTodo, fn_ctx->jumps_todo, todo);
     const Node* dst2 = convert_basic_block(p, fn_ctx, dst);
+    lock_mutex(p->lock);
     insert_dict(const Node*, const Node*, p->wrappers_map, wrapper_bb, dst2);
+    unlock_mutex(p->lock);
     return jump_helper(a, wrapper_bb, empty(a));
 }
 
@@ -126,6 +128,7 @@ EmittedInstr convert_instruction(Parser* p, FnParseCtx* fn_ctx, Node* fn_or_bb,
         assert(fn && fn_or_bb);
         LLVMMetadataRef dbgloc = LLVMInstructionGetDebugLoc(instr);
         if (dbgloc) {
+            lock_mutex(p->lock);
             Nodes* found = find_value_dict(const Node*, Nodes, p->scopes, fn_or_bb);
             if (!found) {
                 Nodes str = scope_to_string(p, dbgloc);
@@ -139,6 +142,7 @@ EmittedInstr convert_instruction(Parser* p, FnParseCtx* fn_ctx, Node* fn_or_bb,
                 }
                 debugv_print(" (depth= %zu)\n", str.count);
             }
+            unlock_mutex(p->lock);
         }
     }
 
@@ -4,6 +4,7 @@
 #include "l2s.h"
 #include "arena.h"
 #include "util.h"
+#include "threading.h"
 
 #include "llvm-c/Core.h"
 
@@ -13,13 +14,20 @@
 typedef struct {
     const CompilerConfig* config;
     LLVMContextRef ctx;
+    /// types and module-level values, shared by all function bodies
     struct Dict* map;
+    /// values local to the function body being converted, if any
+    struct Dict* local_map;
     struct Dict* annotations;
     struct Dict* scopes;
     struct Dict* wrappers_map;
     Arena* annotations_arena;
     LLVMModuleRef src;
     Module* dst;
+    /// functions that have been declared, but not had their body converted yet
+    struct List* pending_bodies;
+    /// function bodies are converted in parallel: this guards all of the above except local_map, and the LLVM context
+    Mutex* lock;
 } Parser;
 
 typedef struct {
@@ -6,7 +6,7 @@
 #include "dict.h"
 #include "util.h"
 
-const Type* convert_type(Parser* p, LLVMTypeRef t) {
+static const Type* convert_type_locked(Parser* p, LLVMTypeRef t) {
     const Type** found = find_value_dict(LLVMTypeRef, const Type*, p->map, t);
     if (found) return *found;
     IrArena* a = get_module_arena(p->dst);
@@ -131,3 +131,10 @@ const Type* convert_type(Parser* p, LLVMTypeRef t) {
     LLVMDumpType(t);
     error_die();
 }
+
+const Type* convert_type(Parser* p, LLVMTypeRef t) {
+    lock_mutex(p->lock);
+    const Type* r = convert_type_locked(p, t);
+    unlock_mutex(p->lock);
+    return r;
+}
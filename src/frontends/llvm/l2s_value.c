@@ -43,7 +43,7 @@ static const Node* data_composite(const Type* t, size_t size, LLVMValueRef v) {
     return composite_helper(a, t, nodes(a, size, elements));
 }
 
-const Node* convert_value(Parser* p, LLVMValueRef v) {
+static const Node* convert_value_locked(Parser* p, LLVMValueRef v) {
     const Type** found = find_value_dict(LLVMTypeRef, const Type*, p->map, v);
     if (found) return *found;
     IrArena* a = get_module_arena(p->dst);
@@ -202,3 +202,14 @@ const Node* convert_value(Parser* p, LLVMValueRef v) {
     error_print(" in the already emitted map (kind=%d)\n", LLVMGetValueKind(v));
     error_die();
 }
+
+const Node* convert_value(Parser* p, LLVMValueRef v) {
+    if (p->local_map) {
+        const Node** found = find_value_dict(LLVMValueRef, const Node*, p->local_map, v);
+        if (found) return *found;
+    }
+    lock_mutex(p->lock);
+    const Node* r = convert_value_locked(p, v);
+    unlock_mutex(p->lock);
+    return r;
+}
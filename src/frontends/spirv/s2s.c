@@ -27,7 +27,9 @@ typedef enum {
 #include "arena.h"
 #include "portability.h"
 #include "dict.h"
+#include "list.h"
 #include "util.h"
+#include "threading.h"
 
 #include "../shady/type.h"
 #include "../shady/ir_private.h"
@@ -48,16 +50,14 @@ typedef struct {
 typedef struct SpvDeco_ SpvDeco;
 
 typedef struct {
-    enum { Nothing, Forward, Str, Typ, Decl, BB, Value, Literals } type;
+    enum { Nothing, Str, Typ, Decl, BB, Value, Literals } type;
     const Type* result_type;
     union {
-        size_t instruction_offset;
         const Node* node;
         String str;
-        struct { size_t count; uint32_t* data; } literals;
+        struct { size_t count; const uint32_t* data; } literals;
     };
     SpvDeco* next_decoration;
-    size_t final_size;
 } SpvDef;
 
 struct SpvDeco_ {
@@ -74,12 +74,27 @@ struct SpvPhiArgs_ {
     SpvPhiArgs* next_;
 };
 
+/// A function whose body still needs converting, bodies are converted once every declaration in the module is known
+typedef struct {
+    Node* fun;
+    size_t body_offset;
+} SpvPendingBody;
+
+/// A block terminator that branches to a block that was not converted yet, emitted once the whole function has been seen
+typedef struct {
+    Node* block;
+    SpvId block_id;
+    BodyBuilder* builder;
+    size_t instruction_offset;
+} SpvBranchFixup;
+
 typedef struct {
     size_t cursor;
     size_t len;
-    uint32_t* words;
+    const uint32_t* words;
     Module* mod;
     IrArena* arena;
+    const CompilerConfig* config;
 
     bool is_entry_pt;
     Node* fun;
@@ -87,14 +102,19 @@ typedef struct {
 
     struct CurrBlock {
         SpvId id;
+        Node* block;
         BodyBuilder* builder;
         const Node* finished;
     } current_block;
 
     SpvHeader header;
+    /// One entry per id, sized with the header bound
     SpvDef* defs;
+    /// Decorations and function-local bookkeeping (each function body gets its own arena)
     Arena* decorations_arena;
     struct Dict* phi_arguments;
+    struct List* branch_fixups;
+    struct List* pending_bodies;
 } SpvParser;
 
 SpvDef* get_definition_by_id(SpvParser* parser, size_t id);
@@ -194,7 +214,7 @@ bool parse_spv_header(SpvParser* parser) {
     return true;
 }
 
-String decode_spv_string_literal(SpvParser* parser, uint32_t* at) {
+String decode_spv_string_literal(SpvParser* parser, const uint32_t* at) {
     // TODO: assumes little endian
     return string(get_module_arena(parser->mod), (const char*) at);
 }
@@ -342,7 +362,7 @@ const SpvShdOpMapping* convert_spv_op(SpvOp src) {
 }
 
 SpvId get_result_defined_at(SpvParser* parser, size_t instruction_offset) {
-    uint32_t* instruction = parser->words + instruction_offset;
+    const uint32_t* instruction = parser->words + instruction_offset;
 
     SpvOp op = instruction[0] & 0xFFFF;
     SpvId result;
@@ -358,32 +378,11 @@ SpvId get_result_defined_at(SpvParser* parser, size_t instruction_offset) {
     error("no result defined at offset %zu", instruction_offset);
 }
 
-void scan_definitions(SpvParser* parser) {
-    size_t old_cursor = parser->cursor;
-    while (true) {
-        size_t available = parser->len - parser->cursor;
-        if (available == 0)
-            break;
-        assert(available > 0);
-        uint32_t* instruction = parser->words + parser->cursor;
-        SpvOp op = instruction[0] & 0xFFFF;
-        int size = (int) ((instruction[0] >> 16u) & 0xFFFFu);
-
-        SpvId result;
-        bool has_result, has_type;
-        SpvHasResultAndType(op, &has_result, &has_type);
-        if (has_result) {
-            if (has_type)
-                result = instruction[2];
-            else
-                result = instruction[1];
-
-            parser->defs[result].type = Forward;
-            parser->defs[result].instruction_offset = parser->cursor;
-        }
-        parser->cursor += size;
-    }
-    parser->cursor = old_cursor;
+static size_t get_instruction_size(SpvParser* parser, size_t instruction_offset) {
+    assert(instruction_offset < parser->len);
+    size_t size = (parser->words[instruction_offset] >> 16u) & 0xFFFFu;
+    assert(size > 0 && instruction_offset + size <= parser->len && "malformed instruction");
+    return size;
 }
 
 Nodes get_args_from_phi(SpvParser* parser, SpvId block, SpvId predecessor) {
@@ -418,8 +417,27 @@ Nodes get_args_from_phi(SpvParser* parser, SpvId block, SpvId predecessor) {
     return nodes(parser->arena, params_count, params);
 }
 
+/// Branches to blocks we have not converted yet can't be built now, they are emitted once the whole function has been seen
+static bool defer_forward_branch(SpvParser* parser, size_t instruction_offset, size_t targets_count, const SpvId* targets) {
+    for (size_t i = 0; i < targets_count; i++) {
+        assert(targets[i] > 0 && targets[i] < parser->header.bound);
+        if (parser->defs[targets[i]].type != Nothing)
+            continue;
+        append_list(SpvBranchFixup, parser->branch_fixups, ((SpvBranchFixup) {
+            .block = parser->current_block.block,
+            .block_id = parser->current_block.id,
+            .builder = parser->current_block.builder,
+            .instruction_offset = instruction_offset,
+        }));
+        parser->current_block.builder = NULL;
+        parser->current_block.finished = NULL;
+        return true;
+    }
+    return false;
+}
+
 size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
-    uint32_t* instruction = parser->words + instruction_offset;
+    const uint32_t* instruction = parser->words + instruction_offset;
     SpvOp op = instruction[0] & 0xFFFF;
     int size = (int) ((instruction[0] >> 16u) & 0xFFFFu);
     assert(size > 0);
@@ -435,14 +453,8 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
         result = instruction[1];
 
     if (has_result) {
-        assert(parser->defs[result].type != Nothing && "consistency issue");
-        if (parser->defs[result].final_size > 0) {
-            // already parsed, skip it
-            return parser->defs[result].final_size;
-        } else if (parser->defs[result].type != Forward) {
-            return SIZE_MAX;
-        }
-
+        assert(result > 0 && result < parser->header.bound);
+        assert(parser->defs[result].type == Nothing && "id defined twice");
         if (has_type)
             parser->defs[result].result_type = get_def_type(parser, result_t);
     }
@@ -677,7 +689,7 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
                 case Int_TAG: {
                     uint64_t v;
                     if (width == 64) {
-                        v = *(uint64_t*)(instruction + 3);
+                        v = *(const uint64_t*)(instruction + 3);
                     } else
                         v = instruction[3];
                     parser->defs[result].node = int_literal(parser->arena, (IntLiteral) {
@@ -690,7 +702,7 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
                 case Float_TAG: {
                     uint64_t v;
                     if (width == 64) {
-                        v = *(uint64_t*)(instruction + 3);
+                        v = *(const uint64_t*)(instruction + 3);
                     } else
                         v = instruction[3];
                     parser->defs[result].node = float_literal(parser->arena, (FloatLiteral) {
@@ -775,7 +787,6 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
             break;
         }
         case SpvOpFunction: {
-            assert(parser->defs[result].type == Forward);
             parser->defs[result].type = Decl;
             const Type* t = get_def_type(parser, instruction[4]);
             assert(t && t->tag == FnType_TAG);
@@ -830,31 +841,27 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
                 instruction_offset += s;
             }
 
-            Node* fun = function(parser->mod, nodes(parser->arena, params_count, params), name, annotations, t->payload.fn_type.return_types);
+            Nodes return_types = t->payload.fn_type.return_types;
+            LARRAY(const Type*, qualified_return_types, return_types.count);
+            for (size_t i = 0; i < return_types.count; i++)
+                qualified_return_types[i] = qualified_type_helper(return_types.nodes[i], false);
+
+            Node* fun = function(parser->mod, nodes(parser->arena, params_count, params), name, annotations, nodes(parser->arena, return_types.count, qualified_return_types));
             parser->defs[result].node = fun;
-            Node* old_fun = parser->fun;
-            parser->fun = fun;
 
-            const Node* first_block = NULL;
+            // the body can call functions declared further down, so we only skip over it for now
+            size_t body_offset = instruction_offset;
             while (((parser->words + instruction_offset)[0] & 0xFFFF) != SpvOpFunctionEnd) {
-                size_t s = parse_spv_instruction_at(parser, instruction_offset);
-                assert(s > 0);
-                const Node* block = get_definition_by_id(parser, get_result_defined_at(parser, instruction_offset))->node;
-                assert(is_basic_block(block));
-                if (!first_block)
-                    first_block = block;
+                size_t s = get_instruction_size(parser, instruction_offset);
                 size += s;
                 instruction_offset += s;
             }
+            if (instruction_offset > body_offset)
+                append_list(SpvPendingBody, parser->pending_bodies, ((SpvPendingBody) { .fun = fun, .body_offset = body_offset }));
 
             // Final OpFunctionEnd
             size_t s = parse_spv_instruction_at(parser, instruction_offset);
             size += s;
-
-            // steal the body of the first block, it can't be jumped to anyways!
-            if (first_block)
-                fun->payload.fun.body = first_block->payload.basic_block.body;
-            parser->fun = old_fun;
             break;
         }
         case SpvOpFunctionEnd: {
@@ -906,6 +913,7 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
             parser->defs[result].node = block;
 
             BodyBuilder* bb = begin_body(parser->arena);
+            parser->current_block.block = block;
             parser->current_block.builder = bb;
             parser->current_block.finished = NULL;
             while (parser->current_block.builder) {
@@ -914,8 +922,9 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
                 size += s;
                 instruction_offset += s;
             }
-            assert(parser->current_block.finished);
-            block->payload.basic_block.body = parser->current_block.finished;
+            // no body yet means the terminator was deferred with a fix-up
+            if (parser->current_block.finished)
+                block->payload.basic_block.body = parser->current_block.finished;
             parser->current_block = old;
             break;
         }
@@ -1292,6 +1301,8 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
             break;
         }
         case SpvOpBranch: {
+            if (defer_forward_branch(parser, instruction - parser->words, 1, instruction + 1))
+                break;
             BodyBuilder* bb = parser->current_block.builder;
             parser->current_block.finished = finish_body(bb, jump(parser->arena, (Jump) {
                     .target = get_def_block(parser, instruction[1]),
@@ -1302,6 +1313,8 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
         }
         case SpvOpBranchConditional: {
             SpvId destinations[2] = { instruction[2], instruction[3] };
+            if (defer_forward_branch(parser, instruction - parser->words, 2, destinations))
+                break;
             BodyBuilder* bb = parser->current_block.builder;
             parser->current_block.finished = finish_body(bb, branch(parser->arena, (Branch) {
                     .true_jump = jump_helper(parser->arena, get_def_block(parser, destinations[0]), get_args_from_phi(parser, destinations[0], parser->current_block.id)),
@@ -1329,20 +1342,13 @@ size_t parse_spv_instruction_at(SpvParser* parser, size_t instruction_offset) {
         default: error("Unsupported op: %d, size: %d", op, size);
     }
 
-    if (has_result) {
-        parser->defs[result].final_size = size;
-    }
-
     return size;
 }
 
 SpvDef* get_definition_by_id(SpvParser* parser, size_t id) {
     assert(id > 0 && id < parser->header.bound);
     if (parser->defs[id].type == Nothing)
-    error("there is no Op that defines result %zu", id);
-    if (parser->defs[id].type == Forward)
-        parse_spv_instruction_at(parser, parser->defs[id].instruction_offset);
-    assert(parser->defs[id].type != Forward);
+        error("s2s: result %zu is used before it is defined", id);
     return &parser->defs[id];
 }
 
@@ -1356,6 +1362,56 @@ bool compare_spvid(SpvId* pa, SpvId* pb) {
     return *pa == *pb;
 }
 
+static void convert_function_body(SpvParser* parser, SpvPendingBody pending) {
+    parser->fun = pending.fun;
+    parser->decorations_arena = new_arena();
+    parser->phi_arguments = new_dict(SpvId, SpvPhiArgs*, (HashFn) hash_spvid, (CmpFn) compare_spvid);
+    parser->branch_fixups = new_list(SpvBranchFixup);
+
+    const Node* first_block = NULL;
+    size_t instruction_offset = pending.body_offset;
+    while (((parser->words + instruction_offset)[0] & 0xFFFF) != SpvOpFunctionEnd) {
+        assert(((parser->words + instruction_offset)[0] & 0xFFFF) == SpvOpLabel);
+        size_t s = parse_spv_instruction_at(parser, instruction_offset);
+        assert(s > 0);
+        if (!first_block)
+            first_block = get_def_block(parser, get_result_defined_at(parser, instruction_offset));
+        instruction_offset += s;
+    }
+
+    // every block of the function exists by now
+    for (size_t i = 0; i < entries_count_list(parser->branch_fixups); i++) {
+        SpvBranchFixup fixup = read_list(SpvBranchFixup, parser->branch_fixups)[i];
+        parser->current_block = (struct CurrBlock) {
+            .id = fixup.block_id,
+            .block = fixup.block,
+            .builder = fixup.builder,
+        };
+        parse_spv_instruction_at(parser, fixup.instruction_offset);
+        assert(parser->current_block.finished);
+        fixup.block->payload.basic_block.body = parser->current_block.finished;
+    }
+
+    // steal the body of the first block, it can't be jumped to anyways!
+    if (first_block)
+        pending.fun->payload.fun.body = first_block->payload.basic_block.body;
+
+    destroy_list(parser->branch_fixups);
+    destroy_dict(parser->phi_arguments);
+    destroy_arena(parser->decorations_arena);
+}
+
+typedef struct {
+    const SpvParser* parser;
+    const SpvPendingBody* bodies;
+} SpvBodiesBatch;
+
+static void convert_body_in_batch(SpvBodiesBatch* batch, size_t i) {
+    // each body gets its own copy of the parser state, the id table is shared as ids are unique to the module
+    SpvParser parser = *batch->parser;
+    convert_function_body(&parser, batch->bodies[i]);
+}
+
 S2SError parse_spirv_into_shady(const CompilerConfig* config, size_t len, const char* data, String name, Module** dst) {
     IrArena* a = new_ir_arena(default_arena_config(&config->target));
     *dst = new_module(a, name);
@@ -1363,12 +1419,13 @@ S2SError parse_spirv_into_shady(const CompilerConfig* config, size_t len, const
     SpvParser parser = {
         .cursor = 0,
         .len = len / sizeof(uint32_t),
-        .words = (uint32_t*) data,
+        .words = (const uint32_t*) data,
         .mod = *dst,
         .arena = get_module_arena(*dst),
+        .config = config,
 
         .decorations_arena = new_arena(),
-        .phi_arguments = new_dict(SpvId, SpvPhiArgs*, (HashFn) hash_spvid, (CmpFn) compare_spvid),
+        .pending_bodies = new_list(SpvPendingBody),
     };
 
     if (!parse_spv_header(&parser))
@@ -1376,13 +1433,22 @@ S2SError parse_spirv_into_shady(const CompilerConfig* config, size_t len, const
     assert(parser.header.bound > 0 && parser.header.bound < 512 * 1024 * 1024); // sanity check
     parser.defs = calloc(parser.header.bound, sizeof(SpvDef));
 
-    scan_definitions(&parser);
-
+    // the module-level section defines everything before it gets used, so this is a single pass
     while (parser.cursor < parser.len) {
         parser.cursor += parse_spv_instruction_at(&parser, parser.cursor);
     }
 
-    destroy_dict(parser.phi_arguments);
+    // all the declarations are known now, the bodies only need the id table for reading module-level stuff
+    if (config->frontend.threads != 1)
+        set_ir_arena_thread_safe(a, true);
+    SpvBodiesBatch batch = {
+        .parser = &parser,
+        .bodies = read_list(SpvPendingBody, parser.pending_bodies),
+    };
+    parallel_for(entries_count_list(parser.pending_bodies), config->frontend.threads, (ParallelForFn) convert_body_in_batch, &batch);
+    set_ir_arena_thread_safe(a, false);
+
+    destroy_list(parser.pending_bodies);
     destroy_arena(parser.decorations_arena);
     free(parser.defs);
 
@@ -20,6 +20,12 @@ static void cuda_device_cleanup(CudaDevice* device) {
         shd_cuda_destroy_specialized_kernel(kernel);
     }
     destroy_dict(device->specialized_programs);
+    i = 0;
+    Module* shared_module;
+    while (dict_iter(device->shared_modules, &i, NULL, &shared_module)) {
+        destroy_ir_arena(get_module_arena(shared_module));
+    }
+    destroy_dict(device->shared_modules);
 }
 
 bool cuda_command_wait(CudaCommand* command) {
@@ -82,6 +88,7 @@ static CudaDevice* create_cuda_device(CudaBackend* b, int ordinal) {
         },
         .handle = handle,
         .specialized_programs = new_dict(SpecProgramKey, CudaKernel*, (HashFn) hash_spec_program_key, (CmpFn) cmp_spec_program_keys),
+        .shared_modules = new_dict(Program*, Module*, (HashFn) hash_ptr, (CmpFn) compare_ptrs),
     };
     CHECK_CUDA(cuDeviceGetName(device->name, 255, handle), goto dealloc_and_return_null);
     CHECK_CUDA(cuDeviceGetAttribute(&device->cc_major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device->handle), goto dealloc_and_return_null);
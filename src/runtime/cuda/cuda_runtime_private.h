@@ -28,6 +28,8 @@ typedef struct {
     int cc_major;
     int cc_minor;
     struct Dict* specialized_programs;
+    /// Program -> its module after run_shared_compiler_passes, specialized again for every entry point we need
+    struct Dict* shared_modules;
 } CudaDevice;
 
 typedef struct {
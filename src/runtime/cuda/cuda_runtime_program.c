@@ -12,12 +12,23 @@ static CompilerConfig get_compiler_config_for_device(CudaDevice* device, const C
     return config;
 }
 
+static Module* get_shared_module(CudaDevice* device, Program* program, CompilerConfig* config) {
+    Module** found = find_value_dict(Program*, Module*, device->shared_modules, program);
+    if (found)
+        return *found;
+    Module* shared_module = program->module;
+    CHECK(run_shared_compiler_passes(config, &shared_module) == CompilationNoError, return NULL);
+    insert_dict(Program*, Module*, device->shared_modules, program, shared_module);
+    return shared_module;
+}
+
 static bool emit_cuda_c_code(CudaKernel* spec) {
     CompilerConfig config = get_compiler_config_for_device(spec->device, spec->key.base->base_config);
-    config.specialization.entry_point = spec->key.entry_point;
+    Module* dst_mod = get_shared_module(spec->device, spec->key.base, &config);
+    CHECK(dst_mod, return false);
 
-    Module* dst_mod = spec->key.base->module;
-    CHECK(run_compiler_passes(&config, &dst_mod) == CompilationNoError, return false);
+    config.specialization.entry_point = spec->key.entry_point;
+    CHECK(run_specialized_compiler_passes(&config, &dst_mod) == CompilationNoError, return false);
 
     CEmitterConfig emitter_config = {
         .dialect = CDialect_CUDA,
@@ -19,7 +19,6 @@ Program* new_program_from_module(Runtime* runtime, const CompilerConfig* base_co
     program->arena = NULL;
     program->module = mod;
 
-    // TODO split the compilation pipeline into generic and non-generic parts
     append_list(Program*, runtime->programs, program);
     return program;
 }
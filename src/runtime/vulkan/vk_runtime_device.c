@@ -272,6 +272,7 @@ static VkrDevice* create_vkr_device(SHADY_UNUSED VkrBackend* runtime, VkPhysical
     }, NULL, &device->cmd_pool), goto delete_device);
 
     device->specialized_programs = new_dict(SpecProgramKey, VkrSpecProgram*, (HashFn) hash_spec_program_key, (CmpFn) cmp_spec_program_keys);
+    device->shared_modules = new_dict(Program*, Module*, (HashFn) hash_ptr, (CmpFn) compare_ptrs);
 
     vkGetDeviceQueue(device->device, device->caps.compute_queue_family, 0, &device->compute_queue);
 
@@ -294,6 +295,12 @@ static void shutdown_vkr_device(VkrDevice* device) {
         destroy_specialized_program(sp);
     }
     destroy_dict(device->specialized_programs);
+    i = 0;
+    Module* shared_module;
+    while (dict_iter(device->shared_modules, &i, NULL, &shared_module)) {
+        destroy_ir_arena(get_module_arena(shared_module));
+    }
+    destroy_dict(device->shared_modules);
     vkDestroyCommandPool(device->device, device->cmd_pool, NULL);
     vkDestroyDevice(device->device, NULL);
     free(device);
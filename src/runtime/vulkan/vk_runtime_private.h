@@ -154,6 +154,8 @@ struct VkrDevice_ {
     } extensions;
 
     struct Dict* specialized_programs;
+    /// Program -> its module after run_shared_compiler_passes, specialized again for every entry point we need
+    struct Dict* shared_modules;
 };
 
 bool probe_vkr_devices(VkrBackend*);
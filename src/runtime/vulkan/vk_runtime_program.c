@@ -376,14 +376,26 @@ static bool extract_parameters_info(ProgramParamsInfo* parameters, Module* mod)
     return true;
 }
 
+static Module* get_shared_module(VkrDevice* device, Program* program, CompilerConfig* config) {
+    Module** found = find_value_dict(Program*, Module*, device->shared_modules, program);
+    if (found)
+        return *found;
+    Module* shared_module = program->module;
+    CHECK(run_shared_compiler_passes(config, &shared_module) == CompilationNoError, return NULL);
+    insert_dict(Program*, Module*, device->shared_modules, program, shared_module);
+    return shared_module;
+}
+
 static bool compile_specialized_program(VkrSpecProgram* spec) {
     CompilerConfig config = get_compiler_config_for_device(spec->device, spec->key.base->base_config);
-    config.specialization.entry_point = spec->key.entry_point;
+    Module* mod = get_shared_module(spec->device, spec->key.base, &config);
+    CHECK(mod, return false);
 
-    CHECK(run_compiler_passes(&config, &spec->specialized_module) == CompilationNoError, return false);
+    config.specialization.entry_point = spec->key.entry_point;
+    CHECK(run_specialized_compiler_passes(&config, &mod) == CompilationNoError, return false);
 
     Module* final_mod;
-    emit_spirv(&config, spec->specialized_module, &spec->spirv_size, &spec->spirv_bytes, &final_mod);
+    emit_spirv(&config, mod, &spec->spirv_size, &spec->spirv_bytes, &final_mod);
 
     CHECK(extract_parameters_info(&spec->parameters, final_mod), return false);
 
@@ -42,3 +42,36 @@ bool is_control_static(const UsesMap* map, const Node* control) {
     assert(found_binding_abs);
     return true;
 }
+
+bool is_ptr_leaking(const UsesMap* map, const Node* ptr) {
+    for (const Use* use = get_first_use(map, ptr); use; use = use->next_use) {
+        if (use->operand_class == NcVariable)
+            continue;
+        if (use->user->tag != PrimOp_TAG)
+            return true;
+        PrimOp payload = use->user->payload.prim_op;
+        switch (payload.op) {
+            case load_op: continue;
+            case store_op: {
+                if (payload.operands.nodes[1] == ptr)
+                    return true;
+                continue;
+            }
+            case lea_op: {
+                // a non-zero offset can walk into whatever lives next to the object
+                const IntLiteral* offset = resolve_to_int_literal(payload.operands.nodes[1]);
+                if (first(payload.operands) != ptr || !offset || get_int_literal_value(*offset, false) != 0)
+                    return true;
+                for (const Use* lea_use = get_first_use(map, use->user); lea_use; lea_use = lea_use->next_use) {
+                    if (lea_use->user->tag == Let_TAG)
+                        continue;
+                    if (lea_use->user->tag != Variablez_TAG || is_ptr_leaking(map, lea_use->user))
+                        return true;
+                }
+                continue;
+            }
+            default: return true;
+        }
+    }
+    return false;
+}
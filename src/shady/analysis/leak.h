@@ -11,4 +11,7 @@ void visit_enclosing_abstractions(UsesMap*, const Node*, void* uptr, VisitEnclos
 
 bool is_control_static(const UsesMap*, const Node* control);
 
+/// Whether the address held in ptr is used for anything but loading and storing, directly or through the pointers derived from it
+bool is_ptr_leaking(const UsesMap*, const Node* ptr);
+
 #endif
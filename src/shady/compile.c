@@ -9,13 +9,37 @@
 #include "util.h"
 
 #include <stdbool.h>
+#include <string.h>
 
-void add_scheduler_source(const CompilerConfig* config, Module* dst) {
+static struct {
+    TargetConfig target;
+    SchedulerPolicy scheduler_policy;
+    Module* scheduler_mod;
+} warm_state;
+
+static Module* parse_scheduler_source(const CompilerConfig* config) {
     ParserConfig pconfig = {
         .front_end = true,
     };
-    Module* builtin_scheduler_mod = parse_slim_module(config, pconfig, shady_scheduler_src, "builtin_scheduler");
+    return parse_slim_module(config, pconfig, shady_scheduler_src, "builtin_scheduler");
+}
+
+void prewarm_compiler(const CompilerConfig* config) {
+    if (warm_state.scheduler_mod)
+        destroy_ir_arena(get_module_arena(warm_state.scheduler_mod));
+    warm_state.target = config->target;
+    warm_state.scheduler_policy = config->scheduler_policy;
+    warm_state.scheduler_mod = parse_scheduler_source(config);
+}
+
+void add_scheduler_source(const CompilerConfig* config, Module* dst) {
     debug_print("Adding builtin scheduler code");
+    // the parsed scheduler only depends on the target config and the policy it got built for, so a warmed-up copy can be reused as-is
+    if (warm_state.scheduler_mod && memcmp(&warm_state.target, &config->target, sizeof(TargetConfig)) == 0 && warm_state.scheduler_policy == config->scheduler_policy) {
+        link_module(dst, warm_state.scheduler_mod);
+        return;
+    }
+    Module* builtin_scheduler_mod = parse_scheduler_source(config);
     link_module(dst, builtin_scheduler_mod);
     destroy_ir_arena(get_module_arena(builtin_scheduler_mod));
 }
@@ -42,7 +66,7 @@ void run_pass_impl(CompilerConfig* config, Module** pmod, IrArena* initial_arena
         config->hooks.after_pass.fn(config->hooks.after_pass.uptr, pass_name, *pmod);
 }
 
-CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
+CompilationResult run_shared_compiler_passes(CompilerConfig* config, Module** pmod) {
     IrArena* initial_arena = (*pmod)->arena;
 	
     if (config->dynamic_scheduling) {
@@ -55,6 +79,10 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
 
     RUN_PASS(lower_cf_instrs)
     RUN_PASS(opt_mem2reg) // run because control-flow is now normalized
+    RUN_PASS(opt_generic_ptrs) // mem2reg turned the generic pointers kept in allocas into values we can follow
+    RUN_PASS(opt_gvn)
+    RUN_PASS(opt_sccp)
+    RUN_PASS(opt_licm)
     RUN_PASS(setup_stack_frames)
     if (!config->hacks.force_join_point_lifting)
         RUN_PASS(mark_leaf_functions)
@@ -66,16 +94,29 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     RUN_PASS(opt_mem2reg) // run because we can now weaken non-leaking allocas
 
     RUN_PASS(specialize_execution_model)
+    RUN_PASS(opt_uniformity) // lower_tailcalls and the lowerings after it have cheaper paths for uniform values
 
-    //RUN_PASS(opt_stack)
+    RUN_PASS(opt_stack) // lift_indirect_targets spills everything live, and lower_tailcalls passes every argument on the stack
 
     RUN_PASS(lower_tailcalls)
     RUN_PASS(lower_switch_btree)
     RUN_PASS(opt_restructurize)
     RUN_PASS(opt_mem2reg)
+    RUN_PASS(opt_gvn) // inlining and mem2reg leave duplicate address and arithmetic computations behind
+
+    // the specializations read this module concurrently
+    freeze_ir_arena((*pmod)->arena);
+    return CompilationNoError;
+}
+
+CompilationResult run_specialized_compiler_passes(CompilerConfig* config, Module** pmod) {
+    // the shared module is the initial arena here, so it survives this
+    IrArena* initial_arena = (*pmod)->arena;
 
     if (config->specialization.entry_point)
         RUN_PASS(specialize_entry_point)
+    RUN_PASS(opt_sccp) // the specialization constants are known now
+    RUN_PASS(opt_unroll)
 
     RUN_PASS(lower_mask)
     RUN_PASS(lower_memcpy)
@@ -94,6 +135,8 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     }
     RUN_PASS(lower_subgroup_vars)
     RUN_PASS(lower_memory_layout)
+    RUN_PASS(opt_specialize_args) // the offsets and sizes passed to the generated helpers are literals now
+    RUN_PASS(opt_licm) // the layout computations are explicit now
 
     if (config->lower.decay_ptrs)
         RUN_PASS(lower_decay_ptrs)
@@ -109,4 +152,16 @@ CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
     return CompilationNoError;
 }
 
+CompilationResult run_compiler_passes(CompilerConfig* config, Module** pmod) {
+    IrArena* initial_arena = (*pmod)->arena;
+    CompilationResult result = run_shared_compiler_passes(config, pmod);
+    if (result != CompilationNoError)
+        return result;
+    Module* shared = *pmod;
+    result = run_specialized_compiler_passes(config, pmod);
+    if (get_module_arena(shared) != get_module_arena(*pmod) && get_module_arena(shared) != initial_arena)
+        destroy_ir_arena(get_module_arena(shared));
+    return result;
+}
+
 #undef mod
@@ -29,7 +29,13 @@ CompilerConfig default_compiler_config() {
             .cleanup = {
                 .after_every_pass = true,
                 .delete_unused_instructions = true,
-            }
+            },
+            .fall_through_dispatch = true,
+            .coalesce_emulated_memory = true,
+        },
+
+        .frontend = {
+            .threads = 1,
         },
 
         .target = default_target_config(),
@@ -32,7 +32,7 @@ static void post_construction_validation(IrArena* arena, Node* node) {
 
 static void pre_construction_validation(IrArena* arena, Node* node);
 
-static Node* create_node_helper(IrArena* arena, Node node, bool* pfresh) {
+static Node* create_node_helper_locked(IrArena* arena, Node node, bool* pfresh) {
     pre_construction_validation(arena, &node);
 
     if (pfresh)
@@ -45,6 +45,7 @@ static Node* create_node_helper(IrArena* arena, Node node, bool* pfresh) {
         assert(!found);
     else if (found)
         return *found;
+    assert(!arena->frozen && "nodes can't be added to a frozen arena");
 
     if (pfresh)
         *pfresh = true;
@@ -72,6 +73,13 @@ static Node* create_node_helper(IrArena* arena, Node node, bool* pfresh) {
     return alloc;
 }
 
+static Node* create_node_helper(IrArena* arena, Node node, bool* pfresh) {
+    lock_ir_arena(arena);
+    Node* n = create_node_helper_locked(arena, node, pfresh);
+    unlock_ir_arena(arena);
+    return n;
+}
+
 #include "constructors_generated.c"
 
 const Node* let(IrArena* arena, const Node* instruction, Nodes vars, const Node* tail) {
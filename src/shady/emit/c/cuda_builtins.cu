@@ -29,3 +29,8 @@ __device__ T __shady_broadcast_first(T t) {
     int elected_lane = __ffs(writemask) - 1;
     return __shfl_sync(writemask, t, elected_lane);
 }
+
+template<typename T>
+__device__ T __shady_subgroup_shuffle(T t, unsigned int lane) {
+    return __shfl_sync(__activemask(), t, lane);
+}
@@ -214,9 +214,9 @@ CTerm emit_value(Emitter* emitter, Printer* block_printer, const Node* value) {
         case Variablez_TAG: error("tried to emit a variable: all variables should be register by their binding let !");
         case Value_IntLiteral_TAG: {
             if (value->payload.int_literal.is_signed)
-                emitted = format_string_arena(emitter->arena->arena, "%" PRIi64, value->payload.int_literal.value);
+                emitted = format_string_arena(emitter->arena->arena, "%" PRIi64, get_int_literal_value(value->payload.int_literal, true));
             else
-                emitted = format_string_arena(emitter->arena->arena, "%" PRIu64, value->payload.int_literal.value);
+                emitted = format_string_arena(emitter->arena->arena, "%" PRIu64, (uint64_t) get_int_literal_value(value->payload.int_literal, false));
 
             bool is_long = value->payload.int_literal.width == IntTy64;
             bool is_signed = value->payload.int_literal.is_signed;
@@ -805,6 +805,12 @@ void emit_c(CompilerConfig compiler_config, CEmitterConfig config, Module* mod,
             print(finalp, "\n#include <stddef.h>");
             print(finalp, "\n#include <stdio.h>");
             print(finalp, "\n#include <math.h>");
+            // provided by whatever runs a subgroup's worth of invocations together
+            print(finalp, "\nvoid __shady_subgroup_barrier(void);");
+            print(finalp, "\nuint32_t __shady_subgroup_shuffle(uint32_t, uint32_t);");
+            print(finalp, "\nbool __shady_subgroup_elect_first(void);");
+            print(finalp, "\nuint32_t __shady_subgroup_broadcast_first(uint32_t);");
+            print(finalp, "\nuint64_t __shady_subgroup_ballot(bool);");
             break;
         case CDialect_GLSL:
             print(finalp, "#extension GL_ARB_gpu_shader_int64: require\n");
@@ -86,7 +86,6 @@ static const ISelTableEntry isel_table[PRIMOPS_COUNT] = {
     [and_op] = { IsMono, OsInfix,  "&" },
     [or_op]  = { IsMono, OsInfix,  "|" },
     [xor_op] = { IsMono, OsInfix,  "^" },
-    [not_op] = { IsMono, OsPrefix, "!" },
     /*[rshift_arithm_op] = { IsMono, OsInfix,  ">>" },
     [rshift_logical_op] = { IsMono, OsInfix,  ">>" }, // TODO achieve desired right shift semantics through unsigned/signed casts
     [lshift_op] = { IsMono, OsInfix,  "<<" },*/
@@ -95,6 +94,9 @@ static const ISelTableEntry isel_table[PRIMOPS_COUNT] = {
 static const ISelTableEntry isel_table_c[PRIMOPS_COUNT] = {
     [abs_op] = { IsPoly, OsCall, .s_ops = { "abs", "abs", "abs", "llabs" }, .f_ops = {"fabsf", "fabsf", "fabs"}},
 
+    [subgroup_ballot_op] = { IsMono, OsCall, "__shady_subgroup_ballot" },
+    [subgroup_shuffle_op] = { IsMono, OsCall, "__shady_subgroup_shuffle" },
+
     [sin_op] = { IsPoly, OsCall, .f_ops = {"sinf", "sinf", "sin"}},
     [cos_op] = { IsPoly, OsCall, .f_ops = {"cosf", "cosf", "cos"}},
     [floor_op] = { IsPoly, OsCall, .f_ops = {"floorf", "floorf", "floor"}},
@@ -118,6 +120,16 @@ static const ISelTableEntry isel_table_glsl[PRIMOPS_COUNT] = {
     [sqrt_op] = { IsMono, OsCall, "sqrt" },
     [exp_op] = { IsMono, OsCall, "exp" },
     [pow_op] = { IsMono, OsCall, "pow" },
+
+    [subgroup_reduce_sum_op] = { IsMono, OsCall, "subgroupAdd" },
+    [subgroup_reduce_min_op] = { IsMono, OsCall, "subgroupMin" },
+    [subgroup_reduce_max_op] = { IsMono, OsCall, "subgroupMax" },
+    [subgroup_reduce_and_op] = { IsMono, OsCall, "subgroupAnd" },
+    [subgroup_reduce_or_op] = { IsMono, OsCall, "subgroupOr" },
+    [subgroup_reduce_xor_op] = { IsMono, OsCall, "subgroupXor" },
+    [subgroup_scan_inclusive_sum_op] = { IsMono, OsCall, "subgroupInclusiveAdd" },
+    [subgroup_scan_exclusive_sum_op] = { IsMono, OsCall, "subgroupExclusiveAdd" },
+    [subgroup_shuffle_op] = { IsMono, OsCall, "subgroupShuffle" },
 };
 
 static const ISelTableEntry isel_table_ispc[PRIMOPS_COUNT] = {
@@ -136,6 +148,10 @@ static const ISelTableEntry isel_table_ispc[PRIMOPS_COUNT] = {
     [subgroup_active_mask_op] = { IsMono, OsCall, "lanemask" },
     [subgroup_ballot_op] = { IsMono, OsCall, "packmask" },
     [subgroup_reduce_sum_op] = { IsMono, OsCall, "reduce_add" },
+    [subgroup_reduce_min_op] = { IsMono, OsCall, "reduce_min" },
+    [subgroup_reduce_max_op] = { IsMono, OsCall, "reduce_max" },
+    [subgroup_scan_exclusive_sum_op] = { IsMono, OsCall, "exclusive_scan_add" },
+    [subgroup_shuffle_op] = { IsMono, OsCall, "shuffle" },
 };
 
 static bool emit_using_entry(CTerm* out, Emitter* emitter, Printer* p, const ISelTableEntry* entry, Nodes operands) {
@@ -235,11 +251,32 @@ static void emit_primop(Emitter* emitter, Printer* p, const Node* node, Instruct
             }
             break;
         }
+        // the results are a record of the low part and the carry / borrow / high part
         case add_carry_op:
         case sub_borrow_op:
-        case mul_extended_op:
-            error("TODO: implement extended arithm ops in C");
+        case mul_extended_op: {
+            const Type* t = get_unqualified_type(first(prim_op->operands)->type);
+            assert(t->tag == Int_TAG && t->payload.int_type.width <= IntTy32);
+            if (emitter->config.dialect == CDialect_GLSL)
+                error("TODO: implement extended arithm ops in GLSL");
+            CType ct = emit_type(emitter, t, NULL);
+            CType result_t = emit_type(emitter, get_unqualified_type(node->type), NULL);
+            String a = unique_name(arena, "extended_a");
+            String b = unique_name(arena, "extended_b");
+            print(p, "\n%s = %s;", emit_type(emitter, t, a), to_cvalue(emitter, emit_value(emitter, p, first(prim_op->operands))));
+            print(p, "\n%s = %s;", emit_type(emitter, t, b), to_cvalue(emitter, emit_value(emitter, p, prim_op->operands.nodes[1])));
+            switch (prim_op->op) {
+                case add_carry_op: term = term_from_cvalue(format_string_arena(arena->arena, "((%s) { (%s) (%s + %s), (%s) ((%s) (%s + %s) < %s) })", result_t, ct, a, b, ct, ct, a, b, a)); break;
+                case sub_borrow_op: term = term_from_cvalue(format_string_arena(arena->arena, "((%s) { (%s) (%s - %s), (%s) (%s < %s) })", result_t, ct, a, b, ct, a, b)); break;
+                default: {
+                    String wide_t = t->payload.int_type.is_signed ? "int64_t" : "uint64_t";
+                    size_t width = int_size_in_bytes(t->payload.int_type.width) * 8;
+                    term = term_from_cvalue(format_string_arena(arena->arena, "((%s) { (%s) ((%s) %s * (%s) %s), (%s) (((%s) %s * (%s) %s) >> %d) })", result_t, ct, wide_t, a, wide_t, b, ct, wide_t, a, wide_t, b, (int) width));
+                    break;
+                }
+            }
             break;
+        }
         // MATH OPS
         case fract_op: {
             CTerm floored;
@@ -300,6 +337,13 @@ static void emit_primop(Emitter* emitter, Printer* p, const Node* node, Instruct
             term = term_from_cvalue(format_string_arena(arena->arena, "(%s %s %s)", src, prim_op->op == lshift_op ? "<<" : ">>", c_offset));
             break;
         }
+        // '!' is only right for booleans
+        case not_op: {
+            const Type* t = get_unqualified_type(first(prim_op->operands)->type);
+            CValue src = to_cvalue(emitter, emit_value(emitter, p, first(prim_op->operands)));
+            term = term_from_cvalue(format_string_arena(arena->arena, "%s%s", t->tag == Int_TAG ? "~" : "!", src));
+            break;
+        }
         case alloca_op:
         case alloca_logical_op: {
             assert(outputs.count == 1);
@@ -626,7 +670,7 @@ static void emit_primop(Emitter* emitter, Printer* p, const Node* node, Instruct
             switch (emitter->config.dialect) {
                 case CDialect_CUDA: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "__shady_elect_first()")); break;
                 case CDialect_ISPC: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "(programIndex == count_trailing_zeros(lanemask()))")); break;
-                case CDialect_C11:
+                case CDialect_C11: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "__shady_subgroup_elect_first()")); break;
                 case CDialect_GLSL: error("TODO")
             }
             break;
@@ -643,11 +687,22 @@ static void emit_primop(Emitter* emitter, Printer* p, const Node* node, Instruct
             switch (emitter->config.dialect) {
                 case CDialect_CUDA: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "__shady_broadcast_first(%s)", value)); break;
                 case CDialect_ISPC: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "extract(%s, count_trailing_zeros(lanemask()))", value)); break;
-                case CDialect_C11:
+                case CDialect_C11: term = term_from_cvalue(format_string_arena(emitter->arena->arena, "__shady_subgroup_broadcast_first(%s)", value)); break;
                 case CDialect_GLSL: error("TODO")
             }
             break;
         }
+        case subgroup_barrier_op: {
+            switch (emitter->config.dialect) {
+                case CDialect_CUDA: print(p, "\n__syncwarp();"); break;
+                case CDialect_GLSL: print(p, "\nsubgroupBarrier();"); break;
+                // the gang runs in lockstep
+                case CDialect_ISPC: break;
+                // there are no subgroups in C, whoever runs several invocations as one provides this
+                case CDialect_C11: print(p, "\n__shady_subgroup_barrier();"); break;
+            }
+            return;
+        }
         case empty_mask_op:
         case mask_is_thread_active_op: error("lower_me");
         case debug_printf_op: {
@@ -713,7 +768,7 @@ static void emit_call(Emitter* emitter, Printer* p, const Node* call, Instructio
     CValue e_callee;
     const Node* callee = call->payload.call.callee;
     if (callee->tag == FnAddr_TAG)
-        e_callee = get_declaration_name(callee->payload.fn_addr.fn);
+        e_callee = legalize_c_identifier(emitter, get_declaration_name(callee->payload.fn_addr.fn));
     else
         e_callee = to_cvalue(emitter, emit_value(emitter, p, callee));
 
@@ -139,6 +139,23 @@ static const IselTableEntry isel_table[] = {
     [PRIMOPS_COUNT] = { Custom }
 };
 
+typedef struct {
+    SpvGroupOperation group_op;
+    SpvOp fo[OperandClassCount];
+} SubgroupArithmeticEntry;
+
+static const SubgroupArithmeticEntry subgroup_arithmetic_table[] = {
+    [subgroup_reduce_sum_op] = { SpvGroupOperationReduce, { SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformFAdd, ISEL_ILLEGAL, ISEL_ILLEGAL }},
+    [subgroup_reduce_min_op] = { SpvGroupOperationReduce, { SpvOpGroupNonUniformSMin, SpvOpGroupNonUniformUMin, SpvOpGroupNonUniformFMin, ISEL_ILLEGAL, ISEL_ILLEGAL }},
+    [subgroup_reduce_max_op] = { SpvGroupOperationReduce, { SpvOpGroupNonUniformSMax, SpvOpGroupNonUniformUMax, SpvOpGroupNonUniformFMax, ISEL_ILLEGAL, ISEL_ILLEGAL }},
+    [subgroup_reduce_and_op] = { SpvGroupOperationReduce, { SpvOpGroupNonUniformBitwiseAnd, SpvOpGroupNonUniformBitwiseAnd, ISEL_ILLEGAL, SpvOpGroupNonUniformLogicalAnd, ISEL_ILLEGAL }},
+    [subgroup_reduce_or_op]  = { SpvGroupOperationReduce, { SpvOpGroupNonUniformBitwiseOr,  SpvOpGroupNonUniformBitwiseOr,  ISEL_ILLEGAL, SpvOpGroupNonUniformLogicalOr,  ISEL_ILLEGAL }},
+    [subgroup_reduce_xor_op] = { SpvGroupOperationReduce, { SpvOpGroupNonUniformBitwiseXor, SpvOpGroupNonUniformBitwiseXor, ISEL_ILLEGAL, SpvOpGroupNonUniformLogicalXor, ISEL_ILLEGAL }},
+    [subgroup_scan_inclusive_sum_op] = { SpvGroupOperationInclusiveScan, { SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformFAdd, ISEL_ILLEGAL, ISEL_ILLEGAL }},
+    [subgroup_scan_exclusive_sum_op] = { SpvGroupOperationExclusiveScan, { SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformIAdd, SpvOpGroupNonUniformFAdd, ISEL_ILLEGAL, ISEL_ILLEGAL }},
+    [PRIMOPS_COUNT] = { 0 }
+};
+
 #pragma GCC diagnostic pop
 #pragma GCC diagnostic error "-Wswitch"
 
@@ -262,13 +279,38 @@ static void emit_primop(Emitter* emitter, FnBuilder fn_builder, BBBuilder bb_bui
             spvb_capability(emitter->file_builder, SpvCapabilityGroupNonUniformBallot);
             return;
         }
-        case subgroup_reduce_sum_op: {
+        case subgroup_reduce_sum_op:
+        case subgroup_reduce_min_op:
+        case subgroup_reduce_max_op:
+        case subgroup_reduce_and_op:
+        case subgroup_reduce_or_op:
+        case subgroup_reduce_xor_op:
+        case subgroup_scan_inclusive_sum_op:
+        case subgroup_scan_exclusive_sum_op: {
+            SubgroupArithmeticEntry entry = subgroup_arithmetic_table[the_op.op];
+            const Type* t = get_unqualified_type(first(args)->type);
+            SpvOp opcode = entry.fo[classify_operand_type(t)];
+            assert(opcode != ISEL_ILLEGAL);
             SpvId scope_subgroup = emit_value(emitter, bb_builder, int32_literal(emitter->arena, SpvScopeSubgroup));
             assert(results_count == 1);
-            results[0] = spvb_group_non_uniform_iadd(bb_builder, emit_type(emitter, get_unqualified_type(first(args)->type)), emit_value(emitter, bb_builder, first(args)), scope_subgroup, SpvGroupOperationReduce, NULL);
+            results[0] = spvb_group_non_uniform_arithmetic(bb_builder, opcode, emit_type(emitter, t), emit_value(emitter, bb_builder, first(args)), scope_subgroup, entry.group_op, NULL);
             spvb_capability(emitter->file_builder, SpvCapabilityGroupNonUniformArithmetic);
             return;
         }
+        case subgroup_shuffle_op: {
+            SpvId scope_subgroup = emit_value(emitter, bb_builder, int32_literal(emitter->arena, SpvScopeSubgroup));
+            assert(results_count == 1);
+            results[0] = spvb_group_shuffle(bb_builder, emit_type(emitter, get_unqualified_type(first(args)->type)), scope_subgroup, emit_value(emitter, bb_builder, first(args)), emit_value(emitter, bb_builder, args.nodes[1]));
+            spvb_capability(emitter->file_builder, SpvCapabilityGroupNonUniformShuffle);
+            return;
+        }
+        case subgroup_barrier_op: {
+            // the emulated subgroup ops exchange values through subgroup memory, which lives in shared memory by then
+            SpvId scope_subgroup = emit_value(emitter, bb_builder, int32_literal(emitter->arena, SpvScopeSubgroup));
+            SpvId semantics = emit_value(emitter, bb_builder, uint32_literal(emitter->arena, SpvMemorySemanticsAcquireReleaseMask | SpvMemorySemanticsWorkgroupMemoryMask));
+            spvb_control_barrier(bb_builder, scope_subgroup, scope_subgroup, semantics);
+            return;
+        }
         case subgroup_elect_first_op: {
             SpvId result_t = emit_type(emitter, bool_type(emitter->arena));
             SpvId scope_subgroup = emit_value(emitter, bb_builder, int32_literal(emitter->arena, SpvScopeSubgroup));
@@ -511,7 +553,8 @@ static void emit_match(Emitter* emitter, FnBuilder fn_builder, BBBuilder* bb_bui
     size_t literal_case_entry_size = literal_width + 1;
     LARRAY(uint32_t, literals_and_cases, match.cases.count * literal_case_entry_size);
     for (size_t i = 0; i < match.cases.count; i++) {
-        uint64_t value = (uint64_t) get_int_literal_value(*resolve_to_int_literal(match.literals.nodes[i]), false);
+        // literals narrower than 32 bits are sign-extended for signed selectors
+        uint64_t value = (uint64_t) get_int_literal_value(*resolve_to_int_literal(match.literals.nodes[i]), inspectee_t->payload.int_type.is_signed);
         if (inspectee_t->payload.int_type.width == IntTy64) {
             literals_and_cases[i * literal_case_entry_size + 0] = (SpvId) (uint32_t) (value & 0xFFFFFFFF);
             literals_and_cases[i * literal_case_entry_size + 1] = (SpvId) (uint32_t) (value >> 32);
@@ -846,7 +846,11 @@ SpvId spvb_group_shuffle(SpvbBasicBlockBuilder* bb_builder, SpvId result_type, S
 }
 
 SpvId spvb_group_non_uniform_iadd(SpvbBasicBlockBuilder* bb_builder, SpvId result_type, SpvId value, SpvId scope, SpvGroupOperation group_op, SpvId* cluster_size) {
-    op(SpvOpGroupNonUniformIAdd, cluster_size ? 7 : 6);
+    return spvb_group_non_uniform_arithmetic(bb_builder, SpvOpGroupNonUniformIAdd, result_type, value, scope, group_op, cluster_size);
+}
+
+SpvId spvb_group_non_uniform_arithmetic(SpvbBasicBlockBuilder* bb_builder, SpvOp opcode, SpvId result_type, SpvId value, SpvId scope, SpvGroupOperation group_op, SpvId* cluster_size) {
+    op(opcode, cluster_size ? 7 : 6);
     SpvId id = spvb_fresh_id(bb_builder->fn_builder->file_builder);
     ref_id(result_type);
     ref_id(id);
@@ -858,6 +862,13 @@ SpvId spvb_group_non_uniform_iadd(SpvbBasicBlockBuilder* bb_builder, SpvId resul
     return id;
 }
 
+void spvb_control_barrier(SpvbBasicBlockBuilder* bb_builder, SpvId execution_scope, SpvId memory_scope, SpvId semantics) {
+    op(SpvOpControlBarrier, 4);
+    ref_id(execution_scope);
+    ref_id(memory_scope);
+    ref_id(semantics);
+}
+
 void spvb_branch(SpvbBasicBlockBuilder* bb_builder, SpvId target) {
     op(SpvOpBranch, 2);
     ref_id(target);
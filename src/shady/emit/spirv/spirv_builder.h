@@ -100,6 +100,8 @@ SpvId spvb_group_ballot(SpvbBasicBlockBuilder*, SpvId result_t, SpvId predicate,
 SpvId spvb_group_shuffle(SpvbBasicBlockBuilder*, SpvId result_type, SpvId scope, SpvId value, SpvId id);
 SpvId spvb_group_broadcast_first(SpvbBasicBlockBuilder*, SpvId result_t, SpvId value, SpvId scope);
 SpvId spvb_group_non_uniform_iadd(SpvbBasicBlockBuilder*, SpvId result_t, SpvId value, SpvId scope, SpvGroupOperation group_op, SpvId* cluster_size);
+SpvId spvb_group_non_uniform_arithmetic(SpvbBasicBlockBuilder*, SpvOp op, SpvId result_t, SpvId value, SpvId scope, SpvGroupOperation group_op, SpvId* cluster_size);
+void  spvb_control_barrier(SpvbBasicBlockBuilder*, SpvId execution_scope, SpvId memory_scope, SpvId semantics);
 
 // Terminators
 void  spvb_branch(SpvbBasicBlockBuilder*, SpvId target);
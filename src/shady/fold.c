@@ -15,17 +15,42 @@ static const Node* quote_single(IrArena* a, const Node* value) {
     return quote_helper(a, singleton(value));
 }
 
-static bool is_zero(const Node* node) {
-    const IntLiteral* lit = resolve_to_int_literal(node);
-    if (lit && get_int_literal_value(*lit, false) == 0)
-        return true;
-    return false;
+static const Node* bool_literal(IrArena* a, bool value) {
+    return value ? true_lit(a) : false_lit(a);
 }
 
-static bool is_one(const Node* node) {
-    const IntLiteral* lit = resolve_to_int_literal(node);
-    if (lit && get_int_literal_value(*lit, false) == 1)
+static const bool* resolve_to_bool_literal(const Node* node) {
+    static const bool values[] = { false, true };
+    switch (node->tag) {
+        case True_TAG: return &values[1];
+        case False_TAG: return &values[0];
+        default: return NULL;
+    }
+}
+
+/// Integer literals hold their value zero-extended from their width, whatever the arithmetic left in the high bits
+static const Node* truncated_int_literal(IrArena* a, IntSizes width, bool is_signed, uint64_t value) {
+    IntLiteral literal = { .width = width, .is_signed = is_signed, .value = value };
+    literal.value = (uint64_t) get_int_literal_value(literal, false);
+    return int_literal(a, literal);
+}
+
+bool is_literal(const Node* node) {
+    switch (node->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG: return true;
+        default: return false;
+    }
+}
+
+bool are_same_constant(const Node* a, const Node* b) {
+    if (a == b)
         return true;
+    // int literals of the same width can differ in their unused high bits
+    if (a->tag == IntLiteral_TAG && b->tag == IntLiteral_TAG && a->payload.int_literal.width == b->payload.int_literal.width)
+        return get_int_literal_value(a->payload.int_literal, false) == get_int_literal_value(b->payload.int_literal, false);
     return false;
 }
 
@@ -58,32 +83,88 @@ static inline const Node* fold_constant_math(const Node* node) {
     }
 
 #define UN_OP(primop, op) case primop##_op: \
-if (all_int_literals)        return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = op int_literals[0]->value})); \
+if (all_int_literals)        return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, op int_literals[0]->value)); \
 else if (all_float_literals) return quote_single(arena, fp_literal_helper(arena, float_width, op get_float_literal_value(*float_literals[0]))); \
 else break;
 
 #define BIN_OP(primop, op) case primop##_op: \
-if (all_int_literals)        return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = int_literals[0]->value op int_literals[1]->value })); \
+if (all_int_literals)        return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, (uint64_t) get_int_literal_value(*int_literals[0], false) op (uint64_t) get_int_literal_value(*int_literals[1], false))); \
 else if (all_float_literals) return quote_single(arena, fp_literal_helper(arena, float_width, get_float_literal_value(*float_literals[0]) op get_float_literal_value(*float_literals[1]))); \
+break;
+
+#define INT_BIN_OP(primop, op) case primop##_op: \
+if (all_int_literals)        return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, int_literals[0]->value op int_literals[1]->value)); \
+break;
+
+// comparisons look at the literals with their own signedness, and produce a bool
+#define CMP_OP(primop, op) case primop##_op: \
+if (all_int_literals && is_signed) return quote_single(arena, bool_literal(arena, get_int_literal_value(*int_literals[0], true) op get_int_literal_value(*int_literals[1], true))); \
+else if (all_int_literals)         return quote_single(arena, bool_literal(arena, (uint64_t) get_int_literal_value(*int_literals[0], false) op (uint64_t) get_int_literal_value(*int_literals[1], false))); \
+else if (all_float_literals)       return quote_single(arena, bool_literal(arena, get_float_literal_value(*float_literals[0]) op get_float_literal_value(*float_literals[1]))); \
 break;
 
     if (all_int_literals || all_float_literals) {
+        switch (payload.op) {
+            case div_op:
+            case mod_op:
+                // leave it to the program to trap (or not)
+                if (all_int_literals && get_int_literal_value(*int_literals[1], false) == 0)
+                    return NULL;
+                // INT_MIN / -1 overflows, and the targets disagree on the sign of the remainder of negative numbers
+                if (all_int_literals && is_signed && (get_int_literal_value(*int_literals[0], true) < 0 || get_int_literal_value(*int_literals[1], true) < 0))
+                    return NULL;
+                break;
+            case lshift_op:
+            case rshift_logical_op:
+            case rshift_arithm_op:
+                // shifting by the width or more is undefined
+                if (all_int_literals && get_int_literal_value(*int_literals[1], false) >= int_size_in_bytes(int_width) * 8)
+                    return NULL;
+                break;
+            default: break;
+        }
+
         switch (payload.op) {
             UN_OP(neg, -)
             BIN_OP(add, +)
             BIN_OP(sub, -)
             BIN_OP(mul, *)
             BIN_OP(div, /)
+            INT_BIN_OP(and, &)
+            INT_BIN_OP(or, |)
+            INT_BIN_OP(xor, ^)
+            CMP_OP(gt, >)
+            CMP_OP(gte, >=)
+            CMP_OP(lt, <)
+            CMP_OP(lte, <=)
+            CMP_OP(eq, ==)
+            CMP_OP(neq, !=)
+            case not_op:
+                if (all_int_literals)
+                    return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, ~int_literals[0]->value));
+                break;
+            case lshift_op:
+                if (all_int_literals)
+                    return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, int_literals[0]->value << get_int_literal_value(*int_literals[1], false)));
+                break;
+            case rshift_logical_op:
+                if (all_int_literals)
+                    return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, (uint64_t) get_int_literal_value(*int_literals[0], false) >> get_int_literal_value(*int_literals[1], false)));
+                break;
+            case rshift_arithm_op:
+                if (all_int_literals)
+                    return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, get_int_literal_value(*int_literals[0], true) >> get_int_literal_value(*int_literals[1], false)));
+                break;
             case mod_op:
                 if (all_int_literals)
-                    return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = is_signed, .width = int_width, .value = int_literals[0]->value % int_literals[1]->value }));
+                    return quote_single(arena, truncated_int_literal(arena, int_width, is_signed, get_int_literal_value(*int_literals[0], false) % get_int_literal_value(*int_literals[1], false)));
                 else
                     return quote_single(arena, fp_literal_helper(arena, float_width, fmod(get_float_literal_value(*float_literals[0]), get_float_literal_value(*float_literals[1]))));
             case reinterpret_op: {
                 const Type* dst_t = first(payload.type_arguments);
                 uint64_t raw_value = int_literals[0] ? int_literals[0]->value : float_literals[0]->value;
                 if (dst_t->tag == Int_TAG) {
-                    return quote_single(arena, int_literal(arena, (IntLiteral) { .is_signed = dst_t->payload.int_type.is_signed, .width = dst_t->payload.int_type.width, .value = raw_value }));
+                    return quote_single(arena, truncated_int_literal(arena, dst_t->payload.int_type.width, dst_t->payload.int_type.is_signed, raw_value));
                 } else if (dst_t->tag == Float_TAG) {
                     return quote_single(arena, float_literal(arena, (FloatLiteral) { .width = dst_t->payload.float_type.width, .value = raw_value }));
                 }
@@ -104,7 +185,7 @@ break;
                     } else if (all_float_literals) {
                         double old_value = get_float_literal_value(*float_literals[0]);
                         int64_t value = old_value;
-                        return quote_single(arena, int_literal(arena, (IntLiteral) {.is_signed = dst_t->payload.int_type.is_signed, .width = dst_t->payload.int_type.width, .value = value}));
+                        return quote_single(arena, truncated_int_literal(arena, dst_t->payload.int_type.width, dst_t->payload.int_type.is_signed, value));
                     }
                 } else if (dst_t->tag == Float_TAG) {
                     if (all_int_literals) {
@@ -122,49 +203,113 @@ break;
         }
     }
 
-    return NULL;
-}
+    LARRAY(const bool*, bool_literals, payload.operands.count);
+    bool all_bool_literals = payload.operands.count > 0;
+    for (size_t i = 0; i < payload.operands.count; i++) {
+        bool_literals[i] = resolve_to_bool_literal(payload.operands.nodes[i]);
+        all_bool_literals &= bool_literals[i] != NULL;
+    }
 
-static inline const Node* fold_simplify_math(const Node* node) {
-    IrArena* arena = node->arena;
-    PrimOp payload = node->payload.prim_op;
-    switch (payload.op) {
-        case add_op: {
-            // If either operand is zero, destroy the add
-            for (size_t i = 0; i < 2; i++)
-                if (is_zero(payload.operands.nodes[i]))
-                    return quote_single(arena, payload.operands.nodes[1 - i]);
-            break;
-        }
-        case sub_op: {
-            // If second operand is zero, return the first one
-            if (is_zero(payload.operands.nodes[1]))
-                return quote_single(arena, payload.operands.nodes[0]);
-            // if first operand is zero, invert the second one
-            if (is_zero(payload.operands.nodes[0]))
-                return prim_op(arena, (PrimOp) {.op = neg_op, .operands = singleton(payload.operands.nodes[1]), .type_arguments = empty(arena)});
-            break;
+    if (all_bool_literals) {
+        switch (payload.op) {
+            case not_op: return quote_single(arena, bool_literal(arena, !*bool_literals[0]));
+            case and_op: return quote_single(arena, bool_literal(arena, *bool_literals[0] && *bool_literals[1]));
+            case or_op:  return quote_single(arena, bool_literal(arena, *bool_literals[0] || *bool_literals[1]));
+            case xor_op:
+            case neq_op: return quote_single(arena, bool_literal(arena, *bool_literals[0] != *bool_literals[1]));
+            case eq_op:  return quote_single(arena, bool_literal(arena, *bool_literals[0] == *bool_literals[1]));
+            default: break;
         }
-        case mul_op: {
-            for (size_t i = 0; i < 2; i++)
-                if (is_zero(payload.operands.nodes[i]))
-                    return quote_single(arena, payload.operands.nodes[i]); // return zero !
+    }
 
-            for (size_t i = 0; i < 2; i++)
-                if (is_one(payload.operands.nodes[i]))
-                    return quote_single(arena, payload.operands.nodes[1 - i]);
+    return NULL;
+}
 
-            break;
+/// Looks through the variable for the primop that defines it
+static const PrimOp* rule_resolve_prim_op(const Node* value, Op op) {
+    while (value->tag == Variablez_TAG) {
+        const Node* def = get_var_def(value->payload.varz);
+        if (!def || def->tag != PrimOp_TAG)
+            return NULL;
+        const PrimOp* instruction = &def->payload.prim_op;
+        if (instruction->op == quote_op) {
+            value = instruction->operands.nodes[value->payload.varz.iindex];
+            continue;
         }
-        case div_op: {
-            // If second operand is one, return the first one
-            if (is_one(payload.operands.nodes[1]))
-                return quote_single(arena, payload.operands.nodes[0]);
-            break;
-        }
-        default: break;
+        return instruction->op == op ? instruction : NULL;
     }
+    return NULL;
+}
+
+/// What's left of an instruction made of constants, once it's been folded
+static const Node* rule_fold_constant(const Node* instruction) {
+    if (instruction->tag == PrimOp_TAG && instruction->payload.prim_op.op == quote_op && instruction->payload.prim_op.operands.count == 1)
+        return first(instruction->payload.prim_op.operands);
+    return NULL;
+}
+
+static bool rule_is_literal(const Node* node) {
+    return resolve_to_int_literal(node) || resolve_to_float_literal(node) || resolve_to_bool_literal(node);
+}
+
+static bool rule_is_int_value(const Node* node, int64_t value) {
+    const IntLiteral* lit = resolve_to_int_literal(node);
+    return lit && get_int_literal_value(*lit, lit->is_signed) == value;
+}
 
+static bool rule_is_power_of_two(const Node* node) {
+    uint64_t value = get_int_literal_value(*resolve_to_int_literal(node), false);
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+static bool rule_is_unsigned(const Node* node) {
+    return !resolve_to_int_literal(node)->is_signed;
+}
+
+/// Only scalars, comparing vectors doesn't give back a single bool
+static bool rule_is_int(const Node* node) {
+    return node->type && get_unqualified_type(node->type)->tag == Int_TAG;
+}
+
+static bool rule_has_type(const Node* node, const Type* t) {
+    return node->type && get_unqualified_type(node->type) == t;
+}
+
+static bool rule_is_wider_or_same(const Type* wide, const Type* narrow) {
+    if (wide->tag == Int_TAG && narrow->tag == Int_TAG)
+        return wide->payload.int_type.width >= narrow->payload.int_type.width;
+    if (wide->tag == Float_TAG && narrow->tag == Float_TAG)
+        return wide->payload.float_type.width >= narrow->payload.float_type.width;
+    return false;
+}
+
+static const Node* rule_log2(IrArena* arena, const Node* node) {
+    const IntLiteral* lit = resolve_to_int_literal(node);
+    uint64_t value = get_int_literal_value(*lit, false);
+    uint64_t log2 = 0;
+    while (value >>= 1)
+        log2++;
+    return int_literal(arena, (IntLiteral) { .width = lit->width, .is_signed = lit->is_signed, .value = log2 });
+}
+
+static const Node* rule_one_like(IrArena* arena, const Node* node) {
+    const IntLiteral* lit = resolve_to_int_literal(node);
+    return int_literal(arena, (IntLiteral) { .width = lit->width, .is_signed = lit->is_signed, .value = 1 });
+}
+
+static const Node* rule_zero_like(IrArena* arena, const Node* node) {
+    if (!node->type)
+        return NULL;
+    return get_default_zero_value(arena, get_unqualified_type(node->type));
+}
+
+// the algebraic simplifications are described in fold_rules.json, this gives fold_rules[op]
+#include "fold_generated.c"
+
+static inline const Node* fold_simplify_math(const Node* node) {
+    FoldRules rules = fold_rules[node->payload.prim_op.op];
+    if (rules)
+        return rules(node->arena, node);
     return NULL;
 }
 
@@ -259,7 +404,13 @@ static const Node* fold_prim_op(IrArena* arena, const Node* node) {
     PrimOp payload = node->payload.prim_op;
     switch (payload.op) {
         case subgroup_assume_uniform_op:
-        case subgroup_broadcast_first_op: {
+        case subgroup_broadcast_first_op:
+        // these give back the value itself when it's the same in every lane
+        case subgroup_reduce_min_op:
+        case subgroup_reduce_max_op:
+        case subgroup_reduce_and_op:
+        case subgroup_reduce_or_op:
+        case subgroup_shuffle_op: {
             const Node* value = first(payload.operands);
             if (is_qualified_type_uniform(value->type))
                 return quote_single(arena, value);
@@ -282,9 +433,6 @@ static const Node* fold_prim_op(IrArena* arena, const Node* node) {
             if (first(payload.operands)->tag == Undef_TAG) {
                 return quote_single(arena, undef(arena, (Undef) { .type = get_unqualified_type(node->type) }));
             }
-            // get rid of identity casts
-            if (payload.type_arguments.nodes[0] == get_unqualified_type(payload.operands.nodes[0]->type))
-                return quote_single(arena, payload.operands.nodes[0]);
             break;
         case lea_op:
             if (first(payload.operands)->tag == Undef_TAG) {
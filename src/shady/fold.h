@@ -5,4 +5,9 @@
 
 const Node* fold_node(IrArena* arena, const Node* instruction);
 
+/// Int, float and boolean literals
+bool is_literal(const Node* node);
+/// Literals for the same value
+bool are_same_constant(const Node* a, const Node* b);
+
 #endif
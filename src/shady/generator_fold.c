@@ -0,0 +1,409 @@
+#include "generator.h"
+#include "portability.h"
+
+// Turns the rules in fold_rules.json into matchers, the predicates and helpers they use are in fold.c.
+// A rule matches [op, operands...], where op<T> captures the type argument, or any of a list of those. Operands are nested
+// patterns, or leaves:
+//   x           any value, captured as x. Seeing x again means the same value
+//   #c          an integer literal, captured as c
+//   0, 1        an integer literal of that value
+//   true, false the boolean literals
+// where: predicates on the captures, ! negates them.
+// rewrite: a capture or a literal, or a primop made out of them, where $op is the op that matched. Primops nested in it are
+// folded on the spot and must come out as constants. [@helper, args...] calls a helper, and the rule fails if that gives NULL.
+// Alternatives that only differ in their op share the function they match with.
+
+#define MAX_CAPTURES 16
+
+typedef struct {
+    Growy* g;
+    json_object* primops;
+    String rule_name;
+    String captures[MAX_CAPTURES];
+    /// where the capture was found, it only gets a variable once something uses it
+    String capture_values[MAX_CAPTURES];
+    bool capture_is_type[MAX_CAPTURES];
+    bool capture_is_bound[MAX_CAPTURES];
+    size_t captures_count;
+    int next_id;
+} RuleEmitter;
+
+static bool is_known_primop(json_object* primops, String name) {
+    for (size_t i = 0; i < json_object_array_length(primops); i++) {
+        String primop = json_object_get_string(json_object_object_get(json_object_array_get_idx(primops, i), "name"));
+        if (strcmp(primop, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+/// Splits op<T> into op and T, the latter being NULL when there is none
+static String parse_op(RuleEmitter* e, String str, String* type_capture) {
+    char* op = strdup(str);
+    *type_capture = NULL;
+    char* bracket = strchr(op, '<');
+    if (bracket) {
+        *bracket = '\0';
+        char* end = strchr(bracket + 1, '>');
+        if (!end || end[1] != '\0')
+            error("fold rule %s: malformed op '%s'\n", e->rule_name, str);
+        *end = '\0';
+        *type_capture = bracket + 1;
+    }
+    if (strcmp(op, "$op") != 0 && !is_known_primop(e->primops, op))
+        error("fold rule %s: unknown primop '%s'\n", e->rule_name, op);
+    return op;
+}
+
+static String capture_name(String leaf) {
+    return leaf[0] == '#' ? leaf + 1 : leaf;
+}
+
+static bool is_captured(RuleEmitter* e, String name) {
+    for (size_t i = 0; i < e->captures_count; i++)
+        if (strcmp(e->captures[i], name) == 0)
+            return true;
+    return false;
+}
+
+static void add_capture(RuleEmitter* e, String name, String value, bool is_type) {
+    if (e->captures_count == MAX_CAPTURES)
+        error("fold rule %s: too many captures\n", e->rule_name);
+    e->captures[e->captures_count] = name;
+    e->capture_values[e->captures_count] = strdup(value);
+    e->capture_is_type[e->captures_count] = is_type;
+    e->capture_is_bound[e->captures_count] = false;
+    e->captures_count++;
+}
+
+/// Gives the name of the capture, binding it first if this is its first use
+static String use_capture(RuleEmitter* e, String name) {
+    for (size_t i = 0; i < e->captures_count; i++) {
+        if (strcmp(e->captures[i], name) != 0)
+            continue;
+        if (!e->capture_is_bound[i]) {
+            growy_append_formatted(e->g, "\tconst %s* %s = %s;\n", e->capture_is_type[i] ? "Type" : "Node", name, e->capture_values[i]);
+            e->capture_is_bound[i] = true;
+        }
+        return name;
+    }
+    error("fold rule %s: '%s' is not captured\n", e->rule_name, name);
+}
+
+static void emit_match(RuleEmitter* e, json_object* pattern, String value);
+
+/// Matches the operands of the primop at 'primop', whose op is already known to be the right one
+static void emit_match_operands(RuleEmitter* e, json_object* pattern, String primop) {
+    Growy* g = e->g;
+    String type_capture;
+    String op = parse_op(e, json_object_get_string(json_object_array_get_idx(pattern, 0)), &type_capture);
+    if (strcmp(op, "$op") == 0)
+        error("fold rule %s: $op only makes sense in rewrites\n", e->rule_name);
+    size_t operands_count = json_object_array_length(pattern) - 1;
+    growy_append_formatted(g, "\tif (%s->operands.count != %d) return NULL;\n", primop, (int) operands_count);
+    if (type_capture) {
+        growy_append_formatted(g, "\tif (%s->type_arguments.count != 1) return NULL;\n", primop);
+        String type_argument = format_string_new("first(%s->type_arguments)", primop);
+        if (is_captured(e, type_capture))
+            growy_append_formatted(g, "\tif (%s != %s) return NULL;\n", type_argument, use_capture(e, type_capture));
+        else {
+            // the op string goes away, the capture's name stays around
+            add_capture(e, strdup(type_capture), type_argument, true);
+        }
+        free((void*) type_argument);
+    }
+    free((void*) op);
+    for (size_t i = 0; i < operands_count; i++) {
+        String operand = format_string_new("%s->operands.nodes[%d]", primop, (int) i);
+        emit_match(e, json_object_array_get_idx(pattern, i + 1), operand);
+        free((void*) operand);
+    }
+}
+
+static void emit_match(RuleEmitter* e, json_object* pattern, String value) {
+    Growy* g = e->g;
+    switch (json_object_get_type(pattern)) {
+        case json_type_int:
+            growy_append_formatted(g, "\tif (!rule_is_int_value(%s, %d)) return NULL;\n", value, json_object_get_int(pattern));
+            break;
+        case json_type_string: {
+            String leaf = json_object_get_string(pattern);
+            if (strcmp(leaf, "true") == 0 || strcmp(leaf, "false") == 0) {
+                growy_append_formatted(g, "\tif (%s->tag != %s_TAG) return NULL;\n", value, strcmp(leaf, "true") == 0 ? "True" : "False");
+                break;
+            }
+            String name = capture_name(leaf);
+            if (is_captured(e, name)) {
+                growy_append_formatted(g, "\tif (%s != %s) return NULL;\n", value, use_capture(e, name));
+                break;
+            }
+            if (leaf[0] == '#')
+                growy_append_formatted(g, "\tif (!resolve_to_int_literal(%s)) return NULL;\n", value);
+            add_capture(e, name, value, false);
+            break;
+        }
+        case json_type_array: {
+            String type_capture;
+            String op = parse_op(e, json_object_get_string(json_object_array_get_idx(pattern, 0)), &type_capture);
+            int id = e->next_id++;
+            growy_append_formatted(g, "\tconst PrimOp* p%d = rule_resolve_prim_op(%s, %s_op);\n", id, value, op);
+            growy_append_formatted(g, "\tif (!p%d) return NULL;\n", id);
+            free((void*) op);
+            String primop = format_string_new("p%d", id);
+            emit_match_operands(e, pattern, primop);
+            free((void*) primop);
+            break;
+        }
+        default: error("fold rule %s: can't match on %s\n", e->rule_name, json_object_to_json_string(pattern));
+    }
+}
+
+static void emit_predicate(RuleEmitter* e, json_object* predicate) {
+    String name = json_object_get_string(json_object_array_get_idx(predicate, 0));
+    bool negated = name[0] == '!';
+    // the captures get bound before the condition starts
+    Growy* args = new_growy();
+    for (size_t i = 1; i < json_object_array_length(predicate); i++) {
+        json_object* arg = json_object_array_get_idx(predicate, i);
+        if (i > 1)
+            growy_append_formatted(args, ", ");
+        if (json_object_get_type(arg) == json_type_int)
+            growy_append_formatted(args, "%d", json_object_get_int(arg));
+        else
+            growy_append_formatted(args, "%s", use_capture(e, capture_name(json_object_get_string(arg))));
+    }
+    growy_append_bytes(args, 1, "\0");
+    char* args_str = growy_deconstruct(args);
+    growy_append_formatted(e->g, "\tif (%srule_%s(%s)) return NULL;\n", negated ? "" : "!", negated ? name + 1 : name, args_str);
+    free(args_str);
+}
+
+static String emit_rewrite_value(RuleEmitter* e, json_object* rewrite);
+
+/// Gives the PrimOp payload that builds it
+static String emit_rewrite_primop(RuleEmitter* e, json_object* rewrite) {
+    String type_capture;
+    String op = parse_op(e, json_object_get_string(json_object_array_get_idx(rewrite, 0)), &type_capture);
+    size_t operands_count = json_object_array_length(rewrite) - 1;
+    LARRAY(String, operands, operands_count);
+    for (size_t i = 0; i < operands_count; i++)
+        operands[i] = emit_rewrite_value(e, json_object_array_get_idx(rewrite, i + 1));
+
+    Growy* payload = new_growy();
+    if (strcmp(op, "$op") == 0)
+        growy_append_formatted(payload, "(PrimOp) { .op = p->op");
+    else
+        growy_append_formatted(payload, "(PrimOp) { .op = %s_op", op);
+    if (type_capture)
+        growy_append_formatted(payload, ", .type_arguments = singleton(%s)", use_capture(e, type_capture));
+    else
+        growy_append_formatted(payload, ", .type_arguments = empty(arena)");
+    if (operands_count == 0)
+        growy_append_formatted(payload, ", .operands = empty(arena) }");
+    else {
+        growy_append_formatted(payload, ", .operands = mk_nodes(arena");
+        for (size_t i = 0; i < operands_count; i++) {
+            growy_append_formatted(payload, ", %s", operands[i]);
+            free((void*) operands[i]);
+        }
+        growy_append_formatted(payload, ") }");
+    }
+    growy_append_bytes(payload, 1, "\0");
+    free((void*) op);
+    return growy_deconstruct(payload);
+}
+
+/// Gives the C expression for the value, emitting whatever needs to happen before
+static String emit_rewrite_value(RuleEmitter* e, json_object* rewrite) {
+    Growy* g = e->g;
+    switch (json_object_get_type(rewrite)) {
+        case json_type_string: {
+            String leaf = json_object_get_string(rewrite);
+            if (strcmp(leaf, "true") == 0)
+                return strdup("true_lit(arena)");
+            if (strcmp(leaf, "false") == 0)
+                return strdup("false_lit(arena)");
+            return strdup(use_capture(e, capture_name(leaf)));
+        }
+        case json_type_array: {
+            String head = json_object_get_string(json_object_array_get_idx(rewrite, 0));
+            int id = e->next_id++;
+            if (head[0] == '@') {
+                size_t args_count = json_object_array_length(rewrite) - 1;
+                LARRAY(String, args, args_count);
+                for (size_t i = 0; i < args_count; i++)
+                    args[i] = emit_rewrite_value(e, json_object_array_get_idx(rewrite, i + 1));
+                growy_append_formatted(g, "\tconst Node* r%d = rule_%s(arena", id, head + 1);
+                for (size_t i = 0; i < args_count; i++) {
+                    growy_append_formatted(g, ", %s", args[i]);
+                    free((void*) args[i]);
+                }
+                growy_append_formatted(g, ");\n");
+            } else {
+                String payload = emit_rewrite_primop(e, rewrite);
+                growy_append_formatted(g, "\tconst Node* r%d = rule_fold_constant(prim_op(arena, %s));\n", id, payload);
+                free((void*) payload);
+            }
+            growy_append_formatted(g, "\tif (!r%d) return NULL;\n", id);
+            return format_string_new("r%d", id);
+        }
+        default: error("fold rule %s: can't rewrite into %s\n", e->rule_name, json_object_to_json_string(rewrite));
+    }
+}
+
+static void emit_rewrite(RuleEmitter* e, json_object* rewrite) {
+    Growy* g = e->g;
+    if (json_object_get_type(rewrite) == json_type_array && json_object_get_string(json_object_array_get_idx(rewrite, 0))[0] != '@') {
+        String payload = emit_rewrite_primop(e, rewrite);
+        growy_append_formatted(g, "\treturn prim_op(arena, %s);\n", payload);
+        free((void*) payload);
+        return;
+    }
+    String value = emit_rewrite_value(e, rewrite);
+    growy_append_formatted(g, "\treturn quote_single(arena, %s);\n", value);
+    free((void*) value);
+}
+
+/// A rule's match is either a single pattern or a list of them
+static bool has_alternatives(json_object* match) {
+    return json_object_get_type(json_object_array_get_idx(match, 0)) == json_type_array;
+}
+
+static json_object* get_alternative_pattern(json_object* rule, size_t alternative) {
+    json_object* match = json_object_object_get(rule, "match");
+    return has_alternatives(match) ? json_object_array_get_idx(match, alternative) : match;
+}
+
+static size_t get_alternatives_count(json_object* rule) {
+    json_object* match = json_object_object_get(rule, "match");
+    return has_alternatives(match) ? json_object_array_length(match) : 1;
+}
+
+/// The ops themselves are checked by the dispatch, so only the type captures and the operands make a difference
+static bool is_same_matcher(json_object* a, json_object* b) {
+    if (json_object_array_length(a) != json_object_array_length(b))
+        return false;
+    String a_type = strchr(json_object_get_string(json_object_array_get_idx(a, 0)), '<');
+    String b_type = strchr(json_object_get_string(json_object_array_get_idx(b, 0)), '<');
+    if ((a_type || b_type) && (!a_type || !b_type || strcmp(a_type, b_type) != 0))
+        return false;
+    for (size_t i = 1; i < json_object_array_length(a); i++)
+        if (!json_object_equal(json_object_array_get_idx(a, i), json_object_array_get_idx(b, i)))
+            return false;
+    return true;
+}
+
+/// The first alternative that matches the same way, and therefore gets to generate the function
+static size_t get_shared_alternative(json_object* rule, size_t alternative) {
+    for (size_t i = 0; i < alternative; i++)
+        if (is_same_matcher(get_alternative_pattern(rule, i), get_alternative_pattern(rule, alternative)))
+            return i;
+    return alternative;
+}
+
+static bool has_distinct_alternatives(json_object* rule) {
+    for (size_t i = 1; i < get_alternatives_count(rule); i++)
+        if (get_shared_alternative(rule, i) != 0)
+            return true;
+    return false;
+}
+
+static String get_alternative_fn_name(json_object* rule, size_t alternative) {
+    String name = json_object_get_string(json_object_object_get(rule, "name"));
+    if (has_distinct_alternatives(rule))
+        return format_string_new("fold_rule_%s_%d", name, (int) get_shared_alternative(rule, alternative));
+    return format_string_new("fold_rule_%s", name);
+}
+
+static String get_alternative_op(json_object* rule, size_t alternative) {
+    json_object* match = get_alternative_pattern(rule, alternative);
+    char* op = strdup(json_object_get_string(json_object_array_get_idx(match, 0)));
+    char* bracket = strchr(op, '<');
+    if (bracket)
+        *bracket = '\0';
+    return op;
+}
+
+static void generate_rule(Growy* g, json_object* primops, json_object* rule) {
+    String name = json_object_get_string(json_object_object_get(rule, "name"));
+    json_object* match = json_object_object_get(rule, "match");
+    json_object* where = json_object_object_get(rule, "where");
+    json_object* rewrite = json_object_object_get(rule, "rewrite");
+    if (!name || !match || !rewrite)
+        error("fold rules need a name, something to match and something to rewrite it into\n");
+
+    for (size_t i = 0; i < get_alternatives_count(rule); i++) {
+        if (get_shared_alternative(rule, i) != i)
+            continue;
+        json_object* pattern = get_alternative_pattern(rule, i);
+        String fn_name = get_alternative_fn_name(rule, i);
+        add_comments(g, "", json_object_object_get(rule, "description"));
+        growy_append_formatted(g, "static const Node* %s(IrArena* arena, const Node* node) {\n", fn_name);
+        growy_append_formatted(g, "\tconst PrimOp* p = &node->payload.prim_op;\n");
+        RuleEmitter e = { .g = g, .primops = primops, .rule_name = name };
+        emit_match_operands(&e, pattern, "p");
+        for (size_t j = 0; where && j < json_object_array_length(where); j++)
+            emit_predicate(&e, json_object_array_get_idx(where, j));
+        emit_rewrite(&e, rewrite);
+        growy_append_formatted(g, "}\n\n");
+        for (size_t j = 0; j < e.captures_count; j++)
+            free((void*) e.capture_values[j]);
+        free((void*) fn_name);
+    }
+}
+
+static void generate_dispatch(Growy* g, json_object* primops, json_object* rules) {
+    LARRAY(bool, has_rules, json_object_array_length(primops));
+    for (size_t i = 0; i < json_object_array_length(primops); i++) {
+        String op = json_object_get_string(json_object_object_get(json_object_array_get_idx(primops, i), "name"));
+        has_rules[i] = false;
+        for (size_t j = 0; j < json_object_array_length(rules); j++) {
+            json_object* rule = json_object_array_get_idx(rules, j);
+            for (size_t k = 0; k < get_alternatives_count(rule); k++) {
+                String alternative_op = get_alternative_op(rule, k);
+                if (strcmp(alternative_op, op) == 0) {
+                    if (!has_rules[i]) {
+                        growy_append_formatted(g, "static const Node* fold_rules_%s(IrArena* arena, const Node* node) {\n", op);
+                        growy_append_formatted(g, "\tconst Node* folded;\n");
+                        has_rules[i] = true;
+                    }
+                    String fn_name = get_alternative_fn_name(rule, k);
+                    String name = json_object_get_string(json_object_object_get(rule, "name"));
+                    growy_append_formatted(g, "\tif ((folded = %s(arena, node))) {\n", fn_name);
+                    growy_append_formatted(g, "\t\tdebugv_print(\"Fold: applied rule %s\\n\");\n", name);
+                    growy_append_formatted(g, "\t\treturn folded;\n");
+                    growy_append_formatted(g, "\t}\n");
+                    free((void*) fn_name);
+                }
+                free((void*) alternative_op);
+            }
+        }
+        if (has_rules[i]) {
+            growy_append_formatted(g, "\treturn NULL;\n");
+            growy_append_formatted(g, "}\n\n");
+        }
+    }
+
+    growy_append_formatted(g, "typedef const Node* (*FoldRules)(IrArena*, const Node*);\n\n");
+    growy_append_formatted(g, "static const FoldRules fold_rules[PRIMOPS_COUNT] = {\n");
+    for (size_t i = 0; i < json_object_array_length(primops); i++) {
+        if (!has_rules[i])
+            continue;
+        String op = json_object_get_string(json_object_object_get(json_object_array_get_idx(primops, i), "name"));
+        growy_append_formatted(g, "\t[%s_op] = fold_rules_%s,\n", op, op);
+    }
+    growy_append_formatted(g, "};\n");
+}
+
+void generate(Growy* g, json_object* src) {
+    growy_append_formatted(g, "/* Generated from fold_rules.json */\n");
+    growy_append_formatted(g, "/* Do not edit this file manually ! */\n");
+    growy_append_formatted(g, "/* It is generated by the 'fold_generated' target, see generator_fold.c for the syntax of the rules. */\n\n");
+
+    json_object* primops = json_object_object_get(src, "prim-ops");
+    json_object* rules = json_object_object_get(src, "fold-rules");
+    assert(primops && rules);
+    for (size_t i = 0; i < json_object_array_length(rules); i++)
+        generate_rule(g, primops, json_object_array_get_idx(rules, i));
+    generate_dispatch(g, primops, rules);
+}
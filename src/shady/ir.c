@@ -57,16 +57,38 @@ void destroy_ir_arena(IrArena* arena) {
     destroy_dict(arena->node_set);
     destroy_arena(arena->arena);
     destroy_growy(arena->ids);
+    if (arena->lock)
+        destroy_mutex(arena->lock);
     free(arena);
 }
 
+void set_ir_arena_thread_safe(IrArena* arena, bool thread_safe) {
+    if (thread_safe && !arena->lock)
+        arena->lock = new_mutex();
+    else if (!thread_safe && arena->lock) {
+        destroy_mutex(arena->lock);
+        arena->lock = NULL;
+    }
+}
+
+void freeze_ir_arena(IrArena* arena) {
+    // reading the declarations interns them as a node list, that needs to have happened already
+    for (size_t i = 0; i < entries_count_list(arena->modules); i++)
+        get_module_declarations(read_list(Module*, arena->modules)[i]);
+    arena->frozen = true;
+}
+
 ArenaConfig get_arena_config(const IrArena* a) {
     return a->config;
 }
 
 NodeId allocate_node_id(IrArena* arena, const Node* n) {
+    lock_ir_arena(arena);
+    assert(!arena->frozen && "nodes can't be added to a frozen arena");
     growy_append_object(arena->ids, n);
-    return growy_size(arena->ids) / sizeof(const Node*);
+    NodeId id = growy_size(arena->ids) / sizeof(const Node*);
+    unlock_ir_arena(arena);
+    return id;
 }
 
 Nodes nodes(IrArena* arena, size_t count, const Node* in_nodes[]) {
@@ -74,10 +96,15 @@ Nodes nodes(IrArena* arena, size_t count, const Node* in_nodes[]) {
         .count = count,
         .nodes = in_nodes
     };
+    lock_ir_arena(arena);
     const Nodes* found = find_key_dict(Nodes, arena->nodes_set, tmp);
-    if (found)
-        return *found;
+    if (found) {
+        Nodes existing = *found;
+        unlock_ir_arena(arena);
+        return existing;
+    }
 
+    assert(!arena->frozen && "node lists can't be added to a frozen arena");
     Nodes nodes;
     nodes.count = count;
     nodes.nodes = arena_alloc(arena->arena, sizeof(Node*) * count);
@@ -85,6 +112,7 @@ Nodes nodes(IrArena* arena, size_t count, const Node* in_nodes[]) {
         nodes.nodes[i] = in_nodes[i];
 
     insert_set_get_result(Nodes, arena->nodes_set, nodes);
+    unlock_ir_arena(arena);
     return nodes;
 }
 
@@ -93,10 +121,15 @@ Strings strings(IrArena* arena, size_t count, const char* in_strs[])  {
         .count = count,
         .strings = in_strs,
     };
+    lock_ir_arena(arena);
     const Strings* found = find_key_dict(Strings, arena->strings_set, tmp);
-    if (found)
-        return *found;
+    if (found) {
+        Strings existing = *found;
+        unlock_ir_arena(arena);
+        return existing;
+    }
 
+    assert(!arena->frozen && "string lists can't be added to a frozen arena");
     Strings strings;
     strings.count = count;
     strings.strings = arena_alloc(arena->arena, sizeof(const char*) * count);
@@ -104,6 +137,7 @@ Strings strings(IrArena* arena, size_t count, const char* in_strs[])  {
         strings.strings[i] = in_strs[i];
 
     insert_set_get_result(Strings, arena->strings_set, strings);
+    unlock_ir_arena(arena);
     return strings;
 }
 
@@ -169,15 +203,21 @@ static const char* string_impl(IrArena* arena, size_t size, const char* zero_ter
     if (!zero_terminated)
         return NULL;
     const char* ptr = zero_terminated;
+    lock_ir_arena(arena);
     const char** found = find_key_dict(const char*, arena->string_set, ptr);
-    if (found)
-        return *found;
+    if (found) {
+        const char* existing = *found;
+        unlock_ir_arena(arena);
+        return existing;
+    }
 
+    assert(!arena->frozen && "strings can't be added to a frozen arena");
     char* new_str = (char*) arena_alloc(arena->arena, strlen(zero_terminated) + 1);
     strncpy(new_str, zero_terminated, size);
     new_str[size] = '\0';
 
     insert_set_get_result(const char*, arena->string_set, new_str);
+    unlock_ir_arena(arena);
     return new_str;
 }
 
@@ -6,6 +6,7 @@
 #include "arena.h"
 
 #include "growy.h"
+#include "threading.h"
 
 #include "stdlib.h"
 #include "stdio.h"
@@ -22,8 +23,30 @@ typedef struct IrArena_ {
 
     struct Dict* nodes_set;
     struct Dict* strings_set;
+
+    /// only set for arenas that are built from several threads at once, see set_ir_arena_thread_safe
+    Mutex* lock;
+    /// see freeze_ir_arena
+    bool frozen;
 } IrArena_;
 
+/// Makes creating nodes, strings and declarations in this arena safe from several threads.
+/// Nodes are still only safe to mutate (ie setting bodies) from the thread that created them.
+void set_ir_arena_thread_safe(IrArena*, bool);
+/// Nothing new can be added to a frozen arena, which makes reading it from several threads at once safe without locking.
+/// Asking for a node, string or list that it already contains is still fine: that only looks it up.
+void freeze_ir_arena(IrArena*);
+
+static inline void lock_ir_arena(IrArena* arena) {
+    if (arena->lock)
+        lock_mutex(arena->lock);
+}
+
+static inline void unlock_ir_arena(IrArena* arena) {
+    if (arena->lock)
+        unlock_mutex(arena->lock);
+}
+
 struct Module_ {
     IrArena* arena;
     String name;
@@ -6,6 +6,8 @@
 #include <string.h>
 
 Module* new_module(IrArena* arena, String name) {
+    lock_ir_arena(arena);
+    assert(!arena->frozen && "modules can't be added to a frozen arena");
     Module* m = arena_alloc(arena->arena, sizeof(Module));
     *m = (Module) {
         .arena = arena,
@@ -13,6 +15,7 @@ Module* new_module(IrArena* arena, String name) {
         .decls = new_list(Node*),
     };
     append_list(Module*, arena->modules, m);
+    unlock_ir_arena(arena);
     return m;
 }
 
@@ -32,8 +35,11 @@ Nodes get_module_declarations(const Module* m) {
 
 void register_decl_module(Module* m, Node* node) {
     assert(is_declaration(node));
+    lock_ir_arena(m->arena);
+    assert(!m->arena->frozen && "declarations can't be added to a frozen arena");
     assert(!get_declaration(m, get_declaration_name(node)) && "duplicate declaration");
     append_list(Node*, m->decls, node);
+    unlock_ir_arena(m->arena);
 }
 
 const Node* get_declaration(const Module* m, String name) {
@@ -444,11 +444,16 @@ static const Node* infer_primop(Context* ctx, const Node* node, const Nodes* exp
         case empty_mask_op:
         case subgroup_active_mask_op:
         case subgroup_elect_first_op:
+        case subgroup_barrier_op:
             input_types = nodes(a, 0, NULL);
             break;
         case subgroup_broadcast_first_op:
             new_operands[0] = infer(ctx, old_operands.nodes[0], NULL);
             goto rebuild;
+        case subgroup_shuffle_op:
+            new_operands[0] = infer(ctx, old_operands.nodes[0], NULL);
+            new_operands[1] = infer(ctx, old_operands.nodes[1], qualified_type_helper(uint32_type(a), false));
+            goto rebuild;
         case subgroup_ballot_op:
             input_types = singleton(qualified_type_helper(bool_type(a), false));
             break;
@@ -16,9 +16,12 @@
 #include "../analysis/uses.h"
 #include "../analysis/leak.h"
 #include "../analysis/verify.h"
+#include "../visit.h"
 
 #include <assert.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 KeyHash hash_node(Node**);
 bool compare_node(Node**, Node**);
@@ -37,20 +40,266 @@ typedef struct Context_ {
 
 static const Node* process_node(Context* ctx, const Node* node);
 
+/// A narrow value sharing a 32-bit word with others on the stack
+typedef struct {
+    const Node* value;
+    unsigned word;
+    unsigned offset;
+} PackedSpill;
+
+/// What happens to each value that is live going into a lifted continuation
+typedef struct {
+    /// Pushed as they are, the last one is popped first
+    struct List* spilled;
+    /// bool/i8/i16 values packed into 32-bit words, sorted by word. The words are pushed before the spilled values.
+    struct List* packed;
+    size_t packed_words_count;
+    /// Recomputed in the continuation from the other values, constants or builtins
+    struct List* rematerialised;
+} SpillPlan;
+
 typedef struct {
     const Node* old_cont;
     const Node* lifted_fn;
-    struct List* save_values;
+    SpillPlan plan;
 } LiftedCont;
 
 #pragma GCC diagnostic error "-Wswitch"
 
-static const Node* add_spill_instrs(Context* ctx, BodyBuilder* builder, struct List* spilled_vars) {
+static unsigned get_packed_width(const Type* t) {
+    switch (t->tag) {
+        case Bool_TAG: return 1;
+        case Int_TAG: switch (t->payload.int_type.width) {
+            case IntTy8: return 8;
+            case IntTy16: return 16;
+            default: return 0;
+        }
+        default: return 0;
+    }
+}
+
+static bool is_invariant_operand(const Node* operand) {
+    switch (operand->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case NullPtr_TAG:
+        case RefDecl_TAG:
+        case FnAddr_TAG: return true;
+        case Composite_TAG: {
+            Nodes contents = operand->payload.composite.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                if (!is_invariant_operand(contents.nodes[i]))
+                    return false;
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static bool is_cheap_to_rematerialise(const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    Builtin b;
+    // builtin inputs read the same in the continuation as they did before the fork
+    if (is_builtin_load_op(instruction, &b))
+        return get_builtin_as(b) == AsInput || get_builtin_as(b) == AsUInput;
+    if (has_primop_got_side_effects(op))
+        return false;
+    switch (op) {
+        case lea_op:
+        case convert_op:
+        case reinterpret_op:
+        case select_op:
+        case extract_op: return true;
+        default: return get_primop_class(op) & (OcArithmetic | OcLogic | OcCompare | OcShift);
+    }
+}
+
+/// Values get rematerialised when their operands are available in the continuation anyway, be it because they are
+/// constants, because they are live there too, or because they can be rematerialised themselves.
+static bool can_rematerialise(const Node* value, struct Dict* live, int depth) {
+    if (value->tag != Variablez_TAG || depth > 3)
+        return false;
+    const Node* instruction = get_var_def(value->payload.varz);
+    if (!is_cheap_to_rematerialise(instruction))
+        return false;
+    Nodes operands = instruction->payload.prim_op.operands;
+    for (size_t i = 0; i < operands.count; i++) {
+        const Node* operand = operands.nodes[i];
+        if (is_invariant_operand(operand))
+            continue;
+        if ((operand->tag == Variablez_TAG || operand->tag == Param_TAG) && find_key_dict(const Node*, live, operand))
+            continue;
+        if (!can_rematerialise(operand, live, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+typedef struct {
+    Visitor visitor;
+    struct Dict* first_use;
+    size_t uses_count;
+} FirstUseVisitor;
+
+static void record_first_use(FirstUseVisitor* v, const Node* node) {
+    if (node->tag == Variablez_TAG || node->tag == Param_TAG) {
+        if (!find_value_dict(const Node*, size_t, v->first_use, node)) {
+            size_t rank = v->uses_count++;
+            insert_dict(const Node*, size_t, v->first_use, node, rank);
+        }
+        return;
+    }
+    visit_node_operands(&v->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+}
+
+typedef struct {
+    const Node* value;
+    size_t first_use;
+} SpillCandidate;
+
+static int compare_spill_candidates(const SpillCandidate* a, const SpillCandidate* b) {
+    if (a->first_use != b->first_use)
+        return a->first_use < b->first_use ? -1 : 1;
+    return a->value->id < b->value->id ? -1 : (a->value->id > b->value->id);
+}
+
+static SpillPlan plan_spills(CFG* cfg, struct Dict* live, Nodes except) {
+    SpillPlan plan = {
+        .spilled = new_list(const Node*),
+        .packed = new_list(PackedSpill),
+        .rematerialised = new_list(const Node*),
+    };
+
+    // rank the values by where the continuation first uses them, going through it in reverse post-order
+    FirstUseVisitor v = {
+        .visitor = { .visit_node_fn = (VisitNodeFn) record_first_use },
+        .first_use = new_dict(const Node*, size_t, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    for (size_t i = 0; i < cfg->size; i++) {
+        const Node* body = get_abstraction_body(cfg->rpo[i]->node);
+        if (body)
+            visit_node(&v.visitor, body);
+    }
+
+    size_t candidates_count = entries_count_dict(live);
+    LARRAY(SpillCandidate, candidates, candidates_count);
+    candidates_count = 0;
+    size_t i = 0;
+    const Node* value;
+    while (dict_iter(live, &i, &value, NULL)) {
+        if (find_in_nodes(except, value))
+            continue;
+        size_t* found = find_value_dict(const Node*, size_t, v.first_use, value);
+        candidates[candidates_count++] = (SpillCandidate) { .value = value, .first_use = found ? *found : SIZE_MAX };
+    }
+    destroy_dict(v.first_use);
+    qsort(candidates, candidates_count, sizeof(SpillCandidate), (int (*)(const void*, const void*)) compare_spill_candidates);
+
+    // the continuation pops the spilled values in the order it first uses them, so they get pushed in the opposite one
+    LARRAY(PackedSpill, narrow, candidates_count);
+    size_t narrow_count = 0;
+    LARRAY(unsigned, words_usage, candidates_count);
+    LARRAY(unsigned, words_population, candidates_count);
+    size_t words_count = 0;
+    for (size_t j = candidates_count - 1; j < candidates_count; j--) {
+        const Node* candidate = candidates[j].value;
+        if (can_rematerialise(candidate, live, 0)) {
+            append_list(const Node*, plan.rematerialised, candidate);
+            continue;
+        }
+
+        unsigned width = get_packed_width(get_unqualified_type(candidate->type));
+        if (width == 0) {
+            append_list(const Node*, plan.spilled, candidate);
+            continue;
+        }
+
+        // first fit
+        unsigned word = 0;
+        while (word < words_count && words_usage[word] + width > 32)
+            word++;
+        if (word == words_count) {
+            words_usage[words_count] = 0;
+            words_population[words_count++] = 0;
+        }
+        narrow[narrow_count++] = (PackedSpill) { .value = candidate, .word = word, .offset = words_usage[word] };
+        words_usage[word] += width;
+        words_population[word]++;
+    }
+
+    // a word holding a single value saves nothing over pushing that value as it is
+    for (unsigned w = 0; w < words_count; w++) {
+        bool shared = words_population[w] > 1;
+        for (size_t j = 0; j < narrow_count; j++) {
+            PackedSpill packed = narrow[j];
+            if (packed.word != w)
+                continue;
+            if (!shared) {
+                append_list(const Node*, plan.spilled, packed.value);
+                continue;
+            }
+            packed.word = plan.packed_words_count;
+            append_list(PackedSpill, plan.packed, packed);
+        }
+        if (shared)
+            plan.packed_words_count++;
+    }
+
+    return plan;
+}
+
+static void destroy_spill_plan(SpillPlan plan) {
+    destroy_list(plan.spilled);
+    destroy_list(plan.packed);
+    destroy_list(plan.rematerialised);
+}
+
+static const Node* gen_pack_word(Context* ctx, BodyBuilder* bb, const SpillPlan* plan, unsigned word) {
     IrArena* a = ctx->rewriter.dst_arena;
+    const Node* packed_word = NULL;
+    for (size_t i = 0; i < entries_count_list(plan->packed); i++) {
+        PackedSpill packed = read_list(PackedSpill, plan->packed)[i];
+        if (packed.word != word)
+            continue;
+        const Node* value = rewrite_node(&ctx->rewriter, packed.value);
+        if (get_unqualified_type(value->type)->tag == Bool_TAG)
+            value = gen_primop_e(bb, select_op, empty(a), mk_nodes(a, value, uint32_literal(a, 1), uint32_literal(a, 0)));
+        else
+            value = convert_int_zero_extend(bb, uint32_type(a), value);
+        if (packed.offset > 0)
+            value = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, value, uint32_literal(a, packed.offset)));
+        packed_word = packed_word ? gen_primop_e(bb, or_op, empty(a), mk_nodes(a, packed_word, value)) : value;
+    }
+    assert(packed_word);
+    return packed_word;
+}
 
-    size_t recover_context_size = entries_count_list(spilled_vars);
-    for (size_t i = 0; i < recover_context_size; i++) {
-        const Node* ovar = read_list(const Node*, spilled_vars)[i];
+static const Node* gen_unpack_value(BodyBuilder* bb, const Node* packed_word, PackedSpill packed, const Type* t) {
+    IrArena* a = bb->arena;
+    const Node* value = packed_word;
+    if (packed.offset > 0)
+        value = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, value, uint32_literal(a, packed.offset)));
+    if (t->tag == Bool_TAG) {
+        value = gen_primop_e(bb, and_op, empty(a), mk_nodes(a, value, uint32_literal(a, 1)));
+        return gen_primop_e(bb, neq_op, empty(a), mk_nodes(a, value, uint32_literal(a, 0)));
+    }
+    value = gen_conversion(bb, int_type(a, (Int) { .width = t->payload.int_type.width, .is_signed = false }), value);
+    return gen_reinterpret_cast(bb, t, value);
+}
+
+static const Node* add_spill_instrs(Context* ctx, BodyBuilder* builder, const SpillPlan* plan) {
+    IrArena* a = ctx->rewriter.dst_arena;
+
+    for (unsigned w = 0; w < plan->packed_words_count; w++)
+        gen_push_value_stack(builder, gen_pack_word(ctx, builder, plan, w));
+
+    size_t spilled_count = entries_count_list(plan->spilled);
+    for (size_t i = 0; i < spilled_count; i++) {
+        const Node* ovar = read_list(const Node*, plan->spilled)[i];
         const Node* nvar = rewrite_node(&ctx->rewriter, ovar);
         const Type* t = nvar->type;
         deconstruct_qualified_type(&t);
@@ -68,14 +317,30 @@ static const Node* add_spill_instrs(Context* ctx, BodyBuilder* builder, struct L
     return sp;
 }
 
-static void add_to_recover_context(struct List* recover_context, struct Dict* set, Nodes except) {
-    size_t i = 0;
-    const Node* item;
-    while (dict_iter(set, &i, &item, NULL)) {
-        if (find_in_nodes(except, item))
-            continue;
-        append_list(const Node*, recover_context, item );
+static const Node* recover_uniformity(BodyBuilder* bb, const Node* ovar, const Node* recovered_value, String* name) {
+    IrArena* a = bb->arena;
+    if (is_qualified_type_uniform(ovar->type))
+        recovered_value = first(bind_instruction_named(bb, prim_op(a, (PrimOp) { .op = subgroup_assume_uniform_op, .operands = singleton(recovered_value) }), name));
+    return recovered_value;
+}
+
+static const Node* rematerialise(Rewriter* r, BodyBuilder* bb, const Node* ovar) {
+    const Node* found = search_processed(r, ovar);
+    if (found)
+        return found;
+
+    assert(ovar->tag == Variablez_TAG);
+    const Node* oinstruction = get_var_def(ovar->payload.varz);
+    Nodes ooperands = oinstruction->payload.prim_op.operands;
+    for (size_t i = 0; i < ooperands.count; i++) {
+        if (ooperands.nodes[i]->tag == Variablez_TAG)
+            rematerialise(r, bb, ooperands.nodes[i]);
     }
+
+    String name = get_value_name_unsafe(ovar);
+    const Node* value = first(bind_instruction_named(bb, rewrite_node(r, oinstruction), &name));
+    register_processed(r, ovar, value);
+    return value;
 }
 
 static LiftedCont* lambda_lift(Context* ctx, const Node* liftee, Nodes ovariables) {
@@ -90,25 +355,25 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* liftee, Nodes ovariable
 
     String name = get_abstraction_name_safe(liftee);
 
-    // Compute the live stuff we'll need
+    // Compute the live stuff we'll need, and what to do with it
     CFG* cfg_rooted_in_liftee = build_cfg(ctx->cfg->entry->node, liftee, NULL, false);
     CFNode* cf_node = cfg_lookup(cfg_rooted_in_liftee, liftee);
     struct Dict* live_vars = compute_cfg_variables_map(cfg_rooted_in_liftee, CfgVariablesAnalysisFlagFreeSet);
     CFNodeVariables* node_vars = *find_value_dict(CFNode*, CFNodeVariables*, live_vars, cf_node);
-    struct List* recover_context = new_list(const Node*);
-
-    add_to_recover_context(recover_context, node_vars->free_set, ovariables);
-    size_t recover_context_size = entries_count_list(recover_context);
+    SpillPlan plan = plan_spills(cfg_rooted_in_liftee, node_vars->free_set, ovariables);
 
     destroy_cfg_variables_map(live_vars);
     destroy_cfg(cfg_rooted_in_liftee);
 
-    debugv_print("lambda_lift: free (to-be-spilled) variables at '%s' (count=%d): ", get_abstraction_name_safe(liftee), recover_context_size);
-    for (size_t i = 0; i < recover_context_size; i++) {
-        const Node* item = read_list(const Node*, recover_context)[i];
+    size_t spilled_count = entries_count_list(plan.spilled);
+    size_t packed_count = entries_count_list(plan.packed);
+    size_t rematerialised_count = entries_count_list(plan.rematerialised);
+    debugv_print("lambda_lift: spilling at '%s' %d values, packing %d into %d words, rematerialising %d: ", get_abstraction_name_safe(liftee), spilled_count, packed_count, plan.packed_words_count, rematerialised_count);
+    for (size_t i = 0; i < spilled_count; i++) {
+        const Node* item = read_list(const Node*, plan.spilled)[i];
         String item_name = get_value_name_unsafe(item);
         debugv_print("%s %%%d", item_name ? item_name : "", item->id);
-        if (i + 1 < recover_context_size)
+        if (i + 1 < spilled_count)
             debugv_print(", ");
     }
     debugv_print("\n");
@@ -121,7 +386,7 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* liftee, Nodes ovariable
 
     LiftedCont* lifted_cont = calloc(sizeof(LiftedCont), 1);
     lifted_cont->old_cont = liftee;
-    lifted_cont->save_values = recover_context;
+    lifted_cont->plan = plan;
     insert_dict(const Node*, LiftedCont*, ctx->lifted, liftee, lifted_cont);
 
     Context lifting_ctx = *ctx;
@@ -139,8 +404,8 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* liftee, Nodes ovariable
     // Recover that stuff inside the new body
     BodyBuilder* bb = begin_body(a);
     gen_primop(bb, set_stack_size_op, empty(a), singleton(payload));
-    for (size_t i = recover_context_size - 1; i < recover_context_size; i--) {
-        const Node* ovar = read_list(const Node*, recover_context)[i];
+    for (size_t i = spilled_count - 1; i < spilled_count; i--) {
+        const Node* ovar = read_list(const Node*, plan.spilled)[i];
         // assert(ovar->tag == Variable_TAG);
 
         const Type* value_type = rewrite_node(&ctx->rewriter, ovar->type);
@@ -151,12 +416,27 @@ static LiftedCont* lambda_lift(Context* ctx, const Node* liftee, Nodes ovariable
             .type_arguments = singleton(get_unqualified_type(value_type))
         }), &param_name));
 
-        if (is_qualified_type_uniform(ovar->type))
-            recovered_value = first(bind_instruction_named(bb, prim_op(a, (PrimOp) { .op = subgroup_assume_uniform_op, .operands = singleton(recovered_value) }), &param_name));
-
+        recovered_value = recover_uniformity(bb, ovar, recovered_value, &param_name);
         register_processed(&lifting_ctx.rewriter, ovar, recovered_value);
     }
 
+    for (size_t w = plan.packed_words_count - 1; w < plan.packed_words_count; w--) {
+        const Node* packed_word = gen_pop_value_stack(bb, uint32_type(a));
+        for (size_t i = 0; i < packed_count; i++) {
+            PackedSpill packed = read_list(PackedSpill, plan.packed)[i];
+            if (packed.word != w)
+                continue;
+            String param_name = get_value_name_unsafe(packed.value);
+            const Type* value_type = get_unqualified_type(rewrite_node(&ctx->rewriter, packed.value->type));
+            const Node* recovered_value = gen_unpack_value(bb, packed_word, packed, value_type);
+            recovered_value = recover_uniformity(bb, packed.value, recovered_value, &param_name);
+            register_processed(&lifting_ctx.rewriter, packed.value, recovered_value);
+        }
+    }
+
+    for (size_t i = 0; i < rematerialised_count; i++)
+        rematerialise(&lifting_ctx.rewriter, bb, read_list(const Node*, plan.rematerialised)[i]);
+
     const Node* substituted = rewrite_node(&lifting_ctx.rewriter, obody);
     destroy_rewriter(&lifting_ctx.rewriter);
 
@@ -210,7 +490,7 @@ static const Node* process_node(Context* ctx, const Node* node) {
                     const Node* otail = get_let_tail(node);
                     BodyBuilder* bb = begin_body(a);
                     LiftedCont* lifted_tail = lambda_lift(ctx, otail, node->payload.let.variables);
-                    const Node* sp = add_spill_instrs(ctx, bb, lifted_tail->save_values);
+                    const Node* sp = add_spill_instrs(ctx, bb, &lifted_tail->plan);
                     const Node* tail_ptr = fn_addr_helper(a, lifted_tail->lifted_fn);
 
                     const Node* jp = gen_primop_e(bb, create_joint_point_op, rewrite_nodes(&ctx->rewriter, oinstruction->payload.control.yield_types), mk_nodes(a, tail_ptr, sp));
@@ -253,7 +533,7 @@ Module* lift_indirect_targets(const CompilerConfig* config, Module* src) {
         size_t iter = 0;
         LiftedCont* lifted_cont;
         while (dict_iter(ctx.lifted, &iter, NULL, &lifted_cont)) {
-            destroy_list(lifted_cont->save_values);
+            destroy_spill_plan(lifted_cont->plan);
             free(lifted_cont);
         }
         destroy_dict(ctx.lifted);
@@ -11,8 +11,11 @@
 #include "../type.h"
 #include "../ir_private.h"
 #include "../transform/ir_gen_helpers.h"
+#include "../transform/memory_layout.h"
+#include "../analysis/cfg.h"
 
 #include <assert.h>
+#include <stdlib.h>
 
 typedef struct Context_ {
     Rewriter rewriter;
@@ -28,50 +31,287 @@ typedef struct Context_ {
     const Type* stack_ptr_t;
 } Context;
 
-typedef struct {
-    Visitor visitor;
-    Context* context;
-    BodyBuilder* bb;
-    Node* nom_t;
-    size_t num_slots;
-    struct List* members;
-    struct Dict* prepared_offsets;
-} VContext;
-
 typedef struct {
     size_t i;
-    const Node* offset;
+    size_t offset;
     const Type* type;
     AddressSpace as;
 } StackSlot;
 
+/// An alloca, and the CF nodes where what it holds has to be preserved
+typedef struct {
+    const Node* var;
+    const Type* type;
+    TypeMemLayout layout;
+    CFNode* def;
+    /// @ref List of @ref CFNode* using the alloca or a pointer derived from it
+    struct List* uses;
+    /// The pointer ends up somewhere we can't follow it, so it has to live for the whole function
+    bool escapes;
+    /// Indexed by rpo index
+    bool* live;
+    size_t slot;
+} FrameAlloca;
+
+/// Storage shared by allocas that are never live at the same time
+typedef struct {
+    size_t size;
+    size_t alignment;
+    size_t offset;
+} FrameSlot;
+
+typedef struct {
+    Visitor visitor;
+    Context* context;
+    CFNode* cf_node;
+    /// @ref List of @ref FrameAlloca
+    struct List* allocas;
+    /// Pointers to the allocas or derived from them -> their index in allocas
+    struct Dict* tracked;
+} VContext;
+
+static FrameAlloca* find_tracked_alloca(VContext* vctx, const Node* node) {
+    size_t* found = find_value_dict(const Node*, size_t, vctx->tracked, node);
+    if (!found)
+        return NULL;
+    return &read_list(FrameAlloca, vctx->allocas)[*found];
+}
+
+/// Records a use of the operand if it points into an alloca, as opposed to visit_node which considers it escaped
+static bool use_operand(VContext* vctx, const Node* operand) {
+    FrameAlloca* alloca = find_tracked_alloca(vctx, operand);
+    if (!alloca)
+        return false;
+    append_list(CFNode*, alloca->uses, vctx->cf_node);
+    return true;
+}
+
 static void search_operand_for_alloca(VContext* vctx, const Node* node) {
-    if (node->tag == Variablez_TAG)
+    IrArena* a = vctx->context->rewriter.dst_arena;
+
+    switch (node->tag) {
+        case Variablez_TAG:
+        case Param_TAG: {
+            // anything that isn't looked at more closely below takes the pointer out of our sight
+            FrameAlloca* alloca = find_tracked_alloca(vctx, node);
+            if (alloca)
+                alloca->escapes = true;
+            return;
+        }
+        case Let_TAG: {
+            const Node* instruction = get_let_instruction(node);
+            Nodes vars = node->payload.let.variables;
+            if (instruction->tag != PrimOp_TAG)
+                break;
+            PrimOp prim_op = instruction->payload.prim_op;
+            switch (prim_op.op) {
+                case alloca_op: {
+                    const Type* element_type = rewrite_node(&vctx->context->rewriter, first(prim_op.type_arguments));
+                    assert(is_data_type(element_type));
+                    FrameAlloca alloca = {
+                        .var = first(vars),
+                        .type = element_type,
+                        .layout = get_mem_layout(a, element_type),
+                        .def = vctx->cf_node,
+                        .uses = new_list(CFNode*),
+                    };
+                    size_t index = entries_count_list(vctx->allocas);
+                    append_list(FrameAlloca, vctx->allocas, alloca);
+                    insert_dict(const Node*, size_t, vctx->tracked, alloca.var, index);
+                    return;
+                }
+                case lea_op:
+                case reinterpret_op:
+                case convert_op: {
+                    FrameAlloca* alloca = find_tracked_alloca(vctx, first(prim_op.operands));
+                    if (!alloca)
+                        break;
+                    size_t index = alloca - read_list(FrameAlloca, vctx->allocas);
+                    use_operand(vctx, first(prim_op.operands));
+                    for (size_t i = 0; i < vars.count; i++)
+                        insert_dict(const Node*, size_t, vctx->tracked, vars.nodes[i], index);
+                    for (size_t i = 1; i < prim_op.operands.count; i++)
+                        visit_node(&vctx->visitor, prim_op.operands.nodes[i]);
+                    return;
+                }
+                default: break;
+            }
+            visit_node(&vctx->visitor, instruction);
+            return;
+        }
+        case PrimOp_TAG: {
+            PrimOp prim_op = node->payload.prim_op;
+            size_t accesses = 0;
+            switch (prim_op.op) {
+                case load_op:
+                case store_op:
+                case memset_op: accesses = 1; break;
+                case memcpy_op: accesses = 2; break;
+                default: break;
+            }
+            for (size_t i = 0; i < prim_op.operands.count; i++) {
+                if (i < accesses && use_operand(vctx, prim_op.operands.nodes[i]))
+                    continue;
+                visit_node(&vctx->visitor, prim_op.operands.nodes[i]);
+            }
+            return;
+        }
+        default: break;
+    }
+
+    visit_node_operands(&vctx->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+}
+
+static bool is_dominated_by(CFNode* node, CFNode* dominator) {
+    for (; node; node = node->idom) {
+        if (node == dominator)
+            return true;
+    }
+    return false;
+}
+
+/// Walks back from the use to the alloca, everything on the way needs the contents to stay around
+static void mark_live_range(FrameAlloca* alloca, CFNode* node) {
+    if (alloca->live[node->rpo_index] || !is_dominated_by(node, alloca->def))
+        return;
+    alloca->live[node->rpo_index] = true;
+    if (node == alloca->def)
         return;
+    for (size_t i = 0; i < entries_count_list(node->pred_edges); i++)
+        mark_live_range(alloca, read_list(CFEdge, node->pred_edges)[i].src);
+}
 
-    IrArena* a = vctx->context->rewriter.dst_arena;
-    AddressSpace as;
-    if (node->tag == PrimOp_TAG) {
-        switch (node->payload.prim_op.op) {
-            case alloca_op: as = AsPrivate; break;
-            default: goto not_alloca;
+static void mark_enclosed_nodes(const CFG* cfg, FrameAlloca* alloca, CFNode* entry) {
+    for (size_t i = 0; i < cfg->size; i++) {
+        if (is_dominated_by(cfg->rpo[i], entry))
+            alloca->live[i] = true;
+    }
+}
+
+static bool is_live_under(const CFG* cfg, const FrameAlloca* alloca, CFNode* entry) {
+    for (size_t i = 0; i < cfg->size; i++) {
+        if (alloca->live[i] && is_dominated_by(cfg->rpo[i], entry))
+            return true;
+    }
+    return false;
+}
+
+/// Nothing leads from the end of a structured construct's body to what comes after it, or back to the start of a loop.
+/// So an alloca that is live across a construct, or that a loop carries over to its next iteration, is live in
+/// everything the construct encloses.
+static void extend_over_structured_constructs(const CFG* cfg, FrameAlloca* alloca) {
+    for (size_t i = 0; i < cfg->size; i++) {
+        CFNode* node = cfg->rpo[i];
+        const Node* body = get_abstraction_body(node->node);
+        if (!body || body->tag != Let_TAG)
+            continue;
+        bool is_loop = get_let_instruction(body)->tag == Loop_TAG;
+
+        CFNode* tail = NULL;
+        for (size_t j = 0; j < entries_count_list(node->succ_edges); j++) {
+            CFEdge edge = read_list(CFEdge, node->succ_edges)[j];
+            if (edge.type == LetTailEdge || edge.type == StructuredPseudoExitEdge)
+                tail = edge.dst;
         }
+        bool across = tail && alloca->live[node->rpo_index] && alloca->live[tail->rpo_index];
 
-        const Type* element_type = rewrite_node(&vctx->context->rewriter, node->payload.prim_op.type_arguments.nodes[0]);
-        assert(is_data_type(element_type));
-        const Node* slot_offset = gen_primop_e(vctx->bb, offset_of_op, singleton(type_decl_ref_helper(a, vctx->nom_t)), singleton(int32_literal(a, entries_count_list(vctx->members))));
-        append_list(const Type*, vctx->members, element_type);
+        for (size_t j = 0; j < entries_count_list(node->succ_edges); j++) {
+            CFEdge edge = read_list(CFEdge, node->succ_edges)[j];
+            if (edge.type != StructuredEnterBodyEdge)
+                continue;
+            bool carried = is_loop && !is_dominated_by(alloca->def, edge.dst) && is_live_under(cfg, alloca, edge.dst);
+            if (across || carried)
+                mark_enclosed_nodes(cfg, alloca, edge.dst);
+        }
+    }
+}
 
-        StackSlot slot = { vctx->num_slots, slot_offset, element_type, as };
-        insert_dict(const Node*, StackSlot, vctx->prepared_offsets, node, slot);
+static bool do_allocas_interfere(const CFG* cfg, const FrameAlloca* a, const FrameAlloca* b) {
+    if (a->escapes || b->escapes)
+        return true;
+    for (size_t i = 0; i < cfg->size; i++) {
+        if (a->live[i] && b->live[i])
+            return true;
+    }
+    return false;
+}
 
-        vctx->num_slots++;
+static int compare_allocas_by_alignment(FrameAlloca* const* a, FrameAlloca* const* b) {
+    if ((*a)->layout.alignment_in_bytes != (*b)->layout.alignment_in_bytes)
+        return (*a)->layout.alignment_in_bytes > (*b)->layout.alignment_in_bytes ? -1 : 1;
+    if ((*a)->layout.size_in_bytes != (*b)->layout.size_in_bytes)
+        return (*a)->layout.size_in_bytes > (*b)->layout.size_in_bytes ? -1 : 1;
+    return (*a)->var->id < (*b)->var->id ? -1 : 1;
+}
 
-        return;
+static size_t round_up(size_t a, size_t b) {
+    return (a + b - 1) / b * b;
+}
+
+/// Gives allocas that are never live at the same time the same storage, then lays that out by decreasing alignment
+static size_t layout_frame(Context* ctx, const Node* fn, const CFG* cfg, struct List* allocas) {
+    size_t allocas_count = entries_count_list(allocas);
+    LARRAY(FrameAlloca*, sorted, allocas_count);
+    for (size_t i = 0; i < allocas_count; i++) {
+        FrameAlloca* alloca = &read_list(FrameAlloca, allocas)[i];
+        alloca->live = calloc(sizeof(bool), cfg->size);
+        mark_live_range(alloca, alloca->def);
+        for (size_t j = 0; j < entries_count_list(alloca->uses); j++)
+            mark_live_range(alloca, read_list(CFNode*, alloca->uses)[j]);
+        extend_over_structured_constructs(cfg, alloca);
+        sorted[i] = alloca;
     }
+    qsort(sorted, allocas_count, sizeof(FrameAlloca*), (int (*)(const void*, const void*)) compare_allocas_by_alignment);
 
-    not_alloca:
-    visit_node_operands(&vctx->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+    // greedy colouring, the biggest and most aligned allocas pick first so the slots stay sorted by alignment
+    LARRAY(FrameSlot, slots, allocas_count);
+    size_t slots_count = 0;
+    for (size_t i = 0; i < allocas_count; i++) {
+        FrameAlloca* alloca = sorted[i];
+        size_t slot = 0;
+        for (; slot < slots_count; slot++) {
+            bool interferes = false;
+            for (size_t j = 0; j < i && !interferes; j++)
+                interferes = sorted[j]->slot == slot && do_allocas_interfere(cfg, alloca, sorted[j]);
+            if (!interferes)
+                break;
+        }
+        if (slot == slots_count)
+            slots[slots_count++] = (FrameSlot) { 0 };
+        alloca->slot = slot;
+        if (alloca->layout.size_in_bytes > slots[slot].size)
+            slots[slot].size = alloca->layout.size_in_bytes;
+        if (alloca->layout.alignment_in_bytes > slots[slot].alignment)
+            slots[slot].alignment = alloca->layout.alignment_in_bytes;
+    }
+
+    size_t frame_size = 0;
+    size_t frame_alignment = 1;
+    size_t unshared_size = 0;
+    for (size_t i = 0; i < slots_count; i++) {
+        frame_size = round_up(frame_size, slots[i].alignment);
+        slots[i].offset = frame_size;
+        frame_size += slots[i].size;
+        if (slots[i].alignment > frame_alignment)
+            frame_alignment = slots[i].alignment;
+    }
+    frame_size = round_up(frame_size, frame_alignment);
+
+    for (size_t i = 0; i < allocas_count; i++) {
+        FrameAlloca* alloca = sorted[i];
+        unshared_size = round_up(unshared_size, alloca->layout.alignment_in_bytes) + alloca->layout.size_in_bytes;
+        StackSlot slot = { alloca->slot, slots[alloca->slot].offset, alloca->type, AsPrivate };
+        insert_dict(const Node*, StackSlot, ctx->prepared_offsets, alloca->var, slot);
+        free(alloca->live);
+        destroy_list(alloca->uses);
+    }
+    unshared_size = round_up(unshared_size, frame_alignment);
+
+    if (ctx->config->logging.dump_frames && allocas_count > 0)
+        info_print("%s: %zu bytes in %zu slots for %zu allocas (%zu bytes without sharing)\n", get_abstraction_name(fn), frame_size, slots_count, allocas_count, unshared_size);
+
+    ctx->num_slots = slots_count;
+    return frame_size;
 }
 
 KeyHash hash_node(Node**);
@@ -82,7 +322,6 @@ static const Node* process(Context* ctx, const Node* node) {
     if (found) return found;
 
     IrArena* a = ctx->rewriter.dst_arena;
-    Module* m = ctx->rewriter.dst_module;
     switch (node->tag) {
         case Function_TAG: {
             Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
@@ -102,68 +341,64 @@ static const Node* process(Context* ctx, const Node* node) {
             String tmp_name = "stack_ptr_before_alloca";
             ctx2.entry_stack_offset = first(bind_instruction_named(bb, prim_op(a, (PrimOp) { .op = get_stack_size_op } ), (String []) { tmp_name }));
 
-            Node* nom_t = nominal_type(m, empty(a), format_string_arena(a->arena, "%s_stack_frame", get_abstraction_name(node)));
+            CFG* cfg = build_fn_cfg(node);
             VContext vctx = {
                 .visitor = {
                     .visit_node_fn = (VisitNodeFn) search_operand_for_alloca,
                 },
                 .context = &ctx2,
-                .bb = bb,
-                .nom_t = nom_t,
-                .num_slots = 0,
-                .members = new_list(const Node*),
-                .prepared_offsets = ctx2.prepared_offsets,
+                .allocas = new_list(FrameAlloca),
+                .tracked = new_dict(const Node*, size_t, (HashFn) hash_node, (CmpFn) compare_node),
             };
-            search_operand_for_alloca(&vctx, node->payload.fun.body);
-            visit_function_rpo(&vctx.visitor, node);
-
-            vctx.nom_t->payload.nom_type.body = record_type(a, (RecordType) {
-                .members = nodes(a, vctx.num_slots, read_list(const Node*, vctx.members)),
-                .names = strings(a, 0, NULL),
-                .special = 0
-            });
-            destroy_list(vctx.members);
-            ctx2.num_slots = vctx.num_slots;
-            ctx2.frame_size = gen_primop_e(bb, size_of_op, singleton(type_decl_ref_helper(a, vctx.nom_t)), empty(a));
-            ctx2.frame_size = convert_int_extend_according_to_src_t(bb, ctx->stack_ptr_t, ctx2.frame_size);
+            for (size_t i = 0; i < cfg->size; i++) {
+                vctx.cf_node = cfg->rpo[i];
+                const Node* body = get_abstraction_body(vctx.cf_node->node);
+                if (body)
+                    search_operand_for_alloca(&vctx, body);
+            }
+
+            size_t frame_size = layout_frame(&ctx2, node, cfg, vctx.allocas);
+            destroy_list(vctx.allocas);
+            destroy_dict(vctx.tracked);
+            destroy_cfg(cfg);
+            ctx2.frame_size = int_literal(a, (IntLiteral) { .width = ctx->stack_ptr_t->payload.int_type.width, .is_signed = false, .value = frame_size });
 
             fun->payload.fun.body = finish_body(bb, rewrite_node(&ctx2.rewriter, node->payload.fun.body));
 
             destroy_dict(ctx2.prepared_offsets);
             return fun;
         }
-        case PrimOp_TAG: {
-            if (!ctx->disable_lowering && node->payload.prim_op.op == alloca_op) {
-                StackSlot* found_slot = find_value_dict(const Node*, StackSlot, ctx->prepared_offsets, node);
-                if (!found_slot) {
-                    error_print("lower_alloca: failed to find a stack offset for ");
-                    log_node(ERROR, node);
-                    error_print(", most likely this means this alloca was not found in the first block of a function.\n");
-                    log_module(DEBUG, ctx->config, ctx->rewriter.src_module);
-                    error_die();
-                }
-
-                BodyBuilder* bb = begin_body(a);
-                if (!ctx->entry_stack_offset) {
-                    //String tmp_name = format_string_arena(a->arena, "stack_ptr_before_alloca_%s", get_abstraction_name(fun));
-                    assert(false);
-                }
+        case Let_TAG: {
+            const Node* oinstruction = get_let_instruction(node);
+            if (ctx->disable_lowering || oinstruction->tag != PrimOp_TAG || oinstruction->payload.prim_op.op != alloca_op)
+                break;
 
-                //const Node* lea_instr = prim_op_helper(a, lea_op, empty(a), mk_nodes(a, rewrite_node(&ctx->rewriter, first(node->payload.prim_op.operands)), found_slot->offset));
-                const Node* converted_offset = convert_int_extend_according_to_dst_t(bb, ctx->stack_ptr_t, found_slot->offset);
-                const Node* lea_instr = prim_op_helper(a, lea_op, empty(a), mk_nodes(a, ctx->entry_base_stack_ptr, gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx->entry_stack_offset, converted_offset))));
-                const Node* slot = first(bind_instruction_named(bb, lea_instr, (String []) { format_string_arena(a->arena, "stack_slot_%d", found_slot->i) }));
-                const Node* ptr_t = ptr_type(a, (PtrType) { .pointed_type = found_slot->type, .address_space = found_slot->as });
-                slot = gen_reinterpret_cast(bb, ptr_t, slot);
-                //bool last = found_slot->i == ctx->num_slots - 1;
-                //if (last) {
-                    const Node* updated_stack_ptr = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx->entry_stack_offset, ctx->frame_size));
-                    gen_primop(bb, set_stack_size_op, empty(a), singleton(updated_stack_ptr));
-                //}
-
-                return yield_values_and_wrap_in_block(bb, singleton(slot));
+            // allocas of the same type are the same node, so they're told apart by the variable they're bound to
+            const Node* ovar = first(node->payload.let.variables);
+            StackSlot* found_slot = find_value_dict(const Node*, StackSlot, ctx->prepared_offsets, ovar);
+            if (!found_slot) {
+                error_print("lower_alloca: failed to find a stack offset for ");
+                log_node(ERROR, node);
+                error_print(", most likely this means this alloca is not reachable in the CFG of its function.\n");
+                log_module(DEBUG, ctx->config, ctx->rewriter.src_module);
+                error_die();
             }
-            break;
+
+            BodyBuilder* bb = begin_body(a);
+            assert(ctx->entry_stack_offset);
+
+            const Node* offset = int_literal(a, (IntLiteral) { .width = ctx->stack_ptr_t->payload.int_type.width, .is_signed = false, .value = found_slot->offset });
+            const Node* lea_instr = prim_op_helper(a, lea_op, empty(a), mk_nodes(a, ctx->entry_base_stack_ptr, gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx->entry_stack_offset, offset))));
+            const Node* slot = first(bind_instruction_named(bb, lea_instr, (String []) { format_string_arena(a->arena, "stack_slot_%d", found_slot->i) }));
+            const Node* ptr_t = ptr_type(a, (PtrType) { .pointed_type = found_slot->type, .address_space = found_slot->as });
+            slot = gen_reinterpret_cast(bb, ptr_t, slot);
+            const Node* updated_stack_ptr = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, ctx->entry_stack_offset, ctx->frame_size));
+            gen_primop(bb, set_stack_size_op, empty(a), singleton(updated_stack_ptr));
+
+            register_processed(&ctx->rewriter, ovar, slot);
+            const Node* otail = get_let_tail(node);
+            assert(get_abstraction_params(otail).count == 0);
+            return finish_body(bb, rewrite_node(&ctx->rewriter, get_abstraction_body(otail)));
         }
         default: break;
     }
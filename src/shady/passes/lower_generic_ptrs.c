@@ -211,8 +211,13 @@ static const Node* process(Context* ctx, const Node* old) {
                                     generic_ptr = gen_primop_e(bb, or_op, empty(a), mk_nodes(a, generic_ptr, shifted_tag));
                         return yield_values_and_wrap_in_block(bb, singleton(generic_ptr));
                     } else if (old_src_t->tag == PtrType_TAG && old_src_t->payload.ptr_type.address_space == AsGeneric) {
-                        // cast _from_ generic
-                        error("TODO");
+                        // cast _from_ generic: the tag is assumed to match, and just replaced by the sign extension
+                        AddressSpace dst_as = old_dst_t->payload.ptr_type.address_space;
+                        BodyBuilder* bb = begin_body(a);
+                        const Node* src_ptr = rewrite_node(&ctx->rewriter, old_src);
+                        const Node* element_type = rewrite_node(&ctx->rewriter, old_dst_t->payload.ptr_type.pointed_type);
+                        const Node* concrete_ptr = recover_full_pointer(ctx, bb, get_tag_for_addr_space(dst_as), src_ptr, element_type);
+                        return yield_values_and_wrap_in_block(bb, singleton(concrete_ptr));
                     }
                     break;
                 }
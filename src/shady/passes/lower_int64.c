@@ -1,97 +1,615 @@
-#include "passes.h"
-
-#include "log.h"
-#include "portability.h"
-
-#include "../ir_private.h"
-#include "../type.h"
-#include "../rewrite.h"
-#include "../transform/ir_gen_helpers.h"
-
-typedef struct {
-    Rewriter rewriter;
-    const CompilerConfig* config;
-} Context;
-
-static bool should_convert(Context* ctx, const Type* t) {
-    t = get_unqualified_type(t);
-    return t->tag == Int_TAG && t->payload.int_type.width == IntTy64 && ctx->config->lower.int64;
-}
-
-static void extract_low_hi_halves(BodyBuilder* bb, const Node* src, const Node** lo, const Node** hi) {
-    *lo = first(bind_instruction(bb, prim_op(bb->arena,
-        (PrimOp) { .op = extract_op, .operands = mk_nodes(bb->arena, src, int32_literal(bb->arena, 0))})));
-    *hi = first(bind_instruction(bb, prim_op(bb->arena,
-        (PrimOp) { .op = extract_op, .operands = mk_nodes(bb->arena, src, int32_literal(bb->arena, 1))})));
-}
-
-static void extract_low_hi_halves_list(BodyBuilder* bb, Nodes src, const Node** lows, const Node** his) {
-    for (size_t i = 0; i < src.count; i++) {
-        extract_low_hi_halves(bb, src.nodes[i], lows, his);
-        lows++;
-        his++;
-    }
-}
-
-static const Node* process(Context* ctx, const Node* node) {
-    const Node* found = search_processed(&ctx->rewriter, node);
-    if (found) return found;
-
-    IrArena* a = ctx->rewriter.dst_arena;
-
-    switch (node->tag) {
-        case Int_TAG:
-            if (node->payload.int_type.width == IntTy64 && ctx->config->lower.int64)
-                return record_type(a, (RecordType) {
-                    .members = mk_nodes(a, int32_type(a), int32_type(a))
-                });
-            break;
-        case IntLiteral_TAG:
-            if (node->payload.int_literal.width == IntTy64 && ctx->config->lower.int64) {
-                uint64_t raw = node->payload.int_literal.value;
-                const Node* lower = uint32_literal(a, (uint32_t) raw);
-                const Node* upper = uint32_literal(a, (uint32_t) (raw >> 32));
-                return tuple_helper(a, mk_nodes(a, lower, upper));
-            }
-            break;
-        case PrimOp_TAG: {
-            Op op = node->payload.prim_op.op;
-            Nodes old_nodes = node->payload.prim_op.operands;
-            LARRAY(const Node*, lows, old_nodes.count);
-            LARRAY(const Node*, his, old_nodes.count);
-            switch(op) {
-                case add_op: if (should_convert(ctx, first(old_nodes)->type)) {
-                    Nodes new_nodes = rewrite_nodes(&ctx->rewriter, old_nodes);
-                    // TODO: convert into and then out of unsigned
-                    BodyBuilder* bb = begin_body(a);
-                    extract_low_hi_halves_list(bb, new_nodes, lows, his);
-                    Nodes low_and_carry = bind_instruction(bb, prim_op(a, (PrimOp) { .op = add_carry_op, .operands = nodes(a, 2, lows)}));
-                    const Node* lo = first(low_and_carry);
-                    // compute the high side, without forgetting the carry bit
-                    const Node* hi = first(bind_instruction(bb, prim_op(a, (PrimOp) { .op = add_op, .operands = nodes(a, 2, his)})));
-                                hi = first(bind_instruction(bb, prim_op(a, (PrimOp) { .op = add_op, .operands = mk_nodes(a, hi, low_and_carry.nodes[1])})));
-                    return yield_values_and_wrap_in_block(bb, singleton(tuple_helper(a, mk_nodes(a, lo, hi))));
-                } break;
-                default: break;
-            }
-            break;
-        }
-        default: break;
-    }
-
-    rebuild:
-    return recreate_node_identity(&ctx->rewriter, node);
-}
-
-Module* lower_int(const CompilerConfig* config, Module* src) {
-    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
-    IrArena* a = new_ir_arena(aconfig);
-    Module* dst = new_module(a, get_module_name(src));
-    Context ctx = {
-        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
-        .config = config,
-    };
-    rewrite_module(&ctx.rewriter);
-    destroy_rewriter(&ctx.rewriter);
-    return dst;
-}
+#include "passes.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "../ir_private.h"
+#include "../type.h"
+#include "../rewrite.h"
+#include "../transform/ir_gen_helpers.h"
+
+#include <assert.h>
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    /// Shared by all the divisions and remainders that can't be done with 32-bit ops, built on first use
+    const Node* udivmod_fn;
+} Context;
+
+static bool should_convert(Context* ctx, const Type* t) {
+    return t->tag == Int_TAG && t->payload.int_type.width == IntTy64 && ctx->config->lower.int64;
+}
+
+static bool is_signed_int(const Type* t) {
+    return t->tag == Int_TAG && t->payload.int_type.is_signed;
+}
+
+/// A lowered 64-bit integer: two u32 words, the high one being zero when hi_zero is set
+typedef struct {
+    const Node* lo;
+    const Node* hi;
+    bool hi_zero;
+} Halves;
+
+/// Whether the high half of a (not yet lowered) 64-bit value is known to be zero, which lets us skip the work on it
+static bool is_hi_known_zero(const Node* old) {
+    const IntLiteral* literal = resolve_to_int_literal(old);
+    if (literal)
+        return (get_int_literal_value(*literal, false) >> 32) == 0;
+    if (old->tag != Variablez_TAG || !old->payload.varz.instruction || old->payload.varz.instruction->tag != PrimOp_TAG)
+        return false;
+    PrimOp prim_op = old->payload.varz.instruction->payload.prim_op;
+    switch (prim_op.op) {
+        // zero-extended
+        case convert_op: {
+            const Type* src_t = get_unqualified_type(first(prim_op.operands)->type);
+            return src_t->tag == Int_TAG && src_t->payload.int_type.width <= IntTy32 && !src_t->payload.int_type.is_signed;
+        }
+        case and_op: return is_hi_known_zero(prim_op.operands.nodes[0]) || is_hi_known_zero(prim_op.operands.nodes[1]);
+        case rshift_logical_op: {
+            literal = resolve_to_int_literal(prim_op.operands.nodes[1]);
+            return literal && get_int_literal_value(*literal, false) >= 32;
+        }
+        default: return false;
+    }
+}
+
+static Halves get_halves(BodyBuilder* bb, const Node* old, const Node* new) {
+    IrArena* a = bb->arena;
+    Halves halves;
+    if (new->tag == Composite_TAG) {
+        halves.lo = new->payload.composite.contents.nodes[0];
+        halves.hi = new->payload.composite.contents.nodes[1];
+    } else {
+        halves.lo = gen_extract(bb, new, singleton(int32_literal(a, 0)));
+        halves.hi = gen_extract(bb, new, singleton(int32_literal(a, 1)));
+    }
+    halves.hi_zero = old && is_hi_known_zero(old);
+    return halves;
+}
+
+static Halves make_halves(const Node* lo, const Node* hi) {
+    const IntLiteral* literal = resolve_to_int_literal(hi);
+    return (Halves) { .lo = lo, .hi = hi, .hi_zero = literal && get_int_literal_value(*literal, false) == 0 };
+}
+
+static const Node* join_halves(IrArena* a, Halves halves) {
+    return tuple_helper(a, mk_nodes(a, halves.lo, halves.hi));
+}
+
+static const Node* gen_op(BodyBuilder* bb, Op op, const Node* x, const Node* y) {
+    return gen_primop_e(bb, op, empty(bb->arena), mk_nodes(bb->arena, x, y));
+}
+
+static const Node* gen_select(BodyBuilder* bb, const Node* condition, const Node* x, const Node* y) {
+    return gen_primop_e(bb, select_op, empty(bb->arena), mk_nodes(bb->arena, condition, x, y));
+}
+
+static Halves gen_select_halves(BodyBuilder* bb, const Node* condition, Halves x, Halves y) {
+    Halves result = make_halves(gen_select(bb, condition, x.lo, y.lo), gen_select(bb, condition, x.hi, y.hi));
+    result.hi_zero = x.hi_zero && y.hi_zero;
+    return result;
+}
+
+static const Node* gen_u32_literal(BodyBuilder* bb, uint32_t value) {
+    return uint32_literal(bb->arena, value);
+}
+
+/// Arithmetic right shift, on a u32 that holds the bits of an i32
+static const Node* gen_sra(BodyBuilder* bb, const Node* x, const Node* amount) {
+    IrArena* a = bb->arena;
+    return gen_reinterpret_cast(bb, uint32_type(a), gen_op(bb, rshift_arithm_op, gen_reinterpret_cast(bb, int32_type(a), x), amount));
+}
+
+/// Gets any (up to 32-bit) integer into a u32, extending it according to its own signedness
+static const Node* gen_to_u32(BodyBuilder* bb, const Node* x) {
+    IrArena* a = bb->arena;
+    const Type* t = get_unqualified_type(x->type);
+    assert(t->tag == Int_TAG && t->payload.int_type.width <= IntTy32);
+    if (t->payload.int_type.width != IntTy32)
+        x = gen_conversion(bb, int_type(a, (Int) { .width = IntTy32, .is_signed = t->payload.int_type.is_signed }), x);
+    return gen_reinterpret_cast(bb, uint32_type(a), x);
+}
+
+/// The reverse of gen_to_u32, truncating
+static const Node* gen_from_u32(BodyBuilder* bb, const Type* dst_t, const Node* x) {
+    IrArena* a = bb->arena;
+    assert(dst_t->tag == Int_TAG && dst_t->payload.int_type.width <= IntTy32);
+    x = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = IntTy32, .is_signed = dst_t->payload.int_type.is_signed }), x);
+    if (dst_t->payload.int_type.width != IntTy32)
+        x = gen_conversion(bb, dst_t, x);
+    return x;
+}
+
+static Halves gen_add(BodyBuilder* bb, Halves x, Halves y) {
+    const Node* sum = gen_op(bb, add_carry_op, x.lo, y.lo);
+    const Node* lo = gen_extract(bb, sum, singleton(int32_literal(bb->arena, 0)));
+    const Node* hi = gen_extract(bb, sum, singleton(int32_literal(bb->arena, 1)));
+    if (!x.hi_zero)
+        hi = gen_op(bb, add_op, x.hi, hi);
+    if (!y.hi_zero)
+        hi = gen_op(bb, add_op, hi, y.hi);
+    return make_halves(lo, hi);
+}
+
+static Halves gen_sub(BodyBuilder* bb, Halves x, Halves y) {
+    const Node* difference = gen_op(bb, sub_borrow_op, x.lo, y.lo);
+    const Node* lo = gen_extract(bb, difference, singleton(int32_literal(bb->arena, 0)));
+    const Node* borrow = gen_extract(bb, difference, singleton(int32_literal(bb->arena, 1)));
+    const Node* hi = x.hi_zero ? gen_u32_literal(bb, 0) : x.hi;
+    if (!y.hi_zero)
+        hi = gen_op(bb, sub_op, hi, y.hi);
+    return make_halves(lo, gen_op(bb, sub_op, hi, borrow));
+}
+
+static Halves gen_neg(BodyBuilder* bb, Halves x) {
+    return gen_sub(bb, make_halves(gen_u32_literal(bb, 0), gen_u32_literal(bb, 0)), x);
+}
+
+/// The cross products only matter for the high half, and not at all when the high halves are zero (a 32x32 to 64 multiply)
+static Halves gen_mul(BodyBuilder* bb, Halves x, Halves y) {
+    const Node* product = gen_op(bb, mul_extended_op, x.lo, y.lo);
+    const Node* lo = gen_extract(bb, product, singleton(int32_literal(bb->arena, 0)));
+    const Node* hi = gen_extract(bb, product, singleton(int32_literal(bb->arena, 1)));
+    if (!x.hi_zero)
+        hi = gen_op(bb, add_op, hi, gen_op(bb, mul_op, x.hi, y.lo));
+    if (!y.hi_zero)
+        hi = gen_op(bb, add_op, hi, gen_op(bb, mul_op, x.lo, y.hi));
+    return make_halves(lo, hi);
+}
+
+static Halves gen_bitwise(BodyBuilder* bb, Op op, Halves x, Halves y) {
+    Halves result = make_halves(gen_op(bb, op, x.lo, y.lo), gen_op(bb, op, x.hi, y.hi));
+    if (op == and_op)
+        result.hi_zero = x.hi_zero || y.hi_zero;
+    else
+        result.hi_zero = x.hi_zero && y.hi_zero;
+    return result;
+}
+
+static const Node* gen_cmp(BodyBuilder* bb, Op op, Halves x, Halves y, bool is_signed) {
+    IrArena* a = bb->arena;
+    switch (op) {
+        case eq_op: return gen_op(bb, and_op, gen_op(bb, eq_op, x.lo, y.lo), gen_op(bb, eq_op, x.hi, y.hi));
+        case neq_op: return gen_op(bb, or_op, gen_op(bb, neq_op, x.lo, y.lo), gen_op(bb, neq_op, x.hi, y.hi));
+        default: break;
+    }
+    // the high halves decide, unless they are equal
+    Op strict_op = op == lt_op || op == lte_op ? lt_op : gt_op;
+    const Node* x_hi = is_signed ? gen_reinterpret_cast(bb, int32_type(a), x.hi) : x.hi;
+    const Node* y_hi = is_signed ? gen_reinterpret_cast(bb, int32_type(a), y.hi) : y.hi;
+    const Node* lo_result = gen_op(bb, op, x.lo, y.lo);
+    if (x.hi_zero && y.hi_zero)
+        return lo_result;
+    return gen_op(bb, or_op, gen_op(bb, strict_op, x_hi, y_hi), gen_op(bb, and_op, gen_op(bb, eq_op, x.hi, y.hi), lo_result));
+}
+
+static Halves gen_constant_shift(BodyBuilder* bb, Op op, Halves x, uint32_t s) {
+    if (s == 0)
+        return x;
+    const Node* zero = gen_u32_literal(bb, 0);
+    switch (op) {
+        case lshift_op:
+            if (s >= 32)
+                return make_halves(zero, gen_op(bb, lshift_op, x.lo, gen_u32_literal(bb, s - 32)));
+            return make_halves(gen_op(bb, lshift_op, x.lo, gen_u32_literal(bb, s)), gen_op(bb, or_op, gen_op(bb, lshift_op, x.hi, gen_u32_literal(bb, s)), gen_op(bb, rshift_logical_op, x.lo, gen_u32_literal(bb, 32 - s))));
+        case rshift_logical_op:
+            if (s >= 32)
+                return make_halves(gen_op(bb, rshift_logical_op, x.hi, gen_u32_literal(bb, s - 32)), zero);
+            return make_halves(gen_op(bb, or_op, gen_op(bb, rshift_logical_op, x.lo, gen_u32_literal(bb, s)), gen_op(bb, lshift_op, x.hi, gen_u32_literal(bb, 32 - s))), gen_op(bb, rshift_logical_op, x.hi, gen_u32_literal(bb, s)));
+        case rshift_arithm_op:
+            if (s >= 32)
+                return make_halves(gen_sra(bb, x.hi, gen_u32_literal(bb, s - 32)), gen_sra(bb, x.hi, gen_u32_literal(bb, 31)));
+            return make_halves(gen_op(bb, or_op, gen_op(bb, rshift_logical_op, x.lo, gen_u32_literal(bb, s)), gen_op(bb, lshift_op, x.hi, gen_u32_literal(bb, 32 - s))), gen_sra(bb, x.hi, gen_u32_literal(bb, s)));
+        default: error("not a shift");
+    }
+}
+
+/// Works out both the shift by less than a word and the shift by a word or more, then picks one.
+/// The bits crossing over between the halves are shifted by (32 - amount), which is masked so it never is a full word.
+static Halves gen_shift(BodyBuilder* bb, Op op, Halves x, const Node* amount) {
+    const IntLiteral* constant_amount = resolve_to_int_literal(amount);
+    if (constant_amount)
+        return gen_constant_shift(bb, op, x, get_int_literal_value(*constant_amount, false) & 63);
+
+    const Node* zero = gen_u32_literal(bb, 0);
+    const Node* s = gen_op(bb, and_op, amount, gen_u32_literal(bb, 31));
+    const Node* is_big = gen_op(bb, neq_op, gen_op(bb, and_op, amount, gen_u32_literal(bb, 32)), zero);
+    const Node* is_zero = gen_op(bb, eq_op, s, zero);
+    const Node* complement = gen_op(bb, and_op, gen_op(bb, sub_op, gen_u32_literal(bb, 32), s), gen_u32_literal(bb, 31));
+    Halves small, big;
+    switch (op) {
+        case lshift_op: {
+            const Node* crossing = gen_select(bb, is_zero, zero, gen_op(bb, rshift_logical_op, x.lo, complement));
+            small = make_halves(gen_op(bb, lshift_op, x.lo, s), gen_op(bb, or_op, gen_op(bb, lshift_op, x.hi, s), crossing));
+            big = make_halves(zero, gen_op(bb, lshift_op, x.lo, s));
+            break;
+        }
+        case rshift_logical_op:
+        case rshift_arithm_op: {
+            const Node* crossing = gen_select(bb, is_zero, zero, gen_op(bb, lshift_op, x.hi, complement));
+            const Node* lo = gen_op(bb, or_op, gen_op(bb, rshift_logical_op, x.lo, s), crossing);
+            if (op == rshift_logical_op) {
+                small = make_halves(lo, gen_op(bb, rshift_logical_op, x.hi, s));
+                big = make_halves(gen_op(bb, rshift_logical_op, x.hi, s), zero);
+            } else {
+                small = make_halves(lo, gen_sra(bb, x.hi, s));
+                big = make_halves(gen_sra(bb, x.hi, s), gen_sra(bb, x.hi, gen_u32_literal(bb, 31)));
+            }
+            break;
+        }
+        default: error("not a shift");
+    }
+    return gen_select_halves(bb, is_big, big, small);
+}
+
+/// Shift-and-subtract division: the dividend is shifted into the remainder a bit at a time and the quotient bits take its place.
+/// Gives back the quotient and the remainder as one record.
+static const Node* get_udivmod_fn(Context* ctx) {
+    if (ctx->udivmod_fn)
+        return ctx->udivmod_fn;
+
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* u32_t = uint32_type(a);
+    const Type* varying_u32_t = qualified_type_helper(u32_t, false);
+    Nodes params = mk_nodes(a, param(a, varying_u32_t, "n_lo"), param(a, varying_u32_t, "n_hi"), param(a, varying_u32_t, "d_lo"), param(a, varying_u32_t, "d_hi"));
+    const Type* result_t = record_type(a, (RecordType) { .members = mk_nodes(a, u32_t, u32_t, u32_t, u32_t) });
+    Node* fn = function(ctx->rewriter.dst_module, params, "generated_udivmod64", singleton(annotation(a, (Annotation) { .name = "Generated" })), singleton(qualified_type_helper(result_t, false)));
+    ctx->udivmod_fn = fn;
+    Halves d = make_halves(params.nodes[2], params.nodes[3]);
+
+    Nodes loop_params = mk_nodes(a, param(a, varying_u32_t, "i"), param(a, varying_u32_t, "q_lo"), param(a, varying_u32_t, "q_hi"), param(a, varying_u32_t, "r_lo"), param(a, varying_u32_t, "r_hi"));
+    const Node* i = loop_params.nodes[0];
+    Halves q = make_halves(loop_params.nodes[1], loop_params.nodes[2]);
+    Halves r = make_halves(loop_params.nodes[3], loop_params.nodes[4]);
+
+    BodyBuilder* loop_bb = begin_body(a);
+    BodyBuilder* step_bb = begin_body(a);
+    Halves next_r = make_halves(gen_op(step_bb, or_op, gen_op(step_bb, lshift_op, r.lo, gen_u32_literal(step_bb, 1)), gen_op(step_bb, rshift_logical_op, q.hi, gen_u32_literal(step_bb, 31))), gen_op(step_bb, or_op, gen_op(step_bb, lshift_op, r.hi, gen_u32_literal(step_bb, 1)), gen_op(step_bb, rshift_logical_op, r.lo, gen_u32_literal(step_bb, 31))));
+    Halves next_q = gen_constant_shift(step_bb, lshift_op, q, 1);
+    // the remainder holds less than 64 bits of the dividend until the last step, so doubling it never overflows
+    const Node* fits = gen_cmp(step_bb, gte_op, next_r, d, false);
+    next_r = gen_select_halves(step_bb, fits, gen_sub(step_bb, next_r, d), next_r);
+    next_q.lo = gen_op(step_bb, or_op, next_q.lo, gen_select(step_bb, fits, gen_u32_literal(step_bb, 1), gen_u32_literal(step_bb, 0)));
+    const Node* next_i = gen_op(step_bb, add_op, i, gen_u32_literal(step_bb, 1));
+    bind_instruction(loop_bb, if_instr(a, (If) {
+        .condition = gen_op(loop_bb, lt_op, i, gen_u32_literal(loop_bb, 64)),
+        .yield_types = empty(a),
+        .if_true = case_(a, empty(a), finish_body(step_bb, merge_continue(a, (MergeContinue) { .args = mk_nodes(a, next_i, next_q.lo, next_q.hi, next_r.lo, next_r.hi) }))),
+        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) { .args = mk_nodes(a, q.lo, q.hi, r.lo, r.hi) })),
+    }));
+
+    BodyBuilder* bb = begin_body(a);
+    Nodes results = bind_instruction(bb, loop_instr(a, (Loop) {
+        .yield_types = mk_nodes(a, u32_t, u32_t, u32_t, u32_t),
+        .body = case_(a, loop_params, finish_body(loop_bb, unreachable(a))),
+        .initial_args = mk_nodes(a, gen_u32_literal(bb, 0), params.nodes[0], params.nodes[1], gen_u32_literal(bb, 0), gen_u32_literal(bb, 0)),
+    }));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fn, .args = singleton(tuple_helper(a, results)) }));
+    return fn;
+}
+
+static Halves gen_udivmod(Context* ctx, BodyBuilder* bb, bool remainder, Halves x, Halves y) {
+    IrArena* a = bb->arena;
+    if (x.hi_zero && y.hi_zero)
+        return make_halves(gen_op(bb, remainder ? mod_op : div_op, x.lo, y.lo), gen_u32_literal(bb, 0));
+
+    // powers of two are just shifts and masks
+    const IntLiteral* divisor_lo = resolve_to_int_literal(y.lo);
+    const IntLiteral* divisor_hi = resolve_to_int_literal(y.hi);
+    if (divisor_lo && divisor_hi) {
+        uint64_t divisor = ((uint64_t) get_int_literal_value(*divisor_hi, false) << 32) | (uint64_t) get_int_literal_value(*divisor_lo, false);
+        if (divisor != 0 && (divisor & (divisor - 1)) == 0) {
+            if (remainder)
+                return gen_bitwise(bb, and_op, x, make_halves(gen_u32_literal(bb, (uint32_t) (divisor - 1)), gen_u32_literal(bb, (uint32_t) ((divisor - 1) >> 32))));
+            uint32_t shift = 0;
+            while ((1ull << shift) != divisor)
+                shift++;
+            return gen_constant_shift(bb, rshift_logical_op, x, shift);
+        }
+    }
+
+    const Node* results = first(bind_instruction(bb, call(a, (Call) { .callee = fn_addr_helper(a, get_udivmod_fn(ctx)), .args = mk_nodes(a, x.lo, x.hi, y.lo, y.hi) })));
+    size_t offset = remainder ? 2 : 0;
+    return make_halves(gen_extract(bb, results, singleton(int32_literal(a, offset))), gen_extract(bb, results, singleton(int32_literal(a, offset + 1))));
+}
+
+/// Rounds towards zero, like the native ops: the quotient is negative when the signs differ, and the remainder takes the sign of the dividend
+static Halves gen_sdivmod(Context* ctx, BodyBuilder* bb, bool remainder, Halves x, Halves y) {
+    IrArena* a = bb->arena;
+    // both are positive then
+    if (x.hi_zero && y.hi_zero)
+        return gen_udivmod(ctx, bb, remainder, x, y);
+    const Node* zero = int32_literal(a, 0);
+    const Node* x_negative = gen_op(bb, lt_op, gen_reinterpret_cast(bb, int32_type(a), x.hi), zero);
+    const Node* y_negative = gen_op(bb, lt_op, gen_reinterpret_cast(bb, int32_type(a), y.hi), zero);
+    Halves result = gen_udivmod(ctx, bb, remainder, gen_select_halves(bb, x_negative, gen_neg(bb, x), x), gen_select_halves(bb, y_negative, gen_neg(bb, y), y));
+    const Node* negate = remainder ? x_negative : gen_op(bb, neq_op, x_negative, y_negative);
+    return gen_select_halves(bb, negate, gen_neg(bb, result), result);
+}
+
+/// Counts the leading zeroes of a u32 by halving the window it looks in, there is no primop for it
+static const Node* gen_leading_zeroes(BodyBuilder* bb, const Node* x) {
+    const Node* count = gen_u32_literal(bb, 0);
+    for (uint32_t step = 16; step > 0; step /= 2) {
+        const Node* fits = gen_op(bb, lt_op, x, gen_u32_literal(bb, 1u << (32 - step)));
+        x = gen_select(bb, fits, gen_op(bb, lshift_op, x, gen_u32_literal(bb, step)), x);
+        count = gen_select(bb, fits, gen_op(bb, add_op, count, gen_u32_literal(bb, step)), count);
+    }
+    return count;
+}
+
+/// Floats with no more mantissa bits than a word can't convert the halves separately without rounding twice.
+/// Instead the value is shifted up until the high half holds its top 32 bits, and that gets converted once then scaled back.
+/// What's left in the low half can only break a tie, so it's folded into the lowest bit.
+static const Node* gen_uint64_to_narrow_float(BodyBuilder* bb, const Type* dst_t, Halves x) {
+    IrArena* a = bb->arena;
+    const Node* small = gen_conversion(bb, dst_t, x.lo);
+    if (x.hi_zero)
+        return small;
+    const Node* zero = gen_u32_literal(bb, 0);
+    const Node* s = gen_leading_zeroes(bb, x.hi);
+    Halves normalized = gen_shift(bb, lshift_op, x, s);
+    const Node* sticky = gen_select(bb, gen_op(bb, neq_op, normalized.lo, zero), gen_u32_literal(bb, 1), zero);
+    const Node* top = gen_conversion(bb, dst_t, gen_op(bb, or_op, normalized.hi, sticky));
+    // 2^(32 - s) doesn't always fit in a u32, 2^(31 - s) does
+    const Node* scale = gen_conversion(bb, dst_t, gen_op(bb, lshift_op, gen_u32_literal(bb, 1), gen_op(bb, sub_op, gen_u32_literal(bb, 31), s)));
+    const Node* big = gen_op(bb, mul_op, gen_op(bb, mul_op, top, scale), fp_literal_helper(a, dst_t->payload.float_type.width, 2.0));
+    return gen_select(bb, gen_op(bb, eq_op, x.hi, zero), small, big);
+}
+
+static const Node* gen_int64_to_float(BodyBuilder* bb, const Type* dst_t, Halves x, bool is_signed) {
+    IrArena* a = bb->arena;
+    // a double holds either half exactly, so the add is the only thing rounding
+    if (dst_t->payload.float_type.width == FloatTy64) {
+        const Node* hi = gen_conversion(bb, dst_t, is_signed ? gen_reinterpret_cast(bb, int32_type(a), x.hi) : x.hi);
+        const Node* lo = gen_conversion(bb, dst_t, x.lo);
+        const Node* word = fp_literal_helper(a, FloatTy64, 4294967296.0);
+        return gen_op(bb, add_op, gen_op(bb, mul_op, hi, word), lo);
+    }
+    if (!is_signed || x.hi_zero)
+        return gen_uint64_to_narrow_float(bb, dst_t, x);
+    // rounding to nearest is symmetric, so the magnitude can be rounded instead
+    const Node* is_negative = gen_op(bb, lt_op, gen_reinterpret_cast(bb, int32_type(a), x.hi), int32_literal(a, 0));
+    const Node* magnitude = gen_uint64_to_narrow_float(bb, dst_t, gen_select_halves(bb, is_negative, gen_neg(bb, x), x));
+    return gen_select(bb, is_negative, gen_primop_e(bb, neg_op, empty(a), singleton(magnitude)), magnitude);
+}
+
+/// Splits the magnitude rounded towards zero, which is exact: the high half's part is at least half of it when not zero, so taking it away doesn't round.
+/// Negative values get their sign back with a 64-bit negation.
+static Halves gen_float_to_int64(BodyBuilder* bb, const Node* x, bool is_signed) {
+    IrArena* a = bb->arena;
+    const Type* float_t = get_unqualified_type(x->type);
+    FloatSizes width = float_t->payload.float_type.width;
+    const Node* is_negative = gen_op(bb, lt_op, x, fp_literal_helper(a, width, 0.0));
+    const Node* magnitude = gen_select(bb, is_negative, gen_primop_e(bb, neg_op, empty(a), singleton(gen_primop_e(bb, ceil_op, empty(a), singleton(x)))), gen_primop_e(bb, floor_op, empty(a), singleton(x)));
+    Halves result;
+    if (width == FloatTy16) {
+        // halves don't go anywhere near 2^32, which they can't even represent
+        result = make_halves(gen_conversion(bb, uint32_type(a), magnitude), gen_u32_literal(bb, 0));
+    } else {
+        const Node* hi = gen_primop_e(bb, floor_op, empty(a), singleton(gen_op(bb, mul_op, magnitude, fp_literal_helper(a, width, 1.0 / 4294967296.0))));
+        const Node* lo = gen_op(bb, sub_op, magnitude, gen_op(bb, mul_op, hi, fp_literal_helper(a, width, 4294967296.0)));
+        result = make_halves(gen_conversion(bb, uint32_type(a), lo), gen_conversion(bb, uint32_type(a), hi));
+    }
+    // converting a negative float to an unsigned integer is undefined past -1
+    if (!is_signed)
+        return result;
+    return gen_select_halves(bb, is_negative, gen_neg(bb, result), result);
+}
+
+static const Node* get_pair_type(IrArena* a) {
+    return pack_type(a, (PackType) { .element_type = uint32_type(a), .width = 2 });
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    const Node* found = search_processed(&ctx->rewriter, node);
+    if (found) return found;
+
+    IrArena* a = ctx->rewriter.dst_arena;
+
+    switch (node->tag) {
+        case Int_TAG:
+            if (node->payload.int_type.width == IntTy64 && ctx->config->lower.int64)
+                return record_type(a, (RecordType) {
+                    .members = mk_nodes(a, uint32_type(a), uint32_type(a))
+                });
+            break;
+        case IntLiteral_TAG:
+            if (node->payload.int_literal.width == IntTy64 && ctx->config->lower.int64) {
+                uint64_t raw = node->payload.int_literal.value;
+                const Node* lower = uint32_literal(a, (uint32_t) raw);
+                const Node* upper = uint32_literal(a, (uint32_t) (raw >> 32));
+                return tuple_helper(a, mk_nodes(a, lower, upper));
+            }
+            break;
+        // array sizes need to stay literals
+        case ArrType_TAG: {
+            const Node* size = node->payload.arr_type.size;
+            const IntLiteral* literal = size ? resolve_to_int_literal(size) : NULL;
+            if (literal && literal->width == IntTy64 && ctx->config->lower.int64)
+                return arr_type(a, (ArrType) { .element_type = rewrite_node(&ctx->rewriter, node->payload.arr_type.element_type), .size = uint32_literal(a, get_int_literal_value(*literal, false)) });
+            break;
+        }
+        case PrimOp_TAG: {
+            Op op = node->payload.prim_op.op;
+            Nodes old_nodes = node->payload.prim_op.operands;
+            if (old_nodes.count == 0)
+                break;
+            const Node* old_first = first(old_nodes);
+            const Type* first_t = get_unqualified_type(old_first->type);
+            Halves result;
+            BodyBuilder* bb = begin_body(a);
+            switch (op) {
+                case add_op:
+                case sub_op:
+                case mul_op:
+                case div_op:
+                case mod_op:
+                case and_op:
+                case or_op:
+                case xor_op:
+                case min_op:
+                case max_op: {
+                    if (!should_convert(ctx, first_t))
+                        break;
+                    Nodes new_nodes = rewrite_nodes(&ctx->rewriter, old_nodes);
+                    Halves x = get_halves(bb, old_nodes.nodes[0], new_nodes.nodes[0]);
+                    Halves y = get_halves(bb, old_nodes.nodes[1], new_nodes.nodes[1]);
+                    bool is_signed = is_signed_int(first_t);
+                    switch (op) {
+                        case add_op: result = gen_add(bb, x, y); break;
+                        case sub_op: result = gen_sub(bb, x, y); break;
+                        case mul_op: result = gen_mul(bb, x, y); break;
+                        case div_op:
+                        case mod_op: result = is_signed ? gen_sdivmod(ctx, bb, op == mod_op, x, y) : gen_udivmod(ctx, bb, op == mod_op, x, y); break;
+                        case min_op: result = gen_select_halves(bb, gen_cmp(bb, lt_op, x, y, is_signed), x, y); break;
+                        case max_op: result = gen_select_halves(bb, gen_cmp(bb, gt_op, x, y, is_signed), x, y); break;
+                        default: result = gen_bitwise(bb, op, x, y); break;
+                    }
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                case neg_op:
+                case not_op:
+                case abs_op: {
+                    if (!should_convert(ctx, first_t))
+                        break;
+                    Halves x = get_halves(bb, old_first, rewrite_node(&ctx->rewriter, old_first));
+                    if (op == not_op)
+                        result = make_halves(gen_primop_e(bb, not_op, empty(a), singleton(x.lo)), gen_primop_e(bb, not_op, empty(a), singleton(x.hi)));
+                    else if (op == neg_op)
+                        result = gen_neg(bb, x);
+                    else if (is_signed_int(first_t))
+                        result = gen_select_halves(bb, gen_op(bb, lt_op, gen_reinterpret_cast(bb, int32_type(a), x.hi), int32_literal(a, 0)), gen_neg(bb, x), x);
+                    else
+                        result = x;
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                case eq_op:
+                case neq_op:
+                case lt_op:
+                case lte_op:
+                case gt_op:
+                case gte_op: {
+                    if (!should_convert(ctx, first_t))
+                        break;
+                    Nodes new_nodes = rewrite_nodes(&ctx->rewriter, old_nodes);
+                    Halves x = get_halves(bb, old_nodes.nodes[0], new_nodes.nodes[0]);
+                    Halves y = get_halves(bb, old_nodes.nodes[1], new_nodes.nodes[1]);
+                    return yield_values_and_wrap_in_block(bb, singleton(gen_cmp(bb, op, x, y, is_signed_int(first_t))));
+                }
+                case lshift_op:
+                case rshift_logical_op:
+                case rshift_arithm_op: {
+                    const Node* old_amount = old_nodes.nodes[1];
+                    if (!should_convert(ctx, first_t) && !should_convert(ctx, get_unqualified_type(old_amount->type)))
+                        break;
+                    const Node* amount = rewrite_node(&ctx->rewriter, old_amount);
+                    amount = should_convert(ctx, get_unqualified_type(old_amount->type)) ? get_halves(bb, old_amount, amount).lo : gen_to_u32(bb, amount);
+                    if (!should_convert(ctx, first_t)) {
+                        // only the amount was 64-bit, and a shift by that many bits is undefined past 32 anyways
+                        const Type* amount_t = get_unqualified_type(rewrite_node(&ctx->rewriter, old_first)->type);
+                        return yield_values_and_wrap_in_block(bb, singleton(gen_op(bb, op, rewrite_node(&ctx->rewriter, old_first), gen_from_u32(bb, amount_t, amount))));
+                    }
+                    Halves x = get_halves(bb, old_first, rewrite_node(&ctx->rewriter, old_first));
+                    result = gen_shift(bb, op, x, amount);
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                case convert_op: {
+                    const Type* dst_t = first(node->payload.prim_op.type_arguments);
+                    bool convert_src = should_convert(ctx, first_t);
+                    bool convert_dst = should_convert(ctx, dst_t);
+                    if (!convert_src && !convert_dst)
+                        break;
+                    const Node* src = rewrite_node(&ctx->rewriter, old_first);
+                    // only the signedness changes
+                    if (convert_src && convert_dst)
+                        return quote_helper(a, singleton(src));
+                    if (convert_src) {
+                        Halves x = get_halves(bb, old_first, src);
+                        const Type* new_dst_t = rewrite_node(&ctx->rewriter, dst_t);
+                        const Node* converted = new_dst_t->tag == Float_TAG ? gen_int64_to_float(bb, new_dst_t, x, is_signed_int(first_t)) : gen_from_u32(bb, new_dst_t, x.lo);
+                        return yield_values_and_wrap_in_block(bb, singleton(converted));
+                    }
+                    if (first_t->tag == Float_TAG) {
+                        result = gen_float_to_int64(bb, src, is_signed_int(dst_t));
+                    } else {
+                        const Node* lo = gen_to_u32(bb, src);
+                        result = is_signed_int(first_t) ? make_halves(lo, gen_sra(bb, lo, gen_u32_literal(bb, 31))) : make_halves(lo, gen_u32_literal(bb, 0));
+                    }
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                // anything else of the same size goes through a pair of words
+                case reinterpret_op: {
+                    const Type* dst_t = first(node->payload.prim_op.type_arguments);
+                    bool convert_src = should_convert(ctx, first_t);
+                    bool convert_dst = should_convert(ctx, dst_t);
+                    if (!convert_src && !convert_dst)
+                        break;
+                    const Node* src = rewrite_node(&ctx->rewriter, old_first);
+                    if (convert_src && convert_dst)
+                        return quote_helper(a, singleton(src));
+                    if (convert_src) {
+                        Halves x = get_halves(bb, old_first, src);
+                        const Node* pair = composite_helper(a, get_pair_type(a), mk_nodes(a, x.lo, x.hi));
+                        return yield_values_and_wrap_in_block(bb, singleton(gen_reinterpret_cast(bb, rewrite_node(&ctx->rewriter, dst_t), pair)));
+                    }
+                    result = get_halves(bb, NULL, gen_reinterpret_cast(bb, get_pair_type(a), src));
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                case select_op: {
+                    if (!should_convert(ctx, get_unqualified_type(old_nodes.nodes[1]->type)))
+                        break;
+                    Nodes new_nodes = rewrite_nodes(&ctx->rewriter, old_nodes);
+                    Halves x = get_halves(bb, old_nodes.nodes[1], new_nodes.nodes[1]);
+                    Halves y = get_halves(bb, old_nodes.nodes[2], new_nodes.nodes[2]);
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, gen_select_halves(bb, first(new_nodes), x, y))));
+                }
+                case subgroup_broadcast_first_op: {
+                    if (!should_convert(ctx, first_t))
+                        break;
+                    Halves x = get_halves(bb, old_first, rewrite_node(&ctx->rewriter, old_first));
+                    result = make_halves(gen_primop_e(bb, op, empty(a), singleton(x.lo)), gen_primop_e(bb, op, empty(a), singleton(x.hi)));
+                    return yield_values_and_wrap_in_block(bb, singleton(join_halves(a, result)));
+                }
+                // offsets and indices: the high half can't matter
+                case lea_op:
+                case extract_dynamic_op: {
+                    bool any = false;
+                    for (size_t i = 1; i < old_nodes.count; i++)
+                        any |= should_convert(ctx, get_unqualified_type(old_nodes.nodes[i]->type));
+                    if (!any)
+                        break;
+                    LARRAY(const Node*, new_nodes, old_nodes.count);
+                    for (size_t i = 0; i < old_nodes.count; i++) {
+                        new_nodes[i] = rewrite_node(&ctx->rewriter, old_nodes.nodes[i]);
+                        if (i > 0 && should_convert(ctx, get_unqualified_type(old_nodes.nodes[i]->type)))
+                            new_nodes[i] = get_halves(bb, old_nodes.nodes[i], new_nodes[i]).lo;
+                    }
+                    Nodes results = bind_instruction(bb, prim_op(a, (PrimOp) { .op = op, .type_arguments = rewrite_nodes(&ctx->rewriter, node->payload.prim_op.type_arguments), .operands = nodes(a, old_nodes.count, new_nodes) }));
+                    return yield_values_and_wrap_in_block(bb, results);
+                }
+                default: break;
+            }
+            cancel_body(bb);
+            break;
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(&ctx->rewriter, node);
+}
+
+Module* lower_int(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+    };
+    rewrite_module(&ctx.rewriter);
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
@@ -11,108 +11,241 @@
 
 #include <assert.h>
 
+enum {
+    /// Constant-size operations up to this many units are unrolled rather than looped over
+    MaxUnrolledUnits = 16,
+};
+
 typedef struct {
     Rewriter rewriter;
     const CompilerConfig* config;
 } Context;
 
+/// What we know about the alignment of an address, going by the type it points to
+static size_t get_known_alignment(IrArena* a, const Type* t) {
+    t = get_maybe_nominal_type_body(t);
+    switch (t->tag) {
+        case ArrType_TAG: return get_known_alignment(a, t->payload.arr_type.element_type);
+        case Int_TAG:
+        case Float_TAG:
+        case Bool_TAG:
+        case PackType_TAG:
+        case RecordType_TAG: return get_mem_layout(a, t).alignment_in_bytes;
+        default: return int_size_in_bytes(a->config.memory.word_size);
+    }
+}
+
+/// Whether get_mem_layout can tell the size of a type
+static bool is_sized(const Type* t) {
+    t = get_maybe_nominal_type_body(t);
+    switch (t->tag) {
+        case ArrType_TAG: return t->payload.arr_type.size && resolve_to_int_literal(t->payload.arr_type.size) && is_sized(t->payload.arr_type.element_type);
+        case RecordType_TAG: {
+            Nodes members = t->payload.record_type.members;
+            for (size_t i = 0; i < members.count; i++)
+                if (!is_sized(members.nodes[i]))
+                    return false;
+            return true;
+        }
+        case Int_TAG:
+        case Float_TAG:
+        case Bool_TAG:
+        case PackType_TAG: return true;
+        default: return false;
+    }
+}
+
+/// Emulated memory is made of words, splitting wider accesses there only adds shifts, so only real pointers get wider units
+static const Type* get_unit_type(IrArena* a, const Type* dst_t, const Type* src_t) {
+    const Type* word_t = int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false });
+    if (dst_t->payload.ptr_type.address_space != AsGlobal || get_known_alignment(a, dst_t->payload.ptr_type.pointed_type) < 8)
+        return word_t;
+    if (src_t && (src_t->payload.ptr_type.address_space != AsGlobal || get_known_alignment(a, src_t->payload.ptr_type.pointed_type) < 8))
+        return word_t;
+    if (int_size_in_bytes(a->config.memory.word_size) >= 8)
+        return word_t;
+    return uint64_type(a);
+}
+
+/// A memcpy or a memset, done in units of the same type
+typedef struct {
+    const Type* unit_t;
+    const Node* dst;
+    /// when there is no source, value is stored in every unit instead
+    const Node* src;
+    const Node* value;
+} MemOp;
+
+static const Node* gen_unit_array(BodyBuilder* bb, const Type* unit_t, const Node* ptr) {
+    IrArena* a = ptr->arena;
+    const Type* ptr_t = get_unqualified_type(ptr->type);
+    assert(ptr_t->tag == PtrType_TAG);
+    return gen_reinterpret_cast(bb, ptr_type(a, (PtrType) {
+        .address_space = ptr_t->payload.ptr_type.address_space,
+        .pointed_type = arr_type(a, (ArrType) { .element_type = unit_t, .size = NULL }),
+    }), ptr);
+}
+
+static MemOp with_unit_type(BodyBuilder* bb, MemOp op, const Type* unit_t, const Node* value) {
+    return (MemOp) {
+        .unit_t = unit_t,
+        .dst = gen_unit_array(bb, unit_t, op.dst),
+        .src = op.src ? gen_unit_array(bb, unit_t, op.src) : NULL,
+        .value = value,
+    };
+}
+
+static void gen_unit_op(BodyBuilder* bb, const MemOp* op, const Node* index) {
+    IrArena* a = op->dst->arena;
+    const Node* value = op->value;
+    if (op->src)
+        value = gen_load(bb, gen_lea(bb, op->src, uint32_literal(a, 0), singleton(index)));
+    gen_store(bb, gen_lea(bb, op->dst, uint32_literal(a, 0), singleton(index)), value);
+}
+
+static void gen_unrolled_op(BodyBuilder* bb, const MemOp* op, size_t start, size_t count) {
+    IrArena* a = op->dst->arena;
+    for (size_t i = start; i < start + count; i++)
+        gen_unit_op(bb, op, uint32_literal(a, i));
+}
+
+/// The exit test comes first, so an empty range does nothing
+static void gen_loop_op(BodyBuilder* bb, const MemOp* op, const Node* count, String index_name) {
+    IrArena* a = op->dst->arena;
+    const Node* index = param(a, qualified_type_helper(uint32_type(a), false), index_name);
+    BodyBuilder* loop_bb = begin_body(a);
+    BodyBuilder* body_bb = begin_body(a);
+    gen_unit_op(body_bb, op, index);
+    const Node* next_index = gen_primop_e(body_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, 1)));
+    bind_instruction(loop_bb, if_instr(a, (If) {
+        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, index, count)),
+        .yield_types = empty(a),
+        .if_true = case_(a, empty(a), finish_body(body_bb, merge_continue(a, (MergeContinue) {.args = singleton(next_index)}))),
+        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) {.args = empty(a)}))
+    }));
+
+    bind_instruction(bb, loop_instr(a, (Loop) {
+        .yield_types = empty(a),
+        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
+        .initial_args = singleton(uint32_literal(a, 0))
+    }));
+}
+
+/// Only whole words are copied or set, like before: emulated memory can't address anything smaller
+static void gen_mem_op(BodyBuilder* bb, MemOp op, const Node* word_value, const Node* num_bytes, String index_name) {
+    IrArena* a = op.dst->arena;
+    const Type* word_t = int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false });
+    size_t unit_size = get_type_bitwidth(op.unit_t) / 8;
+    size_t word_size = int_size_in_bytes(a->config.memory.word_size);
+    size_t words_per_unit = unit_size / word_size;
+    MemOp unit_op = with_unit_type(bb, op, op.unit_t, op.value);
+
+    const IntLiteral* constant_size = resolve_to_int_literal(num_bytes);
+    if (constant_size) {
+        // body: whole units, tail: the words after them
+        size_t size = get_int_literal_value(*constant_size, false);
+        size_t units = size / unit_size;
+        if (units <= MaxUnrolledUnits)
+            gen_unrolled_op(bb, &unit_op, 0, units);
+        else
+            gen_loop_op(bb, &unit_op, uint32_literal(a, units), index_name);
+        size_t tail_words = (size % unit_size) / word_size;
+        if (tail_words > 0 && (op.src || word_value)) {
+            MemOp word_op = with_unit_type(bb, op, word_t, word_value);
+            gen_unrolled_op(bb, &word_op, units * words_per_unit, tail_words);
+        }
+        return;
+    }
+
+    const Node* size = gen_conversion(bb, uint32_type(a), num_bytes);
+    const Node* units = gen_primop_e(bb, div_op, empty(a), mk_nodes(a, size, uint32_literal(a, unit_size)));
+    gen_loop_op(bb, &unit_op, units, index_name);
+    if (words_per_unit > 1 && (op.src || word_value)) {
+        // the units are two words wide, so there is at most one word left after them
+        assert(words_per_unit == 2);
+        MemOp word_op = with_unit_type(bb, op, word_t, word_value);
+        const Node* has_tail = gen_primop_e(bb, neq_op, empty(a), mk_nodes(a, gen_primop_e(bb, and_op, empty(a), mk_nodes(a, size, uint32_literal(a, word_size))), uint32_literal(a, 0)));
+        BodyBuilder* tail_bb = begin_body(a);
+        gen_unit_op(tail_bb, &word_op, gen_primop_e(tail_bb, mul_op, empty(a), mk_nodes(a, units, uint32_literal(a, 2))));
+        bind_instruction(bb, if_instr(a, (If) {
+            .condition = has_tail,
+            .yield_types = empty(a),
+            .if_true = case_(a, empty(a), finish_body(tail_bb, yield(a, (Yield) { .args = empty(a) }))),
+            .if_false = NULL,
+        }));
+    }
+}
+
+/// Repeats the bytes (or shorts) of a memset value across a whole unit
+static const Node* gen_splat(BodyBuilder* bb, const Type* unit_t, const Node* value) {
+    IrArena* a = unit_t->arena;
+    const Type* value_t = get_unqualified_type(value->type);
+    assert(value_t->tag == Int_TAG);
+    size_t value_width = get_type_bitwidth(value_t);
+    size_t unit_width = get_type_bitwidth(unit_t);
+    value = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = value_t->payload.int_type.width, .is_signed = false }), value);
+    if (value_width == unit_width)
+        return value;
+    assert(value_width < unit_width);
+    uint64_t pattern = 0;
+    for (size_t i = 0; i < unit_width; i += value_width)
+        pattern |= 1ull << i;
+    value = convert_int_zero_extend(bb, unit_t, value);
+    return gen_primop_e(bb, mul_op, empty(a), mk_nodes(a, value, int_literal(a, (IntLiteral) { .width = unit_t->payload.int_type.width, .value = pattern })));
+}
+
 static const Node* process(Context* ctx, const Node* old) {
     const Node* found = search_processed(&ctx->rewriter, old);
     if (found) return found;
 
     IrArena* a = ctx->rewriter.dst_arena;
-    Module* m = ctx->rewriter.dst_module;
 
     switch (old->tag) {
         case PrimOp_TAG: {
             switch (old->payload.prim_op.op) {
                 case memcpy_op: {
-                    const Type* word_type = int_type(a, (Int) { .is_signed = false, .width = a->config.memory.word_size });
-
                     BodyBuilder* bb = begin_body(a);
                     Nodes old_ops = old->payload.prim_op.operands;
 
                     const Node* dst_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[0]);
-                    const Type* dst_addr_type = dst_addr->type;
-                    deconstruct_qualified_type(&dst_addr_type);
+                    const Type* dst_addr_type = get_unqualified_type(dst_addr->type);
                     assert(dst_addr_type->tag == PtrType_TAG);
-                    dst_addr_type = ptr_type(a, (PtrType) {
-                        .address_space = dst_addr_type->payload.ptr_type.address_space,
-                        .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    dst_addr = gen_reinterpret_cast(bb, dst_addr_type, dst_addr);
-
                     const Node* src_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
-                    const Type* src_addr_type = src_addr->type;
-                    deconstruct_qualified_type(&src_addr_type);
+                    const Type* src_addr_type = get_unqualified_type(src_addr->type);
                     assert(src_addr_type->tag == PtrType_TAG);
-                    src_addr_type = ptr_type(a, (PtrType) {
-                            .address_space = src_addr_type->payload.ptr_type.address_space,
-                            .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    src_addr = gen_reinterpret_cast(bb, src_addr_type, src_addr);
-
                     const Node* num = rewrite_node(&ctx->rewriter, old_ops.nodes[2]);
-                    const Node* num_in_bytes = gen_conversion(bb, uint32_type(a), bytes_to_words(bb, num));
-
-                    const Node* index = param(a, qualified_type_helper(uint32_type(a), false), "memcpy_i");
-                    BodyBuilder* loop_bb = begin_body(a);
-                    const Node* loaded_word = gen_load(loop_bb, gen_lea(loop_bb, src_addr, index, singleton(uint32_literal(a, 0))));
-                    gen_store(loop_bb, gen_lea(loop_bb, dst_addr, index, singleton(uint32_literal(a, 0))), loaded_word);
-                    const Node* next_index = gen_primop_e(loop_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, 1)));
-                    bind_instruction(loop_bb, if_instr(a, (If) {
-                        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, next_index, num_in_bytes)),
-                        .yield_types = empty(a),
-                        .if_true = case_(a, empty(a), merge_continue(a, (MergeContinue) {.args = singleton(next_index)})),
-                        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) {.args = empty(a)}))
-                    }));
-
-                    bind_instruction(bb, loop_instr(a, (Loop) {
-                        .yield_types = empty(a),
-                        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
-                        .initial_args = singleton(uint32_literal(a, 0))
-                    }));
+
+                    // copying exactly one value of the type both sides point to: that's just a load and a store, which later passes know how to do well
+                    const Type* pointee = dst_addr_type->payload.ptr_type.pointed_type;
+                    const IntLiteral* constant_size = resolve_to_int_literal(num);
+                    if (constant_size && pointee == src_addr_type->payload.ptr_type.pointed_type && is_sized(pointee) && get_mem_layout(a, pointee).size_in_bytes == get_int_literal_value(*constant_size, false)) {
+                        gen_store(bb, dst_addr, gen_load(bb, src_addr));
+                        return yield_values_and_wrap_in_block(bb, empty(a));
+                    }
+
+                    const Type* unit_t = get_unit_type(a, dst_addr_type, src_addr_type);
+                    gen_mem_op(bb, (MemOp) { .unit_t = unit_t, .dst = dst_addr, .src = src_addr }, NULL, num, "memcpy_i");
                     return yield_values_and_wrap_in_block(bb, empty(a));
                 }
                 case memset_op: {
-                    Nodes old_ops = old->payload.prim_op.operands;
-                    const Node* src_value = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
-                    const Type* src_type = src_value->type;
-                    deconstruct_qualified_type(&src_type);
-                    assert(src_type->tag == Int_TAG);
-                    const Type* word_type = src_type;// int_type(a, (Int) { .is_signed = false, .width = a->config.memory.word_size });
-
                     BodyBuilder* bb = begin_body(a);
+                    Nodes old_ops = old->payload.prim_op.operands;
 
                     const Node* dst_addr = rewrite_node(&ctx->rewriter, old_ops.nodes[0]);
-                    const Type* dst_addr_type = dst_addr->type;
-                    deconstruct_qualified_type(&dst_addr_type);
+                    const Type* dst_addr_type = get_unqualified_type(dst_addr->type);
                     assert(dst_addr_type->tag == PtrType_TAG);
-                    dst_addr_type = ptr_type(a, (PtrType) {
-                        .address_space = dst_addr_type->payload.ptr_type.address_space,
-                        .pointed_type = arr_type(a, (ArrType) { .element_type = word_type, .size = NULL }),
-                    });
-                    dst_addr = gen_reinterpret_cast(bb, dst_addr_type, dst_addr);
-
+                    const Node* src_value = rewrite_node(&ctx->rewriter, old_ops.nodes[1]);
+                    const Type* src_type = get_unqualified_type(src_value->type);
+                    assert(src_type->tag == Int_TAG);
                     const Node* num = rewrite_node(&ctx->rewriter, old_ops.nodes[2]);
-                    const Node* num_in_bytes = gen_conversion(bb, uint32_type(a), bytes_to_words(bb, num));
-
-                    const Node* index = param(a, qualified_type_helper(uint32_type(a), false), "memset_i");
-                    BodyBuilder* loop_bb = begin_body(a);
-                    gen_store(loop_bb, gen_lea(loop_bb, dst_addr, index, singleton(uint32_literal(a, 0))), src_value);
-                    const Node* next_index = gen_primop_e(loop_bb, add_op, empty(a), mk_nodes(a, index, uint32_literal(a, 1)));
-                    bind_instruction(loop_bb, if_instr(a, (If) {
-                        .condition = gen_primop_e(loop_bb, lt_op, empty(a), mk_nodes(a, next_index, num_in_bytes)),
-                        .yield_types = empty(a),
-                        .if_true = case_(a, empty(a), merge_continue(a, (MergeContinue) {.args = singleton(next_index)})),
-                        .if_false = case_(a, empty(a), merge_break(a, (MergeBreak) {.args = empty(a)}))
-                    }));
-
-                    bind_instruction(bb, loop_instr(a, (Loop) {
-                        .yield_types = empty(a),
-                        .body = case_(a, singleton(index), finish_body(loop_bb, unreachable(a))),
-                        .initial_args = singleton(uint32_literal(a, 0))
-                    }));
+
+                    const Type* word_t = int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false });
+                    const Type* unit_t = get_unit_type(a, dst_addr_type, NULL);
+                    // values wider than the unit are stored as they are
+                    if (get_type_bitwidth(src_type) > get_type_bitwidth(unit_t))
+                        unit_t = int_type(a, (Int) { .width = src_type->payload.int_type.width, .is_signed = false });
+                    const Node* word_value = get_type_bitwidth(src_type) <= get_type_bitwidth(word_t) ? gen_splat(bb, word_t, src_value) : NULL;
+                    gen_mem_op(bb, (MemOp) { .unit_t = unit_t, .dst = dst_addr, .value = gen_splat(bb, unit_t, src_value) }, word_value, num, "memset_i");
                     return yield_values_and_wrap_in_block(bb, empty(a));
                 }
                 default: break;
@@ -125,13 +258,14 @@ static const Node* process(Context* ctx, const Node* old) {
     return recreate_node_identity(&ctx->rewriter, old);
 }
 
-Module* lower_memcpy(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+Module* lower_memcpy(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
 
     Context ctx = {
-            .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process)
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
     };
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
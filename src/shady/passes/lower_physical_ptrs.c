@@ -17,6 +17,11 @@
 #include <string.h>
 #include <assert.h>
 
+enum {
+    /// Past this, holding the whole value as words costs more registers than the address computations it saves
+    MaxCoalescedWords = 64,
+};
+
 typedef struct Context_ {
     Rewriter rewriter;
     const CompilerConfig* config;
@@ -137,7 +142,7 @@ static const Node* gen_deserialisation(Context* ctx, BodyBuilder* bb, const Type
             const Node* offset = base_offset;
             for (size_t i = 0; i < components_count; i++) {
                 components[i] = gen_deserialisation(ctx, bb, component_type, arr, offset);
-                offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a))));
+                offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, bytes_to_words(bb, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a)))));
             }
             return composite_helper(a, element_type, nodes(a, components_count, components));
         }
@@ -152,8 +157,8 @@ static void gen_serialisation(Context* ctx, BodyBuilder* bb, const Type* element
     switch (element_type->tag) {
         case Bool_TAG: {
             const Node* logical_ptr = gen_primop_ce(bb, lea_op, 3, (const Node* []) { arr, zero, base_offset });
-            const Node* zero_b = int_literal(a, (IntLiteral) { .value = 1, .width = a->config.memory.word_size });
-            const Node* one_b =  int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size });
+            const Node* zero_b = int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size });
+            const Node* one_b =  int_literal(a, (IntLiteral) { .value = 1, .width = a->config.memory.word_size });
             const Node* int_value = gen_primop_ce(bb, select_op, 3, (const Node*[]) { value, one_b, zero_b });
             gen_store(bb, logical_ptr, int_value);
             return;
@@ -241,14 +246,199 @@ static void gen_serialisation(Context* ctx, BodyBuilder* bb, const Type* element
             const Node* offset = base_offset;
             for (size_t i = 0; i < components_count; i++) {
                 gen_serialisation(ctx, bb, component_type, arr, offset, gen_extract(bb, value, singleton(int32_literal(a, i))));
-                offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a))));
+                offset = gen_primop_e(bb, add_op, empty(a), mk_nodes(a, offset, bytes_to_words(bb, gen_primop_e(bb, size_of_op, singleton(component_type), empty(a)))));
+            }
+            return;
+        }
+        default: error("TODO");
+    }
+}
+
+/// memory_layout.c aligns every scalar to a word, but in arrays and packs the smaller ones end up sharing words
+static bool is_word_granular(IrArena* a, const Type* t) {
+    switch (t->tag) {
+        case Bool_TAG:
+        case Int_TAG:
+        case Float_TAG: return true;
+        case PtrType_TAG: return t->payload.ptr_type.address_space == AsGlobal;
+        case TypeDeclRef_TAG: return is_word_granular(a, get_maybe_nominal_type_body(t));
+        case RecordType_TAG: {
+            Nodes members = t->payload.record_type.members;
+            for (size_t i = 0; i < members.count; i++)
+                if (!is_word_granular(a, members.nodes[i]))
+                    return false;
+            return true;
+        }
+        case ArrType_TAG:
+        case PackType_TAG: {
+            const Node* size = get_fill_type_size(t);
+            const Type* element_type = get_fill_type_element_type(t);
+            if (!size || !resolve_to_int_literal(size) || !is_word_granular(a, element_type))
+                return false;
+            return get_mem_layout(a, element_type).size_in_bytes % int_size_in_bytes(a->config.memory.word_size) == 0;
+        }
+        default: return false;
+    }
+}
+
+static size_t get_size_in_words(IrArena* a, const Type* t) {
+    size_t word_size = int_size_in_bytes(a->config.memory.word_size);
+    return (get_mem_layout(a, t).size_in_bytes + word_size - 1) / word_size;
+}
+
+static const Node* gen_word_ptr(Context* ctx, BodyBuilder* bb, const Node* arr, const Node* base_offset, size_t i) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* offset = i == 0 ? base_offset : gen_primop_e(bb, add_op, empty(a), mk_nodes(a, base_offset, size_t_literal(a, i)));
+    return gen_primop_ce(bb, lea_op, 3, (const Node* []) { arr, size_t_literal(a, 0), offset });
+}
+
+/// The words of a value being loaded, they are only loaded once something actually uses them so the padding is skipped
+typedef struct {
+    const Node* arr;
+    const Node* base_offset;
+    const Node** words;
+} LoadedWords;
+
+static const Node* get_loaded_word(Context* ctx, BodyBuilder* bb, LoadedWords* loaded, size_t i) {
+    if (!loaded->words[i])
+        loaded->words[i] = gen_load(bb, gen_word_ptr(ctx, bb, loaded->arr, loaded->base_offset, i));
+    return loaded->words[i];
+}
+
+/// Builds a value out of the words it's made of, using the offsets get_mem_layout gives us rather than computing them
+static const Node* gen_decode_words(Context* ctx, BodyBuilder* bb, const Type* element_type, LoadedWords* loaded, size_t offset) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    switch (element_type->tag) {
+        case Bool_TAG: return gen_primop_e(bb, neq_op, empty(a), mk_nodes(a, get_loaded_word(ctx, bb, loaded, offset), int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size })));
+        case PtrType_TAG: {
+            const Type* ptr_int_t = int_type(a, (Int) {.width = a->config.memory.ptr_size, .is_signed = false });
+            return gen_reinterpret_cast(bb, element_type, gen_decode_words(ctx, bb, ptr_int_t, loaded, offset));
+        }
+        case Int_TAG: {
+            const Type* unsigned_t = int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = false });
+            size_t word_bitwidth = int_size_in_bytes(a->config.memory.word_size) * 8;
+            const Node* acc = NULL;
+            for (size_t i = 0; i < get_size_in_words(a, element_type); i++) {
+                const Node* word = gen_conversion(bb, unsigned_t, get_loaded_word(ctx, bb, loaded, offset + i));
+                if (i > 0)
+                    word = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, word, int_literal(a, (IntLiteral) { .width = unsigned_t->payload.int_type.width, .value = i * word_bitwidth })));
+                acc = acc ? gen_primop_e(bb, or_op, empty(a), mk_nodes(a, acc, word)) : word;
+            }
+            return gen_reinterpret_cast(bb, element_type, acc);
+        }
+        case Float_TAG: {
+            const Type* unsigned_int_t = int_type(a, (Int) {.width = float_to_int_width(element_type->payload.float_type.width), .is_signed = false });
+            return gen_reinterpret_cast(bb, element_type, gen_decode_words(ctx, bb, unsigned_int_t, loaded, offset));
+        }
+        case TypeDeclRef_TAG:
+        case RecordType_TAG: {
+            const Type* record_t = get_maybe_nominal_type_body(element_type);
+            Nodes member_types = record_t->payload.record_type.members;
+            LARRAY(FieldLayout, fields, member_types.count);
+            get_record_layout(a, record_t, fields);
+            LARRAY(const Node*, members, member_types.count);
+            for (size_t i = 0; i < member_types.count; i++)
+                members[i] = gen_decode_words(ctx, bb, member_types.nodes[i], loaded, offset + bytes_to_words_static(a, fields[i].offset_in_bytes));
+            return composite_helper(a, element_type, nodes(a, member_types.count, members));
+        }
+        case ArrType_TAG:
+        case PackType_TAG: {
+            size_t components_count = get_int_literal_value(*resolve_to_int_literal(get_fill_type_size(element_type)), false);
+            const Type* component_type = get_fill_type_element_type(element_type);
+            size_t stride = get_size_in_words(a, component_type);
+            LARRAY(const Node*, components, components_count);
+            for (size_t i = 0; i < components_count; i++)
+                components[i] = gen_decode_words(ctx, bb, component_type, loaded, offset + i * stride);
+            return composite_helper(a, element_type, nodes(a, components_count, components));
+        }
+        default: error("TODO");
+    }
+}
+
+/// The reverse of gen_decode_words
+static void gen_encode_words(Context* ctx, BodyBuilder* bb, const Type* element_type, const Node* value, const Node** words) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* word_t = int_type(a, (Int) { .width = a->config.memory.word_size, .is_signed = false });
+    switch (element_type->tag) {
+        case Bool_TAG: {
+            words[0] = gen_primop_e(bb, select_op, empty(a), mk_nodes(a, value, int_literal(a, (IntLiteral) { .value = 1, .width = a->config.memory.word_size }), int_literal(a, (IntLiteral) { .value = 0, .width = a->config.memory.word_size })));
+            return;
+        }
+        case PtrType_TAG: {
+            const Type* ptr_int_t = int_type(a, (Int) {.width = a->config.memory.ptr_size, .is_signed = false });
+            return gen_encode_words(ctx, bb, ptr_int_t, gen_reinterpret_cast(bb, ptr_int_t, value), words);
+        }
+        case Int_TAG: {
+            // bitcast to unsigned first, so we get zero-extension and not sign-extension
+            const Type* unsigned_t = int_type(a, (Int) { .width = element_type->payload.int_type.width, .is_signed = false });
+            value = convert_int_extend_according_to_src_t(bb, unsigned_t, value);
+            size_t word_bitwidth = int_size_in_bytes(a->config.memory.word_size) * 8;
+            for (size_t i = 0; i < get_size_in_words(a, element_type); i++) {
+                const Node* word = value;
+                if (i > 0)
+                    word = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, word, int_literal(a, (IntLiteral) { .width = unsigned_t->payload.int_type.width, .value = i * word_bitwidth })));
+                words[i] = gen_conversion(bb, word_t, word);
             }
             return;
         }
+        case Float_TAG: {
+            const Type* unsigned_int_t = int_type(a, (Int) {.width = float_to_int_width(element_type->payload.float_type.width), .is_signed = false });
+            return gen_encode_words(ctx, bb, unsigned_int_t, gen_reinterpret_cast(bb, unsigned_int_t, value), words);
+        }
+        case TypeDeclRef_TAG:
+        case RecordType_TAG: {
+            const Type* record_t = get_maybe_nominal_type_body(element_type);
+            Nodes member_types = record_t->payload.record_type.members;
+            LARRAY(FieldLayout, fields, member_types.count);
+            get_record_layout(a, record_t, fields);
+            for (size_t i = 0; i < member_types.count; i++)
+                gen_encode_words(ctx, bb, member_types.nodes[i], gen_extract(bb, value, singleton(int32_literal(a, i))), &words[bytes_to_words_static(a, fields[i].offset_in_bytes)]);
+            return;
+        }
+        case ArrType_TAG:
+        case PackType_TAG: {
+            size_t components_count = get_int_literal_value(*resolve_to_int_literal(get_fill_type_size(element_type)), false);
+            const Type* component_type = get_fill_type_element_type(element_type);
+            size_t stride = get_size_in_words(a, component_type);
+            for (size_t i = 0; i < components_count; i++)
+                gen_encode_words(ctx, bb, component_type, gen_extract(bb, value, singleton(int32_literal(a, i))), &words[i * stride]);
+            return;
+        }
         default: error("TODO");
     }
 }
 
+/// Whether the value can be moved as one block of words at constant offsets from the address, instead of field by field
+static bool can_coalesce(Context* ctx, const Type* element_type) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    // the traces are per scalar
+    if (!ctx->config->optimisations.coalesce_emulated_memory || ctx->config->printf_trace.memory_accesses)
+        return false;
+    return is_word_granular(a, element_type) && get_size_in_words(a, element_type) <= MaxCoalescedWords;
+}
+
+static const Node* gen_coalesced_deserialisation(Context* ctx, BodyBuilder* bb, const Type* element_type, const Node* arr, const Node* base_offset) {
+    size_t words_count = get_size_in_words(ctx->rewriter.dst_arena, element_type);
+    LARRAY(const Node*, words, words_count);
+    for (size_t i = 0; i < words_count; i++)
+        words[i] = NULL;
+    LoadedWords loaded = { .arr = arr, .base_offset = base_offset, .words = words };
+    return gen_decode_words(ctx, bb, element_type, &loaded, 0);
+}
+
+static void gen_coalesced_serialisation(Context* ctx, BodyBuilder* bb, const Type* element_type, const Node* arr, const Node* base_offset, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    size_t words_count = get_size_in_words(a, element_type);
+    LARRAY(const Node*, words, words_count);
+    // padding is left untouched
+    for (size_t i = 0; i < words_count; i++)
+        words[i] = NULL;
+    gen_encode_words(ctx, bb, element_type, value, words);
+    for (size_t i = 0; i < words_count; i++)
+        if (words[i])
+            gen_store(bb, gen_word_ptr(ctx, bb, arr, base_offset, i), words[i]);
+}
+
 static const Node* gen_serdes_fn(Context* ctx, const Type* element_type, bool uniform_address, bool ser, AddressSpace as) {
     assert(is_as_emulated(ctx, as));
     struct Dict* cache;
@@ -282,10 +472,13 @@ static const Node* gen_serdes_fn(Context* ctx, const Type* element_type, bool un
     const Node* address = bytes_to_words(bb, address_param);
     const Node* base = *get_emulated_as_word_array(ctx, as);
     if (ser) {
-        gen_serialisation(ctx, bb, element_type, base, address, value_param);
+        if (can_coalesce(ctx, element_type))
+            gen_coalesced_serialisation(ctx, bb, element_type, base, address, value_param);
+        else
+            gen_serialisation(ctx, bb, element_type, base, address, value_param);
         fun->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fun, .args = empty(a) }));
     } else {
-        const Node* loaded_value = gen_deserialisation(ctx, bb, element_type, base, address);
+        const Node* loaded_value = can_coalesce(ctx, element_type) ? gen_coalesced_deserialisation(ctx, bb, element_type, base, address) : gen_deserialisation(ctx, bb, element_type, base, address);
         assert(loaded_value);
         fun->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fun, .args = singleton(loaded_value) }));
     }
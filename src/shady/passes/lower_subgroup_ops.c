@@ -9,10 +9,35 @@
 #include "../transform/ir_gen_helpers.h"
 #include "../transform/memory_layout.h"
 
+// Subgroup ops the target can't do on a given type are turned into calls to generated functions, one per op and type.
+// Broadcasts and shuffles of types the target can't move between lanes are split into ones it can, reductions and scans
+// of composites are done one element at a time. With emulate_subgroup_ops, reductions, scans and shuffles are built
+// out of exchanges between lanes instead: native shuffles when there are some, a scratchpad in subgroup memory otherwise.
+// The emulation expects the whole subgroup to be active. broadcast_first needs to know which lanes are, so it's left alone.
+
+/// Past this many lanes, reading every other lane's value out of subgroup memory costs more than the barriers around log2(n) exchanges
+#define MAX_LINEAR_SCRATCHPAD_LANES 16
+
+typedef struct {
+    Op op;
+    const Type* t;
+} FnKey;
+
+static KeyHash hash_fn_key(FnKey* key) {
+    return hash_murmur(&key->op, sizeof(Op)) ^ hash_murmur(&key->t, sizeof(const Type*));
+}
+
+static bool compare_fn_keys(FnKey* a, FnKey* b) {
+    return a->op == b->op && a->t == b->t;
+}
+
 typedef struct {
     Rewriter rewriter;
     const CompilerConfig* config;
+    /// FnKey -> the generated function doing that op on that type
     struct Dict* fns;
+    /// type -> subgroup variable the emulation exchanges values of that type through
+    struct Dict* scratchpads;
 } Context;
 
 static bool is_extended_type(SHADY_UNUSED IrArena* a, const Type* t, bool allow_vectors) {
@@ -39,86 +64,342 @@ static bool is_supported_natively(Context* ctx, const Type* element_type) {
     return false;
 }
 
-static const Node* build_subgroup_first(Context* ctx, BodyBuilder* bb, const Node* src);
+static bool is_composite(const Type* t) {
+    t = get_maybe_nominal_type_body(t);
+    return t->tag == RecordType_TAG || t->tag == ArrType_TAG;
+}
+
+static bool is_emulated(Context* ctx, Op op) {
+    if (!ctx->config->lower.emulate_subgroup_ops)
+        return false;
+    switch (op) {
+        case subgroup_broadcast_first_op: return false;
+        case subgroup_shuffle_op: return !ctx->config->lower.native_subgroup_shuffles;
+        default: return true;
+    }
+}
 
-static const Node* generate(Context* ctx, BodyBuilder* bb, const Node* t, const Node* param) {
+static bool needs_lowering(Context* ctx, Op op, const Type* t) {
+    if (is_emulated(ctx, op))
+        return true;
+    switch (op) {
+        case subgroup_broadcast_first_op:
+        case subgroup_shuffle_op: return !is_supported_natively(ctx, t);
+        // the native reductions and scans only take scalars and vectors
+        default: return is_composite(t);
+    }
+}
+
+static bool is_result_uniform(Op op) {
+    switch (op) {
+        case subgroup_scan_inclusive_sum_op:
+        case subgroup_scan_exclusive_sum_op:
+        case subgroup_shuffle_op: return false;
+        default: return true;
+    }
+}
+
+static Op get_combining_op(Op op) {
+    switch (op) {
+        case subgroup_reduce_sum_op:
+        case subgroup_scan_inclusive_sum_op:
+        case subgroup_scan_exclusive_sum_op: return add_op;
+        case subgroup_reduce_min_op: return min_op;
+        case subgroup_reduce_max_op: return max_op;
+        case subgroup_reduce_and_op: return and_op;
+        case subgroup_reduce_or_op: return or_op;
+        case subgroup_reduce_xor_op: return xor_op;
+        default: error("not a reduction or a scan");
+    }
+}
+
+/// Log-step algorithms take log2(n) exchanges, linear ones read all n lanes out of one. With native shuffles fewer exchanges
+/// always win, through subgroup memory the barriers around every exchange only pay off on large subgroups.
+static bool use_log_steps(Context* ctx) {
+    size_t n = ctx->config->specialization.subgroup_size;
+    // only powers of two pair up evenly
+    if ((n & (n - 1)) != 0)
+        return false;
+    if (ctx->config->lower.native_subgroup_shuffles)
+        return true;
+    return n > MAX_LINEAR_SCRATCHPAD_LANES;
+}
+
+static const Node* gen_subgroup_op(Context* ctx, BodyBuilder* bb, Op op, const Node* value, const Node* lane);
+
+/// Lanes see each other's value through native shuffles, or through what every lane wrote to the scratchpad
+typedef struct {
+    const Node* value;
+    /// NULL with native shuffles
+    const Node* scratchpad;
+} Exchange;
+
+static const Node* get_scratchpad(Context* ctx, const Type* t) {
     IrArena* a = ctx->rewriter.dst_arena;
-    const Type* original_t = t;
-    t = get_maybe_nominal_type_body(t);
+    Node** found = find_value_dict(const Node*, Node*, ctx->scratchpads, t);
+    if (found)
+        return ref_decl_helper(a, *found);
+
+    Nodes annotations = mk_nodes(a, annotation(a, (Annotation) { .name = "Generated" }), annotation(a, (Annotation) { .name = "Logical" }));
+    const Type* arr_t = arr_type(a, (ArrType) { .element_type = t, .size = uint32_literal(a, ctx->config->specialization.subgroup_size) });
+    Node* scratchpad = global_var(ctx->rewriter.dst_module, annotations, arr_t, format_string_interned(a, "subgroup_scratchpad_%s", name_type_safe(a, t)), AsSubgroup);
+    insert_dict(const Node*, Node*, ctx->scratchpads, t, scratchpad);
+    return ref_decl_helper(a, scratchpad);
+}
+
+static Exchange gen_publish(Context* ctx, BodyBuilder* bb, const Node* local_id, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Exchange ex = { .value = value };
+    if (ctx->config->lower.native_subgroup_shuffles)
+        return ex;
+    ex.scratchpad = get_scratchpad(ctx, get_unqualified_type(value->type));
+    gen_store(bb, gen_lea(bb, ex.scratchpad, int32_literal(a, 0), singleton(local_id)), value);
+    gen_primop(bb, subgroup_barrier_op, empty(a), empty(a));
+    return ex;
+}
+
+static const Node* gen_read_lane(Context* ctx, BodyBuilder* bb, Exchange ex, const Node* lane) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (!ex.scratchpad)
+        return gen_subgroup_op(ctx, bb, subgroup_shuffle_op, ex.value, lane);
+    return gen_load(bb, gen_lea(bb, ex.scratchpad, int32_literal(a, 0), singleton(lane)));
+}
+
+/// The next exchange can't write to the scratchpad before every lane is done reading from it
+static void gen_retire(Context* ctx, BodyBuilder* bb, Exchange ex) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (ex.scratchpad)
+        gen_primop(bb, subgroup_barrier_op, empty(a), empty(a));
+}
+
+/// Takes the element straight out of the composites built here, instead of extracting it back
+static const Node* gen_element(BodyBuilder* bb, const Node* value, size_t i) {
+    if (value->tag == Composite_TAG)
+        return value->payload.composite.contents.nodes[i];
+    return gen_extract(bb, value, singleton(uint32_literal(value->arena, i)));
+}
+
+static const Node* gen_combine(Context* ctx, BodyBuilder* bb, Op op, const Node* lhs, const Node* rhs) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* t = get_unqualified_type(lhs->type);
+    if (is_composite(t)) {
+        Nodes element_types = get_composite_type_element_types(get_maybe_nominal_type_body(t));
+        LARRAY(const Node*, elements, element_types.count);
+        for (size_t i = 0; i < element_types.count; i++) {
+            elements[i] = gen_combine(ctx, bb, op, gen_element(bb, lhs, i), gen_element(bb, rhs, i));
+        }
+        return composite_helper(a, t, nodes(a, element_types.count, elements));
+    }
+    return gen_primop_e(bb, op, empty(a), mk_nodes(a, lhs, rhs));
+}
+
+static const Node* gen_select(Context* ctx, BodyBuilder* bb, const Node* condition, const Node* if_true, const Node* if_false) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* t = get_unqualified_type(if_true->type);
+    if (is_composite(t)) {
+        Nodes element_types = get_composite_type_element_types(get_maybe_nominal_type_body(t));
+        LARRAY(const Node*, elements, element_types.count);
+        for (size_t i = 0; i < element_types.count; i++) {
+            elements[i] = gen_select(ctx, bb, condition, gen_element(bb, if_true, i), gen_element(bb, if_false, i));
+        }
+        return composite_helper(a, t, nodes(a, element_types.count, elements));
+    }
+    return gen_primop_e(bb, select_op, empty(a), mk_nodes(a, condition, if_true, if_false));
+}
+
+/// Lanes below `distance` read from themselves, and are expected to throw it away
+static const Node* gen_lane_below(Context* ctx, BodyBuilder* bb, const Node* local_id, const Node* has_one, size_t distance) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node* below = gen_primop_e(bb, sub_op, empty(a), mk_nodes(a, local_id, uint32_literal(a, distance)));
+    return gen_primop_e(bb, select_op, empty(a), mk_nodes(a, has_one, below, local_id));
+}
+
+static const Node* gen_emulated_scan(Context* ctx, BodyBuilder* bb, Op op, const Node* local_id, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    size_t n = ctx->config->specialization.subgroup_size;
+    Op combining_op = get_combining_op(op);
+    bool inclusive = op == subgroup_scan_inclusive_sum_op;
+    // this is the identity for sums only
+    const Node* identity = get_default_zero_value(a, get_unqualified_type(value->type));
+
+    if (use_log_steps(ctx)) {
+        // Hillis-Steele: every round, each lane takes in what the lane `distance` below it has accumulated so far
+        const Node* acc = value;
+        for (size_t distance = 1; distance < n; distance *= 2) {
+            const Node* has_partner = gen_primop_e(bb, gte_op, empty(a), mk_nodes(a, local_id, uint32_literal(a, distance)));
+            Exchange ex = gen_publish(ctx, bb, local_id, acc);
+            const Node* partner = gen_read_lane(ctx, bb, ex, gen_lane_below(ctx, bb, local_id, has_partner, distance));
+            gen_retire(ctx, bb, ex);
+            acc = gen_select(ctx, bb, has_partner, gen_combine(ctx, bb, combining_op, partner, acc), acc);
+        }
+        if (inclusive)
+            return acc;
+
+        // an exclusive scan is the inclusive one, shifted up a lane
+        const Node* has_previous = gen_primop_e(bb, gte_op, empty(a), mk_nodes(a, local_id, uint32_literal(a, 1)));
+        Exchange ex = gen_publish(ctx, bb, local_id, acc);
+        const Node* previous = gen_read_lane(ctx, bb, ex, gen_lane_below(ctx, bb, local_id, has_previous, 1));
+        gen_retire(ctx, bb, ex);
+        return gen_select(ctx, bb, has_previous, previous, identity);
+    }
+
+    Exchange ex = gen_publish(ctx, bb, local_id, value);
+    const Node* acc = inclusive ? gen_read_lane(ctx, bb, ex, uint32_literal(a, 0)) : identity;
+    for (size_t i = inclusive ? 1 : 0; i < n; i++) {
+        // lanes only take in the ones below them, and themselves when the scan is inclusive
+        const Node* takes_it = gen_primop_e(bb, inclusive ? lte_op : lt_op, empty(a), mk_nodes(a, uint32_literal(a, i), local_id));
+        const Node* combined = gen_combine(ctx, bb, combining_op, acc, gen_read_lane(ctx, bb, ex, uint32_literal(a, i)));
+        acc = gen_select(ctx, bb, takes_it, combined, acc);
+    }
+    gen_retire(ctx, bb, ex);
+    return acc;
+}
+
+static const Node* gen_emulated_reduction(Context* ctx, BodyBuilder* bb, Op op, const Node* local_id, const Node* value) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    size_t n = ctx->config->specialization.subgroup_size;
+    Op combining_op = get_combining_op(op);
+
+    if (use_log_steps(ctx)) {
+        // butterfly: pairs of lanes swap their partial results, so every lane ends up with all of them, in the same order
+        const Node* acc = value;
+        for (size_t distance = n / 2; distance > 0; distance /= 2) {
+            const Node* partner_lane = gen_primop_e(bb, xor_op, empty(a), mk_nodes(a, local_id, uint32_literal(a, distance)));
+            Exchange ex = gen_publish(ctx, bb, local_id, acc);
+            const Node* partner = gen_read_lane(ctx, bb, ex, partner_lane);
+            gen_retire(ctx, bb, ex);
+            acc = gen_combine(ctx, bb, combining_op, acc, partner);
+        }
+        return acc;
+    }
+
+    Exchange ex = gen_publish(ctx, bb, local_id, value);
+    const Node* acc = gen_read_lane(ctx, bb, ex, uint32_literal(a, 0));
+    for (size_t i = 1; i < n; i++)
+        acc = gen_combine(ctx, bb, combining_op, acc, gen_read_lane(ctx, bb, ex, uint32_literal(a, i)));
+    gen_retire(ctx, bb, ex);
+    return acc;
+}
+
+static const Node* gen_emulated(Context* ctx, BodyBuilder* bb, Op op, const Node* value, const Node* lane) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (ctx->config->specialization.subgroup_size == 1) {
+        if (op == subgroup_scan_exclusive_sum_op)
+            return get_default_zero_value(a, get_unqualified_type(value->type));
+        return value;
+    }
+
+    const Node* local_id = gen_builtin_load(ctx->rewriter.dst_module, bb, BuiltinSubgroupLocalInvocationId);
+    switch (op) {
+        case subgroup_shuffle_op: {
+            Exchange ex = gen_publish(ctx, bb, local_id, value);
+            const Node* result = gen_read_lane(ctx, bb, ex, lane);
+            gen_retire(ctx, bb, ex);
+            return result;
+        }
+        case subgroup_scan_inclusive_sum_op:
+        case subgroup_scan_exclusive_sum_op: return gen_emulated_scan(ctx, bb, op, local_id, value);
+        default: return gen_emulated_reduction(ctx, bb, op, local_id, value);
+    }
+}
+
+/// Does the op on parts of the value the target can deal with
+static const Node* gen_split(Context* ctx, BodyBuilder* bb, Op op, const Node* value, const Node* lane) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* original_t = get_unqualified_type(value->type);
+    const Type* t = get_maybe_nominal_type_body(original_t);
     switch (is_type(t)) {
         case Type_ArrType_TAG:
-        case Type_RecordType_TAG: {
-            assert(t->payload.record_type.special == 0);
+        case Type_RecordType_TAG:
+        case Type_PackType_TAG: {
+            assert(t->tag != RecordType_TAG || t->payload.record_type.special == 0);
             Nodes element_types = get_composite_type_element_types(t);
             LARRAY(const Node*, elements, element_types.count);
-            for (size_t i = 0; i < element_types.count; i++) {
-                const Node* e = gen_extract(bb, param, singleton(uint32_literal(a, i)));
-                elements[i] = build_subgroup_first(ctx, bb, e);
-            }
+            for (size_t i = 0; i < element_types.count; i++)
+                elements[i] = gen_subgroup_op(ctx, bb, op, gen_element(bb, value, i), lane);
             return composite_helper(a, original_t, nodes(a, element_types.count, elements));
         }
+        // only broadcasts and shuffles get here from now on: they just move bits around
         case Type_Int_TAG: {
             if (t->payload.int_type.width == IntTy64) {
-                const Node* hi = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, param, int32_literal(a, 32)));
+                const Node* hi = gen_primop_e(bb, rshift_logical_op, empty(a), mk_nodes(a, value, int32_literal(a, 32)));
                 hi = convert_int_zero_extend(bb, int32_type(a), hi);
-                const Node* lo = convert_int_zero_extend(bb, int32_type(a), param);
-                hi = build_subgroup_first(ctx, bb, hi);
-                lo = build_subgroup_first(ctx, bb, lo);
+                const Node* lo = convert_int_zero_extend(bb, int32_type(a), value);
+                hi = gen_subgroup_op(ctx, bb, op, hi, lane);
+                lo = gen_subgroup_op(ctx, bb, op, lo, lane);
                 const Node* it = int_type(a, (Int) { .width = IntTy64, .is_signed = t->payload.int_type.is_signed });
                 hi = convert_int_zero_extend(bb, it, hi);
                 lo = convert_int_zero_extend(bb, it, lo);
                 hi = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, hi, int32_literal(a, 32)));
                 return gen_primop_e(bb, or_op, empty(a), mk_nodes(a, lo, hi));
             }
-            break;
+            const Node* word = convert_int_zero_extend(bb, uint32_type(a), value);
+            return gen_conversion(bb, t, gen_subgroup_op(ctx, bb, op, word, lane));
+        }
+        case Type_Float_TAG: {
+            IntSizes width;
+            switch (t->payload.float_type.width) {
+                case FloatTy16: width = IntTy16; break;
+                case FloatTy32: width = IntTy32; break;
+                case FloatTy64: width = IntTy64; break;
+                default: error("unknown float width");
+            }
+            const Node* bits = gen_reinterpret_cast(bb, int_type_helper(a, false, width), value);
+            return gen_reinterpret_cast(bb, t, gen_subgroup_op(ctx, bb, op, bits, lane));
+        }
+        case Type_Bool_TAG: {
+            const Node* word = gen_primop_e(bb, select_op, empty(a), mk_nodes(a, value, uint32_literal(a, 1), uint32_literal(a, 0)));
+            word = gen_subgroup_op(ctx, bb, op, word, lane);
+            return gen_primop_e(bb, neq_op, empty(a), mk_nodes(a, word, uint32_literal(a, 0)));
         }
         case Type_PtrType_TAG: {
-            param = gen_reinterpret_cast(bb, uint64_type(a), param);
-            return gen_reinterpret_cast(bb, t, generate(ctx, bb, uint64_type(a), param));
+            value = gen_reinterpret_cast(bb, uint64_type(a), value);
+            return gen_reinterpret_cast(bb, t, gen_subgroup_op(ctx, bb, op, value, lane));
         }
         default: break;
     }
-    return NULL;
-}
-
-static void build_fn_body(Context* ctx, Node* fn, const Node* param, const Type* t) {
-    IrArena* a = ctx->rewriter.dst_arena;
-    BodyBuilder* bb = begin_body(a);
-    const Node* result = generate(ctx, bb, t, param);
-    if (result) {
-        fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) {
-            .fn = fn,
-            .args = singleton(result)
-        }));
-        return;
-    }
 
-    log_string(ERROR, "subgroup_first emulation is not supported for ");
-    log_node(ERROR, t);
+    log_string(ERROR, "%s emulation is not supported for ", get_primop_name(op));
+    log_node(ERROR, original_t);
     log_string(ERROR, ".\n");
     error_die();
+    SHADY_UNREACHABLE;
 }
 
-static const Node* build_subgroup_first(Context* ctx, BodyBuilder* bb, const Node* src) {
+static Node* get_fn(Context* ctx, Op op, const Type* t) {
     IrArena* a = ctx->rewriter.dst_arena;
-    Module* m = ctx->rewriter.dst_module;
-    const Node* t =  get_unqualified_type(src->type);
-    if (is_supported_natively(ctx, t))
-        return gen_primop_e(bb, subgroup_broadcast_first_op, empty(a), singleton(src));
-
-    Node* fn = NULL;
-    Node** found = find_value_dict(const Node*, Node*, ctx->fns, t);
+    FnKey key = { op, t };
+    Node** found = find_value_dict(FnKey, Node*, ctx->fns, key);
     if (found)
-        fn = *found;
-    else {
-        const Node* src_param = param(a, qualified_type_helper(t, false), "src");
-        fn = function(m, singleton(src_param), format_string_interned(a, "subgroup_first_%s", name_type_safe(a, t)),
-                      singleton(annotation(a, (Annotation) { .name = "Generated"})), singleton(qualified_type_helper(t, true)));
-        insert_dict(const Node*, Node*, ctx->fns, t, fn);
-        build_fn_body(ctx, fn, src_param, t);
-    }
+        return *found;
+
+    bool uniform_result = is_result_uniform(op);
+    const Node* value_param = param(a, qualified_type_helper(t, false), "value");
+    const Node* lane_param = op == subgroup_shuffle_op ? param(a, qualified_type_helper(uint32_type(a), false), "lane") : NULL;
+    Nodes params = lane_param ? mk_nodes(a, value_param, lane_param) : singleton(value_param);
+    Node* fn = function(ctx->rewriter.dst_module, params, format_string_interned(a, "%s_%s", get_primop_name(op), name_type_safe(a, t)),
+                        singleton(annotation(a, (Annotation) { .name = "Generated" })), singleton(qualified_type_helper(t, uniform_result)));
+    insert_dict(FnKey, Node*, ctx->fns, key, fn);
+
+    BodyBuilder* bb = begin_body(a);
+    const Node* result = is_emulated(ctx, op) ? gen_emulated(ctx, bb, op, value_param, lane_param) : gen_split(ctx, bb, op, value_param, lane_param);
+    // the lanes computed the same thing, but the type system can't tell
+    if (uniform_result && !is_qualified_type_uniform(result->type))
+        result = gen_primop_e(bb, subgroup_assume_uniform_op, empty(a), singleton(result));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) {
+        .fn = fn,
+        .args = singleton(result)
+    }));
+    return fn;
+}
 
-    return first(gen_call(bb, fn_addr_helper(a, fn), singleton(src)));
+static const Node* gen_subgroup_op(Context* ctx, BodyBuilder* bb, Op op, const Node* value, const Node* lane) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* t = get_unqualified_type(value->type);
+    Nodes operands = lane ? mk_nodes(a, value, lane) : singleton(value);
+    if (!needs_lowering(ctx, op, t))
+        return gen_primop_e(bb, op, empty(a), operands);
+    return first(gen_call(bb, fn_addr_helper(a, get_fn(ctx, op, t)), operands));
 }
 
 static const Node* process(Context* ctx, const Node* node) {
@@ -132,10 +413,26 @@ static const Node* process(Context* ctx, const Node* node) {
         case PrimOp_TAG: {
             PrimOp payload = node->payload.prim_op;
             switch (payload.op) {
-                case subgroup_broadcast_first_op: {
+                case subgroup_broadcast_first_op:
+                case subgroup_reduce_sum_op:
+                case subgroup_reduce_min_op:
+                case subgroup_reduce_max_op:
+                case subgroup_reduce_and_op:
+                case subgroup_reduce_or_op:
+                case subgroup_reduce_xor_op:
+                case subgroup_scan_inclusive_sum_op:
+                case subgroup_scan_exclusive_sum_op:
+                case subgroup_shuffle_op: {
+                    const Node* value = rewrite_node(r, first(payload.operands));
+                    const Node* lane = payload.operands.count > 1 ? rewrite_node(r, payload.operands.nodes[1]) : NULL;
+                    if (!needs_lowering(ctx, payload.op, get_unqualified_type(value->type)))
+                        break;
                     BodyBuilder* bb = begin_body(a);
-                    return yield_values_and_wrap_in_block(bb, singleton(
-                            build_subgroup_first(ctx, bb, rewrite_node(r, first(payload.operands)))));
+                    const Node* result = gen_subgroup_op(ctx, bb, payload.op, value, lane);
+                    // a shuffle from a uniform lane is uniform, but the generated functions return varying values
+                    if (is_qualified_type_uniform(node->type) && !is_qualified_type_uniform(result->type))
+                        result = gen_primop_e(bb, subgroup_assume_uniform_op, empty(a), singleton(result));
+                    return yield_values_and_wrap_in_block(bb, singleton(result));
                 }
                 default: break;
             }
@@ -152,14 +449,15 @@ Module* lower_subgroup_ops(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
-    assert(!config->lower.emulate_subgroup_ops && "TODO");
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
         .config = config,
-        .fns =  new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node)
+        .fns = new_dict(FnKey, Node*, (HashFn) hash_fn_key, (CmpFn) compare_fn_keys),
+        .scratchpads = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node),
     };
     rewrite_module(&ctx.rewriter);
     destroy_rewriter(&ctx.rewriter);
     destroy_dict(ctx.fns);
+    destroy_dict(ctx.scratchpads);
     return dst;
 }
@@ -8,26 +8,67 @@
 #include "../rewrite.h"
 #include "../transform/ir_gen_helpers.h"
 
+#include <stdlib.h>
+
+enum {
+    /// A table costs a load, it's only worth it when it's reasonably full and saves a few levels of the tree
+    MinTableKeys = 4,
+    MinTableDensityPercent = 40,
+    MaxTableSize = 256,
+    /// Bit tests work on a single 32-bit mask per target
+    MinBitTestKeys = 3,
+    MaxBitTestSpan = 32,
+    MaxBitTestTargets = 3,
+};
+
+typedef struct {
+    size_t tables, bit_tests, ranges, native;
+} Stats;
+
 typedef struct {
     Rewriter rewriter;
+    const CompilerConfig* config;
+    Stats* stats;
 
     const Node* inspectee;
     const Node* run_default_case;
     Nodes yield_types;
 } Context;
 
+/// Keys are biased so that unsigned comparisons on them order signed inspectees correctly
+typedef struct {
+    uint64_t lo, hi;
+    const Node* lam;
+} CaseRange;
+
+typedef enum {
+    /// One run of contiguous keys sharing a target, the tree around it already does the range check
+    ClusterRange,
+    /// Up to MaxBitTestTargets targets, each gets a mask of the keys leading to it
+    ClusterBitTest,
+    /// Looks up which target to use in a constant array indexed by the key
+    ClusterTable,
+} ClusterKind;
+
+typedef struct {
+    ClusterKind kind;
+    uint64_t lo, hi;
+    const CaseRange* ranges;
+    size_t ranges_count;
+} Cluster;
+
 typedef struct TreeNode_ TreeNode;
 
 struct TreeNode_ {
     TreeNode* children[2];
     int depth;
     uint64_t key;
-    const Node* lam;
+    const Cluster* cluster;
 };
 
-const Node* find(TreeNode* tree, uint64_t value) {
-    if (tree->key == value)
-        return tree->lam;
+const Cluster* find(TreeNode* tree, uint64_t value) {
+    if (value >= tree->key && value <= tree->cluster->hi)
+        return tree->cluster;
     else if (value < tree->key && tree->children[0])
         return find(tree->children[0], value);
     else if (value > tree->key && tree->children[1])
@@ -77,6 +118,109 @@ TreeNode* insert(TreeNode* t, TreeNode* x) {
     return t;
 }
 
+static const Type* get_inspectee_type(Context* ctx) {
+    const Type* inspectee_t = ctx->inspectee->type;
+    deconstruct_qualified_type(&inspectee_t);
+    assert(inspectee_t->tag == Int_TAG);
+    return inspectee_t;
+}
+
+static uint64_t get_sign_bias(const Type* int_t) {
+    return int_t->payload.int_type.is_signed ? (uint64_t) 1 << 63 : 0;
+}
+
+static uint64_t get_key_mask(const Type* int_t) {
+    size_t width = get_type_bitwidth(int_t);
+    return width >= 64 ? UINT64_MAX : ((uint64_t) 1 << width) - 1;
+}
+
+static const Node* make_key_literal(Context* ctx, uint64_t key) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Type* inspectee_t = get_inspectee_type(ctx);
+    return int_literal(a, (IntLiteral) {
+        .width = inspectee_t->payload.int_type.width,
+        .is_signed = inspectee_t->payload.int_type.is_signed,
+        .value = (key ^ get_sign_bias(inspectee_t)) & get_key_mask(inspectee_t),
+    });
+}
+
+static size_t count_keys(const CaseRange* ranges, size_t count) {
+    size_t keys = 0;
+    for (size_t i = 0; i < count; i++)
+        keys += ranges[i].hi - ranges[i].lo + 1;
+    return keys;
+}
+
+/// Cases are not shared between keys, but the ones doing the exact same thing might as well be
+static bool is_same_target(const Node* a, const Node* b) {
+    if (a == b)
+        return true;
+    return a->payload.case_.params.count == 0 && b->payload.case_.params.count == 0 && a->payload.case_.body == b->payload.case_.body;
+}
+
+/// Whether ranges[i] is the first one going to its target
+static bool is_new_target(const CaseRange* ranges, size_t i) {
+    for (size_t j = 0; j < i; j++)
+        if (is_same_target(ranges[j].lam, ranges[i].lam))
+            return false;
+    return true;
+}
+
+/// Greedily groups the sorted ranges, preferring whichever of a bit test or a table covers the most keys
+static size_t plan_clusters(const CaseRange* ranges, size_t count, Cluster* clusters) {
+    size_t clusters_count = 0;
+    for (size_t i = 0; i < count;) {
+        size_t bit_test_end = i;
+        size_t targets = 1;
+        for (size_t j = i + 1; j < count; j++) {
+            targets += is_new_target(&ranges[i], j - i) ? 1 : 0;
+            if (ranges[j].hi - ranges[i].lo >= MaxBitTestSpan || targets > MaxBitTestTargets)
+                break;
+            bit_test_end = j;
+        }
+        size_t bit_test_keys = count_keys(&ranges[i], bit_test_end - i + 1);
+        if (bit_test_end == i || bit_test_keys < MinBitTestKeys)
+            bit_test_keys = 0;
+
+        size_t table_end = i;
+        size_t table_keys = 0;
+        size_t keys = ranges[i].hi - ranges[i].lo + 1;
+        targets = 1;
+        for (size_t j = i + 1; j < count; j++) {
+            uint64_t span = ranges[j].hi - ranges[i].lo;
+            if (span >= MaxTableSize)
+                break;
+            span++;
+            keys += ranges[j].hi - ranges[j].lo + 1;
+            targets += is_new_target(&ranges[i], j - i) ? 1 : 0;
+            // all distinct targets would just move the tree to the table indices
+            if (keys < MinTableKeys || keys * 100 < span * MinTableDensityPercent || targets * 2 > keys)
+                continue;
+            table_end = j;
+            table_keys = keys;
+        }
+
+        Cluster* cluster = &clusters[clusters_count++];
+        size_t end;
+        if (bit_test_keys > 0 && bit_test_keys >= table_keys) {
+            *cluster = (Cluster) { .kind = ClusterBitTest };
+            end = bit_test_end;
+        } else if (table_keys > 0) {
+            *cluster = (Cluster) { .kind = ClusterTable };
+            end = table_end;
+        } else {
+            *cluster = (Cluster) { .kind = ClusterRange };
+            end = i;
+        }
+        cluster->lo = ranges[i].lo;
+        cluster->hi = ranges[end].hi;
+        cluster->ranges = &ranges[i];
+        cluster->ranges_count = end - i + 1;
+        i = end + 1;
+    }
+    return clusters_count;
+}
+
 static const Node* generate_default_fallback_case(Context* ctx) {
     IrArena* a = ctx->rewriter.dst_arena;
     BodyBuilder* bb = begin_body(a);
@@ -94,38 +238,156 @@ static const Node* wrap_instr_in_lambda(const Node* instr) {
     return case_(a, empty(a), finish_body(bb, yield(a, (Yield) {.args = values})));
 }
 
-static const Node* generate_decision_tree(Context* ctx, TreeNode* n, uint64_t min, uint64_t max) {
+static const Node* generate_decision_tree(Context* ctx, TreeNode* n, uint64_t min, uint64_t max);
+
+/// The key's offset in the cluster, as a u32. The subtraction is done on the unsigned type of the same width, so it can't
+/// overflow and the result is zero-extended or truncated rather than sign-extended.
+static const Node* gen_cluster_offset(Context* ctx, BodyBuilder* bb, const Cluster* cluster) {
     IrArena* a = ctx->rewriter.dst_arena;
-    assert(n->key >= min && n->key <= max);
-    assert(n->lam);
+    const Type* inspectee_t = get_inspectee_type(ctx);
+    IntSizes width = inspectee_t->payload.int_type.width;
+    const Node* inspectee = ctx->inspectee;
+    if (inspectee_t->payload.int_type.is_signed)
+        inspectee = gen_reinterpret_cast(bb, int_type(a, (Int) { .width = width, .is_signed = false }), inspectee);
+    const Node* lo = int_literal(a, (IntLiteral) {
+        .width = width,
+        .is_signed = false,
+        .value = (cluster->lo ^ get_sign_bias(inspectee_t)) & get_key_mask(inspectee_t),
+    });
+    const Node* offset = gen_primop_e(bb, sub_op, empty(a), mk_nodes(a, inspectee, lo));
+    if (width != IntTy32)
+        offset = gen_conversion(bb, uint32_type(a), offset);
+    return offset;
+}
 
-    // instruction in case we match
-    const Node* body = n->lam;
+static const Node* generate_bit_test(Context* ctx, const Cluster* cluster) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    BodyBuilder* bb = begin_body(a);
+    const Node* bit = gen_primop_e(bb, lshift_op, empty(a), mk_nodes(a, uint32_literal(a, 1), gen_cluster_offset(ctx, bb, cluster)));
+
+    const Node* targets[MaxBitTestTargets];
+    uint32_t masks[MaxBitTestTargets];
+    size_t targets_count = 0;
+    for (size_t i = 0; i < cluster->ranges_count; i++) {
+        const CaseRange* range = &cluster->ranges[i];
+        size_t t = 0;
+        while (t < targets_count && !is_same_target(targets[t], range->lam))
+            t++;
+        if (t == targets_count) {
+            targets[targets_count] = range->lam;
+            masks[targets_count++] = 0;
+        }
+        // hi + 1 wraps around for the last key of a 64-bit inspectee
+        uint64_t count = range->hi - range->lo + 1;
+        for (uint64_t key = range->lo; key - range->lo < count; key++)
+            masks[t] |= (uint32_t) 1 << (key - cluster->lo);
+    }
 
-    const Type* inspectee_t = ctx->inspectee->type;
-    deconstruct_qualified_type(&inspectee_t);
-    assert(inspectee_t->tag == Int_TAG);
+    // without holes in the cluster, whatever isn't any of the other targets is the last one
+    bool full = count_keys(cluster->ranges, cluster->ranges_count) == cluster->hi - cluster->lo + 1;
+    const Node* body = full ? targets[targets_count - 1] : generate_default_fallback_case(ctx);
+    for (size_t t = targets_count - (full ? 1 : 0); t > 0; t--) {
+        BodyBuilder* test_bb = begin_body(a);
+        const Node* masked = gen_primop_e(test_bb, and_op, empty(a), mk_nodes(a, bit, uint32_literal(a, masks[t - 1])));
+        Nodes values = bind_instruction(test_bb, if_instr(a, (If) {
+            .yield_types = ctx->yield_types,
+            .condition = gen_primop_e(test_bb, neq_op, empty(a), mk_nodes(a, masked, uint32_literal(a, 0))),
+            .if_true = targets[t - 1],
+            .if_false = body,
+        }));
+        body = case_(a, empty(a), finish_body(test_bb, yield(a, (Yield) {.args = values})));
+    }
+    Nodes values = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx->yield_types, false), .inside = body }));
+    return case_(a, empty(a), finish_body(bb, yield(a, (Yield) {.args = values})));
+}
+
+/// Looks up the index of the target in a table, then dispatches on that with a tree over the distinct targets
+static const Node* generate_table(Context* ctx, const Cluster* cluster) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    BodyBuilder* bb = begin_body(a);
+
+    size_t size = cluster->hi - cluster->lo + 1;
+    LARRAY(const Node*, entries, size);
+    for (size_t i = 0; i < size; i++)
+        entries[i] = uint32_literal(a, 0);
+    LARRAY(CaseRange, targets, cluster->ranges_count);
+    size_t targets_count = 0;
+    for (size_t i = 0; i < cluster->ranges_count; i++) {
+        const CaseRange* range = &cluster->ranges[i];
+        size_t t = 0;
+        while (t < targets_count && !is_same_target(targets[t].lam, range->lam))
+            t++;
+        if (t == targets_count) {
+            // 0 is left for the holes
+            targets[targets_count] = (CaseRange) { .lo = t + 1, .hi = t + 1, .lam = range->lam };
+            targets_count++;
+        }
+        uint64_t count = range->hi - range->lo + 1;
+        for (uint64_t key = range->lo; key - range->lo < count; key++)
+            entries[key - cluster->lo] = uint32_literal(a, t + 1);
+    }
+
+    const Type* table_t = arr_type(a, (ArrType) { .element_type = uint32_type(a), .size = uint32_literal(a, size) });
+    const Node* table = composite_helper(a, table_t, nodes(a, size, entries));
+    const Node* target_index = gen_primop_e(bb, extract_dynamic_op, empty(a), mk_nodes(a, table, gen_cluster_offset(ctx, bb, cluster)));
+
+    Arena* arena = new_arena();
+    TreeNode* root = NULL;
+    LARRAY(Cluster, clusters, targets_count);
+    for (size_t i = 0; i < targets_count; i++) {
+        clusters[i] = (Cluster) { .kind = ClusterRange, .lo = targets[i].lo, .hi = targets[i].hi, .ranges = &targets[i], .ranges_count = 1 };
+        TreeNode* t = arena_alloc(arena, sizeof(TreeNode));
+        t->key = clusters[i].lo;
+        t->cluster = &clusters[i];
+        root = insert(root, t);
+    }
+
+    Context table_ctx = *ctx;
+    table_ctx.inspectee = target_index;
+    bool full = count_keys(cluster->ranges, cluster->ranges_count) == size;
+    const Node* body = generate_decision_tree(&table_ctx, root, full ? 1 : 0, targets_count);
+    destroy_arena(arena);
+
+    Nodes values = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx->yield_types, false), .inside = body }));
+    return case_(a, empty(a), finish_body(bb, yield(a, (Yield) {.args = values})));
+}
+
+static const Node* generate_cluster(Context* ctx, const Cluster* cluster) {
+    switch (cluster->kind) {
+        case ClusterRange: return cluster->ranges[0].lam;
+        case ClusterBitTest: return generate_bit_test(ctx, cluster);
+        case ClusterTable: return generate_table(ctx, cluster);
+    }
+    SHADY_UNREACHABLE;
+}
+
+/// The keys in [min, max] are the ones the parent nodes did not rule out yet
+static const Node* generate_decision_tree(Context* ctx, TreeNode* n, uint64_t min, uint64_t max) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Cluster* cluster = n->cluster;
+    assert(cluster->lo >= min && cluster->hi <= max);
 
-    const Node* pivot = int_literal(a, (IntLiteral) { .width = inspectee_t->payload.int_type.width, .is_signed = inspectee_t->payload.int_type.is_signed, .value = n->key });
+    // instruction in case we match
+    const Node* body = generate_cluster(ctx, cluster);
 
-    if (min < n->key) {
+    if (min < cluster->lo) {
         BodyBuilder* bb = begin_body(a);
         const Node* instr = if_instr(a, (If) {
             .yield_types = ctx->yield_types,
-            .condition = gen_primop_e(bb, lt_op, empty(a), mk_nodes(a, ctx->inspectee, pivot)),
-            .if_true = n->children[0] ? generate_decision_tree(ctx, n->children[0], min, n->key - 1) : generate_default_fallback_case(ctx),
+            .condition = gen_primop_e(bb, lt_op, empty(a), mk_nodes(a, ctx->inspectee, make_key_literal(ctx, cluster->lo))),
+            .if_true = n->children[0] ? generate_decision_tree(ctx, n->children[0], min, cluster->lo - 1) : generate_default_fallback_case(ctx),
             .if_false = body,
         });
         Nodes values = bind_instruction(bb, instr);
         body = case_(a, empty(a), finish_body(bb, yield(a, (Yield) {.args = values})));
     }
 
-    if (max > n->key) {
+    if (max > cluster->hi) {
         BodyBuilder* bb = begin_body(a);
         const Node* instr = if_instr(a, (If) {
             .yield_types = ctx->yield_types,
-            .condition = gen_primop_e(bb, gt_op, empty(a), mk_nodes(a, ctx->inspectee, pivot)),
-            .if_true = n->children[1] ? generate_decision_tree(ctx, n->children[1], n->key + 1, max) : generate_default_fallback_case(ctx),
+            .condition = gen_primop_e(bb, gt_op, empty(a), mk_nodes(a, ctx->inspectee, make_key_literal(ctx, cluster->hi))),
+            .if_true = n->children[1] ? generate_decision_tree(ctx, n->children[1], cluster->hi + 1, max) : generate_default_fallback_case(ctx),
             .if_false = body,
         });
         Nodes values = bind_instruction(bb, instr);
@@ -135,11 +397,21 @@ static const Node* generate_decision_tree(Context* ctx, TreeNode* n, uint64_t mi
     return body;
 }
 
+static int compare_case_ranges(const CaseRange* l, const CaseRange* r) {
+    return l->lo < r->lo ? -1 : (l->lo > r->lo ? 1 : 0);
+}
+
 static const Node* process(Context* ctx, const Node* node) {
     IrArena* a = ctx->rewriter.dst_arena;
 
     switch (node->tag) {
         case Match_TAG: {
+            // ie SPIR-V has OpSwitch, the GPU driver can do a better job of it than we can
+            if (ctx->config->lower.native_switches) {
+                ctx->stats->native++;
+                break;
+            }
+
             Nodes yield_types = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.yield_types);
             Nodes literals = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.literals);
             Nodes cases = rewrite_nodes(&ctx->rewriter, node->payload.match_instr.cases);
@@ -148,24 +420,57 @@ static const Node* process(Context* ctx, const Node* node) {
             // TODO or maybe do that in fold()
             assert(cases.count > 0);
 
+            Context ctx2 = *ctx;
+            ctx2.yield_types = yield_types;
+            ctx2.inspectee = rewrite_node(&ctx->rewriter, node->payload.match_instr.inspect);
+            const Type* inspectee_t = get_inspectee_type(&ctx2);
+            uint64_t bias = get_sign_bias(inspectee_t);
+
+            LARRAY(CaseRange, keys, literals.count);
+            for (size_t i = 0; i < literals.count; i++) {
+                uint64_t key = get_int_literal_value(*resolve_to_int_literal(literals.nodes[i]), inspectee_t->payload.int_type.is_signed);
+                keys[i] = (CaseRange) { .lo = key ^ bias, .hi = key ^ bias, .lam = cases.nodes[i] };
+            }
+            qsort(keys, literals.count, sizeof(CaseRange), (int (*)(const void*, const void*)) compare_case_ranges);
+
+            // merge contiguous keys going to the same place
+            LARRAY(CaseRange, ranges, literals.count);
+            size_t ranges_count = 0;
+            for (size_t i = 0; i < literals.count; i++) {
+                assert(i == 0 || keys[i].lo != keys[i - 1].lo);
+                if (ranges_count > 0 && is_same_target(ranges[ranges_count - 1].lam, keys[i].lam) && ranges[ranges_count - 1].hi + 1 == keys[i].lo)
+                    ranges[ranges_count - 1].hi = keys[i].hi;
+                else
+                    ranges[ranges_count++] = keys[i];
+            }
+
+            LARRAY(Cluster, clusters, ranges_count);
+            size_t clusters_count = plan_clusters(ranges, ranges_count, clusters);
+
             Arena* arena = new_arena();
             TreeNode* root = NULL;
-            for (size_t i = 0; i < literals.count; i++) {
+            for (size_t i = 0; i < clusters_count; i++) {
                 TreeNode* t = arena_alloc(arena, sizeof(TreeNode));
-                t->key = get_int_literal_value(*resolve_to_int_literal(literals.nodes[i]), false);
-                t->lam = cases.nodes[i];
+                t->key = clusters[i].lo;
+                t->cluster = &clusters[i];
                 root = insert(root, t);
+                switch (clusters[i].kind) {
+                    case ClusterRange: ctx->stats->ranges++; break;
+                    case ClusterBitTest: ctx->stats->bit_tests++; break;
+                    case ClusterTable: ctx->stats->tables++; break;
+                }
             }
 
             BodyBuilder* bb = begin_body(a);
             const Node* run_default_case = gen_primop_e(bb, alloca_logical_op, singleton(bool_type(a)), empty(a));
             gen_store(bb, run_default_case, false_lit(a));
-
-            Context ctx2 = *ctx;
             ctx2.run_default_case = run_default_case;
-            ctx2.yield_types = yield_types;
-            ctx2.inspectee = rewrite_node(&ctx->rewriter, node->payload.match_instr.inspect);
-            Nodes matched_results = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx2.yield_types, false), .inside = generate_decision_tree(&ctx2, root, 0, UINT64_MAX) }));
+
+            // the keys the inspectee can take, in biased form
+            uint64_t mask = get_key_mask(inspectee_t);
+            uint64_t min = bias ? ~(mask >> 1) ^ bias : 0;
+            uint64_t max = bias ? (mask >> 1) ^ bias : mask;
+            Nodes matched_results = bind_instruction(bb, block(a, (Block) { .yield_types = add_qualifiers(a, ctx2.yield_types, false), .inside = generate_decision_tree(&ctx2, root, min, max) }));
 
             // Check if we need to run the default case
             Nodes final_results = bind_instruction(bb, if_instr(a, (If) {
@@ -186,15 +491,20 @@ static const Node* process(Context* ctx, const Node* node) {
     return recreate_node_identity(&ctx->rewriter, node);
 }
 
-Module* lower_switch_btree(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+Module* lower_switch_btree(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
 
+    Stats stats = { 0 };
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .stats = &stats,
     };
     rewrite_module(&ctx.rewriter);
+    if (config->logging.pass_stats && (stats.tables + stats.bit_tests + stats.ranges + stats.native) > 0)
+        info_print("lower_switch_btree: %d jump tables, %d bit tests and %d range checks generated, %d switches left to the target\n", (int) stats.tables, (int) stats.bit_tests, (int) stats.ranges, (int) stats.native);
     destroy_rewriter(&ctx.rewriter);
     return dst;
 }
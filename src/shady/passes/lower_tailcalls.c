@@ -5,6 +5,7 @@
 #include "util.h"
 
 #include "../rewrite.h"
+#include "../visit.h"
 #include "../type.h"
 #include "../ir_private.h"
 
@@ -21,6 +22,11 @@
 
 typedef uint64_t FnPtr;
 
+enum {
+    /// How many successors the top dispatcher runs in a row before it goes back around its loop
+    MaxFallThroughs = 4,
+};
+
 typedef struct Context_ {
     Rewriter rewriter;
     const CompilerConfig* config;
@@ -33,6 +39,11 @@ typedef struct Context_ {
 
     Node** top_dispatcher_fn;
     Node* init_fn;
+
+    /// Lifted functions -> the only function they can tail call into, for the ones where that's statically known
+    struct Dict* sole_successors;
+    size_t dispatched;
+    size_t fall_throughs;
 } Context;
 
 static const Node* process(Context* ctx, const Node* old);
@@ -41,18 +52,85 @@ static const Node* fn_ptr_as_value(IrArena* a, FnPtr ptr) {
     return uint64_literal(a, ptr);
 }
 
-static const Node* lower_fn_addr(Context* ctx, const Node* the_function) {
-    IrArena* a = ctx->rewriter.dst_arena;
+static FnPtr get_fn_ptr(Context* ctx, const Node* the_function) {
     assert(the_function->arena == ctx->rewriter.src_arena);
     assert(the_function->tag == Function_TAG);
 
     FnPtr* found = find_value_dict(const Node*, FnPtr, ctx->assigned_fn_ptrs, the_function);
-    if (found) return fn_ptr_as_value(a, *found);
+    if (found) return *found;
 
     FnPtr ptr = (*ctx->next_fn_ptr)++;
     bool r = insert_dict_and_get_result(const Node*, FnPtr, ctx->assigned_fn_ptrs, the_function, ptr);
     assert(r);
-    return fn_ptr_as_value(a, ptr);
+    return ptr;
+}
+
+static const Node* lower_fn_addr(Context* ctx, const Node* the_function) {
+    return fn_ptr_as_value(ctx->rewriter.dst_arena, get_fn_ptr(ctx, the_function));
+}
+
+typedef struct {
+    Visitor visitor;
+    const UsesMap* uses;
+    struct Dict* seen;
+    /// The join points of static controls, joining them doesn't leave the function
+    struct Dict* static_jps;
+    const Node* successor;
+    bool dynamic;
+} SuccessorVisitor;
+
+static void search_successors(SuccessorVisitor* v, const Node* node) {
+    if (!insert_set_get_result(const Node*, v->seen, node))
+        return;
+    switch (node->tag) {
+        case TailCall_TAG: {
+            const Node* target = node->payload.tail_call.target;
+            if (target->tag != FnAddr_TAG || (v->successor && v->successor != target->payload.fn_addr.fn))
+                v->dynamic = true;
+            else
+                v->successor = target->payload.fn_addr.fn;
+            break;
+        }
+        case Control_TAG: {
+            if (is_control_static(v->uses, node)) {
+                const Node* jp = first(get_abstraction_params(node->payload.control.inside));
+                insert_set_get_result(const Node*, v->static_jps, jp);
+            }
+            break;
+        }
+        // the other joins resume wherever the join point was made for
+        case Join_TAG: {
+            const Node* jp = node->payload.join.join_point;
+            if (!find_key_dict(const Node*, v->static_jps, jp))
+                v->dynamic = true;
+            break;
+        }
+        case Return_TAG: v->dynamic = true; break;
+        default: break;
+    }
+    visit_node_operands(&v->visitor, NcDeclaration, node);
+}
+
+/// Finds the lifted functions that can only ever tail call one function, the dispatcher can run that one right after them
+static void compute_sole_successors(Context* ctx) {
+    Nodes old_decls = get_module_declarations(ctx->rewriter.src_module);
+    for (size_t i = 0; i < old_decls.count; i++) {
+        const Node* decl = old_decls.nodes[i];
+        if (decl->tag != Function_TAG || lookup_annotation(decl, "Leaf") || !decl->payload.fun.body)
+            continue;
+        SuccessorVisitor v = {
+            .visitor = { .visit_node_fn = (VisitNodeFn) search_successors },
+            .uses = create_uses_map(decl, (NcDeclaration | NcType)),
+            .seen = new_set(const Node*, (HashFn) hash_ptr, (CmpFn) compare_ptrs),
+            .static_jps = new_set(const Node*, (HashFn) hash_ptr, (CmpFn) compare_ptrs),
+        };
+        visit_node(&v.visitor, decl->payload.fun.body);
+        if (!v.dynamic && v.successor && !lookup_annotation(v.successor, "Leaf"))
+            insert_dict(const Node*, const Node*, ctx->sole_successors, decl, v.successor);
+        destroy_uses_map(v.uses);
+        destroy_dict(v.seen);
+        destroy_dict(v.static_jps);
+    }
 }
 
 /// Turn a function into a top-level entry point, calling into the top dispatch function.
@@ -269,6 +347,55 @@ static const Node* process(Context* ctx, const Node* old) {
     return recreate_node_identity(&ctx->rewriter, old);
 }
 
+/// Calls the lifted version of fn, for the threads that should run it
+static const Node* gen_run_if_active(Context* ctx, const Node* should_run, const Node* local_id, const Node* next_mask, const Node* fn) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    BodyBuilder* if_builder = begin_body(a);
+    if (ctx->config->printf_trace.god_function) {
+        const Node* sid = gen_builtin_load(ctx->rewriter.dst_module, if_builder, BuiltinSubgroupId);
+        bind_instruction(if_builder, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = "trace: thread %d:%d will run fn %ul with mask = %lx\n" }), sid, local_id, lower_fn_addr(ctx, fn), next_mask) }));
+    }
+    bind_instruction(if_builder, call(a, (Call) {
+        .callee = fn_addr_helper(a, find_processed(&ctx->rewriter, fn)),
+        .args = nodes(a, 0, NULL)
+    }));
+    const Node* if_true_lam = case_(a, empty(a), finish_body(if_builder, yield(a, (Yield) {.args = nodes(a, 0, NULL)})));
+    return if_instr(a, (If) {
+        .condition = should_run,
+        .if_true = if_true_lam,
+        .if_false = NULL,
+        .yield_types = empty(a),
+    });
+}
+
+/// When fn can only tail call one function, that one is most likely next: check for it and run it without going back around the loop.
+/// This is what the next iteration would do anyways, and if the scheduler picked another branch it still gets to run there.
+static void gen_fall_through(Context* ctx, BodyBuilder* bb, const Node* local_id, const Node* fn, size_t depth) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Node** found = find_value_dict(const Node*, const Node*, ctx->sole_successors, fn);
+    if (!found || depth >= MaxFallThroughs)
+        return;
+    const Node* successor = *found;
+    ctx->fall_throughs++;
+
+    const Node* next_function = gen_load(bb, access_decl(&ctx->rewriter, "next_fn"));
+    const Node* is_successor_next = gen_primop_e(bb, eq_op, empty(a), mk_nodes(a, next_function, uint32_literal(a, get_fn_ptr(ctx, successor))));
+
+    BodyBuilder* successor_builder = begin_body(a);
+    const Node* get_active_branch_fn = access_decl(&ctx->rewriter, "builtin_get_active_branch");
+    const Node* next_mask = first(bind_instruction(successor_builder, call(a, (Call) { .callee = get_active_branch_fn, .args = empty(a) })));
+    const Node* should_run = gen_primop_e(successor_builder, mask_is_thread_active_op, empty(a), mk_nodes(a, next_mask, local_id));
+    bind_instruction(successor_builder, gen_run_if_active(ctx, should_run, local_id, next_mask, successor));
+    gen_fall_through(ctx, successor_builder, local_id, successor, depth + 1);
+
+    bind_instruction(bb, if_instr(a, (If) {
+        .condition = is_successor_next,
+        .if_true = case_(a, empty(a), finish_body(successor_builder, yield(a, (Yield) { .args = empty(a) }))),
+        .if_false = NULL,
+        .yield_types = empty(a),
+    }));
+}
+
 void generate_top_level_dispatch_fn(Context* ctx) {
     assert(ctx->config->dynamic_scheduling);
     assert(*ctx->top_dispatcher_fn);
@@ -354,25 +481,11 @@ void generate_top_level_dispatch_fn(Context* ctx) {
 
             const Node* fn_lit = lower_fn_addr(ctx, decl);
 
-            BodyBuilder* if_builder = begin_body(a);
-            if (ctx->config->printf_trace.god_function) {
-                const Node* sid = gen_builtin_load(ctx->rewriter.dst_module, loop_body_builder, BuiltinSubgroupId);
-                bind_instruction(if_builder, prim_op(a, (PrimOp) { .op = debug_printf_op, .operands = mk_nodes(a, string_lit(a, (StringLiteral) { .string = "trace: thread %d:%d will run fn %ul with mask = %lx\n" }), sid, local_id, fn_lit, next_mask) }));
-            }
-            bind_instruction(if_builder, call(a, (Call) {
-                .callee = fn_addr_helper(a, find_processed(&ctx->rewriter, decl)),
-                .args = nodes(a, 0, NULL)
-            }));
-            const Node* if_true_lam = case_(a, empty(a), finish_body(if_builder, yield(a, (Yield) {.args = nodes(a, 0, NULL)})));
-            const Node* if_instruction = if_instr(a, (If) {
-                .condition = should_run,
-                .if_true = if_true_lam,
-                .if_false = NULL,
-                .yield_types = empty(a),
-            });
-
+            ctx->dispatched++;
             BodyBuilder* case_builder = begin_body(a);
-            bind_instruction(case_builder, if_instruction);
+            bind_instruction(case_builder, gen_run_if_active(ctx, should_run, local_id, next_mask, decl));
+            if (ctx->config->optimisations.fall_through_dispatch)
+                gen_fall_through(ctx, case_builder, local_id, decl, 0);
             const Node* case_lam = case_(a, nodes(a, 0, NULL), finish_body(case_builder, continue_terminator));
 
             append_list(const Node*, literals, fn_lit);
@@ -438,14 +551,29 @@ Module* lower_tailcalls(SHADY_UNUSED const CompilerConfig* config, Module* src)
 
         .top_dispatcher_fn = &top_dispatcher_fn,
         .init_fn = init_fn,
+
+        .sole_successors = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
     };
 
+    // The functions the dispatcher can jump to get the first ids, so its switch covers a dense range
+    Nodes old_decls = get_module_declarations(src);
+    for (size_t i = 0; i < old_decls.count; i++) {
+        if (old_decls.nodes[i]->tag == Function_TAG && !lookup_annotation(old_decls.nodes[i], "Leaf"))
+            get_fn_ptr(&ctx, old_decls.nodes[i]);
+    }
+    if (config->dynamic_scheduling && config->optimisations.fall_through_dispatch)
+        compute_sole_successors(&ctx);
+
     rewrite_module(&ctx.rewriter);
 
     // Generate the top dispatcher, but only if it is used for realsies
-    if (*ctx.top_dispatcher_fn)
+    if (*ctx.top_dispatcher_fn) {
         generate_top_level_dispatch_fn(&ctx);
+        if (config->logging.pass_stats)
+            info_print("lower_tailcalls: %d functions dispatched, %d of them with a known successor, %d direct fall-through edges\n", (int) ctx.dispatched, (int) entries_count_dict(ctx.sole_successors), (int) ctx.fall_throughs);
+    }
 
+    destroy_dict(ctx.sole_successors);
     destroy_dict(ptrs);
     destroy_rewriter(&ctx.rewriter);
     return dst;
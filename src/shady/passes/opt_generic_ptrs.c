@@ -0,0 +1,729 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "arena.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+#include "../visit.h"
+#include "../analysis/cfg.h"
+#include "../analysis/callgraph.h"
+#include "../transform/ir_gen_helpers.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// Nothing but null pointers and undefs seen so far: compatible with any address space
+static const AddressSpace Unconstrained = NumAddressSpaces;
+
+static AddressSpace join_address_spaces(AddressSpace a, AddressSpace b) {
+    if (a == Unconstrained)
+        return b;
+    if (b == Unconstrained || a == b)
+        return a;
+    return AsGeneric;
+}
+
+/// Something generic pointers flow into: a param, the i-th return value of a function, or the i-th value a control yields
+typedef struct {
+    const Node* node;
+    size_t index;
+} SlotKey;
+
+static KeyHash hash_slot_key(SlotKey* key) {
+    return hash_murmur(&key->node, sizeof(const Node*)) ^ hash_murmur(&key->index, sizeof(size_t));
+}
+
+static bool compare_slot_keys(SlotKey* a, SlotKey* b) {
+    return a->node == b->node && a->index == b->index;
+}
+
+typedef struct {
+    /// The values that flow into it
+    struct List* incoming;
+    /// The address space all of them point into, or AsGeneric if they don't agree
+    AddressSpace as;
+} Slot;
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+
+    Arena* arena;
+    /// SlotKey -> Slot*
+    struct Dict* slots;
+    /// Values that must stay generic, because they're used where we can't change the types
+    struct Dict* pinned;
+    /// Values -> AddressSpace, only valid until a slot changes
+    struct Dict* known;
+
+    /// Set while scanning or rewriting a function
+    const Node* fn;
+    /// Set while scanning or rewriting the body of a structured loop
+    const Node* loop_body;
+
+    size_t resolved_accesses;
+    size_t generic_accesses;
+} Context;
+
+static bool is_generic_ptr(const Type* t) {
+    return is_generic_ptr_type(get_unqualified_type(t));
+}
+
+static Slot* get_slot(Context* ctx, const Node* node, size_t index) {
+    Slot** found = find_value_dict(SlotKey, Slot*, ctx->slots, ((SlotKey) { node, index }));
+    return found ? *found : NULL;
+}
+
+static void add_slot(Context* ctx, const Node* node, size_t index) {
+    Slot* slot = arena_alloc(ctx->arena, sizeof(Slot));
+    *slot = (Slot) {
+        .incoming = new_list(const Node*),
+        .as = Unconstrained,
+    };
+    insert_dict(SlotKey, Slot*, ctx->slots, ((SlotKey) { node, index }), slot);
+}
+
+static void add_param_slots(Context* ctx, Nodes params) {
+    for (size_t i = 0; i < params.count; i++) {
+        if (is_generic_ptr(params.nodes[i]->type))
+            add_slot(ctx, params.nodes[i], 0);
+    }
+}
+
+static void add_incoming(Context* ctx, const Node* node, size_t index, const Node* value) {
+    Slot* slot = get_slot(ctx, node, index);
+    if (slot)
+        append_list(const Node*, slot->incoming, value);
+}
+
+static void add_incoming_args(Context* ctx, Nodes params, Nodes args) {
+    assert(params.count == args.count);
+    for (size_t i = 0; i < params.count; i++)
+        add_incoming(ctx, params.nodes[i], 0, args.nodes[i]);
+}
+
+static AddressSpace get_address_space(Context* ctx, const Node* value);
+
+static AddressSpace get_slot_address_space(Context* ctx, const Node* node, size_t index) {
+    Slot* slot = get_slot(ctx, node, index);
+    return slot ? slot->as : AsGeneric;
+}
+
+static AddressSpace get_output_address_space(Context* ctx, const Node* instruction, size_t i) {
+    switch (instruction->tag) {
+        case PrimOp_TAG: {
+            PrimOp payload = instruction->payload.prim_op;
+            Nodes operands = payload.operands;
+            switch (payload.op) {
+                case convert_op: {
+                    // the conversions into generic pointers are where the address spaces get lost
+                    const Type* src_t = get_unqualified_type(first(operands)->type);
+                    if (src_t->tag == PtrType_TAG && src_t->payload.ptr_type.address_space != AsGeneric)
+                        return src_t->payload.ptr_type.address_space;
+                    return AsGeneric;
+                }
+                case reinterpret_op: {
+                    if (is_generic_ptr(first(operands)->type))
+                        return get_address_space(ctx, first(operands));
+                    return AsGeneric;
+                }
+                case lea_op: return get_address_space(ctx, first(operands));
+                case select_op: return join_address_spaces(get_address_space(ctx, operands.nodes[1]), get_address_space(ctx, operands.nodes[2]));
+                case quote_op: return get_address_space(ctx, operands.nodes[i]);
+                default: return AsGeneric;
+            }
+        }
+        case Call_TAG: {
+            const Node* callee = instruction->payload.call.callee;
+            if (callee->tag != FnAddr_TAG)
+                return AsGeneric;
+            return get_slot_address_space(ctx, callee->payload.fn_addr.fn, i);
+        }
+        case Control_TAG: return get_slot_address_space(ctx, first(get_abstraction_params(instruction->payload.control.inside)), i);
+        default: return AsGeneric;
+    }
+}
+
+/// Where a generic pointer value points to, as far as we know now
+static AddressSpace get_address_space(Context* ctx, const Node* value) {
+    if (!is_generic_ptr(value->type))
+        return AsGeneric;
+    if (value->tag == NullPtr_TAG || value->tag == Undef_TAG)
+        return Unconstrained;
+    if (find_key_dict(const Node*, ctx->pinned, value))
+        return AsGeneric;
+    AddressSpace* found = find_value_dict(const Node*, AddressSpace, ctx->known, value);
+    if (found)
+        return *found;
+
+    AddressSpace as = AsGeneric;
+    switch (value->tag) {
+        case Param_TAG: as = get_slot_address_space(ctx, value, 0); break;
+        case Variablez_TAG: as = get_output_address_space(ctx, value->payload.varz.instruction, value->payload.varz.iindex); break;
+        default: break;
+    }
+    insert_dict(const Node*, AddressSpace, ctx->known, value, as);
+    return as;
+}
+
+/// Once the analysis is done, values we know nothing about stay generic
+static AddressSpace get_resolved_address_space(Context* ctx, const Node* value) {
+    AddressSpace as = get_address_space(ctx, value);
+    return as == Unconstrained ? AsGeneric : as;
+}
+
+static AddressSpace get_resolved_slot_address_space(Context* ctx, const Node* node, size_t index) {
+    AddressSpace as = get_slot_address_space(ctx, node, index);
+    return as == Unconstrained ? AsGeneric : as;
+}
+
+typedef struct {
+    Visitor visitor;
+    Context* ctx;
+} PinVisitor;
+
+static void pin(Context* ctx, const Node* value) {
+    if (is_generic_ptr(value->type))
+        insert_set_get_result(const Node*, ctx->pinned, value);
+}
+
+/// Finds the values used in places where the types are fixed, and the join points that don't stay where they were made
+static void search_for_pinned_values(PinVisitor* v, NodeClass class, String name, const Node* node) {
+    // params are declared here, not used
+    if (class == NcParam)
+        return;
+    switch (node->tag) {
+        case Param_TAG: {
+            if (get_unqualified_type(node->type)->tag == JoinPointType_TAG)
+                insert_set_get_result(const Node*, v->ctx->pinned, node);
+            return;
+        }
+        case Join_TAG: {
+            visit_ops(&v->visitor, NcValue, "args", node->payload.join.args);
+            return;
+        }
+        case Composite_TAG: {
+            Nodes contents = node->payload.composite.contents;
+            for (size_t i = 0; i < contents.count; i++)
+                pin(v->ctx, contents.nodes[i]);
+            break;
+        }
+        case Fill_TAG: pin(v->ctx, node->payload.fill.value); break;
+        default: break;
+    }
+    // the structured constructs' bodies are part of the same walk, the basic blocks are visited in rpo
+    visit_node_operands(&v->visitor, NcBasic_block | NcDeclaration, node);
+}
+
+static void search_for_pinned_values_in_node(PinVisitor* v, const Node* node) {
+    search_for_pinned_values(v, 0, NULL, node);
+}
+
+/// Records what flows into the slots from the body of an abstraction, following the structured constructs into theirs
+static void scan_abstraction(Context* ctx, const Node* abs) {
+    const Node* terminator = get_abstraction_body(abs);
+    if (!terminator)
+        return;
+    switch (terminator->tag) {
+        case Let_TAG: {
+            const Node* instruction = get_let_instruction(terminator);
+            switch (instruction->tag) {
+                case If_TAG:
+                    scan_abstraction(ctx, instruction->payload.if_instr.if_true);
+                    if (instruction->payload.if_instr.if_false)
+                        scan_abstraction(ctx, instruction->payload.if_instr.if_false);
+                    break;
+                case Match_TAG:
+                    for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                        scan_abstraction(ctx, instruction->payload.match_instr.cases.nodes[i]);
+                    scan_abstraction(ctx, instruction->payload.match_instr.default_case);
+                    break;
+                case Loop_TAG: {
+                    const Node* body = instruction->payload.loop_instr.body;
+                    add_param_slots(ctx, get_abstraction_params(body));
+                    add_incoming_args(ctx, get_abstraction_params(body), instruction->payload.loop_instr.initial_args);
+                    const Node* outer_loop_body = ctx->loop_body;
+                    ctx->loop_body = body;
+                    scan_abstraction(ctx, body);
+                    ctx->loop_body = outer_loop_body;
+                    break;
+                }
+                case Control_TAG: {
+                    const Node* jp = first(get_abstraction_params(instruction->payload.control.inside));
+                    Nodes yield_types = instruction->payload.control.yield_types;
+                    for (size_t i = 0; i < yield_types.count; i++) {
+                        if (is_generic_ptr_type(yield_types.nodes[i]) && !find_key_dict(const Node*, ctx->pinned, jp))
+                            add_slot(ctx, jp, i);
+                    }
+                    scan_abstraction(ctx, instruction->payload.control.inside);
+                    break;
+                }
+                case Block_TAG: scan_abstraction(ctx, instruction->payload.block.inside); break;
+                default: break;
+            }
+            scan_abstraction(ctx, get_let_tail(terminator));
+            break;
+        }
+        case Jump_TAG: add_incoming_args(ctx, get_abstraction_params(terminator->payload.jump.target), terminator->payload.jump.args); break;
+        case Branch_TAG: {
+            const Node* jumps[] = { terminator->payload.branch.true_jump, terminator->payload.branch.false_jump };
+            for (size_t i = 0; i < 2; i++)
+                add_incoming_args(ctx, get_abstraction_params(jumps[i]->payload.jump.target), jumps[i]->payload.jump.args);
+            break;
+        }
+        case Switch_TAG: {
+            Nodes jumps = terminator->payload.br_switch.case_jumps;
+            for (size_t i = 0; i < jumps.count; i++)
+                add_incoming_args(ctx, get_abstraction_params(jumps.nodes[i]->payload.jump.target), jumps.nodes[i]->payload.jump.args);
+            const Node* default_jump = terminator->payload.br_switch.default_jump;
+            add_incoming_args(ctx, get_abstraction_params(default_jump->payload.jump.target), default_jump->payload.jump.args);
+            break;
+        }
+        case MergeContinue_TAG: {
+            if (ctx->loop_body)
+                add_incoming_args(ctx, get_abstraction_params(ctx->loop_body), terminator->payload.merge_continue.args);
+            break;
+        }
+        case Join_TAG: {
+            Nodes args = terminator->payload.join.args;
+            for (size_t i = 0; i < args.count; i++)
+                add_incoming(ctx, terminator->payload.join.join_point, i, args.nodes[i]);
+            break;
+        }
+        case Return_TAG: {
+            Nodes args = terminator->payload.fn_ret.args;
+            for (size_t i = 0; i < args.count; i++)
+                add_incoming(ctx, ctx->fn, i, args.nodes[i]);
+            break;
+        }
+        default: break;
+    }
+}
+
+static bool is_fixed_interface(const Node* fn) {
+    return lookup_annotation(fn, "EntryPoint") || lookup_annotation(fn, "Exported");
+}
+
+/// The params and return values of functions are slots only when we see all of their call sites
+static void add_function_slots(Context* ctx, CGNode* fn_node) {
+    const Node* fn = fn_node->fn;
+    if (!fn->payload.fun.body || fn_node->is_address_captured || is_fixed_interface(fn))
+        return;
+
+    Nodes return_types = fn->payload.fun.return_types;
+    for (size_t i = 0; i < return_types.count; i++) {
+        if (is_generic_ptr(return_types.nodes[i]))
+            add_slot(ctx, fn, i);
+    }
+
+    // without callers there is nothing to learn about the params from
+    if (entries_count_dict(fn_node->callers) == 0)
+        return;
+    size_t i = 0;
+    CGEdge edge;
+    bool tail_called = false;
+    while (dict_iter(fn_node->callers, &i, &edge, NULL))
+        tail_called |= edge.instr->tag == TailCall_TAG;
+    // the arguments of tail calls go through the dynamic scheduler, which doesn't know about our types
+    if (tail_called)
+        return;
+    add_param_slots(ctx, fn->payload.fun.params);
+    i = 0;
+    while (dict_iter(fn_node->callers, &i, &edge, NULL))
+        add_incoming_args(ctx, fn->payload.fun.params, edge.instr->payload.call.args);
+}
+
+static void analyze_module(Context* ctx, Module* mod) {
+    Nodes decls = get_module_declarations(mod);
+    PinVisitor v = {
+        .visitor = {
+            .visit_node_fn = (VisitNodeFn) search_for_pinned_values_in_node,
+            .visit_op_fn = (VisitOpFn) search_for_pinned_values,
+        },
+        .ctx = ctx,
+    };
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != Function_TAG || !decl->payload.fun.body)
+            continue;
+        visit_node(&v.visitor, decl->payload.fun.body);
+        visit_function_rpo(&v.visitor, decl);
+    }
+
+    CallGraph* graph = new_callgraph(mod);
+    size_t i = 0;
+    CGNode* fn_node;
+    while (dict_iter(graph->fn2cgn, &i, NULL, &fn_node))
+        add_function_slots(ctx, fn_node);
+    destroy_callgraph(graph);
+
+    for (size_t j = 0; j < decls.count; j++) {
+        const Node* fn = decls.nodes[j];
+        if (fn->tag != Function_TAG || !fn->payload.fun.body)
+            continue;
+        CFG* cfg = build_fn_cfg(fn);
+        for (size_t k = 0; k < cfg->size; k++) {
+            const Node* abs = read_list(CFNode*, cfg->contents)[k]->node;
+            if (abs->tag == BasicBlock_TAG)
+                add_param_slots(ctx, get_abstraction_params(abs));
+        }
+        ctx->fn = fn;
+        scan_abstraction(ctx, fn);
+        for (size_t k = 0; k < cfg->size; k++) {
+            const Node* abs = read_list(CFNode*, cfg->contents)[k]->node;
+            if (abs->tag == BasicBlock_TAG)
+                scan_abstraction(ctx, abs);
+        }
+        ctx->fn = NULL;
+        destroy_cfg(cfg);
+    }
+
+    // the slots only ever go from unconstrained to one address space, and then to generic
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        size_t k = 0;
+        SlotKey key;
+        Slot* slot;
+        while (dict_iter(ctx->slots, &k, &key, &slot)) {
+            AddressSpace as = find_key_dict(const Node*, ctx->pinned, key.node) ? AsGeneric : Unconstrained;
+            for (size_t l = 0; l < entries_count_list(slot->incoming) && as != AsGeneric; l++)
+                as = join_address_spaces(as, get_address_space(ctx, read_list(const Node*, slot->incoming)[l]));
+            if (as != slot->as) {
+                slot->as = as;
+                changed = true;
+                clear_dict(ctx->known);
+            }
+        }
+    }
+}
+
+static const Type* concrete_ptr_type(Context* ctx, const Type* old_type, AddressSpace as) {
+    assert(old_type->tag == PtrType_TAG);
+    return ptr_type(ctx->rewriter.dst_arena, (PtrType) {
+        .pointed_type = rewrite_node(&ctx->rewriter, old_type->payload.ptr_type.pointed_type),
+        .address_space = as,
+        .is_reference = old_type->payload.ptr_type.is_reference,
+    });
+}
+
+static const Type* concrete_qualified_ptr_type(Context* ctx, const Type* old_type, AddressSpace as) {
+    bool uniform = deconstruct_qualified_type(&old_type);
+    return qualified_type_helper(concrete_ptr_type(ctx, old_type, as), uniform);
+}
+
+/// Rewrites a value for a place that expects it to point into a given address space, or to be generic
+static const Node* rewrite_value_for(Context* ctx, BodyBuilder* bb, const Node* old, AddressSpace expected) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (!is_generic_ptr(old->type))
+        return rewrite_node(&ctx->rewriter, old);
+    const Type* old_ptr_t = get_unqualified_type(old->type);
+    if (expected != AsGeneric) {
+        if (old->tag == NullPtr_TAG)
+            return null_ptr(a, (NullPtr) { .ptr_type = concrete_ptr_type(ctx, old_ptr_t, expected) });
+        if (old->tag == Undef_TAG)
+            return undef(a, (Undef) { .type = concrete_ptr_type(ctx, old_ptr_t, expected) });
+        // values nothing ever flowed into, like params only passed back to their own function, join with anything
+        const Node* new = rewrite_node(&ctx->rewriter, old);
+        AddressSpace as = get_resolved_address_space(ctx, old);
+        if (as != expected) {
+            if (as != AsGeneric)
+                new = gen_conversion(bb, rewrite_node(&ctx->rewriter, old_ptr_t), new);
+            new = gen_conversion(bb, concrete_ptr_type(ctx, old_ptr_t, expected), new);
+        }
+        return new;
+    }
+    const Node* new = rewrite_node(&ctx->rewriter, old);
+    if (get_resolved_address_space(ctx, old) != AsGeneric)
+        new = gen_conversion(bb, rewrite_node(&ctx->rewriter, old_ptr_t), new);
+    return new;
+}
+
+/// For the places that use a value as it is, if they can
+static const Node* rewrite_value_as_is(Context* ctx, BodyBuilder* bb, const Node* old) {
+    return rewrite_value_for(ctx, bb, old, get_resolved_address_space(ctx, old));
+}
+
+static Nodes rewrite_values_for_slots(Context* ctx, BodyBuilder* bb, Nodes old, const Node* node, bool params) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    LARRAY(const Node*, new, old.count);
+    for (size_t i = 0; i < old.count; i++) {
+        AddressSpace expected = AsGeneric;
+        if (node && params)
+            expected = get_resolved_slot_address_space(ctx, get_abstraction_params(node).nodes[i], 0);
+        else if (node)
+            expected = get_resolved_slot_address_space(ctx, node, i);
+        new[i] = rewrite_value_for(ctx, bb, old.nodes[i], expected);
+    }
+    return nodes(a, old.count, new);
+}
+
+static Nodes rewrite_values_generic(Context* ctx, BodyBuilder* bb, Nodes old) {
+    return rewrite_values_for_slots(ctx, bb, old, NULL, false);
+}
+
+static void count_access(Context* ctx, const Node* old_ptr) {
+    if (!is_generic_ptr(old_ptr->type))
+        return;
+    if (get_resolved_address_space(ctx, old_ptr) != AsGeneric)
+        ctx->resolved_accesses++;
+    else
+        ctx->generic_accesses++;
+}
+
+static const Node* rewrite_prim_op(Context* ctx, BodyBuilder* bb, const Node* old, Nodes ovars) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    PrimOp payload = old->payload.prim_op;
+    Nodes ops = payload.operands;
+    Nodes type_arguments = rewrite_nodes(&ctx->rewriter, payload.type_arguments);
+    LARRAY(const Node*, nops, ops.count);
+    // by default the operands are used where they have to be generic
+    for (size_t i = 0; i < ops.count; i++)
+        nops[i] = NULL;
+
+    AddressSpace result_as = ovars.count > 0 ? get_resolved_address_space(ctx, ovars.nodes[0]) : AsGeneric;
+    switch (payload.op) {
+        case load_op:
+            count_access(ctx, first(ops));
+            nops[0] = rewrite_value_as_is(ctx, bb, first(ops));
+            break;
+        case store_op:
+            count_access(ctx, first(ops));
+            nops[0] = rewrite_value_as_is(ctx, bb, first(ops));
+            break;
+        case lea_op:
+            nops[0] = rewrite_value_for(ctx, bb, first(ops), result_as);
+            break;
+        case reinterpret_op: {
+            if (result_as == AsGeneric)
+                break;
+            type_arguments = singleton(concrete_ptr_type(ctx, first(payload.type_arguments), result_as));
+            nops[0] = rewrite_value_for(ctx, bb, first(ops), result_as);
+            break;
+        }
+        case convert_op: {
+            const Type* dst_t = first(payload.type_arguments);
+            // generic pointers that are made out of a pointer we know stay that pointer
+            if (result_as != AsGeneric)
+                return quote_helper(a, singleton(rewrite_node(&ctx->rewriter, first(ops))));
+            // and converting them back is a no-op when we know they already point there
+            if (dst_t->tag == PtrType_TAG && is_generic_ptr(first(ops)->type) && get_resolved_address_space(ctx, first(ops)) == dst_t->payload.ptr_type.address_space)
+                return quote_helper(a, singleton(rewrite_node(&ctx->rewriter, first(ops))));
+            break;
+        }
+        case select_op: {
+            if (result_as == AsGeneric)
+                break;
+            nops[1] = rewrite_value_for(ctx, bb, ops.nodes[1], result_as);
+            nops[2] = rewrite_value_for(ctx, bb, ops.nodes[2], result_as);
+            break;
+        }
+        case quote_op: {
+            for (size_t i = 0; i < ops.count; i++)
+                nops[i] = rewrite_value_for(ctx, bb, ops.nodes[i], get_resolved_address_space(ctx, ovars.nodes[i]));
+            break;
+        }
+        default: break;
+    }
+
+    for (size_t i = 0; i < ops.count; i++) {
+        if (!nops[i])
+            nops[i] = rewrite_value_for(ctx, bb, ops.nodes[i], AsGeneric);
+    }
+    return prim_op(a, (PrimOp) { .op = payload.op, .type_arguments = type_arguments, .operands = nodes(a, ops.count, nops) });
+}
+
+static const Node* rewrite_instruction(Context* ctx, BodyBuilder* bb, const Node* old, Nodes ovars) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+    switch (old->tag) {
+        case PrimOp_TAG: return rewrite_prim_op(ctx, bb, old, ovars);
+        case Call_TAG: {
+            const Node* callee = old->payload.call.callee;
+            Nodes args = old->payload.call.args;
+            if (callee->tag == FnAddr_TAG)
+                args = rewrite_values_for_slots(ctx, bb, args, callee->payload.fn_addr.fn, true);
+            else
+                args = rewrite_values_generic(ctx, bb, args);
+            return call(a, (Call) { .callee = rewrite_node(r, callee), .args = args });
+        }
+        case Loop_TAG: {
+            Loop payload = old->payload.loop_instr;
+            Nodes initial_args = rewrite_values_for_slots(ctx, bb, payload.initial_args, payload.body, true);
+            Context loop_ctx = *ctx;
+            loop_ctx.loop_body = payload.body;
+            const Node* body = rewrite_node(&loop_ctx.rewriter, payload.body);
+            ctx->resolved_accesses = loop_ctx.resolved_accesses;
+            ctx->generic_accesses = loop_ctx.generic_accesses;
+            return loop_instr(a, (Loop) { .yield_types = rewrite_nodes(r, payload.yield_types), .body = body, .initial_args = initial_args });
+        }
+        case Control_TAG: {
+            Control payload = old->payload.control;
+            const Node* jp = first(get_abstraction_params(payload.inside));
+            LARRAY(const Type*, yield_types, payload.yield_types.count);
+            for (size_t i = 0; i < payload.yield_types.count; i++) {
+                AddressSpace as = get_resolved_slot_address_space(ctx, jp, i);
+                yield_types[i] = as != AsGeneric ? concrete_ptr_type(ctx, payload.yield_types.nodes[i], as) : rewrite_node(r, payload.yield_types.nodes[i]);
+            }
+            return control(a, (Control) { .yield_types = nodes(a, payload.yield_types.count, yield_types), .inside = rewrite_node(r, payload.inside) });
+        }
+        default: return rewrite_node(r, old);
+    }
+}
+
+static const Node* rewrite_jump(Context* ctx, BodyBuilder* bb, const Node* old) {
+    const Node* target = old->payload.jump.target;
+    Nodes args = rewrite_values_for_slots(ctx, bb, old->payload.jump.args, target, true);
+    return jump(ctx->rewriter.dst_arena, (Jump) { .target = rewrite_node(&ctx->rewriter, target), .args = args });
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+
+    switch (node->tag) {
+        case Param_TAG: {
+            const Type* t = node->payload.param.type;
+            if (get_unqualified_type(t)->tag == JoinPointType_TAG) {
+                // the join points of the controls we resolved yield concrete pointers
+                bool uniform = deconstruct_qualified_type(&t);
+                Nodes oyield_types = t->payload.join_point_type.yield_types;
+                LARRAY(const Type*, yield_types, oyield_types.count);
+                for (size_t i = 0; i < oyield_types.count; i++) {
+                    AddressSpace as = get_resolved_slot_address_space(ctx, node, i);
+                    yield_types[i] = as != AsGeneric ? concrete_ptr_type(ctx, oyield_types.nodes[i], as) : rewrite_node(r, oyield_types.nodes[i]);
+                }
+                const Type* jp_type = join_point_type(a, (JoinPointType) { .yield_types = nodes(a, oyield_types.count, yield_types) });
+                return param(a, qualified_type_helper(jp_type, uniform), node->payload.param.name);
+            }
+            AddressSpace as = get_resolved_slot_address_space(ctx, node, 0);
+            if (as != AsGeneric)
+                return param(a, concrete_qualified_ptr_type(ctx, t, as), node->payload.param.name);
+            return recreate_param(r, node);
+        }
+        case Function_TAG: {
+            Context fn_ctx = *ctx;
+            fn_ctx.fn = node;
+            fn_ctx.loop_body = NULL;
+            Nodes oreturn_types = node->payload.fun.return_types;
+            LARRAY(const Type*, return_types, oreturn_types.count);
+            for (size_t i = 0; i < oreturn_types.count; i++) {
+                AddressSpace as = get_resolved_slot_address_space(ctx, node, i);
+                return_types[i] = as != AsGeneric ? concrete_qualified_ptr_type(ctx, oreturn_types.nodes[i], as) : rewrite_node(r, oreturn_types.nodes[i]);
+            }
+            Nodes params = recreate_params(r, node->payload.fun.params);
+            Node* new = function(r->dst_module, params, get_abstraction_name(node), rewrite_nodes(r, node->payload.fun.annotations), nodes(a, oreturn_types.count, return_types));
+            register_processed_list(r, node->payload.fun.params, params);
+            register_processed(r, node, new);
+            recreate_decl_body_identity(&fn_ctx.rewriter, node, new);
+            ctx->resolved_accesses = fn_ctx.resolved_accesses;
+            ctx->generic_accesses = fn_ctx.generic_accesses;
+            return new;
+        }
+        case Let_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes ovars = node->payload.let.variables;
+            const Node* instruction = rewrite_instruction(ctx, bb, get_let_instruction(node), ovars);
+            Nodes nvars = recreate_vars(a, ovars, instruction);
+            register_processed_list(r, ovars, nvars);
+            return finish_body(bb, let(a, instruction, nvars, rewrite_node(r, get_let_tail(node))));
+        }
+        case Jump_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            return finish_body(bb, rewrite_jump(ctx, bb, node));
+        }
+        case Branch_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            const Node* true_jump = rewrite_jump(ctx, bb, node->payload.branch.true_jump);
+            const Node* false_jump = rewrite_jump(ctx, bb, node->payload.branch.false_jump);
+            return finish_body(bb, branch(a, (Branch) {
+                .branch_condition = rewrite_node(r, node->payload.branch.branch_condition),
+                .true_jump = true_jump,
+                .false_jump = false_jump,
+            }));
+        }
+        case Switch_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes ocase_jumps = node->payload.br_switch.case_jumps;
+            LARRAY(const Node*, case_jumps, ocase_jumps.count);
+            for (size_t i = 0; i < ocase_jumps.count; i++)
+                case_jumps[i] = rewrite_jump(ctx, bb, ocase_jumps.nodes[i]);
+            const Node* default_jump = rewrite_jump(ctx, bb, node->payload.br_switch.default_jump);
+            return finish_body(bb, br_switch(a, (Switch) {
+                .switch_value = rewrite_node(r, node->payload.br_switch.switch_value),
+                .case_values = rewrite_nodes(r, node->payload.br_switch.case_values),
+                .case_jumps = nodes(a, ocase_jumps.count, case_jumps),
+                .default_jump = default_jump,
+            }));
+        }
+        case MergeContinue_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_for_slots(ctx, bb, node->payload.merge_continue.args, ctx->loop_body, true);
+            return finish_body(bb, merge_continue(a, (MergeContinue) { .args = args }));
+        }
+        case MergeBreak_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_generic(ctx, bb, node->payload.merge_break.args);
+            return finish_body(bb, merge_break(a, (MergeBreak) { .args = args }));
+        }
+        case Yield_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_generic(ctx, bb, node->payload.yield.args);
+            return finish_body(bb, yield(a, (Yield) { .args = args }));
+        }
+        case Join_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_for_slots(ctx, bb, node->payload.join.args, node->payload.join.join_point, false);
+            return finish_body(bb, join(a, (Join) { .join_point = rewrite_node(r, node->payload.join.join_point), .args = args }));
+        }
+        case Return_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_for_slots(ctx, bb, node->payload.fn_ret.args, ctx->fn, false);
+            return finish_body(bb, fn_ret(a, (Return) { .fn = rewrite_node(r, node->payload.fn_ret.fn), .args = args }));
+        }
+        case TailCall_TAG: {
+            BodyBuilder* bb = begin_body(a);
+            Nodes args = rewrite_values_generic(ctx, bb, node->payload.tail_call.args);
+            return finish_body(bb, tail_call(a, (TailCall) { .target = rewrite_node(r, node->payload.tail_call.target), .args = args }));
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_generic_ptrs(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .arena = new_arena(),
+        .slots = new_dict(SlotKey, Slot*, (HashFn) hash_slot_key, (CmpFn) compare_slot_keys),
+        .pinned = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .known = new_dict(const Node*, AddressSpace, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    ctx.rewriter.config.process_params = true;
+    analyze_module(&ctx, src);
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_generic_ptrs: %d accesses through generic pointers made concrete, %d left generic\n", (int) ctx.resolved_accesses, (int) ctx.generic_accesses);
+
+    destroy_rewriter(&ctx.rewriter);
+    size_t i = 0;
+    Slot* slot;
+    while (dict_iter(ctx.slots, &i, NULL, &slot))
+        destroy_list(slot->incoming);
+    destroy_dict(ctx.slots);
+    destroy_dict(ctx.pinned);
+    destroy_dict(ctx.known);
+    destroy_arena(ctx.arena);
+    return dst;
+}
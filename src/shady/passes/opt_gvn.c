@@ -0,0 +1,181 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "arena.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+#include "../analysis/cfg.h"
+
+#include <string.h>
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// A side-effect free primop, with its operands replaced by their leaders
+typedef struct {
+    Op op;
+    Nodes type_arguments;
+    size_t operands_count;
+    const Node** operands;
+} ValueKey;
+
+static KeyHash hash_value_key(ValueKey* key) {
+    KeyHash h = hash_murmur(&key->op, sizeof(Op));
+    h ^= hash_murmur(&key->type_arguments.nodes, sizeof(const Node**));
+    if (key->operands_count > 0)
+        h ^= hash_murmur(key->operands, sizeof(const Node*) * key->operands_count);
+    return h;
+}
+
+static bool compare_value_keys(ValueKey* a, ValueKey* b) {
+    if (a->op != b->op || a->operands_count != b->operands_count)
+        return false;
+    // Nodes are hash-consed, so equal lists are the same allocation
+    if (a->type_arguments.count != b->type_arguments.count || a->type_arguments.nodes != b->type_arguments.nodes)
+        return false;
+    return a->operands_count == 0 || memcmp(a->operands, b->operands, sizeof(const Node*) * a->operands_count) == 0;
+}
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+
+    Arena* arena;
+    /// Variable -> the dominating value it is equal to
+    struct Dict* leaders;
+    /// ValueKey -> the variable of the dominating let that computes it, scoped to the dominator tree walk
+    struct Dict* values;
+    /// Let nodes that compute nothing new, and that we can drop
+    struct Dict* redundant;
+
+    size_t eliminated_instructions;
+    size_t eliminated_quotes;
+} Context;
+
+static const Node* get_leader(Context* ctx, const Node* value) {
+    const Node** found = find_value_dict(const Node*, const Node*, ctx->leaders, value);
+    return found ? *found : value;
+}
+
+static bool is_numberable(const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    return is_primop_pure(instruction->payload.prim_op.op);
+}
+
+/// Looks at the instruction bound by the let in this abstraction's body, if there is one
+static void number_let(Context* ctx, const Node* let, struct List* inserted) {
+    const Node* instruction = get_let_instruction(let);
+    Nodes vars = let->payload.let.variables;
+    if (instruction->tag != PrimOp_TAG)
+        return;
+    PrimOp payload = instruction->payload.prim_op;
+
+    // quote(x, y...) only renames its operands
+    if (payload.op == quote_op) {
+        assert(vars.count == payload.operands.count);
+        for (size_t i = 0; i < vars.count; i++) {
+            const Node* leader = get_leader(ctx, payload.operands.nodes[i]);
+            insert_dict(const Node*, const Node*, ctx->leaders, vars.nodes[i], leader);
+        }
+        insert_set_get_result(const Node*, ctx->redundant, let);
+        ctx->eliminated_quotes++;
+        return;
+    }
+
+    if (!is_numberable(instruction) || vars.count != 1)
+        return;
+
+    ValueKey key = {
+        .op = payload.op,
+        .type_arguments = payload.type_arguments,
+        .operands_count = payload.operands.count,
+        .operands = arena_alloc(ctx->arena, sizeof(const Node*) * payload.operands.count),
+    };
+    for (size_t i = 0; i < payload.operands.count; i++)
+        key.operands[i] = get_leader(ctx, payload.operands.nodes[i]);
+
+    const Node** found = find_value_dict(ValueKey, const Node*, ctx->values, key);
+    if (found) {
+        insert_dict(const Node*, const Node*, ctx->leaders, vars.nodes[0], *found);
+        insert_set_get_result(const Node*, ctx->redundant, let);
+        ctx->eliminated_instructions++;
+        return;
+    }
+    insert_dict(ValueKey, const Node*, ctx->values, key, vars.nodes[0]);
+    append_list(ValueKey, inserted, key);
+}
+
+/// Walks the dominator tree: a value computed in some node is available in every node it dominates, and nowhere else.
+static void number_cf_node(Context* ctx, CFNode* node) {
+    struct List* inserted = new_list(ValueKey);
+    const Node* body = get_abstraction_body(node->node);
+    if (body && body->tag == Let_TAG)
+        number_let(ctx, body, inserted);
+
+    for (size_t i = 0; i < entries_count_list(node->dominates); i++)
+        number_cf_node(ctx, read_list(CFNode*, node->dominates)[i]);
+
+    // leave the scope
+    for (size_t i = 0; i < entries_count_list(inserted); i++) {
+        ValueKey key = read_list(ValueKey, inserted)[i];
+        remove_dict(ValueKey, ctx->values, key);
+    }
+    destroy_list(inserted);
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    Rewriter* r = &ctx->rewriter;
+    switch (node->tag) {
+        case Function_TAG: {
+            if (node->payload.fun.body) {
+                CFG* cfg = build_fn_cfg(node);
+                number_cf_node(ctx, cfg->entry);
+                destroy_cfg(cfg);
+            }
+            break;
+        }
+        case Let_TAG: {
+            if (find_key_dict(const Node*, ctx->redundant, node)) {
+                Nodes vars = node->payload.let.variables;
+                for (size_t i = 0; i < vars.count; i++)
+                    register_processed(r, vars.nodes[i], rewrite_node(r, get_leader(ctx, vars.nodes[i])));
+                return rewrite_node(r, get_abstraction_body(get_let_tail(node)));
+            }
+            break;
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_gvn(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .arena = new_arena(),
+        .leaders = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .values = new_dict(ValueKey, const Node*, (HashFn) hash_value_key, (CmpFn) compare_value_keys),
+        .redundant = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_gvn: %d redundant instructions and %d quotes eliminated\n", (int) ctx.eliminated_instructions, (int) ctx.eliminated_quotes);
+
+    destroy_rewriter(&ctx.rewriter);
+    destroy_arena(ctx.arena);
+    destroy_dict(ctx.leaders);
+    destroy_dict(ctx.values);
+    destroy_dict(ctx.redundant);
+    return dst;
+}
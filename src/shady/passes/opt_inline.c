@@ -10,17 +10,57 @@
 #include "../type.h"
 #include "../ir_private.h"
 
+#include "../visit.h"
 #include "../analysis/callgraph.h"
 
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
 typedef struct {
     const Node* host_fn;
     const Node* return_jp;
 } InlinedCall;
 
+/// Identifies a call site: call nodes are hash-consed, so the same one can appear in several functions
+typedef struct {
+    const Node* src_fn;
+    const Node* instr;
+} CallSite;
+
+static KeyHash hash_call_site(CallSite* site) {
+    return hash_murmur(site, sizeof(CallSite));
+}
+
+static bool compare_call_sites(CallSite* a, CallSite* b) {
+    return a->src_fn == b->src_fn && a->instr == b->instr;
+}
+
+typedef struct {
+    /// instruction count of the body
+    size_t size;
+    /// how many instructions inlining has added to it so far
+    size_t growth;
+    /// every call to it gets inlined and nothing else refers to it
+    bool can_be_eliminated;
+} FnInliningInfo;
+
+typedef struct {
+    size_t considered_sites;
+    size_t inlined_sites;
+    size_t rejected_for_cost;
+    size_t rejected_for_budget;
+    size_t eliminated_fns;
+    size_t growth;
+} InliningStats;
+
 typedef struct {
     Rewriter rewriter;
     const CompilerConfig* config;
     CallGraph* graph;
+    struct Dict* fns;
+    struct Dict* inlined_sites;
+    InliningStats stats;
+    /// the function the nodes being rewritten come from, which is the callee when rewriting an inlined body
     const Node* old_fun;
     Node* fun;
     InlinedCall* inlined_call;
@@ -54,53 +94,218 @@ static bool is_call_safely_removable(const Node* fn) {
 }
 
 typedef struct {
-    size_t num_calls;
-    size_t num_inlineable_calls;
-    bool can_be_inlined;
-    bool can_be_eliminated;
-} FnInliningCriteria;
+    Visitor visitor;
+    size_t instructions;
+} SizeVisitor;
+
+static void count_instructions(SizeVisitor* v, const Node* node) {
+    if (is_instruction(node))
+        v->instructions++;
+    visit_node_operands(&v->visitor, IGNORE_ABSTRACTIONS_MASK, node);
+}
 
-static FnInliningCriteria get_inlining_heuristic(const CompilerConfig* config, CGNode* fn_node) {
-    FnInliningCriteria crit = { 0 };
+static size_t get_function_size(const Node* fn) {
+    SizeVisitor v = {
+        .visitor = {
+            .visit_node_fn = (VisitNodeFn) count_instructions,
+        },
+    };
+    if (fn->payload.fun.body) {
+        count_instructions(&v, fn->payload.fun.body);
+        visit_function_rpo(&v.visitor, fn);
+    }
+    return v.instructions;
+}
 
-    CGEdge e;
-    size_t i = 0;
-    while (dict_iter(fn_node->callers, &i, &e, NULL)) {
-        crit.num_calls++;
-        if (is_call_potentially_inlineable(e.src_fn->fn, e.dst_fn->fn))
-            crit.num_inlineable_calls++;
+/// Rough costs and savings, counted in instructions
+enum {
+    /// What any call costs: moving the arguments and the results around
+    CallCost = 4,
+    /// lower_callf turned calls to non-leaf functions into a control around a tail call. Those end up in the
+    /// lower_tailcalls dispatcher, and everything live across them gets spilled when the join point is lifted.
+    JoinPointBonus = 32,
+    /// The arguments of non-leaf calls are passed through the stack, and so is the callee's frame
+    StackArgBonus = 2,
+    StackFrameBonus = 4,
+    /// A constant argument is likely to let the inlined body fold
+    ConstantArgBonus = 4,
+    /// Calls where the callee is at most this much bigger than what inlining it saves are inlined
+    InlineThreshold = 16,
+    /// How much a caller is allowed to grow, relative to its size, but it always gets at least MinGrowthBudget
+    GrowthBudgetPercent = 100,
+    MinGrowthBudget = 64,
+};
+
+typedef struct {
+    CGEdge edge;
+    int64_t size;
+    int64_t benefit;
+    /// this is the only call to the callee, which can be deleted once it's inlined
+    bool removes_callee;
+} InliningCandidate;
+
+static bool is_constant_arg(const Node* arg) {
+    if (resolve_to_int_literal(arg) || resolve_to_float_literal(arg))
+        return true;
+    switch (arg->tag) {
+        case True_TAG:
+        case False_TAG:
+        case FnAddr_TAG:
+        case NullPtr_TAG: return true;
+        default: return false;
     }
+}
 
-    // a function can be inlined if it has exactly one inlineable call...
-    if (crit.num_inlineable_calls <= 1 || config->optimisations.inline_everything)
-        crit.can_be_inlined = true;
+static int64_t estimate_benefit(const CGEdge* edge) {
+    int64_t benefit = CallCost;
+    Nodes args;
+    if (edge->instr->tag == TailCall_TAG) {
+        args = edge->instr->payload.tail_call.args;
+        benefit += JoinPointBonus + StackFrameBonus + StackArgBonus * args.count;
+    } else {
+        assert(edge->instr->tag == Call_TAG);
+        args = edge->instr->payload.call.args;
+    }
+    for (size_t i = 0; i < args.count; i++) {
+        if (is_constant_arg(args.nodes[i]))
+            benefit += ConstantArgBonus;
+    }
+    return benefit;
+}
 
+static bool can_inline_into_callers(CGNode* fn_node) {
     // avoid inlining recursive things for now
+    return !fn_node->is_address_captured && !fn_node->is_recursive;
+}
+
+static bool can_be_eliminated(CGNode* fn_node) {
+    // the address must remain available for the indirect calls
     if (fn_node->is_address_captured || fn_node->is_recursive)
-        crit.can_be_inlined = false;
-
-    // it can be eliminated if it can be inlined, and all the calls are inlineable calls ...
-    if (crit.num_calls == crit.num_inlineable_calls && crit.can_be_inlined)
-        crit.can_be_eliminated = true;
-
-    // unless the address is captured, in which case it must remain available for the indirect calls.
-    if (fn_node->is_address_captured)
-        crit.can_be_eliminated = false;
-
-    if (!is_call_safely_removable(fn_node->fn))
-        crit.can_be_eliminated = false;
-
-    debugv_print("inlining heuristic for '%s': num_calls=%d num_inlineable_calls=%d safely_removable=%d address_leaks=%d recursive=%d inlineable=%d can_be_eliminated=%d\n",
-                 get_abstraction_name(fn_node->fn),
-                 crit.num_calls,
-                 crit.num_inlineable_calls,
-                 is_call_safely_removable(fn_node->fn),
-                 fn_node->is_address_captured,
-                 fn_node->is_recursive,
-                 crit.can_be_inlined,
-                 crit.can_be_eliminated);
-
-    return crit;
+        return false;
+    return is_call_safely_removable(fn_node->fn);
+}
+
+static int compare_candidates(const void* a, const void* b) {
+    const InliningCandidate* ca = a;
+    const InliningCandidate* cb = b;
+    int64_t sa = ca->benefit - ca->size;
+    int64_t sb = cb->benefit - cb->size;
+    return (sa < sb) - (sa > sb);
+}
+
+static FnInliningInfo* get_fn_info(Context* ctx, const Node* fn) {
+    FnInliningInfo* info = find_value_dict(const Node*, FnInliningInfo, ctx->fns, fn);
+    assert(info);
+    return info;
+}
+
+/// Decides which call sites get inlined before the rewrite, so that it is known which functions disappear.
+/// Every call is weighed on its own: the size of the callee against what inlining saves.
+/// The most profitable calls go first, until the caller has used up its growth budget.
+static void plan_inlining(Context* ctx) {
+    const CompilerConfig* config = ctx->config;
+    bool print_stats = config->logging.pass_stats;
+
+    size_t i = 0;
+    CGNode* fn_node;
+    while (dict_iter(ctx->graph->fn2cgn, &i, NULL, &fn_node)) {
+        FnInliningInfo info = { .size = get_function_size(fn_node->fn) };
+        insert_dict(const Node*, FnInliningInfo, ctx->fns, fn_node->fn, info);
+    }
+
+    struct List* candidates = new_list(InliningCandidate);
+    i = 0;
+    while (dict_iter(ctx->graph->fn2cgn, &i, NULL, &fn_node)) {
+        if (!can_inline_into_callers(fn_node))
+            continue;
+        size_t num_calls = entries_count_dict(fn_node->callers);
+        size_t j = 0;
+        CGEdge e;
+        while (dict_iter(fn_node->callers, &j, &e, NULL)) {
+            if (!is_call_potentially_inlineable(e.src_fn->fn, e.dst_fn->fn))
+                continue;
+            InliningCandidate candidate = {
+                .edge = e,
+                .size = (int64_t) get_fn_info(ctx, fn_node->fn)->size,
+                .benefit = estimate_benefit(&e),
+                .removes_callee = num_calls == 1 && can_be_eliminated(fn_node),
+            };
+            append_list(InliningCandidate, candidates, candidate);
+        }
+    }
+
+    size_t candidates_count = entries_count_list(candidates);
+    InliningCandidate* sorted = read_list(InliningCandidate, candidates);
+    qsort(sorted, candidates_count, sizeof(InliningCandidate), compare_candidates);
+    for (size_t k = 0; k < candidates_count; k++) {
+        InliningCandidate* candidate = &sorted[k];
+        const Node* src_fn = candidate->edge.src_fn->fn;
+        const Node* dst_fn = candidate->edge.dst_fn->fn;
+        ctx->stats.considered_sites++;
+
+        // inlining the only call to a function doesn't make anything bigger
+        bool forced = config->optimisations.inline_everything || candidate->removes_callee;
+        if (!forced && candidate->size - candidate->benefit > InlineThreshold) {
+            ctx->stats.rejected_for_cost++;
+            if (print_stats)
+                info_print("opt_inline: not inlining '%s' into '%s': size=%d benefit=%d\n", get_abstraction_name(dst_fn), get_abstraction_name(src_fn), (int) candidate->size, (int) candidate->benefit);
+            continue;
+        }
+
+        FnInliningInfo* host = get_fn_info(ctx, src_fn);
+        size_t growth = candidate->removes_callee ? 0 : (size_t) candidate->size;
+        size_t budget = host->size * GrowthBudgetPercent / 100;
+        if (budget < MinGrowthBudget)
+            budget = MinGrowthBudget;
+        if (!forced && host->growth + growth > budget) {
+            ctx->stats.rejected_for_budget++;
+            if (print_stats)
+                info_print("opt_inline: not inlining '%s' into '%s': growth budget exhausted (%d/%d)\n", get_abstraction_name(dst_fn), get_abstraction_name(src_fn), (int) host->growth, (int) budget);
+            continue;
+        }
+
+        host->growth += growth;
+        ctx->stats.growth += growth;
+        ctx->stats.inlined_sites++;
+        CallSite site = { .src_fn = src_fn, .instr = candidate->edge.instr };
+        insert_set_get_result(CallSite, ctx->inlined_sites, site);
+        if (print_stats)
+            info_print("opt_inline: inlining '%s' into '%s': size=%d benefit=%d%s\n", get_abstraction_name(dst_fn), get_abstraction_name(src_fn), (int) candidate->size, (int) candidate->benefit, candidate->removes_callee ? " (only call)" : "");
+    }
+    destroy_list(candidates);
+
+    // a function goes away once nothing refers to it anymore
+    i = 0;
+    while (dict_iter(ctx->graph->fn2cgn, &i, NULL, &fn_node)) {
+        FnInliningInfo* info = get_fn_info(ctx, fn_node->fn);
+        info->can_be_eliminated = can_be_eliminated(fn_node);
+        size_t j = 0;
+        CGEdge e;
+        while (dict_iter(fn_node->callers, &j, &e, NULL) && info->can_be_eliminated) {
+            CallSite site = { .src_fn = e.src_fn->fn, .instr = e.instr };
+            info->can_be_eliminated &= find_key_dict(CallSite, ctx->inlined_sites, site) != NULL;
+        }
+        if (info->can_be_eliminated)
+            ctx->stats.eliminated_fns++;
+        debugv_print("inlining info for '%s': size=%d num_calls=%d address_leaks=%d recursive=%d growth=%d can_be_eliminated=%d\n",
+                     get_abstraction_name(fn_node->fn),
+                     (int) info->size,
+                     (int) entries_count_dict(fn_node->callers),
+                     fn_node->is_address_captured,
+                     fn_node->is_recursive,
+                     (int) info->growth,
+                     info->can_be_eliminated);
+    }
+
+    if (print_stats)
+        info_print("opt_inline: %d call sites considered, %d inlined, %d too costly, %d over the growth budget, %d functions eliminated, %d instructions added\n",
+                   (int) ctx->stats.considered_sites, (int) ctx->stats.inlined_sites, (int) ctx->stats.rejected_for_cost,
+                   (int) ctx->stats.rejected_for_budget, (int) ctx->stats.eliminated_fns, (int) ctx->stats.growth);
+}
+
+static bool is_call_site_inlined(Context* ctx, const Node* instr) {
+    CallSite site = { .src_fn = ctx->old_fun, .instr = instr };
+    return find_key_dict(CallSite, ctx->inlined_sites, site) != NULL;
 }
 
 /// inlines the abstraction with supplied arguments
@@ -117,6 +322,7 @@ static const Node* inline_call(Context* ctx, const Node* ocallee, Nodes nargs, c
         .return_jp = return_to,
     };
     inline_context.inlined_call = &inlined_call;
+    inline_context.old_fun = ocallee;
 
     Nodes oparams = get_abstraction_params(ocallee);
     register_processed_list(&inline_context.rewriter, oparams, nargs);
@@ -143,12 +349,9 @@ static const Node* process(Context* ctx, const Node* node) {
 
     switch (node->tag) {
         case Function_TAG: {
-            if (ctx->graph) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, node);
-                if (get_inlining_heuristic(ctx->config, fn_node).can_be_eliminated) {
-                    debugv_print("Eliminating %s because it has exactly one caller\n", get_abstraction_name(fn_node->fn));
-                    return NULL;
-                }
+            if (ctx->graph && get_fn_info(ctx, node)->can_be_eliminated) {
+                debugv_print("Eliminating %s because all the calls to it were inlined\n", get_abstraction_name(node));
+                return NULL;
             }
 
             Nodes annotations = rewrite_nodes(&ctx->rewriter, node->payload.fun.annotations);
@@ -174,8 +377,7 @@ static const Node* process(Context* ctx, const Node* node) {
 
             ocallee = ignore_immediate_fn_addr(ocallee);
             if (ocallee->tag == Function_TAG) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, ocallee);
-                if (get_inlining_heuristic(ctx->config, fn_node).can_be_inlined && is_call_potentially_inlineable(ctx->old_fun, ocallee)) {
+                if (is_call_site_inlined(ctx, node)) {
                     debugv_print("Inlining call to %s\n", get_abstraction_name(ocallee));
                     Nodes nargs = rewrite_nodes(&ctx->rewriter, oargs);
 
@@ -219,8 +421,7 @@ static const Node* process(Context* ctx, const Node* node) {
             const Node* ocallee = node->payload.tail_call.target;
             ocallee = ignore_immediate_fn_addr(ocallee);
             if (ocallee->tag == Function_TAG) {
-                CGNode* fn_node = *find_value_dict(const Node*, CGNode*, ctx->graph->fn2cgn, ocallee);
-                if (get_inlining_heuristic(ctx->config, fn_node).can_be_inlined) {
+                if (is_call_site_inlined(ctx, node)) {
                     debugv_print("Inlining tail call to %s\n", get_abstraction_name(ocallee));
                     Nodes nargs = rewrite_nodes(&ctx->rewriter, node->payload.tail_call.args);
                     return inline_call(ctx, ocallee, nargs, NULL);
@@ -237,9 +438,6 @@ static const Node* process(Context* ctx, const Node* node) {
     return new;
 }
 
-KeyHash hash_node(const Node**);
-bool compare_node(const Node**, const Node**);
-
 void opt_simplify_cf(const CompilerConfig* config, Module* src, Module* dst) {
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
@@ -249,10 +447,15 @@ void opt_simplify_cf(const CompilerConfig* config, Module* src, Module* dst) {
         .inlined_call = NULL,
     };
     ctx.graph = new_callgraph(src);
+    ctx.fns = new_dict(const Node*, FnInliningInfo, (HashFn) hash_node, (CmpFn) compare_node);
+    ctx.inlined_sites = new_set(CallSite, (HashFn) hash_call_site, (CmpFn) compare_call_sites);
+    plan_inlining(&ctx);
 
     rewrite_module(&ctx.rewriter);
     if (ctx.graph)
         destroy_callgraph(ctx.graph);
+    destroy_dict(ctx.fns);
+    destroy_dict(ctx.inlined_sites);
 
     destroy_rewriter(&ctx.rewriter);
 }
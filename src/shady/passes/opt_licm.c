@@ -0,0 +1,276 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../analysis/cfg.h"
+#include "../analysis/looptree.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef struct {
+    CFG* cfg;
+    LoopTree* lt;
+    /// Params and variables -> the CFNode from which on they are available
+    struct Dict* defs;
+    /// Hoisted lets -> the CFNode they were moved to
+    struct Dict* hoisted;
+    /// Preheader abstractions -> List of the lets to bind just before their terminator
+    struct Dict* preheaders;
+} Plan;
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    Plan* plan;
+    /// Set when rewriting a preheader, until its terminator is reached
+    const Node* preheader;
+
+    size_t hoisted_instructions;
+} Context;
+
+/// Either a structured loop body or the header of an unstructured loop
+typedef struct {
+    CFNode* entry;
+    /// NULL for structured loops
+    LTNode* head;
+} LoopRegion;
+
+static bool dominates(const CFNode* a, const CFNode* b) {
+    while (b) {
+        if (a == b)
+            return true;
+        b = b->idom;
+    }
+    return false;
+}
+
+static bool in_region(Plan* plan, LoopRegion* loop, CFNode* n) {
+    if (!dominates(loop->entry, n))
+        return false;
+    if (!loop->head)
+        return true;
+    for (LTNode* lt = looptree_lookup(plan->lt, n->node); lt; lt = lt->parent) {
+        if (lt == loop->head)
+            return true;
+    }
+    return false;
+}
+
+static bool is_invariant(Plan* plan, LoopRegion* loop, const Node* value) {
+    switch (value->tag) {
+        case Param_TAG:
+        case Variablez_TAG: {
+            CFNode** def = find_value_dict(const Node*, CFNode*, plan->defs, value);
+            return def && *def != loop->entry && dominates(*def, loop->entry);
+        }
+        case Composite_TAG: {
+            Nodes contents = value->payload.composite.contents;
+            for (size_t i = 0; i < contents.count; i++) {
+                if (!is_invariant(plan, loop, contents.nodes[i]))
+                    return false;
+            }
+            return true;
+        }
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case StringLiteral_TAG:
+        case NullPtr_TAG:
+        case Undef_TAG:
+        case RefDecl_TAG:
+        case FnAddr_TAG: return true;
+        default: return false;
+    }
+}
+
+static bool is_hoistable(const Node* instruction) {
+    if (instruction->tag != PrimOp_TAG)
+        return false;
+    Op op = instruction->payload.prim_op.op;
+    if (op == quote_op)
+        return false;
+    // the loop body might not run every one of its instructions, so they get speculated: nothing that could trap
+    if (op == div_op || op == mod_op)
+        return false;
+    return is_primop_pure(op);
+}
+
+static void hoist_loop(Context* ctx, LoopRegion* loop) {
+    Plan* plan = ctx->plan;
+    CFNode* preheader = loop->entry->idom;
+    struct List** found = find_value_dict(const Node*, struct List*, plan->preheaders, preheader->node);
+    struct List* hoisted = found ? *found : NULL;
+
+    // in reverse post-order, operands get hoisted before their users
+    for (size_t i = loop->entry->rpo_index; i < plan->cfg->size; i++) {
+        CFNode* n = plan->cfg->rpo[i];
+        if (!in_region(plan, loop, n))
+            continue;
+        const Node* let = get_abstraction_body(n->node);
+        if (!let || let->tag != Let_TAG || find_key_dict(const Node*, plan->hoisted, let))
+            continue;
+        const Node* instruction = get_let_instruction(let);
+        if (!is_hoistable(instruction))
+            continue;
+        Nodes operands = instruction->payload.prim_op.operands;
+        bool invariant = true;
+        for (size_t j = 0; j < operands.count && invariant; j++)
+            invariant &= is_invariant(plan, loop, operands.nodes[j]);
+        if (!invariant)
+            continue;
+
+        debugv_print("opt_licm: hoisting ");
+        log_node(DEBUGV, instruction);
+        debugv_print(" out of the loop at %s\n", get_abstraction_name_safe(loop->entry->node));
+
+        if (!hoisted) {
+            hoisted = new_list(const Node*);
+            insert_dict(const Node*, struct List*, plan->preheaders, preheader->node, hoisted);
+        }
+        append_list(const Node*, hoisted, let);
+        insert_dict(const Node*, CFNode*, plan->hoisted, let, preheader);
+        Nodes vars = let->payload.let.variables;
+        for (size_t j = 0; j < vars.count; j++)
+            insert_dict(const Node*, CFNode*, plan->defs, vars.nodes[j], preheader);
+        ctx->hoisted_instructions++;
+    }
+}
+
+static Plan* plan_function(Context* ctx, const Node* fn) {
+    Plan* plan = calloc(1, sizeof(Plan));
+    *plan = (Plan) {
+        .defs = new_dict(const Node*, CFNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .hoisted = new_dict(const Node*, CFNode*, (HashFn) hash_node, (CmpFn) compare_node),
+        .preheaders = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    plan->cfg = build_fn_cfg(fn);
+    plan->lt = build_loop_tree(plan->cfg);
+    ctx->plan = plan;
+    CFG* cfg = plan->cfg;
+
+    for (size_t i = 0; i < cfg->size; i++) {
+        CFNode* n = cfg->rpo[i];
+        Nodes params = get_abstraction_params(n->node);
+        for (size_t j = 0; j < params.count; j++)
+            insert_dict(const Node*, CFNode*, plan->defs, params.nodes[j], n);
+        // variables are only visible from the tail of their let on
+        const Node* let = get_abstraction_body(n->node);
+        if (let && let->tag == Let_TAG) {
+            CFNode* tail = cfg_lookup(cfg, get_let_tail(let));
+            Nodes vars = let->payload.let.variables;
+            for (size_t j = 0; tail && j < vars.count; j++)
+                insert_dict(const Node*, CFNode*, plan->defs, vars.nodes[j], tail);
+        }
+    }
+
+    // outer loops come first, so instructions get hoisted as far out as they can go
+    for (size_t i = 0; i < cfg->size; i++) {
+        CFNode* n = cfg->rpo[i];
+        if (!n->idom)
+            continue;
+        const Node* parent_let = get_abstraction_body(n->idom->node);
+        if (parent_let && parent_let->tag == Let_TAG && get_let_instruction(parent_let)->tag == Loop_TAG && get_let_instruction(parent_let)->payload.loop_instr.body == n->node) {
+            hoist_loop(ctx, &(LoopRegion) { .entry = n });
+            continue;
+        }
+        LTNode* lt = looptree_lookup(plan->lt, n->node);
+        LTNode* head = lt->parent;
+        if (head && head->type == LF_HEAD && entries_count_list(head->cf_nodes) == 1 && read_list(CFNode*, head->cf_nodes)[0] == n)
+            hoist_loop(ctx, &(LoopRegion) { .entry = n, .head = head });
+    }
+
+    return plan;
+}
+
+static void destroy_plan(Plan* plan) {
+    size_t i = 0;
+    struct List* hoisted;
+    while (dict_iter(plan->preheaders, &i, NULL, &hoisted))
+        destroy_list(hoisted);
+    destroy_dict(plan->preheaders);
+    destroy_dict(plan->hoisted);
+    destroy_dict(plan->defs);
+    destroy_loop_tree(plan->lt);
+    destroy_cfg(plan->cfg);
+    free(plan);
+}
+
+static const Node* recreate_abstraction(Context* ctx, const Node* node) {
+    if (ctx->plan && find_key_dict(const Node*, ctx->plan->preheaders, node)) {
+        Context c = *ctx;
+        c.preheader = node;
+        return recreate_node_identity(&c.rewriter, node);
+    }
+    return recreate_node_identity(&ctx->rewriter, node);
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+
+    // we've reached the terminator of a preheader: the hoisted instructions go right before it
+    if (ctx->preheader && node == get_abstraction_body(ctx->preheader)) {
+        Context c = *ctx;
+        c.preheader = NULL;
+        struct List* hoisted = *find_value_dict(const Node*, struct List*, ctx->plan->preheaders, ctx->preheader);
+        BodyBuilder* bb = begin_body(a);
+        for (size_t i = 0; i < entries_count_list(hoisted); i++) {
+            const Node* let = read_list(const Node*, hoisted)[i];
+            Nodes ovars = let->payload.let.variables;
+            LARRAY(String, names, ovars.count);
+            for (size_t j = 0; j < ovars.count; j++)
+                names[j] = ovars.nodes[j]->payload.varz.name;
+            Nodes nvars = bind_instruction_outputs_count(bb, rewrite_node(&c.rewriter, get_let_instruction(let)), ovars.count, names);
+            register_processed_list(&c.rewriter, ovars, nvars);
+        }
+        return finish_body(bb, recreate_node_identity(&c.rewriter, node));
+    }
+
+    switch (node->tag) {
+        case Function_TAG: {
+            if (!node->payload.fun.body)
+                break;
+            Context fn_ctx = *ctx;
+            fn_ctx.preheader = NULL;
+            Plan* plan = plan_function(&fn_ctx, node);
+            const Node* new = recreate_abstraction(&fn_ctx, node);
+            ctx->hoisted_instructions = fn_ctx.hoisted_instructions;
+            destroy_plan(plan);
+            return new;
+        }
+        case Let_TAG: {
+            if (ctx->plan && find_key_dict(const Node*, ctx->plan->hoisted, node))
+                return rewrite_node(r, get_abstraction_body(get_let_tail(node)));
+            break;
+        }
+        default: break;
+    }
+
+    if (is_abstraction(node))
+        return recreate_abstraction(ctx, node);
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_licm(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+    };
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_licm: %d instructions hoisted out of loops\n", (int) ctx.hoisted_instructions);
+
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
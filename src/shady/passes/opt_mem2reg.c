@@ -16,6 +16,13 @@
 #include "../visit.h"
 #include "../type.h"
 
+enum {
+    /// Each round only forwards what the previous one exposed, and an aggregate nested in another one is split a level
+    /// per round. Rounds don't report whether they changed anything, so rather than looking for a fixed point, this
+    /// bounds the work on deeply nested allocas.
+    MaxRounds = 5,
+};
+
 typedef struct {
     AddressSpace as;
     const Type* type;
@@ -707,7 +714,7 @@ Module* opt_mem2reg(const CompilerConfig* config, Module* src) {
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = src;
 
-    for (size_t round = 0; round < 5; round++) {
+    for (size_t round = 0; round < MaxRounds; round++) {
         dst = new_module(a, get_module_name(src));
 
         Context ctx = {
@@ -733,6 +740,9 @@ Module* opt_mem2reg(const CompilerConfig* config, Module* src) {
             destroy_ir_arena(get_module_arena(src));
 
         dst = cleanup(config, dst);
+        // the fields of the aggregates that get split are promoted by the next round, there's none after the last one
+        if (round + 1 < MaxRounds)
+            opt_split_allocas(config, &dst);
         src = dst;
     }
 
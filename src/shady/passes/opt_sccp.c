@@ -0,0 +1,565 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../fold.h"
+#include "../type.h"
+#include "../analysis/uses.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+typedef enum {
+    /// No executable definition reaches this yet
+    LatticeUndefined,
+    LatticeConstant,
+    LatticeOverdefined,
+} LatticeLevel;
+
+typedef struct {
+    LatticeLevel level;
+    /// the literal (in the destination arena) when level == LatticeConstant
+    const Node* constant;
+} LatticeValue;
+
+typedef struct {
+    /// Params and variables -> LatticeValue
+    struct Dict* values;
+    /// Abstractions and lets found to be executable -> the let with the innermost structured construct they are nested in, or NULL
+    struct Dict* scopes;
+    /// Executable abstractions, in the order they were found
+    struct List* executable;
+    /// Join point params of controls -> the let binding that control
+    struct Dict* join_points;
+    const UsesMap* uses;
+    bool changed;
+    /// Something was too murky to follow, we can't trust the results
+    bool give_up;
+} Analysis;
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    Analysis* analysis;
+
+    size_t folded_values;
+    size_t pruned_branches;
+} Context;
+
+static LatticeValue get_lattice_value(Context* ctx, const Node* node) {
+    if (is_literal(node))
+        return (LatticeValue) { .level = LatticeConstant, .constant = rewrite_node(&ctx->rewriter, node) };
+    switch (node->tag) {
+        case RefDecl_TAG: {
+            // that's how the specialization constants (subgroup size etc) come in
+            const Node* decl = node->payload.ref_decl.decl;
+            if (decl->tag == Constant_TAG && decl->payload.constant.instruction) {
+                const Node* value = get_quoted_value(decl->payload.constant.instruction);
+                if (value && is_literal(value))
+                    return get_lattice_value(ctx, value);
+            }
+            break;
+        }
+        case Param_TAG:
+        case Variablez_TAG: {
+            LatticeValue* found = find_value_dict(const Node*, LatticeValue, ctx->analysis->values, node);
+            return found ? *found : (LatticeValue) { .level = LatticeUndefined };
+        }
+        default: break;
+    }
+    return (LatticeValue) { .level = LatticeOverdefined };
+}
+
+static void meet(Context* ctx, const Node* key, LatticeValue value) {
+    Analysis* analysis = ctx->analysis;
+    if (value.level == LatticeUndefined)
+        return;
+    LatticeValue* found = find_value_dict(const Node*, LatticeValue, analysis->values, key);
+    if (!found) {
+        insert_dict(const Node*, LatticeValue, analysis->values, key, value);
+        analysis->changed = true;
+        return;
+    }
+    if (found->level == LatticeOverdefined)
+        return;
+    if (value.level == LatticeConstant && are_same_constant(found->constant, value.constant))
+        return;
+    *found = (LatticeValue) { .level = LatticeOverdefined };
+    analysis->changed = true;
+}
+
+static void meet_list(Context* ctx, Nodes keys, Nodes values) {
+    assert(keys.count == values.count);
+    for (size_t i = 0; i < keys.count; i++)
+        meet(ctx, keys.nodes[i], get_lattice_value(ctx, values.nodes[i]));
+}
+
+static void meet_overdefined(Context* ctx, Nodes keys) {
+    for (size_t i = 0; i < keys.count; i++)
+        meet(ctx, keys.nodes[i], (LatticeValue) { .level = LatticeOverdefined });
+}
+
+static void mark_executable(Context* ctx, const Node* abs, const Node* scope) {
+    Analysis* analysis = ctx->analysis;
+    if (find_key_dict(const Node*, analysis->scopes, abs))
+        return;
+    insert_dict(const Node*, const Node*, analysis->scopes, abs, scope);
+    append_list(const Node*, analysis->executable, abs);
+    analysis->changed = true;
+}
+
+static const Node* get_scope(Context* ctx, const Node* node) {
+    const Node** found = find_value_dict(const Node*, const Node*, ctx->analysis->scopes, node);
+    assert(found);
+    return *found;
+}
+
+/// Looks for the innermost let binding an instruction with the given tag
+static const Node* find_enclosing_construct(Context* ctx, const Node* scope, NodeTag tag) {
+    while (scope) {
+        if (get_let_instruction(scope)->tag == tag)
+            return scope;
+        scope = get_scope(ctx, scope);
+    }
+    return NULL;
+}
+
+/// The values computed by this instruction are available, and its tail might run
+static void leave_construct(Context* ctx, const Node* let, Nodes args) {
+    meet_list(ctx, let->payload.let.variables, args);
+    mark_executable(ctx, get_let_tail(let), get_scope(ctx, let));
+}
+
+static LatticeValue evaluate_prim_op(Context* ctx, PrimOp payload) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    if (!is_primop_pure(payload.op))
+        return (LatticeValue) { .level = LatticeOverdefined };
+
+    bool undefined = false;
+    LARRAY(const Node*, operands, payload.operands.count);
+    for (size_t i = 0; i < payload.operands.count; i++) {
+        LatticeValue value = get_lattice_value(ctx, payload.operands.nodes[i]);
+        if (value.level == LatticeOverdefined)
+            return value;
+        undefined |= value.level == LatticeUndefined;
+        operands[i] = value.constant;
+    }
+    if (undefined)
+        return (LatticeValue) { .level = LatticeUndefined };
+
+    // let the arena do the folding
+    const Node* folded = prim_op(a, (PrimOp) {
+        .op = payload.op,
+        .type_arguments = rewrite_nodes(&ctx->rewriter, payload.type_arguments),
+        .operands = nodes(a, payload.operands.count, operands)
+    });
+    const Node* value = get_quoted_value(folded);
+    if (value && is_literal(value))
+        return (LatticeValue) { .level = LatticeConstant, .constant = value };
+    return (LatticeValue) { .level = LatticeOverdefined };
+}
+
+static bool escapes(Context* ctx, const Node* join_point) {
+    for (const Use* use = get_first_use(ctx->analysis->uses, join_point); use; use = use->next_use) {
+        // the control body listing it as a param is fine
+        if (use->operand_class == NcParam)
+            continue;
+        if (use->user->tag != Join_TAG || strcmp(use->operand_name, "join_point") != 0)
+            return true;
+    }
+    return false;
+}
+
+static void visit_jump(Context* ctx, const Node* jump) {
+    assert(jump->tag == Jump_TAG);
+    const Node* target = jump->payload.jump.target;
+    meet_list(ctx, get_abstraction_params(target), jump->payload.jump.args);
+    mark_executable(ctx, target, NULL);
+}
+
+static void visit_let(Context* ctx, const Node* let, const Node* scope) {
+    Analysis* analysis = ctx->analysis;
+    const Node* instruction = get_let_instruction(let);
+    Nodes vars = let->payload.let.variables;
+    if (!find_key_dict(const Node*, analysis->scopes, let))
+        insert_dict(const Node*, const Node*, analysis->scopes, let, scope);
+
+    switch (is_instruction(instruction)) {
+        case Instruction_PrimOp_TAG: {
+            PrimOp payload = instruction->payload.prim_op;
+            if (payload.op == quote_op)
+                meet_list(ctx, vars, payload.operands);
+            else if (vars.count == 1)
+                meet(ctx, vars.nodes[0], evaluate_prim_op(ctx, payload));
+            else
+                meet_overdefined(ctx, vars);
+            mark_executable(ctx, get_let_tail(let), scope);
+            return;
+        }
+        case Instruction_If_TAG: {
+            If payload = instruction->payload.if_instr;
+            LatticeValue condition = get_lattice_value(ctx, payload.condition);
+            bool true_side = condition.level == LatticeOverdefined || (condition.level == LatticeConstant && condition.constant->tag == True_TAG);
+            bool false_side = condition.level == LatticeOverdefined || (condition.level == LatticeConstant && condition.constant->tag == False_TAG);
+            if (true_side)
+                mark_executable(ctx, payload.if_true, let);
+            if (false_side && payload.if_false)
+                mark_executable(ctx, payload.if_false, let);
+            else if (false_side)
+                leave_construct(ctx, let, empty(ctx->rewriter.src_arena));
+            return;
+        }
+        case Instruction_Match_TAG: {
+            Match payload = instruction->payload.match_instr;
+            LatticeValue inspectee = get_lattice_value(ctx, payload.inspect);
+            if (inspectee.level == LatticeUndefined)
+                return;
+            bool matched = false;
+            for (size_t i = 0; i < payload.cases.count; i++) {
+                if (inspectee.level == LatticeOverdefined || are_same_constant(inspectee.constant, rewrite_node(&ctx->rewriter, payload.literals.nodes[i]))) {
+                    mark_executable(ctx, payload.cases.nodes[i], let);
+                    matched = true;
+                }
+            }
+            if (inspectee.level == LatticeOverdefined || !matched)
+                mark_executable(ctx, payload.default_case, let);
+            return;
+        }
+        case Instruction_Loop_TAG: {
+            Loop payload = instruction->payload.loop_instr;
+            meet_list(ctx, get_abstraction_params(payload.body), payload.initial_args);
+            mark_executable(ctx, payload.body, let);
+            return;
+        }
+        case Instruction_Block_TAG: {
+            mark_executable(ctx, instruction->payload.block.inside, let);
+            return;
+        }
+        case Instruction_Control_TAG: {
+            const Node* inside = instruction->payload.control.inside;
+            const Node* join_point = first(get_abstraction_params(inside));
+            meet_overdefined(ctx, get_abstraction_params(inside));
+            if (!find_key_dict(const Node*, analysis->join_points, join_point))
+                insert_dict(const Node*, const Node*, analysis->join_points, join_point, let);
+            // if the join point gets passed around, we can't tell which joins go where
+            if (escapes(ctx, join_point)) {
+                meet_overdefined(ctx, vars);
+                mark_executable(ctx, get_let_tail(let), scope);
+            }
+            mark_executable(ctx, inside, let);
+            return;
+        }
+        default: {
+            meet_overdefined(ctx, vars);
+            mark_executable(ctx, get_let_tail(let), scope);
+            return;
+        }
+    }
+}
+
+static void visit_abstraction(Context* ctx, const Node* abs) {
+    const Node* scope = get_scope(ctx, abs);
+    const Node* body = get_abstraction_body(abs);
+    if (!body)
+        return;
+    switch (is_terminator(body)) {
+        case Terminator_Let_TAG: visit_let(ctx, body, scope); return;
+        case Terminator_Jump_TAG: visit_jump(ctx, body); return;
+        case Terminator_Branch_TAG: {
+            Branch payload = body->payload.branch;
+            LatticeValue condition = get_lattice_value(ctx, payload.branch_condition);
+            if (condition.level == LatticeOverdefined || (condition.level == LatticeConstant && condition.constant->tag == True_TAG))
+                visit_jump(ctx, payload.true_jump);
+            if (condition.level == LatticeOverdefined || (condition.level == LatticeConstant && condition.constant->tag == False_TAG))
+                visit_jump(ctx, payload.false_jump);
+            return;
+        }
+        case Terminator_Switch_TAG: {
+            Switch payload = body->payload.br_switch;
+            LatticeValue value = get_lattice_value(ctx, payload.switch_value);
+            if (value.level == LatticeUndefined)
+                return;
+            bool matched = false;
+            for (size_t i = 0; i < payload.case_jumps.count; i++) {
+                if (value.level == LatticeOverdefined || are_same_constant(value.constant, rewrite_node(&ctx->rewriter, payload.case_values.nodes[i]))) {
+                    visit_jump(ctx, payload.case_jumps.nodes[i]);
+                    matched = true;
+                }
+            }
+            if (value.level == LatticeOverdefined || !matched)
+                visit_jump(ctx, payload.default_jump);
+            return;
+        }
+        case Terminator_Join_TAG: {
+            const Node** control = find_value_dict(const Node*, const Node*, ctx->analysis->join_points, body->payload.join.join_point);
+            // otherwise the join point escaped and we've been conservative about it already
+            if (control)
+                leave_construct(ctx, *control, body->payload.join.args);
+            return;
+        }
+        case Terminator_Yield_TAG: {
+            if (!scope || get_let_instruction(scope)->tag == Loop_TAG || get_let_instruction(scope)->tag == Control_TAG) {
+                ctx->analysis->give_up = true;
+                return;
+            }
+            leave_construct(ctx, scope, body->payload.yield.args);
+            return;
+        }
+        case Terminator_MergeContinue_TAG: {
+            const Node* loop = find_enclosing_construct(ctx, scope, Loop_TAG);
+            if (!loop) {
+                ctx->analysis->give_up = true;
+                return;
+            }
+            meet_list(ctx, get_abstraction_params(get_let_instruction(loop)->payload.loop_instr.body), body->payload.merge_continue.args);
+            return;
+        }
+        case Terminator_MergeBreak_TAG: {
+            const Node* loop = find_enclosing_construct(ctx, scope, Loop_TAG);
+            if (!loop) {
+                ctx->analysis->give_up = true;
+                return;
+            }
+            leave_construct(ctx, loop, body->payload.merge_break.args);
+            return;
+        }
+        default: return;
+    }
+}
+
+static Analysis* analyse_function(Context* ctx, const Node* fn) {
+    Analysis* analysis = calloc(1, sizeof(Analysis));
+    *analysis = (Analysis) {
+        .values = new_dict(const Node*, LatticeValue, (HashFn) hash_node, (CmpFn) compare_node),
+        .scopes = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .executable = new_list(const Node*),
+        .join_points = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .uses = create_uses_map(fn, NcType | NcDeclaration),
+    };
+    ctx->analysis = analysis;
+
+    meet_overdefined(ctx, fn->payload.fun.params);
+    mark_executable(ctx, fn, NULL);
+    // revisit everything until nothing moves anymore: each value can only go down the lattice twice
+    while (analysis->changed && !analysis->give_up) {
+        analysis->changed = false;
+        for (size_t i = 0; i < entries_count_list(analysis->executable) && !analysis->give_up; i++)
+            visit_abstraction(ctx, read_list(const Node*, analysis->executable)[i]);
+    }
+
+    if (analysis->give_up)
+        debugv_print("opt_sccp: giving up on %s, its structured control flow is too irregular\n", get_abstraction_name(fn));
+    return analysis;
+}
+
+static void destroy_analysis(Analysis* analysis) {
+    destroy_dict(analysis->values);
+    destroy_dict(analysis->scopes);
+    destroy_list(analysis->executable);
+    destroy_dict(analysis->join_points);
+    destroy_uses_map(analysis->uses);
+    free(analysis);
+}
+
+/// Returns the literal this param or variable is known to hold, if any
+static const Node* get_known_constant(Context* ctx, const Node* node) {
+    if (!ctx->analysis)
+        return NULL;
+    LatticeValue* found = find_value_dict(const Node*, LatticeValue, ctx->analysis->values, node);
+    if (found && found->level == LatticeConstant)
+        return found->constant;
+    return NULL;
+}
+
+static const Node* get_known_condition(Context* ctx, const Node* condition) {
+    if (!ctx->analysis)
+        return NULL;
+    LatticeValue value = get_lattice_value(ctx, condition);
+    return value.level == LatticeConstant ? value.constant : NULL;
+}
+
+/// Blocks get flattened into their surroundings later, which only works when they end in a yield at the end of a straight line
+static bool is_straight_line(const Node* c) {
+    const Node* body = get_abstraction_body(c);
+    while (body->tag == Let_TAG)
+        body = get_abstraction_body(get_let_tail(body));
+    return body->tag == Yield_TAG;
+}
+
+/// Stands in for a side of a structured construct that never runs.
+/// Not an unreachable() terminator: the folding would turn the construct into a block, which isn't necessarily straight either.
+static const Node* dead_case(IrArena* a, Nodes yield_types) {
+    LARRAY(const Node*, undefs, yield_types.count);
+    for (size_t i = 0; i < yield_types.count; i++)
+        undefs[i] = undef(a, (Undef) { .type = yield_types.nodes[i] });
+    return case_(a, empty(a), yield(a, (Yield) { .args = nodes(a, yield_types.count, undefs) }));
+}
+
+static void register_params(Context* ctx, Nodes oparams, Nodes nparams) {
+    for (size_t i = 0; i < oparams.count; i++) {
+        const Node* constant = get_known_constant(ctx, oparams.nodes[i]);
+        if (constant)
+            ctx->folded_values++;
+        register_processed(&ctx->rewriter, oparams.nodes[i], constant ? constant : nparams.nodes[i]);
+    }
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+    switch (node->tag) {
+        case Function_TAG: {
+            if (!node->payload.fun.body)
+                break;
+            Context fn_ctx = *ctx;
+            Analysis* analysis = analyse_function(&fn_ctx, node);
+            fn_ctx.analysis = analysis->give_up ? NULL : analysis;
+            const Node* new = recreate_node_identity(&fn_ctx.rewriter, node);
+            ctx->folded_values = fn_ctx.folded_values;
+            ctx->pruned_branches = fn_ctx.pruned_branches;
+            destroy_analysis(analysis);
+            return new;
+        }
+        case Let_TAG: {
+            if (!ctx->analysis)
+                break;
+            Nodes ovars = node->payload.let.variables;
+            bool all_known = true, any_known = false;
+            for (size_t i = 0; i < ovars.count; i++) {
+                bool known = get_known_constant(ctx, ovars.nodes[i]);
+                all_known &= known;
+                any_known |= known;
+            }
+            const Node* oinstruction = get_let_instruction(node);
+            if (all_known && ovars.count > 0 && oinstruction->tag == PrimOp_TAG && !has_primop_got_side_effects(oinstruction->payload.prim_op.op)) {
+                register_params(ctx, ovars, empty(a));
+                return rewrite_node(r, get_abstraction_body(get_let_tail(node)));
+            }
+            if (!any_known)
+                break;
+            // the instruction has to stay, but its results don't
+            const Node* instruction = rewrite_node(r, oinstruction);
+            Nodes nvars = recreate_vars(a, ovars, instruction);
+            register_params(ctx, ovars, nvars);
+            return let(a, instruction, nvars, rewrite_node(r, get_let_tail(node)));
+        }
+        case Case_TAG: {
+            Nodes oparams = get_abstraction_params(node);
+            Nodes nparams = recreate_params(r, oparams);
+            register_params(ctx, oparams, nparams);
+            return case_(a, nparams, rewrite_node(r, get_abstraction_body(node)));
+        }
+        case BasicBlock_TAG: {
+            Nodes oparams = get_abstraction_params(node);
+            Nodes nparams = recreate_params(r, oparams);
+            register_params(ctx, oparams, nparams);
+            Node* bb = basic_block(a, (Node*) rewrite_node(r, node->payload.basic_block.fn), nparams, node->payload.basic_block.name);
+            register_processed(r, node, bb);
+            bb->payload.basic_block.body = rewrite_node(r, get_abstraction_body(node));
+            return bb;
+        }
+        case Branch_TAG: {
+            const Node* condition = get_known_condition(ctx, node->payload.branch.branch_condition);
+            if (!condition)
+                break;
+            ctx->pruned_branches++;
+            return rewrite_node(r, condition->tag == True_TAG ? node->payload.branch.true_jump : node->payload.branch.false_jump);
+        }
+        case Switch_TAG: {
+            Switch payload = node->payload.br_switch;
+            const Node* value = get_known_condition(ctx, payload.switch_value);
+            if (!value)
+                break;
+            ctx->pruned_branches++;
+            for (size_t i = 0; i < payload.case_values.count; i++) {
+                if (are_same_constant(value, rewrite_node(r, payload.case_values.nodes[i])))
+                    return rewrite_node(r, payload.case_jumps.nodes[i]);
+            }
+            return rewrite_node(r, payload.default_jump);
+        }
+        case If_TAG: {
+            If payload = node->payload.if_instr;
+            const Node* condition = get_known_condition(ctx, payload.condition);
+            if (!condition)
+                break;
+            ctx->pruned_branches++;
+            Nodes yield_types = rewrite_nodes(r, payload.yield_types);
+            const Node* taken = condition->tag == True_TAG ? payload.if_true : payload.if_false;
+            if (!taken)
+                return quote_helper(a, empty(a));
+            if (is_straight_line(taken))
+                return block(a, (Block) { .inside = rewrite_node(r, taken), .yield_types = add_qualifiers(a, yield_types, false) });
+            // the taken side leaves some other way, so the construct stays but the other side goes
+            const Node* dead = dead_case(a, yield_types);
+            return if_instr(a, (If) {
+                .condition = condition,
+                .yield_types = yield_types,
+                .if_true = condition->tag == True_TAG ? rewrite_node(r, taken) : dead,
+                .if_false = condition->tag == True_TAG ? (payload.if_false ? dead : NULL) : rewrite_node(r, taken),
+            });
+        }
+        case Match_TAG: {
+            Match payload = node->payload.match_instr;
+            const Node* value = get_known_condition(ctx, payload.inspect);
+            if (!value)
+                break;
+            ctx->pruned_branches++;
+            Nodes yield_types = rewrite_nodes(r, payload.yield_types);
+            const Node* taken = payload.default_case;
+            const Node* taken_literal = NULL;
+            for (size_t i = 0; i < payload.literals.count; i++) {
+                if (are_same_constant(value, rewrite_node(r, payload.literals.nodes[i]))) {
+                    taken = payload.cases.nodes[i];
+                    taken_literal = payload.literals.nodes[i];
+                    break;
+                }
+            }
+            if (is_straight_line(taken))
+                return block(a, (Block) { .inside = rewrite_node(r, taken), .yield_types = add_qualifiers(a, yield_types, false) });
+            if (!taken_literal) {
+                return match_instr(a, (Match) {
+                    .inspect = value,
+                    .yield_types = yield_types,
+                    .literals = empty(a),
+                    .cases = empty(a),
+                    .default_case = rewrite_node(r, taken),
+                });
+            }
+            return match_instr(a, (Match) {
+                .inspect = value,
+                .yield_types = yield_types,
+                .literals = singleton(rewrite_node(r, taken_literal)),
+                .cases = singleton(rewrite_node(r, taken)),
+                .default_case = dead_case(a, yield_types),
+            });
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_sccp(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+    };
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_sccp: %d values found to be constant, %d branches pruned\n", (int) ctx.folded_values, (int) ctx.pruned_branches);
+
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
@@ -0,0 +1,195 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+enum {
+    /// How many specialized functions the whole module may get
+    MaxClones = 64,
+};
+
+typedef struct {
+    const Node* fn;
+    /// The literals passed, or the callee's own params where the argument isn't known.
+    /// Nodes are hash-consed: identical patterns are the same allocation, and share a clone.
+    Nodes args;
+} CloneKey;
+
+static KeyHash hash_clone_key(CloneKey* key) {
+    return hash_murmur(&key->fn, sizeof(const Node*)) ^ hash_murmur(&key->args.nodes, sizeof(const Node**));
+}
+
+static bool compare_clone_keys(CloneKey* a, CloneKey* b) {
+    return a->fn == b->fn && a->args.count == b->args.count && a->args.nodes == b->args.nodes;
+}
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    /// CloneKey -> the specialized function
+    struct Dict* clones;
+    /// Set while rewriting the body of a clone
+    Node* clone;
+
+    size_t specialized_sites;
+} Context;
+
+static const Node* get_constant_arg(const Node* arg) {
+    const Node* def = resolve_node_to_definition(arg, default_node_resolve_config());
+    if (!def)
+        return NULL;
+    switch (def->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG: return def;
+        default: return NULL;
+    }
+}
+
+static bool is_specializable(const Node* fn) {
+    if (fn->tag != Function_TAG || !fn->payload.fun.body)
+        return false;
+    // the builtin scheduler is better left alone
+    if (lookup_annotation(fn, "Internal"))
+        return false;
+    return true;
+}
+
+static Node* get_clone(Context* ctx, const Node* ofn, Nodes pattern) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    CloneKey key = { .fn = ofn, .args = pattern };
+    Node** found = find_value_dict(CloneKey, Node*, ctx->clones, key);
+    if (found)
+        return *found;
+    if (entries_count_dict(ctx->clones) >= MaxClones) {
+        debugv_print("opt_specialize_args: out of clones for '%s'\n", get_abstraction_name(ofn));
+        return NULL;
+    }
+
+    Context clone_ctx = *ctx;
+    clone_ctx.rewriter.map = new_dict(const Node*, Node*, (HashFn) hash_node, (CmpFn) compare_node);
+
+    Nodes oparams = get_abstraction_params(ofn);
+    LARRAY(const Node*, nparams, oparams.count);
+    size_t nparams_count = 0;
+    for (size_t i = 0; i < oparams.count; i++) {
+        const Node* nvalue;
+        if (pattern.nodes[i] == oparams.nodes[i])
+            nvalue = nparams[nparams_count++] = recreate_param(&clone_ctx.rewriter, oparams.nodes[i]);
+        else
+            nvalue = rewrite_node(&clone_ctx.rewriter, pattern.nodes[i]);
+        register_processed(&clone_ctx.rewriter, oparams.nodes[i], nvalue);
+    }
+
+    Nodes annotations = rewrite_nodes(&ctx->rewriter, ofn->payload.fun.annotations);
+    annotations = filter_out_annotation(a, annotations, "Exported");
+    annotations = filter_out_annotation(a, annotations, "EntryPoint");
+    String name = format_string_interned(a, "%s_specialized_%d", get_abstraction_name(ofn), (int) entries_count_dict(ctx->clones));
+    Node* clone = function(ctx->rewriter.dst_module, nodes(a, nparams_count, nparams), name, annotations, rewrite_nodes(&ctx->rewriter, ofn->payload.fun.return_types));
+    debugv_print("opt_specialize_args: specializing '%s' into '%s'\n", get_abstraction_name(ofn), name);
+
+    // recursive calls with the same constants find the clone already there
+    insert_dict(CloneKey, Node*, ctx->clones, key, clone);
+    clone_ctx.clone = clone;
+    clone->payload.fun.body = rewrite_node(&clone_ctx.rewriter, ofn->payload.fun.body);
+    ctx->specialized_sites = clone_ctx.specialized_sites;
+    destroy_dict(clone_ctx.rewriter.map);
+    return clone;
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+
+    switch (node->tag) {
+        case Function_TAG: {
+            // other functions can be reached from the body of a clone, they're not part of it
+            if (ctx->clone) {
+                Context c = *ctx;
+                c.clone = NULL;
+                const Node* new = recreate_node_identity(&c.rewriter, node);
+                ctx->specialized_sites = c.specialized_sites;
+                return new;
+            }
+            break;
+        }
+        case Call_TAG: {
+            const Node* ocallee = node->payload.call.callee;
+            if (ocallee->tag != FnAddr_TAG || !is_specializable(ocallee->payload.fn_addr.fn))
+                break;
+            const Node* ofn = ocallee->payload.fn_addr.fn;
+            Nodes oargs = node->payload.call.args;
+            Nodes oparams = get_abstraction_params(ofn);
+            assert(oargs.count == oparams.count);
+
+            LARRAY(const Node*, pattern, oargs.count);
+            size_t constants = 0;
+            for (size_t i = 0; i < oargs.count; i++) {
+                pattern[i] = get_constant_arg(oargs.nodes[i]);
+                if (pattern[i])
+                    constants++;
+                else
+                    pattern[i] = oparams.nodes[i];
+            }
+            if (constants == 0)
+                break;
+
+            Node* clone = get_clone(ctx, ofn, nodes(ctx->rewriter.src_arena, oargs.count, pattern));
+            if (!clone)
+                break;
+            LARRAY(const Node*, nargs, oargs.count - constants);
+            size_t nargs_count = 0;
+            for (size_t i = 0; i < oargs.count; i++) {
+                if (pattern[i] == oparams.nodes[i])
+                    nargs[nargs_count++] = rewrite_node(r, oargs.nodes[i]);
+            }
+            ctx->specialized_sites++;
+            return call(a, (Call) { .callee = fn_addr_helper(a, clone), .args = nodes(a, nargs_count, nargs) });
+        }
+        case BasicBlock_TAG: {
+            if (!ctx->clone)
+                break;
+            Nodes nparams = recreate_params(r, get_abstraction_params(node));
+            register_processed_list(r, get_abstraction_params(node), nparams);
+            Node* bb = basic_block(a, ctx->clone, nparams, get_abstraction_name(node));
+            register_processed(r, node, bb);
+            bb->payload.basic_block.body = rewrite_node(r, get_abstraction_body(node));
+            return bb;
+        }
+        case Return_TAG: {
+            if (!ctx->clone)
+                break;
+            return fn_ret(a, (Return) { .fn = ctx->clone, .args = rewrite_nodes(r, node->payload.fn_ret.args) });
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_specialize_args(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .clones = new_dict(CloneKey, Node*, (HashFn) hash_clone_key, (CmpFn) compare_clone_keys),
+    };
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_specialize_args: %d call sites specialized, %d clones created\n", (int) ctx.specialized_sites, (int) entries_count_dict(ctx.clones));
+
+    destroy_dict(ctx.clones);
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
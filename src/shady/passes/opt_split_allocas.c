@@ -0,0 +1,193 @@
+#include "passes.h"
+
+#include "log.h"
+#include "portability.h"
+#include "dict.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+#include "../transform/ir_gen_helpers.h"
+#include "../analysis/uses.h"
+#include "../analysis/leak.h"
+
+#include <assert.h>
+
+enum {
+    /// Bigger aggregates are left whole, splitting them would trade memory traffic for register pressure
+    MaxSplitFields = 16,
+};
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+    const UsesMap* uses;
+    /// old alloca variables -> a new alloca for each of their fields
+    struct Dict* fields;
+    size_t split;
+} Context;
+
+static Nodes get_aggregate_fields(IrArena* a, const Type* t) {
+    t = get_maybe_nominal_type_body(t);
+    switch (t->tag) {
+        case RecordType_TAG: {
+            if (t->payload.record_type.special != NotSpecial)
+                break;
+            return t->payload.record_type.members;
+        }
+        case ArrType_TAG: {
+            const IntLiteral* size = t->payload.arr_type.size ? resolve_to_int_literal(t->payload.arr_type.size) : NULL;
+            if (!size || get_int_literal_value(*size, false) > MaxSplitFields)
+                break;
+            size_t count = get_int_literal_value(*size, false);
+            LARRAY(const Type*, elements, count);
+            for (size_t i = 0; i < count; i++)
+                elements[i] = t->payload.arr_type.element_type;
+            return nodes(a, count, elements);
+        }
+        default: break;
+    }
+    return empty(a);
+}
+
+/// Returns which field a lea on the alloca selects, or -1 if it's not a constant one
+static int64_t get_selected_field(const Node* lea, size_t fields_count) {
+    Nodes operands = lea->payload.prim_op.operands;
+    if (operands.count < 3)
+        return -1;
+    const IntLiteral* offset = resolve_to_int_literal(operands.nodes[1]);
+    const IntLiteral* index = resolve_to_int_literal(operands.nodes[2]);
+    if (!offset || get_int_literal_value(*offset, false) != 0 || !index)
+        return -1;
+    int64_t field = get_int_literal_value(*index, false);
+    return field >= 0 && field < fields_count ? field : -1;
+}
+
+/// The alloca can be split when it doesn't leak and every lea on it selects a field with constants
+static bool is_splittable(Context* ctx, const Node* var, size_t fields_count) {
+    if (is_ptr_leaking(ctx->uses, var))
+        return false;
+    for (const Use* use = get_first_use(ctx->uses, var); use; use = use->next_use) {
+        if (use->user->tag == PrimOp_TAG && use->user->payload.prim_op.op == lea_op && get_selected_field(use->user, fields_count) < 0)
+            return false;
+    }
+    return true;
+}
+
+static const Node* process_let(Context* ctx, const Node* old) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+    const Node* oinstruction = get_let_instruction(old);
+    Nodes ovars = old->payload.let.variables;
+    if (!ctx->uses || oinstruction->tag != PrimOp_TAG)
+        return NULL;
+    PrimOp payload = oinstruction->payload.prim_op;
+    const Node* optr = payload.operands.count > 0 ? first(payload.operands) : NULL;
+
+    switch (payload.op) {
+        case alloca_op:
+        case alloca_logical_op: {
+            const Type* t = first(payload.type_arguments);
+            Nodes ofields = get_aggregate_fields(r->src_arena, t);
+            if (ofields.count == 0 || ofields.count > MaxSplitFields || !is_splittable(ctx, first(ovars), ofields.count))
+                return NULL;
+            debugv_print("opt_split_allocas: splitting ");
+            log_node(DEBUGV, first(ovars));
+            debugv_print(" into %d allocas.\n", (int) ofields.count);
+
+            BodyBuilder* bb = begin_body(a);
+            LARRAY(const Node*, nfields, ofields.count);
+            for (size_t i = 0; i < ofields.count; i++)
+                nfields[i] = gen_primop_e(bb, payload.op, singleton(rewrite_node(r, ofields.nodes[i])), empty(a));
+            const Node* ovar = first(ovars);
+            Nodes nfields_list = nodes(a, ofields.count, nfields);
+            insert_dict(const Node*, Nodes, ctx->fields, ovar, nfields_list);
+            ctx->split++;
+            return finish_body(bb, get_abstraction_body(rewrite_node(r, old->payload.let.tail)));
+        }
+        case lea_op: {
+            Nodes* fields = find_value_dict(const Node*, Nodes, ctx->fields, optr);
+            if (!fields)
+                return NULL;
+            const Node* field = fields->nodes[get_selected_field(oinstruction, fields->count)];
+            Nodes rest = rewrite_nodes(r, nodes(a, payload.operands.count - 3, &payload.operands.nodes[3]));
+            BodyBuilder* bb = begin_body(a);
+            if (rest.count > 0)
+                field = gen_lea(bb, field, int32_literal(a, 0), rest);
+            register_processed(r, first(ovars), field);
+            return finish_body(bb, get_abstraction_body(rewrite_node(r, old->payload.let.tail)));
+        }
+        case load_op: {
+            Nodes* fields = find_value_dict(const Node*, Nodes, ctx->fields, optr);
+            if (!fields)
+                return NULL;
+            // the whole thing is read at once, put it back together
+            BodyBuilder* bb = begin_body(a);
+            LARRAY(const Node*, values, fields->count);
+            for (size_t i = 0; i < fields->count; i++)
+                values[i] = gen_load(bb, fields->nodes[i]);
+            const Type* t = rewrite_node(r, get_pointer_type_element(get_unqualified_type(optr->type)));
+            register_processed(r, first(ovars), composite_helper(a, t, nodes(a, fields->count, values)));
+            return finish_body(bb, get_abstraction_body(rewrite_node(r, old->payload.let.tail)));
+        }
+        case store_op: {
+            Nodes* fields = find_value_dict(const Node*, Nodes, ctx->fields, optr);
+            if (!fields)
+                return NULL;
+            BodyBuilder* bb = begin_body(a);
+            const Node* value = rewrite_node(r, payload.operands.nodes[1]);
+            for (size_t i = 0; i < fields->count; i++)
+                gen_store(bb, fields->nodes[i], gen_extract(bb, value, singleton(int32_literal(a, i))));
+            return finish_body(bb, get_abstraction_body(rewrite_node(r, old->payload.let.tail)));
+        }
+        default: return NULL;
+    }
+}
+
+static const Node* process(Context* ctx, const Node* old) {
+    switch (old->tag) {
+        case Function_TAG: {
+            Node* fun = recreate_decl_header_identity(&ctx->rewriter, old);
+            Context fun_ctx = *ctx;
+            fun_ctx.uses = create_uses_map(old, (NcDeclaration | NcType));
+            if (old->payload.fun.body)
+                fun->payload.fun.body = rewrite_node(&fun_ctx.rewriter, old->payload.fun.body);
+            destroy_uses_map(fun_ctx.uses);
+            ctx->split = fun_ctx.split;
+            return fun;
+        }
+        case Constant_TAG: {
+            Context fun_ctx = *ctx;
+            fun_ctx.uses = NULL;
+            return recreate_node_identity(&fun_ctx.rewriter, old);
+        }
+        case Let_TAG: {
+            const Node* new = process_let(ctx, old);
+            if (new)
+                return new;
+            break;
+        }
+        default: break;
+    }
+    return recreate_node_identity(&ctx->rewriter, old);
+}
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+bool opt_split_allocas(const CompilerConfig* config, Module** m) {
+    Module* src = *m;
+    IrArena* a = get_module_arena(src);
+    Module* dst = new_module(a, get_module_name(src));
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .fields = new_dict(const Node*, Nodes, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    rewrite_module(&ctx.rewriter);
+    if (config->logging.pass_stats && ctx.split > 0)
+        info_print("opt_split_allocas: %d aggregate allocas split into their fields\n", (int) ctx.split);
+    destroy_rewriter(&ctx.rewriter);
+    destroy_dict(ctx.fields);
+    *m = dst;
+    return ctx.split > 0;
+}
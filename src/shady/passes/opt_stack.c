@@ -1,24 +1,325 @@
 #include "passes.h"
 
 #include "../rewrite.h"
+#include "../type.h"
+#include "../visit.h"
+#include "../analysis/uses.h"
+#include "../analysis/cfg.h"
 #include "portability.h"
+#include "dict.h"
+#include "list.h"
+#include "arena.h"
 #include "log.h"
 
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
 typedef struct StackState_ StackState;
 struct StackState_ {
     StackState* prev;
     enum { VALUE, MERGE } type;
     bool leaks;
     const Node* value;
+    const Type* value_type;
     size_t count;
     const Node** values;
 };
 
+/// How a function gets entered, as far as the stack is concerned
+typedef struct {
+    /// Every FnAddr referring to the function
+    size_t uses;
+    /// The stack sizes the join points resuming into it were made with
+    struct List* jp_sps;
+    /// The tail calls targeting it directly
+    struct List* tail_calls;
+} FnInfo;
+
 typedef struct {
     Rewriter rewriter;
     StackState* state;
+
+    Arena* arena;
+    /// FnInfo* for every function that is entered through something else than a call
+    struct Dict* fns;
+    /// get_stack_size variables -> the lets pushing what's on top of the stack at that point, in order
+    struct Dict* runs;
+    /// How many join points were made with each stack size
+    struct Dict* sp_uses;
+
+    /// The push lets that go away along with the pop they're paired with
+    struct Dict* removed_pushes;
+    /// The pop lets that go away -> what the popped value is replaced with
+    struct Dict* forwarded_pops;
+    /// The params that go away -> what they're replaced with
+    struct Dict* forwarded_params;
+    /// Functions that lose params -> the ones they keep
+    struct Dict* kept_params;
+
+    size_t* eliminated;
 } Context;
 
+static FnInfo* get_fn_info(Context* ctx, const Node* fn) {
+    FnInfo** found = find_value_dict(const Node*, FnInfo*, ctx->fns, fn);
+    if (found)
+        return *found;
+    FnInfo* info = arena_alloc(ctx->arena, sizeof(FnInfo));
+    *info = (FnInfo) {
+        .jp_sps = new_list(const Node*),
+        .tail_calls = new_list(const Node*),
+    };
+    insert_dict(const Node*, FnInfo*, ctx->fns, fn, info);
+    return info;
+}
+
+static bool is_constant(const Node* value) {
+    switch (value->tag) {
+        case IntLiteral_TAG:
+        case FloatLiteral_TAG:
+        case True_TAG:
+        case False_TAG:
+        case NullPtr_TAG:
+        case Undef_TAG:
+        case RefDecl_TAG: return true;
+        default: return false;
+    }
+}
+
+static bool is_value_used(const UsesMap* map, const Node* value) {
+    for (const Use* use = get_first_use(map, value); use; use = use->next_use) {
+        if (use->operand_class == NcParam || use->operand_class == NcVariable)
+            continue;
+        // the uniformity of popped values gets re-asserted right away, that doesn't count if nothing uses the result
+        if (use->user->tag == PrimOp_TAG && use->user->payload.prim_op.op == subgroup_assume_uniform_op) {
+            for (const Use* assume_use = get_first_use(map, use->user); assume_use; assume_use = assume_use->next_use) {
+                if (assume_use->user->tag == Variablez_TAG && is_value_used(map, assume_use->user))
+                    return true;
+            }
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+/// Finds the pushes right before each get_stack_size, the join points they go with, and the direct tail calls
+static void scan_body(Context* ctx, const Node* body) {
+    Nodes run = empty(ctx->rewriter.src_arena);
+    while (body && body->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(body);
+        switch (instruction->tag) {
+            case PrimOp_TAG: {
+                PrimOp payload = instruction->payload.prim_op;
+                switch (payload.op) {
+                    case push_stack_op: run = append_nodes(ctx->rewriter.src_arena, run, body); goto next;
+                    case get_stack_size_op: {
+                        Nodes vars = body->payload.let.variables;
+                        if (vars.count == 1)
+                            insert_dict(const Node*, Nodes, ctx->runs, vars.nodes[0], run);
+                        break;
+                    }
+                    case create_joint_point_op: {
+                        const Node* target = first(payload.operands);
+                        const Node* sp = payload.operands.nodes[1];
+                        if (target->tag != FnAddr_TAG)
+                            break;
+                        append_list(const Node*, get_fn_info(ctx, target->payload.fn_addr.fn)->jp_sps, sp);
+                        size_t* count = find_value_dict(const Node*, size_t, ctx->sp_uses, sp);
+                        if (count)
+                            (*count)++;
+                        else {
+                            size_t one = 1;
+                            insert_dict(const Node*, size_t, ctx->sp_uses, sp, one);
+                        }
+                        break;
+                    }
+                    default: break;
+                }
+                break;
+            }
+            case If_TAG:
+                scan_body(ctx, get_abstraction_body(instruction->payload.if_instr.if_true));
+                if (instruction->payload.if_instr.if_false)
+                    scan_body(ctx, get_abstraction_body(instruction->payload.if_instr.if_false));
+                break;
+            case Match_TAG:
+                for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                    scan_body(ctx, get_abstraction_body(instruction->payload.match_instr.cases.nodes[i]));
+                scan_body(ctx, get_abstraction_body(instruction->payload.match_instr.default_case));
+                break;
+            case Loop_TAG: scan_body(ctx, get_abstraction_body(instruction->payload.loop_instr.body)); break;
+            case Control_TAG: scan_body(ctx, get_abstraction_body(instruction->payload.control.inside)); break;
+            case Block_TAG: scan_body(ctx, get_abstraction_body(instruction->payload.block.inside)); break;
+            default: break;
+        }
+        run = empty(ctx->rewriter.src_arena);
+        next:
+        body = get_abstraction_body(get_let_tail(body));
+    }
+    if (body && body->tag == TailCall_TAG && body->payload.tail_call.target->tag == FnAddr_TAG)
+        append_list(const Node*, get_fn_info(ctx, body->payload.tail_call.target->payload.fn_addr.fn)->tail_calls, body);
+}
+
+typedef struct {
+    Visitor visitor;
+    Context* ctx;
+    /// the IR is a DAG, every user only gets its operands counted once
+    struct Dict* seen;
+} FnAddrVisitor;
+
+static void count_fn_addr_uses(FnAddrVisitor* v, SHADY_UNUSED NodeClass class, SHADY_UNUSED String name, const Node* node) {
+    if (node->tag == FnAddr_TAG)
+        get_fn_info(v->ctx, node->payload.fn_addr.fn)->uses++;
+    if (!insert_set_get_result(const Node*, v->seen, node))
+        return;
+    visit_node_operands(&v->visitor, NcBasic_block | NcDeclaration | NcType, node);
+}
+
+static void count_fn_addr_uses_in_node(FnAddrVisitor* v, const Node* node) {
+    count_fn_addr_uses(v, 0, NULL, node);
+}
+
+static bool is_entered_only_through(FnInfo* info, const Node* fn) {
+    if (!fn->payload.fun.body || lookup_annotation(fn, "EntryPoint") || lookup_annotation(fn, "Exported") || lookup_annotation(fn, "Internal"))
+        return false;
+    return info->uses == entries_count_list(info->jp_sps) + entries_count_list(info->tail_calls);
+}
+
+/// Continuations made by lift_indirect_targets restore the stack size they were made with, then pop the values spilled for them.
+/// When all the places that spill for one agree on a constant, or the continuation never uses it, the pair goes away.
+static void pair_spills(Context* ctx, const Node* fn, FnInfo* info) {
+    IrArena* a = ctx->rewriter.src_arena;
+    Nodes params = fn->payload.fun.params;
+    const Node* body = fn->payload.fun.body;
+    if (params.count == 0 || body->tag != Let_TAG)
+        return;
+    const Node* restore = get_let_instruction(body);
+    if (restore->tag != PrimOp_TAG || restore->payload.prim_op.op != set_stack_size_op || first(restore->payload.prim_op.operands) != first(params))
+        return;
+
+    Nodes pops = empty(a);
+    for (body = get_abstraction_body(get_let_tail(body)); body->tag == Let_TAG; body = get_abstraction_body(get_let_tail(body))) {
+        const Node* instruction = get_let_instruction(body);
+        if (instruction->tag != PrimOp_TAG)
+            break;
+        if (instruction->payload.prim_op.op == pop_stack_op)
+            pops = append_nodes(a, pops, body);
+        else if (instruction->payload.prim_op.op != subgroup_assume_uniform_op)
+            break;
+    }
+    if (pops.count == 0)
+        return;
+
+    size_t sites_count = entries_count_list(info->jp_sps);
+    LARRAY(Nodes, runs, sites_count);
+    for (size_t i = 0; i < sites_count; i++) {
+        const Node* sp = read_list(const Node*, info->jp_sps)[i];
+        Nodes* run = find_value_dict(const Node*, Nodes, ctx->runs, sp);
+        size_t* sp_uses = find_value_dict(const Node*, size_t, ctx->sp_uses, sp);
+        if (!run || run->count < pops.count || *sp_uses != 1)
+            return;
+        runs[i] = *run;
+    }
+
+    const UsesMap* uses = create_uses_map(fn, NcDeclaration | NcType);
+    for (size_t i = 0; i < pops.count; i++) {
+        const Node* pop = get_let_instruction(pops.nodes[i]);
+        const Type* type = first(pop->payload.prim_op.type_arguments);
+        const Node* value = NULL;
+        bool agree = true;
+        for (size_t j = 0; j < sites_count && agree; j++) {
+            // the last value pushed is the first one popped
+            const Node* push = get_let_instruction(runs[j].nodes[runs[j].count - 1 - i]);
+            const Node* pushed = first(push->payload.prim_op.operands);
+            agree &= first(push->payload.prim_op.type_arguments) == type;
+            agree &= is_constant(pushed) && (!value || value == pushed);
+            value = pushed;
+        }
+        bool dead = !is_value_used(uses, first(pops.nodes[i]->payload.let.variables));
+        if (!dead && !agree)
+            continue;
+        if (dead)
+            value = undef(a, (Undef) { .type = type });
+        for (size_t j = 0; j < sites_count; j++)
+            insert_set_get_result(const Node*, ctx->removed_pushes, runs[j].nodes[runs[j].count - 1 - i]);
+        insert_dict(const Node*, const Node*, ctx->forwarded_pops, pops.nodes[i], value);
+        *ctx->eliminated += sites_count;
+    }
+    destroy_uses_map(uses);
+}
+
+/// Tail calls push their arguments for the callee to pop. Arguments that are never used, or always the same constant, don't need to be passed.
+static void trim_tail_call_params(Context* ctx, const Node* fn, FnInfo* info) {
+    IrArena* a = ctx->rewriter.src_arena;
+    Nodes params = fn->payload.fun.params;
+    size_t sites_count = entries_count_list(info->tail_calls);
+    const UsesMap* uses = create_uses_map(fn, NcDeclaration | NcType);
+    Nodes kept = empty(a);
+    for (size_t i = 0; i < params.count; i++) {
+        const Node* value = NULL;
+        bool agree = true;
+        for (size_t j = 0; j < sites_count && agree; j++) {
+            const Node* arg = read_list(const Node*, info->tail_calls)[j]->payload.tail_call.args.nodes[i];
+            agree &= is_constant(arg) && (!value || value == arg);
+            value = arg;
+        }
+        bool dead = !is_value_used(uses, params.nodes[i]);
+        if (!dead && !agree) {
+            kept = append_nodes(a, kept, params.nodes[i]);
+            continue;
+        }
+        if (dead)
+            value = undef(a, (Undef) { .type = get_unqualified_type(params.nodes[i]->type) });
+        insert_dict(const Node*, const Node*, ctx->forwarded_params, params.nodes[i], value);
+        *ctx->eliminated += sites_count;
+    }
+    if (kept.count < params.count)
+        insert_dict(const Node*, Nodes, ctx->kept_params, fn, kept);
+    destroy_uses_map(uses);
+}
+
+static void analyze_module(Context* ctx, Module* mod) {
+    Nodes decls = get_module_declarations(mod);
+    FnAddrVisitor v = {
+        .visitor = {
+            .visit_node_fn = (VisitNodeFn) count_fn_addr_uses_in_node,
+            .visit_op_fn = (VisitOpFn) count_fn_addr_uses,
+        },
+        .ctx = ctx,
+        .seen = new_set(const Node*, (HashFn) hash_ptr, (CmpFn) compare_ptrs),
+    };
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        visit_node_operands(&v.visitor, NcBasic_block | NcDeclaration | NcType, decl);
+        if (decl->tag != Function_TAG || !decl->payload.fun.body)
+            continue;
+        visit_function_rpo(&v.visitor, decl);
+
+        scan_body(ctx, decl->payload.fun.body);
+        CFG* cfg = build_fn_cfg(decl);
+        for (size_t j = 0; j < cfg->size; j++) {
+            const Node* abs = read_list(CFNode*, cfg->contents)[j]->node;
+            if (abs->tag == BasicBlock_TAG)
+                scan_body(ctx, get_abstraction_body(abs));
+        }
+        destroy_cfg(cfg);
+    }
+    destroy_dict(v.seen);
+
+    size_t i = 0;
+    const Node* fn;
+    FnInfo* info;
+    while (dict_iter(ctx->fns, &i, &fn, &info)) {
+        if (!is_entered_only_through(info, fn))
+            continue;
+        // functions that are both resumed into and tail called have no single calling convention to change
+        if (entries_count_list(info->tail_calls) == 0)
+            pair_spills(ctx, fn, info);
+        else if (entries_count_list(info->jp_sps) == 0)
+            trim_tail_call_params(ctx, fn, info);
+    }
+}
+
 static void tag_leaks(Context* ctx) {
     StackState* s = ctx->state;
     while (s) {
@@ -32,6 +333,7 @@ static const Node* process(Context* ctx, const Node* node) {
     if (found) return found;
 
     IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
     StackState entry;
     Context child_ctx = *ctx;
 
@@ -43,15 +345,26 @@ static const Node* process(Context* ctx, const Node* node) {
         case Let_TAG: {
             const Node* old_instruction = node->payload.let.instruction;
             const Node* ntail = NULL;
+            // these pairs were already matched up across functions
+            if (find_key_dict(const Node*, ctx->removed_pushes, node))
+                return rewrite_node(r, get_abstraction_body(get_let_tail(node)));
+            const Node** forwarded = find_value_dict(const Node*, const Node*, ctx->forwarded_pops, node);
+            if (forwarded) {
+                register_processed(r, first(node->payload.let.variables), rewrite_node(r, *forwarded));
+                return rewrite_node(r, get_abstraction_body(get_let_tail(node)));
+            }
+
             switch (is_instruction(old_instruction)) {
                 case PrimOp_TAG: {
-                    switch (old_instruction->payload.prim_op.op) {
+                    PrimOp payload = old_instruction->payload.prim_op;
+                    switch (payload.op) {
                         case push_stack_op: {
-                            const Node* value = rewrite_node(&ctx->rewriter, first(old_instruction->payload.prim_op.operands));
+                            const Node* value = rewrite_node(&ctx->rewriter, first(payload.operands));
                             entry = (StackState) {
                                 .prev = ctx->state,
                                 .type = VALUE,
                                 .value = value,
+                                .value_type = first(payload.type_arguments),
                                 .leaks = false,
                             };
                             child_ctx.state = &entry;
@@ -59,13 +372,23 @@ static const Node* process(Context* ctx, const Node* node) {
                             break;
                         }
                         case pop_stack_op: {
-                            if (ctx->state) {
+                            if (ctx->state && ctx->state->type == VALUE && ctx->state->value_type == first(payload.type_arguments)) {
                                 child_ctx.state = ctx->state->prev;
                                 is_pop = true;
+                            } else {
+                                tag_leaks(ctx);
+                                child_ctx.state = NULL;
+                            }
+                            break;
+                        }
+                        default: {
+                            // the stack size and base give away how much is on the stack
+                            if (get_primop_class(payload.op) & OcStack) {
+                                tag_leaks(ctx);
+                                child_ctx.state = NULL;
                             }
                             break;
                         }
-                        default: break;
                     }
                     break;
                 }
@@ -86,26 +409,56 @@ static const Node* process(Context* ctx, const Node* node) {
                 case NotAnInstruction: assert(false);
             }
 
-            ntail = rewrite_node(&child_ctx.rewriter, node->payload.let.tail);
-
             const Node* ninstruction = NULL;
-            if (is_push && !child_ctx.state->leaks) {
-                // replace stack pushes with no-ops
-                ninstruction = quote_helper(a, empty(a));
-            } else if (is_pop) {
+            if (is_pop) {
                 assert(ctx->state->type == VALUE);
                 const Node* value = ctx->state->value;
                 ninstruction = quote_helper(a, singleton(value));
-            } else {
+            } else if (!is_push) {
                 // if the stack state is observed, or this was an unrelated instruction, leave it alone
-                ninstruction = recreate_node_identity(&ctx->rewriter, old_instruction);
+                // the bodies of structured constructs start out knowing nothing about the stack
+                Context instruction_ctx = *ctx;
+                instruction_ctx.state = NULL;
+                ninstruction = recreate_node_identity(&instruction_ctx.rewriter, old_instruction);
             }
-            assert(ninstruction);
             Nodes ovars = node->payload.let.variables;
-            Nodes nvars = recreate_vars(a, ovars, ninstruction);
-            register_processed_list(&ctx->rewriter, ovars, nvars);
+            Nodes nvars = empty(a);
+            if (ninstruction) {
+                nvars = recreate_vars(a, ovars, ninstruction);
+                register_processed_list(&ctx->rewriter, ovars, nvars);
+            }
+
+            ntail = rewrite_node(&child_ctx.rewriter, node->payload.let.tail);
+
+            // whether a push is observed is only known once we've seen what comes after it
+            if (is_push) {
+                assert(ovars.count == 0);
+                if (!child_ctx.state->leaks) {
+                    // replace stack pushes with no-ops
+                    ninstruction = quote_helper(a, empty(a));
+                    (*ctx->eliminated)++;
+                } else
+                    ninstruction = recreate_node_identity(&ctx->rewriter, old_instruction);
+            }
+            assert(ninstruction);
             return let(a, ninstruction, nvars, ntail);
         }
+        case Terminator_TailCall_TAG: {
+            tag_leaks(ctx);
+            const Node* target = node->payload.tail_call.target;
+            Nodes* kept = target->tag == FnAddr_TAG ? find_value_dict(const Node*, Nodes, ctx->kept_params, target->payload.fn_addr.fn) : NULL;
+            if (!kept)
+                break;
+            Nodes oparams = target->payload.fn_addr.fn->payload.fun.params;
+            Nodes oargs = node->payload.tail_call.args;
+            LARRAY(const Node*, nargs, kept->count);
+            size_t nargs_count = 0;
+            for (size_t i = 0; i < oparams.count; i++) {
+                if (find_in_nodes(*kept, oparams.nodes[i]))
+                    nargs[nargs_count++] = rewrite_node(r, oargs.nodes[i]);
+            }
+            return tail_call(a, (TailCall) { .target = rewrite_node(r, target), .args = nodes(a, nargs_count, nargs) });
+        }
         // Unreachable is assumed to never happen, so it doesn't observe the stack state
         case NotATerminator: break;
         default: {
@@ -115,29 +468,74 @@ static const Node* process(Context* ctx, const Node* node) {
         }
     }
 
-    // child_ctx.state = NULL;
     switch (node->tag) {
         case Function_TAG: {
-            Node* fun = recreate_decl_header_identity(&ctx->rewriter, node);
             child_ctx.state = NULL;
+            Nodes* kept = find_value_dict(const Node*, Nodes, ctx->kept_params, node);
+            Node* fun;
+            if (kept) {
+                Nodes oparams = node->payload.fun.params;
+                for (size_t i = 0; i < oparams.count; i++) {
+                    const Node** forwarded = find_value_dict(const Node*, const Node*, ctx->forwarded_params, oparams.nodes[i]);
+                    if (forwarded)
+                        register_processed(r, oparams.nodes[i], rewrite_node(r, *forwarded));
+                }
+                Nodes nparams = recreate_params(r, *kept);
+                register_processed_list(r, *kept, nparams);
+                fun = function(r->dst_module, nparams, get_abstraction_name(node), rewrite_nodes(r, node->payload.fun.annotations), rewrite_nodes(r, node->payload.fun.return_types));
+                register_processed(r, node, fun);
+            } else
+                fun = recreate_decl_header_identity(&ctx->rewriter, node);
             recreate_decl_body_identity(&child_ctx.rewriter, node, fun);
             return fun;
         }
-        default: return recreate_node_identity(&child_ctx.rewriter, node);
+        // blocks can be jumped to from anywhere, they start out knowing nothing about the stack
+        case BasicBlock_TAG: child_ctx.state = NULL; break;
+        default: break;
     }
+    return recreate_node_identity(&child_ctx.rewriter, node);
 }
 
-Module* opt_stack(SHADY_UNUSED const CompilerConfig* config, Module* src) {
+Module* opt_stack(const CompilerConfig* config, Module* src) {
     ArenaConfig aconfig = get_arena_config(get_module_arena(src));
     IrArena* a = new_ir_arena(aconfig);
     Module* dst = new_module(a, get_module_name(src));
 
+    size_t eliminated = 0;
     Context ctx = {
         .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
         .state = NULL,
+        .eliminated = &eliminated,
+        .arena = new_arena(),
+        .fns = new_dict(const Node*, FnInfo*, (HashFn) hash_node, (CmpFn) compare_node),
+        .runs = new_dict(const Node*, Nodes, (HashFn) hash_node, (CmpFn) compare_node),
+        .sp_uses = new_dict(const Node*, size_t, (HashFn) hash_node, (CmpFn) compare_node),
+        .removed_pushes = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .forwarded_pops = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .forwarded_params = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .kept_params = new_dict(const Node*, Nodes, (HashFn) hash_node, (CmpFn) compare_node),
     };
 
+    analyze_module(&ctx, src);
     rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_stack: %d push/pop pairs eliminated\n", (int) eliminated);
+
     destroy_rewriter(&ctx.rewriter);
+    size_t i = 0;
+    FnInfo* info;
+    while (dict_iter(ctx.fns, &i, NULL, &info)) {
+        destroy_list(info->jp_sps);
+        destroy_list(info->tail_calls);
+    }
+    destroy_dict(ctx.fns);
+    destroy_dict(ctx.runs);
+    destroy_dict(ctx.sp_uses);
+    destroy_dict(ctx.removed_pushes);
+    destroy_dict(ctx.forwarded_pops);
+    destroy_dict(ctx.forwarded_params);
+    destroy_dict(ctx.kept_params);
+    destroy_arena(ctx.arena);
     return dst;
 }
@@ -0,0 +1,473 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "arena.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../type.h"
+#include "../analysis/cfg.h"
+#include "../analysis/callgraph.h"
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// A param, or a function standing for its return values, that we might prove uniform
+typedef struct {
+    /// The values that flow into it
+    struct List* incoming;
+    /// The conditions that must be uniform for all the threads to get the same one of those
+    struct List* guards;
+    /// Optimistically true, until proven otherwise
+    bool uniform;
+} Candidate;
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+
+    Arena* arena;
+    /// Params and functions -> Candidate*
+    struct Dict* candidates;
+    /// Every list of guards we made, some are shared between candidates
+    struct List* guard_lists;
+    /// Values -> bool, only valid for the current round
+    struct Dict* known;
+    /// The return values of the function being scanned, if they are a candidate
+    Candidate* returns;
+
+    size_t upgraded_values;
+} Context;
+
+static struct List* new_guards(Context* ctx) {
+    struct List* guards = new_list(const Node*);
+    append_list(struct List*, ctx->guard_lists, guards);
+    return guards;
+}
+
+static Candidate* new_candidate(Context* ctx, const Node* node, struct List* guards) {
+    Candidate* c = arena_alloc(ctx->arena, sizeof(Candidate));
+    *c = (Candidate) {
+        .incoming = new_list(const Node*),
+        .guards = guards,
+        .uniform = true,
+    };
+    insert_dict(const Node*, Candidate*, ctx->candidates, node, c);
+    return c;
+}
+
+static Candidate* get_candidate(Context* ctx, const Node* node) {
+    Candidate** found = find_value_dict(const Node*, Candidate*, ctx->candidates, node);
+    return found ? *found : NULL;
+}
+
+/// The params that are varying for now become candidates, sharing the guards of their abstraction
+static void add_candidate_params(Context* ctx, Nodes params, struct List* guards) {
+    for (size_t i = 0; i < params.count; i++) {
+        if (!is_qualified_type_uniform(params.nodes[i]->type))
+            new_candidate(ctx, params.nodes[i], guards);
+    }
+}
+
+static void add_incoming(Context* ctx, Nodes params, Nodes args) {
+    assert(params.count == args.count);
+    for (size_t i = 0; i < params.count; i++) {
+        Candidate* c = get_candidate(ctx, params.nodes[i]);
+        if (c)
+            append_list(const Node*, c->incoming, args.nodes[i]);
+    }
+}
+
+/// Whether the typing rules make the result of this primop exactly as uniform as its operands are
+static bool is_uniformity_preserving(Op op) {
+    switch (op) {
+        case select_op:
+        case convert_op:
+        case reinterpret_op:
+        case extract_op:
+        case extract_dynamic_op:
+        case insert_op:
+        case lea_op: return true;
+        default: break;
+    }
+    return get_primop_class(op) & (OcArithmetic | OcLogic | OcCompare | OcShift | OcMath);
+}
+
+static bool is_uniform(Context* ctx, const Node* value);
+
+static bool is_instruction_output_uniform(Context* ctx, const Node* instruction, size_t i) {
+    switch (instruction->tag) {
+        case PrimOp_TAG: {
+            PrimOp payload = instruction->payload.prim_op;
+            Nodes operands = payload.operands;
+            if (payload.op == quote_op)
+                return is_uniform(ctx, operands.nodes[i]);
+            if (payload.op == load_op) {
+                const Type* ptr_type = get_unqualified_type(first(operands)->type);
+                assert(ptr_type->tag == PtrType_TAG);
+                return is_addr_space_uniform(ctx->rewriter.src_arena, ptr_type->payload.ptr_type.address_space) && is_uniform(ctx, first(operands));
+            }
+            if (!is_uniformity_preserving(payload.op))
+                return false;
+            for (size_t j = 0; j < operands.count; j++) {
+                if (!is_uniform(ctx, operands.nodes[j]))
+                    return false;
+            }
+            return true;
+        }
+        case Call_TAG: {
+            const Node* callee = instruction->payload.call.callee;
+            if (callee->tag != FnAddr_TAG)
+                return false;
+            Candidate* c = get_candidate(ctx, callee->payload.fn_addr.fn);
+            return c && c->uniform;
+        }
+        // the results of the structured constructs are always typed as varying
+        default: return false;
+    }
+}
+
+/// Predicts whether the type checker will see this value as uniform, once the surviving candidates are upgraded
+static bool is_uniform(Context* ctx, const Node* value) {
+    if (is_qualified_type_uniform(value->type))
+        return true;
+    bool* found = find_value_dict(const Node*, bool, ctx->known, value);
+    if (found)
+        return *found;
+
+    bool uniform = false;
+    switch (value->tag) {
+        case Param_TAG: {
+            Candidate* c = get_candidate(ctx, value);
+            uniform = c && c->uniform;
+            break;
+        }
+        case Variablez_TAG: uniform = is_instruction_output_uniform(ctx, value->payload.varz.instruction, value->payload.varz.iindex); break;
+        case Composite_TAG: {
+            Nodes contents = value->payload.composite.contents;
+            uniform = true;
+            for (size_t i = 0; i < contents.count && uniform; i++)
+                uniform &= is_uniform(ctx, contents.nodes[i]);
+            break;
+        }
+        default: break;
+    }
+    insert_dict(const Node*, bool, ctx->known, value, uniform);
+    return uniform;
+}
+
+static bool are_all_uniform(Context* ctx, struct List* values) {
+    for (size_t i = 0; i < entries_count_list(values); i++) {
+        if (!is_uniform(ctx, read_list(const Node*, values)[i]))
+            return false;
+    }
+    return true;
+}
+
+/// Returns the condition this abstraction picks its successors with, if it has one threads could disagree on
+static const Node* get_divergence_condition(const Node* abs) {
+    const Node* body = get_abstraction_body(abs);
+    if (!body)
+        return NULL;
+    switch (body->tag) {
+        case Branch_TAG: return body->payload.branch.branch_condition;
+        case Switch_TAG: return body->payload.br_switch.switch_value;
+        case Let_TAG: {
+            const Node* instruction = get_let_instruction(body);
+            if (instruction->tag == If_TAG)
+                return instruction->payload.if_instr.condition;
+            if (instruction->tag == Match_TAG)
+                return instruction->payload.match_instr.inspect;
+            return NULL;
+        }
+        default: return NULL;
+    }
+}
+
+static void mark_reachable(CFNode* n, struct Dict* reached) {
+    if (!insert_set_get_result(const Node*, reached, n->node))
+        return;
+    for (size_t i = 0; i < entries_count_list(n->succ_edges); i++)
+        mark_reachable(read_list(CFEdge, n->succ_edges)[i].dst, reached);
+}
+
+static struct List* get_guards(Context* ctx, struct Dict* guards, const Node* abs) {
+    struct List** found = find_value_dict(const Node*, struct List*, guards, abs);
+    if (found)
+        return *found;
+    struct List* new = new_guards(ctx);
+    insert_dict(const Node*, struct List*, guards, abs, new);
+    return new;
+}
+
+/// Records what flows into the candidates from the body of an abstraction, following the structured constructs into theirs
+static void scan_abstraction(Context* ctx, const Node* abs, const Node* loop_body) {
+    const Node* terminator = get_abstraction_body(abs);
+    if (!terminator)
+        return;
+    switch (terminator->tag) {
+        case Let_TAG: {
+            const Node* instruction = get_let_instruction(terminator);
+            switch (instruction->tag) {
+                case If_TAG:
+                    scan_abstraction(ctx, instruction->payload.if_instr.if_true, loop_body);
+                    if (instruction->payload.if_instr.if_false)
+                        scan_abstraction(ctx, instruction->payload.if_instr.if_false, loop_body);
+                    break;
+                case Match_TAG:
+                    for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                        scan_abstraction(ctx, instruction->payload.match_instr.cases.nodes[i], loop_body);
+                    scan_abstraction(ctx, instruction->payload.match_instr.default_case, loop_body);
+                    break;
+                case Loop_TAG: {
+                    const Node* body = instruction->payload.loop_instr.body;
+                    add_incoming(ctx, get_abstraction_params(body), instruction->payload.loop_instr.initial_args);
+                    scan_abstraction(ctx, body, body);
+                    break;
+                }
+                case Control_TAG: scan_abstraction(ctx, instruction->payload.control.inside, loop_body); break;
+                case Block_TAG: scan_abstraction(ctx, instruction->payload.block.inside, loop_body); break;
+                default: break;
+            }
+            scan_abstraction(ctx, get_let_tail(terminator), loop_body);
+            break;
+        }
+        case Jump_TAG: add_incoming(ctx, get_abstraction_params(terminator->payload.jump.target), terminator->payload.jump.args); break;
+        case Branch_TAG: {
+            const Node* jumps[] = { terminator->payload.branch.true_jump, terminator->payload.branch.false_jump };
+            for (size_t i = 0; i < 2; i++)
+                add_incoming(ctx, get_abstraction_params(jumps[i]->payload.jump.target), jumps[i]->payload.jump.args);
+            break;
+        }
+        case Switch_TAG: {
+            Nodes jumps = terminator->payload.br_switch.case_jumps;
+            for (size_t i = 0; i < jumps.count; i++)
+                add_incoming(ctx, get_abstraction_params(jumps.nodes[i]->payload.jump.target), jumps.nodes[i]->payload.jump.args);
+            const Node* default_jump = terminator->payload.br_switch.default_jump;
+            add_incoming(ctx, get_abstraction_params(default_jump->payload.jump.target), default_jump->payload.jump.args);
+            break;
+        }
+        case MergeContinue_TAG: {
+            if (loop_body)
+                add_incoming(ctx, get_abstraction_params(loop_body), terminator->payload.merge_continue.args);
+            break;
+        }
+        case Return_TAG: {
+            Nodes args = terminator->payload.fn_ret.args;
+            for (size_t i = 0; ctx->returns && i < args.count; i++)
+                append_list(const Node*, ctx->returns->incoming, args.nodes[i]);
+            break;
+        }
+        default: break;
+    }
+}
+
+static void analyze_function(Context* ctx, const Node* fn) {
+    CFG* cfg = build_fn_cfg(fn);
+    struct Dict* guards = new_dict(const Node*, struct List*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct Dict* reached = new_set(const Node*, (HashFn) hash_node, (CmpFn) compare_node);
+    struct List* all_conditions = new_guards(ctx);
+
+    // threads that disagree on a condition may get to the same place through different paths, so with different values
+    for (size_t i = 0; i < cfg->size; i++) {
+        CFNode* n = read_list(CFNode*, cfg->contents)[i];
+        const Node* condition = get_divergence_condition(n->node);
+        if (!condition)
+            continue;
+        append_list(const Node*, all_conditions, condition);
+        clear_dict(reached);
+        for (size_t j = 0; j < entries_count_list(n->succ_edges); j++) {
+            CFEdge edge = read_list(CFEdge, n->succ_edges)[j];
+            // the tail of an if or a match is where its threads reconverge
+            if (edge.type != StructuredPseudoExitEdge)
+                mark_reachable(edge.dst, reached);
+        }
+        size_t k = 0;
+        const Node* r;
+        while (dict_iter(reached, &k, &r, NULL))
+            append_list(const Node*, get_guards(ctx, guards, r), condition);
+    }
+
+    for (size_t i = 0; i < cfg->size; i++) {
+        CFNode* n = read_list(CFNode*, cfg->contents)[i];
+        if (n->node->tag == BasicBlock_TAG) {
+            add_candidate_params(ctx, get_abstraction_params(n->node), get_guards(ctx, guards, n->node));
+            continue;
+        }
+        const Node* let = get_abstraction_body(n->node);
+        if (!let || let->tag != Let_TAG || get_let_instruction(let)->tag != Loop_TAG)
+            continue;
+        // the iterations stay in lockstep only if nothing in the loop can make threads leave it or continue separately
+        const Node* body = get_let_instruction(let)->payload.loop_instr.body;
+        struct List* body_guards = get_guards(ctx, guards, body);
+        clear_dict(reached);
+        mark_reachable(cfg_lookup(cfg, body), reached);
+        size_t k = 0;
+        const Node* r;
+        while (dict_iter(reached, &k, &r, NULL)) {
+            const Node* condition = get_divergence_condition(r);
+            if (condition)
+                append_list(const Node*, body_guards, condition);
+        }
+        add_candidate_params(ctx, get_abstraction_params(body), body_guards);
+    }
+
+    ctx->returns = get_candidate(ctx, fn);
+    if (ctx->returns)
+        ctx->returns->guards = all_conditions;
+
+    scan_abstraction(ctx, fn, NULL);
+    for (size_t i = 0; i < cfg->size; i++) {
+        const Node* abs = read_list(CFNode*, cfg->contents)[i]->node;
+        if (abs->tag == BasicBlock_TAG)
+            scan_abstraction(ctx, abs, NULL);
+    }
+    ctx->returns = NULL;
+
+    destroy_dict(reached);
+    destroy_dict(guards);
+    destroy_cfg(cfg);
+}
+
+static bool is_fixed_interface(const Node* fn) {
+    return lookup_annotation(fn, "EntryPoint") || lookup_annotation(fn, "Exported");
+}
+
+/// The params and return values of functions are candidates only when we see all of their call sites
+static void add_function_candidates(Context* ctx, CGNode* fn_node) {
+    const Node* fn = fn_node->fn;
+    if (!fn->payload.fun.body || fn_node->is_address_captured || is_fixed_interface(fn))
+        return;
+
+    Nodes return_types = fn->payload.fun.return_types;
+    bool varying_returns = false;
+    for (size_t i = 0; i < return_types.count; i++)
+        varying_returns |= !is_qualified_type_uniform(return_types.nodes[i]);
+    if (varying_returns)
+        new_candidate(ctx, fn, NULL);
+
+    size_t i = 0;
+    CGEdge edge;
+    bool tail_called = false;
+    while (dict_iter(fn_node->callers, &i, &edge, NULL))
+        tail_called |= edge.instr->tag == TailCall_TAG;
+    // the dynamic scheduler runs together threads that tail-called the same function from different places
+    if (tail_called || entries_count_dict(fn_node->callers) == 0)
+        return;
+    add_candidate_params(ctx, fn->payload.fun.params, new_guards(ctx));
+    i = 0;
+    while (dict_iter(fn_node->callers, &i, &edge, NULL))
+        add_incoming(ctx, fn->payload.fun.params, edge.instr->payload.call.args);
+}
+
+static void analyze_module(Context* ctx, Module* mod) {
+    CallGraph* graph = new_callgraph(mod);
+    size_t i = 0;
+    CGNode* fn_node;
+    while (dict_iter(graph->fn2cgn, &i, NULL, &fn_node))
+        add_function_candidates(ctx, fn_node);
+
+    Nodes decls = get_module_declarations(mod);
+    for (size_t j = 0; j < decls.count; j++) {
+        if (decls.nodes[j]->tag == Function_TAG && decls.nodes[j]->payload.fun.body)
+            analyze_function(ctx, decls.nodes[j]);
+    }
+    destroy_callgraph(graph);
+
+    // a candidate stops being one as soon as something varying can flow in, until nothing changes anymore
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        clear_dict(ctx->known);
+        size_t k = 0;
+        Candidate* c;
+        while (dict_iter(ctx->candidates, &k, NULL, &c)) {
+            if (!c->uniform)
+                continue;
+            if ((c->guards && !are_all_uniform(ctx, c->guards)) || !are_all_uniform(ctx, c->incoming)) {
+                c->uniform = false;
+                changed = true;
+                clear_dict(ctx->known);
+            }
+        }
+    }
+}
+
+static const Type* upgrade_type(Context* ctx, const Type* t) {
+    ctx->upgraded_values++;
+    return qualified_type_helper(rewrite_node(&ctx->rewriter, get_unqualified_type(t)), true);
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Rewriter* r = &ctx->rewriter;
+
+    switch (node->tag) {
+        case Param_TAG: {
+            Candidate* c = get_candidate(ctx, node);
+            if (c && c->uniform)
+                return param(a, upgrade_type(ctx, node->payload.param.type), node->payload.param.name);
+            return recreate_param(r, node);
+        }
+        case Function_TAG: {
+            Candidate* c = get_candidate(ctx, node);
+            if (!c || !c->uniform)
+                break;
+            Nodes oreturn_types = node->payload.fun.return_types;
+            LARRAY(const Type*, nreturn_types, oreturn_types.count);
+            for (size_t i = 0; i < oreturn_types.count; i++) {
+                if (is_qualified_type_uniform(oreturn_types.nodes[i]))
+                    nreturn_types[i] = rewrite_node(r, oreturn_types.nodes[i]);
+                else
+                    nreturn_types[i] = upgrade_type(ctx, oreturn_types.nodes[i]);
+            }
+            Nodes nparams = recreate_params(r, node->payload.fun.params);
+            Node* new = function(r->dst_module, nparams, get_abstraction_name(node), rewrite_nodes(r, node->payload.fun.annotations), nodes(a, oreturn_types.count, nreturn_types));
+            register_processed_list(r, node->payload.fun.params, nparams);
+            register_processed(r, node, new);
+            recreate_decl_body_identity(r, node, new);
+            return new;
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(r, node);
+}
+
+Module* opt_uniformity(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+        .arena = new_arena(),
+        .candidates = new_dict(const Node*, Candidate*, (HashFn) hash_node, (CmpFn) compare_node),
+        .guard_lists = new_list(struct List*),
+        .known = new_dict(const Node*, bool, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+    ctx.rewriter.config.process_params = true;
+    // everything is uniform already outside of SIMT arenas
+    if (aconfig.is_simt)
+        analyze_module(&ctx, src);
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_uniformity: %d values proven uniform\n", (int) ctx.upgraded_values);
+
+    destroy_rewriter(&ctx.rewriter);
+    size_t i = 0;
+    Candidate* c;
+    while (dict_iter(ctx.candidates, &i, NULL, &c))
+        destroy_list(c->incoming);
+    for (size_t j = 0; j < entries_count_list(ctx.guard_lists); j++)
+        destroy_list(read_list(struct List*, ctx.guard_lists)[j]);
+    destroy_list(ctx.guard_lists);
+    destroy_dict(ctx.candidates);
+    destroy_dict(ctx.known);
+    destroy_arena(ctx.arena);
+    return dst;
+}
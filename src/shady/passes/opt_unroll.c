@@ -0,0 +1,676 @@
+#include "passes.h"
+
+#include "dict.h"
+#include "list.h"
+#include "portability.h"
+#include "log.h"
+
+#include "../rewrite.h"
+#include "../fold.h"
+#include "../type.h"
+#include "../analysis/uses.h"
+
+#include <stdint.h>
+
+KeyHash hash_node(const Node**);
+bool compare_node(const Node**, const Node**);
+
+/// Rough sizes, counted in instructions
+enum {
+    /// Loops are only simulated up to this many trips
+    MaxSimulatedTrips = 1024,
+    /// How big a fully unrolled loop may get
+    FullUnrollBudget = 256,
+    /// How big the body of a partially unrolled loop may get
+    PartialUnrollBudget = 128,
+    MaxUnrollFactor = 8,
+};
+
+/// What a loop was found to do, by running it with what we know of its initial arguments
+typedef struct {
+    const Node* loop;
+    size_t body_size;
+    /// How many times the body runs, including the last one that breaks out
+    size_t trips;
+    /// Trip -> List of the choices made at the structured constructs along the way
+    struct List* paths;
+    size_t unroll_factor;
+} Plan;
+
+typedef struct {
+    Rewriter rewriter;
+    const CompilerConfig* config;
+
+    const UsesMap* uses;
+    /// Variables bound to allocas -> whether they are only ever loaded from and stored to directly
+    struct Dict* tracked;
+    /// Set while rewriting the body of a partially unrolled loop
+    const Plan* chain;
+
+    size_t fully_unrolled;
+    size_t partially_unrolled;
+} Context;
+
+typedef enum {
+    ExitUnknown,
+    ExitYield,
+    ExitContinue,
+    ExitBreak,
+} ExitKind;
+
+/// The construct stays as it is, we don't know which way it goes
+static const size_t KeptConstruct = SIZE_MAX;
+/// The construct could leave the loop and we don't know if it does
+static const size_t UnknownChoice = SIZE_MAX - 1;
+
+/// Walks one trip through the loop body, following the structured constructs that can be decided
+typedef struct {
+    Context* ctx;
+    /// Where the trip gets emitted to, NULL when only simulating
+    BodyBuilder* bb;
+    /// Computes the values as it goes, otherwise the choices are read from `decisions`
+    bool evaluate;
+    /// Known values replace their computations in the emitted code
+    bool substitute;
+    struct List* decisions;
+    size_t cursor;
+    /// Params and variables -> literals in the destination arena
+    struct Dict* values;
+    /// Tracked allocas -> the literal last stored to them
+    struct Dict* memory;
+} Walk;
+
+static const Node* get_known_value(Walk* w, const Node* node) {
+    if (is_literal(node))
+        return rewrite_node(&w->ctx->rewriter, node);
+    switch (node->tag) {
+        case RefDecl_TAG: {
+            const Node* decl = node->payload.ref_decl.decl;
+            if (decl->tag == Constant_TAG && decl->payload.constant.instruction) {
+                const Node* value = get_quoted_value(decl->payload.constant.instruction);
+                if (value && is_literal(value))
+                    return rewrite_node(&w->ctx->rewriter, value);
+            }
+            return NULL;
+        }
+        case Param_TAG:
+        case Variablez_TAG: {
+            const Node** found = find_value_dict(const Node*, const Node*, w->values, node);
+            return found ? *found : NULL;
+        }
+        default: return NULL;
+    }
+}
+
+/// Allocas whose address goes nowhere but straight into loads and stores can be followed through memory
+static bool is_tracked(Context* ctx, const Node* ptr) {
+    if (ptr->tag != Variablez_TAG)
+        return false;
+    const Node* instruction = ptr->payload.varz.instruction;
+    if (instruction->tag != PrimOp_TAG || (instruction->payload.prim_op.op != alloca_op && instruction->payload.prim_op.op != alloca_logical_op))
+        return false;
+    bool* found = find_value_dict(const Node*, bool, ctx->tracked, ptr);
+    if (found)
+        return *found;
+
+    bool tracked = true;
+    for (const Use* use = get_first_use(ctx->uses, ptr); use && tracked; use = use->next_use) {
+        if (use->operand_class == NcParam || use->operand_class == NcVariable)
+            continue;
+        if (use->user->tag != PrimOp_TAG) {
+            tracked = false;
+            continue;
+        }
+        PrimOp payload = use->user->payload.prim_op;
+        if (payload.op == load_op)
+            continue;
+        tracked = payload.op == store_op && payload.operands.nodes[1] != ptr;
+    }
+    insert_dict(const Node*, bool, ctx->tracked, ptr, tracked);
+    return tracked;
+}
+
+static const Node* evaluate_prim_op(Walk* w, PrimOp payload) {
+    IrArena* a = w->ctx->rewriter.dst_arena;
+    if (!is_primop_pure(payload.op))
+        return NULL;
+    LARRAY(const Node*, operands, payload.operands.count);
+    for (size_t i = 0; i < payload.operands.count; i++) {
+        operands[i] = get_known_value(w, payload.operands.nodes[i]);
+        if (!operands[i])
+            return NULL;
+    }
+    const Node* folded = prim_op(a, (PrimOp) {
+        .op = payload.op,
+        .type_arguments = rewrite_nodes(&w->ctx->rewriter, payload.type_arguments),
+        .operands = nodes(a, payload.operands.count, operands)
+    });
+    const Node* value = get_quoted_value(folded);
+    return value && is_literal(value) ? value : NULL;
+}
+
+/// Finds what can be known about the results of an instruction, and what it does to the tracked allocas
+static void evaluate_instruction(Walk* w, const Node* instruction, Nodes vars, const Node** known) {
+    if (instruction->tag != PrimOp_TAG) {
+        // whatever is nested in there might store to anything
+        clear_dict(w->memory);
+        return;
+    }
+    PrimOp payload = instruction->payload.prim_op;
+    switch (payload.op) {
+        case quote_op: {
+            for (size_t i = 0; i < vars.count; i++)
+                known[i] = get_known_value(w, payload.operands.nodes[i]);
+            return;
+        }
+        case alloca_op:
+        case alloca_logical_op: {
+            if (vars.count == 1)
+                remove_dict(const Node*, w->memory, vars.nodes[0]);
+            return;
+        }
+        case load_op: {
+            const Node* ptr = first(payload.operands);
+            const Node** found = is_tracked(w->ctx, ptr) ? find_value_dict(const Node*, const Node*, w->memory, ptr) : NULL;
+            if (found && vars.count == 1)
+                known[0] = *found;
+            return;
+        }
+        case store_op: {
+            const Node* ptr = first(payload.operands);
+            if (!is_tracked(w->ctx, ptr))
+                return;
+            const Node* value = get_known_value(w, payload.operands.nodes[1]);
+            if (value)
+                insert_dict(const Node*, const Node*, w->memory, ptr, value);
+            else
+                remove_dict(const Node*, w->memory, ptr);
+            return;
+        }
+        default: break;
+    }
+    if (vars.count == 1)
+        known[0] = evaluate_prim_op(w, payload);
+}
+
+static bool leaves_loop(const Node* terminator);
+
+/// Whether a structured construct in a loop body might merge out of that loop, rather than out of an inner one
+static bool construct_leaves_loop(const Node* instruction) {
+    switch (instruction->tag) {
+        case If_TAG: {
+            If payload = instruction->payload.if_instr;
+            return leaves_loop(get_abstraction_body(payload.if_true)) || (payload.if_false && leaves_loop(get_abstraction_body(payload.if_false)));
+        }
+        case Match_TAG: {
+            Match payload = instruction->payload.match_instr;
+            for (size_t i = 0; i < payload.cases.count; i++) {
+                if (leaves_loop(get_abstraction_body(payload.cases.nodes[i])))
+                    return true;
+            }
+            return leaves_loop(get_abstraction_body(payload.default_case));
+        }
+        case Control_TAG: return leaves_loop(get_abstraction_body(instruction->payload.control.inside));
+        case Block_TAG: return leaves_loop(get_abstraction_body(instruction->payload.block.inside));
+        // merges in there are for the inner loop
+        case Loop_TAG:
+        default: return false;
+    }
+}
+
+static bool leaves_loop(const Node* terminator) {
+    while (terminator->tag == Let_TAG) {
+        if (construct_leaves_loop(get_let_instruction(terminator)))
+            return true;
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+    return terminator->tag == MergeContinue_TAG || terminator->tag == MergeBreak_TAG;
+}
+
+static size_t count_instructions(const Node* terminator);
+
+static size_t count_case_instructions(const Node* c) {
+    return c ? count_instructions(get_abstraction_body(c)) : 0;
+}
+
+static size_t count_instructions(const Node* terminator) {
+    size_t count = 0;
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        count++;
+        switch (instruction->tag) {
+            case If_TAG: count += count_case_instructions(instruction->payload.if_instr.if_true) + count_case_instructions(instruction->payload.if_instr.if_false); break;
+            case Match_TAG: {
+                for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                    count += count_case_instructions(instruction->payload.match_instr.cases.nodes[i]);
+                count += count_case_instructions(instruction->payload.match_instr.default_case);
+                break;
+            }
+            case Loop_TAG: count += count_case_instructions(instruction->payload.loop_instr.body); break;
+            case Control_TAG: count += count_case_instructions(instruction->payload.control.inside); break;
+            case Block_TAG: count += count_case_instructions(instruction->payload.block.inside); break;
+            default: break;
+        }
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+    return count;
+}
+
+/// How many places in the loop body continue to the next iteration
+static size_t count_continues(const Node* terminator) {
+    size_t count = 0;
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        switch (instruction->tag) {
+            case If_TAG: {
+                count += count_continues(get_abstraction_body(instruction->payload.if_instr.if_true));
+                if (instruction->payload.if_instr.if_false)
+                    count += count_continues(get_abstraction_body(instruction->payload.if_instr.if_false));
+                break;
+            }
+            case Match_TAG: {
+                for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                    count += count_continues(get_abstraction_body(instruction->payload.match_instr.cases.nodes[i]));
+                count += count_continues(get_abstraction_body(instruction->payload.match_instr.default_case));
+                break;
+            }
+            case Control_TAG: count += count_continues(get_abstraction_body(instruction->payload.control.inside)); break;
+            case Block_TAG: count += count_continues(get_abstraction_body(instruction->payload.block.inside)); break;
+            default: break;
+        }
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+    return count + (terminator->tag == MergeContinue_TAG ? 1 : 0);
+}
+
+/// Drops what the rewriter knows of the params and variables in there, so the same code can be emitted again
+static void forget_definitions(Rewriter* r, const Node* abs) {
+    if (!abs)
+        return;
+    Nodes params = get_abstraction_params(abs);
+    for (size_t i = 0; i < params.count; i++)
+        remove_dict(const Node*, r->map, params.nodes[i]);
+    const Node* terminator = get_abstraction_body(abs);
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        Nodes vars = terminator->payload.let.variables;
+        for (size_t i = 0; i < vars.count; i++)
+            remove_dict(const Node*, r->map, vars.nodes[i]);
+        switch (instruction->tag) {
+            case If_TAG: {
+                forget_definitions(r, instruction->payload.if_instr.if_true);
+                forget_definitions(r, instruction->payload.if_instr.if_false);
+                break;
+            }
+            case Match_TAG: {
+                for (size_t i = 0; i < instruction->payload.match_instr.cases.count; i++)
+                    forget_definitions(r, instruction->payload.match_instr.cases.nodes[i]);
+                forget_definitions(r, instruction->payload.match_instr.default_case);
+                break;
+            }
+            case Loop_TAG: forget_definitions(r, instruction->payload.loop_instr.body); break;
+            case Control_TAG: forget_definitions(r, instruction->payload.control.inside); break;
+            case Block_TAG: forget_definitions(r, instruction->payload.block.inside); break;
+            default: break;
+        }
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+}
+
+static size_t decide(Walk* w, const Node* instruction) {
+    switch (instruction->tag) {
+        case If_TAG: {
+            const Node* condition = get_known_value(w, instruction->payload.if_instr.condition);
+            if (condition)
+                return condition->tag == True_TAG ? 0 : 1;
+            break;
+        }
+        case Match_TAG: {
+            Match payload = instruction->payload.match_instr;
+            const Node* inspectee = get_known_value(w, payload.inspect);
+            if (!inspectee)
+                break;
+            for (size_t i = 0; i < payload.cases.count; i++) {
+                if (are_same_constant(inspectee, rewrite_node(&w->ctx->rewriter, payload.literals.nodes[i])))
+                    return i;
+            }
+            return payload.cases.count;
+        }
+        default: break;
+    }
+    return KeptConstruct;
+}
+
+static size_t next_choice(Walk* w, const Node* instruction) {
+    size_t choice = KeptConstruct;
+    if (instruction->tag == If_TAG || instruction->tag == Match_TAG) {
+        if (w->evaluate) {
+            choice = decide(w, instruction);
+            if (w->decisions)
+                append_list(size_t, w->decisions, choice);
+        } else {
+            assert(w->cursor < entries_count_list(w->decisions));
+            choice = read_list(size_t, w->decisions)[w->cursor++];
+        }
+    }
+    // we can't follow a merge out of a construct when we don't know the way into it
+    if (choice == KeptConstruct && construct_leaves_loop(instruction))
+        return UnknownChoice;
+    return choice;
+}
+
+static const Node* get_chosen_case(const Node* instruction, size_t choice) {
+    if (instruction->tag == If_TAG)
+        return choice == 0 ? instruction->payload.if_instr.if_true : instruction->payload.if_instr.if_false;
+    Match payload = instruction->payload.match_instr;
+    return choice < payload.cases.count ? payload.cases.nodes[choice] : payload.default_case;
+}
+
+/// The values an already decided construct yields become its variables
+static void bind_values(Walk* w, Nodes vars, Nodes values) {
+    Rewriter* r = &w->ctx->rewriter;
+    assert(vars.count == values.count);
+    for (size_t i = 0; i < vars.count; i++) {
+        const Node* known = w->evaluate ? get_known_value(w, values.nodes[i]) : NULL;
+        if (known)
+            insert_dict(const Node*, const Node*, w->values, vars.nodes[i], known);
+        if (w->bb)
+            register_processed(r, vars.nodes[i], w->substitute && known ? known : rewrite_node(r, values.nodes[i]));
+    }
+}
+
+static void visit_instruction(Walk* w, const Node* instruction, Nodes vars) {
+    Rewriter* r = &w->ctx->rewriter;
+    LARRAY(const Node*, known, vars.count);
+    for (size_t i = 0; i < vars.count; i++)
+        known[i] = NULL;
+    if (w->evaluate)
+        evaluate_instruction(w, instruction, vars, known);
+
+    if (w->bb) {
+        bool all_known = vars.count > 0;
+        for (size_t i = 0; i < vars.count; i++)
+            all_known &= known[i] != NULL;
+        // loads from tracked allocas have nothing to do once we know what they read
+        bool droppable = instruction->tag == PrimOp_TAG && (!has_primop_got_side_effects(instruction->payload.prim_op.op) || instruction->payload.prim_op.op == load_op);
+        if (w->substitute && all_known && droppable) {
+            for (size_t i = 0; i < vars.count; i++)
+                register_processed(r, vars.nodes[i], known[i]);
+        } else {
+            LARRAY(String, names, vars.count);
+            for (size_t i = 0; i < vars.count; i++)
+                names[i] = vars.nodes[i]->payload.varz.name;
+            Nodes nvars = bind_instruction_outputs_count(w->bb, rewrite_node(r, instruction), vars.count, names);
+            for (size_t i = 0; i < vars.count; i++)
+                register_processed(r, vars.nodes[i], w->substitute && known[i] ? known[i] : nvars.nodes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < vars.count; i++) {
+        if (known[i])
+            insert_dict(const Node*, const Node*, w->values, vars.nodes[i], known[i]);
+    }
+}
+
+/// Follows the code until it leaves the case it is in, and tells how (with which arguments)
+static ExitKind walk_body(Walk* w, const Node* terminator, Nodes* exit_args) {
+    while (terminator->tag == Let_TAG) {
+        const Node* instruction = get_let_instruction(terminator);
+        Nodes vars = terminator->payload.let.variables;
+        size_t choice = next_choice(w, instruction);
+        if (choice == UnknownChoice)
+            return ExitUnknown;
+        if (choice == KeptConstruct) {
+            visit_instruction(w, instruction, vars);
+        } else {
+            const Node* taken = get_chosen_case(instruction, choice);
+            Nodes yielded = empty(get_module_arena(w->ctx->rewriter.src_module));
+            if (taken) {
+                ExitKind exit = walk_body(w, get_abstraction_body(taken), exit_args);
+                if (exit != ExitYield)
+                    return exit;
+                yielded = *exit_args;
+            }
+            bind_values(w, vars, yielded);
+        }
+        terminator = get_abstraction_body(get_let_tail(terminator));
+    }
+
+    switch (terminator->tag) {
+        case Yield_TAG: *exit_args = terminator->payload.yield.args; return ExitYield;
+        case MergeContinue_TAG: *exit_args = terminator->payload.merge_continue.args; return ExitContinue;
+        case MergeBreak_TAG: *exit_args = terminator->payload.merge_break.args; return ExitBreak;
+        default: return ExitUnknown;
+    }
+}
+
+static Walk begin_walk(Context* ctx) {
+    return (Walk) {
+        .ctx = ctx,
+        .values = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+        .memory = new_dict(const Node*, const Node*, (HashFn) hash_node, (CmpFn) compare_node),
+    };
+}
+
+static void end_walk(Walk* w) {
+    destroy_dict(w->values);
+    destroy_dict(w->memory);
+}
+
+/// Starts a trip with the loop params bound to the given (old) arguments, as they were known in the previous one
+static void enter_trip(Walk* w, Nodes params, const Node** known, const Node** emitted) {
+    clear_dict(w->values);
+    for (size_t i = 0; i < params.count; i++) {
+        if (known && known[i])
+            insert_dict(const Node*, const Node*, w->values, params.nodes[i], known[i]);
+        if (w->bb)
+            register_processed(&w->ctx->rewriter, params.nodes[i], emitted[i]);
+    }
+}
+
+static void resolve_args(Walk* w, Nodes args, const Node** known, const Node** emitted) {
+    for (size_t i = 0; i < args.count; i++) {
+        known[i] = w->evaluate ? get_known_value(w, args.nodes[i]) : NULL;
+        if (w->bb)
+            emitted[i] = w->substitute && known[i] ? known[i] : rewrite_node(&w->ctx->rewriter, args.nodes[i]);
+    }
+}
+
+static bool simulate_loop(Context* ctx, const Node* loop, Plan* plan) {
+    Loop payload = loop->payload.loop_instr;
+    Nodes params = get_abstraction_params(payload.body);
+    Walk w = begin_walk(ctx);
+    w.evaluate = true;
+
+    LARRAY(const Node*, known, params.count);
+    resolve_args(&w, payload.initial_args, known, NULL);
+    bool terminates = false;
+    while (plan->trips < MaxSimulatedTrips) {
+        enter_trip(&w, params, known, NULL);
+        w.decisions = new_list(size_t);
+        append_list(struct List*, plan->paths, w.decisions);
+        plan->trips++;
+        Nodes exit_args;
+        ExitKind exit = walk_body(&w, get_abstraction_body(payload.body), &exit_args);
+        if (exit == ExitBreak)
+            terminates = true;
+        if (exit != ExitContinue)
+            break;
+        resolve_args(&w, exit_args, known, NULL);
+    }
+    end_walk(&w);
+    return terminates;
+}
+
+/// Whether every trip that runs the n-th copy of the body takes the same path through it, without leaving the loop
+static bool can_unroll_by(const Plan* plan, size_t factor) {
+    size_t trips = plan->trips;
+    if (trips <= factor || (trips - 1) % factor != 0 || factor * plan->body_size > PartialUnrollBudget)
+        return false;
+    struct List** paths = read_list(struct List*, plan->paths);
+    for (size_t copy = 1; copy < factor; copy++) {
+        size_t length = entries_count_list(paths[copy]);
+        for (size_t trip = copy + factor; trip < trips; trip += factor) {
+            if (entries_count_list(paths[trip]) != length)
+                return false;
+            for (size_t i = 0; i < length; i++) {
+                if (read_list(size_t, paths[trip])[i] != read_list(size_t, paths[copy])[i])
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void destroy_plan(Plan* plan) {
+    for (size_t i = 0; i < entries_count_list(plan->paths); i++)
+        destroy_list(read_list(struct List*, plan->paths)[i]);
+    destroy_list(plan->paths);
+}
+
+/// Replaces the loop with one straight copy of its body per trip, in a block
+static const Node* unroll_fully(Context* ctx, const Plan* plan) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    Loop payload = plan->loop->payload.loop_instr;
+    Nodes params = get_abstraction_params(payload.body);
+    Walk w = begin_walk(ctx);
+    w.bb = begin_body(a);
+    w.evaluate = true;
+    w.substitute = true;
+
+    LARRAY(const Node*, known, params.count);
+    LARRAY(const Node*, emitted, params.count);
+    resolve_args(&w, payload.initial_args, known, emitted);
+    Nodes results = empty(a);
+    for (size_t trip = 0; trip < plan->trips; trip++) {
+        enter_trip(&w, params, known, emitted);
+        Nodes exit_args;
+        ExitKind exit = walk_body(&w, get_abstraction_body(payload.body), &exit_args);
+        if (exit == ExitBreak) {
+            assert(trip + 1 == plan->trips);
+            LARRAY(const Node*, known_results, exit_args.count);
+            LARRAY(const Node*, emitted_results, exit_args.count);
+            resolve_args(&w, exit_args, known_results, emitted_results);
+            results = nodes(a, exit_args.count, emitted_results);
+        } else {
+            assert(exit == ExitContinue);
+            resolve_args(&w, exit_args, known, emitted);
+        }
+        forget_definitions(&ctx->rewriter, payload.body);
+    }
+    end_walk(&w);
+    return yield_values_and_wrap_in_block(w.bb, results);
+}
+
+/// In the first copy of the body of a partially unrolled loop: the other copies go where it continues
+static const Node* chain_copies(Context* ctx, const Node* merge) {
+    IrArena* a = ctx->rewriter.dst_arena;
+    const Plan* plan = ctx->chain;
+    Loop payload = plan->loop->payload.loop_instr;
+    Nodes params = get_abstraction_params(payload.body);
+
+    // the rest of the first copy still needs its own definitions
+    Context copy_ctx = *ctx;
+    copy_ctx.chain = NULL;
+    copy_ctx.rewriter.map = clone_dict(ctx->rewriter.map);
+    Walk w = begin_walk(&copy_ctx);
+    w.bb = begin_body(a);
+
+    Nodes args = rewrite_nodes(&ctx->rewriter, merge->payload.merge_continue.args);
+    for (size_t copy = 1; copy < plan->unroll_factor; copy++) {
+        forget_definitions(&copy_ctx.rewriter, payload.body);
+        enter_trip(&w, params, NULL, args.nodes);
+        w.decisions = read_list(struct List*, plan->paths)[copy];
+        w.cursor = 0;
+        Nodes exit_args;
+        ExitKind exit = walk_body(&w, get_abstraction_body(payload.body), &exit_args);
+        assert(exit == ExitContinue);
+        args = rewrite_nodes(&copy_ctx.rewriter, exit_args);
+    }
+    end_walk(&w);
+    destroy_dict(copy_ctx.rewriter.map);
+    return finish_body(w.bb, merge_continue(a, (MergeContinue) { .args = args }));
+}
+
+static const Node* process_loop(Context* ctx, const Node* node) {
+    Context c = *ctx;
+    c.chain = NULL;
+
+    Loop payload = node->payload.loop_instr;
+    Plan plan = {
+        .loop = node,
+        .body_size = count_instructions(get_abstraction_body(payload.body)),
+        .paths = new_list(struct List*),
+    };
+    const Node* new = NULL;
+    if (simulate_loop(&c, node, &plan)) {
+        if (plan.trips * plan.body_size <= FullUnrollBudget) {
+            debugv_print("opt_unroll: fully unrolling a loop of %d trips\n", (int) plan.trips);
+            c.fully_unrolled++;
+            new = unroll_fully(&c, &plan);
+        } else if (count_continues(get_abstraction_body(payload.body)) == 1) {
+            for (size_t factor = MaxUnrollFactor; factor > 1 && !new; factor /= 2) {
+                if (!can_unroll_by(&plan, factor))
+                    continue;
+                debugv_print("opt_unroll: unrolling a loop of %d trips by %d\n", (int) plan.trips, (int) factor);
+                plan.unroll_factor = factor;
+                c.partially_unrolled++;
+                c.chain = &plan;
+                new = recreate_node_identity(&c.rewriter, node);
+            }
+        }
+    }
+    if (!new)
+        new = recreate_node_identity(&c.rewriter, node);
+    // nested loops were counted in there too
+    ctx->fully_unrolled = c.fully_unrolled;
+    ctx->partially_unrolled = c.partially_unrolled;
+    destroy_plan(&plan);
+    return new;
+}
+
+static const Node* process(Context* ctx, const Node* node) {
+    switch (node->tag) {
+        case Function_TAG: {
+            if (!node->payload.fun.body)
+                break;
+            Context fn_ctx = *ctx;
+            fn_ctx.uses = create_uses_map(node, (NcType | NcDeclaration));
+            fn_ctx.tracked = new_dict(const Node*, bool, (HashFn) hash_node, (CmpFn) compare_node);
+            fn_ctx.chain = NULL;
+            const Node* new = recreate_node_identity(&fn_ctx.rewriter, node);
+            ctx->fully_unrolled = fn_ctx.fully_unrolled;
+            ctx->partially_unrolled = fn_ctx.partially_unrolled;
+            destroy_dict(fn_ctx.tracked);
+            destroy_uses_map(fn_ctx.uses);
+            return new;
+        }
+        case Loop_TAG: return process_loop(ctx, node);
+        case MergeContinue_TAG: {
+            if (ctx->chain)
+                return chain_copies(ctx, node);
+            break;
+        }
+        default: break;
+    }
+
+    return recreate_node_identity(&ctx->rewriter, node);
+}
+
+Module* opt_unroll(const CompilerConfig* config, Module* src) {
+    ArenaConfig aconfig = get_arena_config(get_module_arena(src));
+    IrArena* a = new_ir_arena(aconfig);
+    Module* dst = new_module(a, get_module_name(src));
+
+    Context ctx = {
+        .rewriter = create_rewriter(src, dst, (RewriteNodeFn) process),
+        .config = config,
+    };
+    rewrite_module(&ctx.rewriter);
+
+    if (config->logging.pass_stats)
+        info_print("opt_unroll: %d loops fully unrolled, %d partially unrolled\n", (int) ctx.fully_unrolled, (int) ctx.partially_unrolled);
+
+    destroy_rewriter(&ctx.rewriter);
+    return dst;
+}
@@ -111,8 +111,24 @@ RewritePass eliminate_constants;
 RewritePass mark_leaf_functions;
 /// In addition, also inlines function calls according to heuristics
 RewritePass opt_inline;
+/// Reuses the results of identical side-effect free instructions that dominate, and forwards quotes
+RewritePass opt_gvn;
+/// Propagates constants through params and structured constructs, and prunes the branches they decide
+RewritePass opt_sccp;
+/// Moves side-effect free computations that don't depend on the loop out of it, for both structured and unstructured loops
+RewritePass opt_licm;
+/// Unrolls the structured loops with a known trip count, fully when they are small enough and partially otherwise
+RewritePass opt_unroll;
+/// Clones functions for the call sites that pass them literals, so the constants fold into the clones
+RewritePass opt_specialize_args;
+/// Proves params and return values uniform when only uniform values reach them under uniform control flow, and qualifies them so
+RewritePass opt_uniformity;
+/// Gives the generic pointers that can only point into one address space that address space, so lower_generic_ptrs only emulates the ambiguous ones
+RewritePass opt_generic_ptrs;
 RewritePass opt_mem2reg;
 OptPass opt_demote_alloca;
+/// Splits the struct and array allocas that are only accessed through constant indices into an alloca per field, for mem2reg to promote
+OptPass opt_split_allocas;
 
 /// Try to identify reconvergence points throughout the program for unstructured control flow programs
 RewritePass reconvergence_heuristics;
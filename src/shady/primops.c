@@ -13,3 +13,10 @@ String get_primop_name(Op op) {
 bool has_primop_got_side_effects(Op op) {
     return primop_side_effects[op];
 }
+
+bool is_primop_pure(Op op) {
+    if (has_primop_got_side_effects(op))
+        return false;
+    // the stack pointer moves, and subgroup ops depend on which threads are active where they are, not just on their operands
+    return !(get_primop_class(op) & (OcStack | OcSubgroup_intrinsic | OcMask | OcJoin_point));
+}
@@ -5,7 +5,7 @@
 
 #include <string.h>
 
-void generate_dummy_constants(SHADY_UNUSED const CompilerConfig* config, Module* mod) {
+void generate_dummy_constants(const CompilerConfig* config, Module* mod) {
     IrArena* arena = get_module_arena(mod);
 #define X(constant_name, T, placeholder) \
     Node* constant_name##_var = constant(mod, singleton(annotation(arena, (Annotation) { .name = "RetainAfterSpecialization" })), T, #constant_name); \
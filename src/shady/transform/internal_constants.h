@@ -3,9 +3,12 @@
 
 #include "shady/ir.h"
 
+// The scheduler's uses of SCHEDULER_POLICY are folded while it's parsed, long before specialization, so that one is
+// the configured policy from the start rather than a placeholder.
 #define INTERNAL_CONSTANTS(X) \
 X(SUBGROUP_SIZE, uint32_type(arena), uint32_literal(arena, 64)) \
 X(SUBGROUPS_PER_WG, uint32_type(arena), uint32_literal(arena, 1)) \
+X(SCHEDULER_POLICY, uint32_type(arena), uint32_literal(arena, config->scheduler_policy)) \
 
 void generate_dummy_constants(const CompilerConfig* config, Module*);
 
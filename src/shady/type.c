@@ -164,6 +164,19 @@ size_t get_type_bitwidth(const Type* t) {
                 return int_size_in_bytes(t->arena->config.memory.ptr_size) * 8;
             break;
         }
+        case PackType_TAG: {
+            size_t element_bitwidth = get_type_bitwidth(t->payload.pack_type.element_type);
+            if (element_bitwidth != SIZE_MAX)
+                return element_bitwidth * t->payload.pack_type.width;
+            break;
+        }
+        case ArrType_TAG: {
+            const IntLiteral* size = t->payload.arr_type.size ? resolve_to_int_literal(t->payload.arr_type.size) : NULL;
+            size_t element_bitwidth = get_type_bitwidth(t->payload.arr_type.element_type);
+            if (size && element_bitwidth != SIZE_MAX)
+                return element_bitwidth * get_int_literal_value(*size, false);
+            break;
+        }
         default: break;
     }
     return SIZE_MAX;
@@ -311,13 +324,22 @@ bool is_generic_ptr_type(const Type* t) {
     return as == AsGeneric;
 }
 
+/// Packs of arithmetic types can be reinterpreted as a whole, and so can the arrays they become when they get emulated
+static bool is_reinterpretable_aggregate(const Type* t) {
+    switch (t->tag) {
+        case PackType_TAG: return is_arithm_type(t->payload.pack_type.element_type);
+        case ArrType_TAG: return is_arithm_type(t->payload.arr_type.element_type) && get_type_bitwidth(t) != SIZE_MAX;
+        default: return false;
+    }
+}
+
 bool is_reinterpret_cast_legal(const Type* src_type, const Type* dst_type) {
     assert(is_data_type(src_type) && is_data_type(dst_type));
     if (src_type == dst_type)
         return true; // folding will eliminate those, but we need to pass type-checking first :)
-    if (!(is_arithm_type(src_type) || src_type->tag == MaskType_TAG || is_physical_ptr_type(src_type)))
+    if (!(is_arithm_type(src_type) || is_reinterpretable_aggregate(src_type) || src_type->tag == MaskType_TAG || is_physical_ptr_type(src_type)))
         return false;
-    if (!(is_arithm_type(dst_type) || dst_type->tag == MaskType_TAG || is_physical_ptr_type(dst_type)))
+    if (!(is_arithm_type(dst_type) || is_reinterpretable_aggregate(dst_type) || dst_type->tag == MaskType_TAG || is_physical_ptr_type(dst_type)))
         return false;
     assert(get_type_bitwidth(src_type) == get_type_bitwidth(dst_type));
     // either both pointers need to be in the generic address space, and we're only casting the element type, OR neither can be
@@ -1013,7 +1035,12 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
         }
         case subgroup_assume_uniform_op:
         case subgroup_broadcast_first_op:
-        case subgroup_reduce_sum_op: {
+        case subgroup_reduce_sum_op:
+        case subgroup_reduce_min_op:
+        case subgroup_reduce_max_op:
+        case subgroup_reduce_and_op:
+        case subgroup_reduce_or_op:
+        case subgroup_reduce_xor_op: {
             assert(prim_op.type_arguments.count == 0);
             assert(prim_op.operands.count == 1);
             const Type* operand_type = get_unqualified_type(prim_op.operands.nodes[0]->type);
@@ -1022,6 +1049,34 @@ const Type* check_type_prim_op(IrArena* arena, PrimOp prim_op) {
                 .type = operand_type
             });
         }
+        case subgroup_scan_inclusive_sum_op:
+        case subgroup_scan_exclusive_sum_op: {
+            assert(prim_op.type_arguments.count == 0);
+            assert(prim_op.operands.count == 1);
+            const Type* operand_type = get_unqualified_type(prim_op.operands.nodes[0]->type);
+            return qualified_type(arena, (QualifiedType) {
+                .is_uniform = false,
+                .type = operand_type
+            });
+        }
+        case subgroup_shuffle_op: {
+            assert(prim_op.type_arguments.count == 0);
+            assert(prim_op.operands.count == 2);
+            const Type* value_type = prim_op.operands.nodes[0]->type;
+            bool value_uniform = deconstruct_qualified_type(&value_type);
+            const Type* lane_type = prim_op.operands.nodes[1]->type;
+            bool lane_uniform = deconstruct_qualified_type(&lane_type);
+            assert(lane_type->tag == Int_TAG && lane_type->payload.int_type.width == IntTy32);
+            // every lane reads the same one if they all ask for the same
+            return qualified_type(arena, (QualifiedType) {
+                .is_uniform = value_uniform || lane_uniform,
+                .type = value_type
+            });
+        }
+        case subgroup_barrier_op: {
+            assert(prim_op.type_arguments.count == 0 && prim_op.operands.count == 0);
+            return empty_multiple_return_type(arena);
+        }
         // Intermediary ops
         case create_joint_point_op: {
             assert(prim_op.operands.count == 2);
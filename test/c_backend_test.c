@@ -0,0 +1,42 @@
+#include "c_backend_test.h"
+
+#include "shady/driver.h"
+
+#include <stdlib.h>
+
+bool compile_module_to_c_and_run(String compiler, CompilerConfig* config, Module* m, const CHarness* harness, String name) {
+    IrArena* initial_arena = get_module_arena(m);
+    CHECK(run_compiler_passes(config, &m) == CompilationNoError, return false);
+
+    size_t size;
+    char* output;
+    emit_c(*config, (CEmitterConfig) { .dialect = CDialect_C11 }, m, &size, &output, NULL);
+    if (get_module_arena(m) != initial_arena)
+        destroy_ir_arena(get_module_arena(m));
+
+    char filename[256];
+    sprintf(filename, "%s.c", name);
+    FILE* f = fopen(filename, "wb");
+    CHECK(f, return false);
+    if (harness->prelude)
+        fputs(harness->prelude, f);
+    fwrite(output, size, 1, f);
+    free(output);
+    if (harness->harness)
+        fputs(harness->harness, f);
+    // this might still need the names that live in the arena
+    if (harness->emit_harness)
+        harness->emit_harness(harness->uptr, f);
+    fclose(f);
+    destroy_ir_arena(initial_arena);
+
+    char command[1024];
+    sprintf(command, "%s -o %s %s.c %s", compiler, name, name, harness->compiler_flags ? harness->compiler_flags : "");
+    CHECK(system(command) == 0, return false);
+    if (harness->capture_output)
+        sprintf(command, "./%s > %s.txt", name, name);
+    else
+        sprintf(command, "./%s", name);
+    CHECK(system(command) == 0, return false);
+    return true;
+}
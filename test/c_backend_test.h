@@ -0,0 +1,31 @@
+#ifndef SHADY_C_BACKEND_TEST_H
+#define SHADY_C_BACKEND_TEST_H
+
+#include "shady/ir.h"
+
+#include "log.h"
+
+#include <stdio.h>
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+/// What goes around the code coming out of the C backend to make a program out of it
+typedef struct {
+    /// Goes in front of the generated code
+    String prelude;
+    /// Goes after the generated code
+    String harness;
+    /// Writes more of the harness after that, for the tests that generate it
+    void (*emit_harness)(void* uptr, FILE* f);
+    void* uptr;
+    /// Passed to the C compiler after the source file
+    String compiler_flags;
+    /// Sends what the program prints to <name>.txt rather than to the console
+    bool capture_output;
+} CHarness;
+
+/// Runs the compiler passes on the module, then builds what comes out of the C backend into the <name> program and runs it.
+/// Takes ownership of the module's arena.
+bool compile_module_to_c_and_run(String compiler, CompilerConfig* config, Module* m, const CHarness* harness, String name);
+
+#endif
@@ -5,12 +5,63 @@
 #include "shady/print.h"
 
 #include "log.h"
+#include "list.h"
 
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
 
-static bool expect_memstuff = false;
+static struct List* visited_blocks = NULL;
+
+/// Variables lead back to the instruction defining them, which the let binding them already visits.
+/// Control flow has been lowered to basic blocks by the time most of the checked passes run, and those can loop back.
+static bool is_visited(const Node* n) {
+    if (n->tag == Variablez_TAG)
+        return true;
+    if (n->tag != BasicBlock_TAG)
+        return false;
+    for (size_t i = 0; i < entries_count_list(visited_blocks); i++) {
+        if (read_list(const Node*, visited_blocks)[i] == n)
+            return true;
+    }
+    append_list(const Node*, visited_blocks, n);
+    return false;
+}
+
+static void visit_function(Visitor* v, const Node* fn) {
+    visited_blocks = new_list(const Node*);
+    if (fn && fn->tag == Function_TAG && fn->payload.fun.body)
+        visit_node(v, fn->payload.fun.body);
+    destroy_list(visited_blocks);
+}
+
+static void visit_function_by_name(Visitor* v, Module* mod, String name) {
+    visit_function(v, get_declaration(mod, name));
+}
+
+static const Type* strip_qualifier(const Type* t) {
+    if (t->tag == QualifiedType_TAG)
+        return t->payload.qualified_type.type;
+    return t;
+}
+
+static bool is_literal(const Node* n, int64_t value) {
+    return n->tag == IntLiteral_TAG && get_int_literal_value(n->payload.int_literal, false) == value;
+}
+
+static bool is_pure_computation(const Node* instruction) {
+    return instruction->tag == PrimOp_TAG && get_primop_class(instruction->payload.prim_op.op) & (OcArithmetic | OcLogic | OcCompare | OcShift | OcMath);
+}
+
+static const Node* get_let_computation(const Node* n) {
+    if (n->tag != Let_TAG)
+        return NULL;
+    const Node* instruction = get_let_instruction(n);
+    return is_pure_computation(instruction) ? instruction : NULL;
+}
+
+// Memory operations (mem2reg)
+
 static bool found_memstuff = false;
 
 static void search_for_memstuff(Visitor* v, const Node* n) {
@@ -32,18 +83,536 @@ static void search_for_memstuff(Visitor* v, const Node* n) {
     visit_node_operands(v, NcDeclaration, n);
 }
 
+static bool has_memops(Module* mod) {
+    found_memstuff = false;
+    Visitor v = {.visit_node_fn = search_for_memstuff};
+    visit_module(&v, mod);
+    return found_memstuff;
+}
+
+static bool check_no_memops(Module* mod) { return !has_memops(mod); }
+static bool check_memops(Module* mod) { return has_memops(mod); }
+
+// Inlining (inline1): f calls add1 twice and scale twice
+
+static size_t found_calls = 0;
+static size_t found_increments = 0;
+
+static void search_for_calls(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    if (n->tag == Call_TAG || n->tag == TailCall_TAG)
+        found_calls++;
+    const Node* computation = get_let_computation(n);
+    if (computation && computation->payload.prim_op.op == add_op && is_literal(computation->payload.prim_op.operands.nodes[1], 1))
+        found_increments++;
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_inlined(Module* mod) {
+    found_calls = 0;
+    found_increments = 0;
+    Visitor v = {.visit_node_fn = search_for_calls};
+    visit_function_by_name(&v, mod, "f");
+    // both calls to add1 left their body behind
+    return found_calls == 0 && found_increments == 2;
+}
+
+// Value numbering (gvn1): (a + b) * 2 is written out three times
+
+static bool same_computation(const Node* a, const Node* b);
+
+static bool same_value(const Node* a, const Node* b) {
+    if (a == b)
+        return true;
+    if (a->tag != Variablez_TAG || b->tag != Variablez_TAG || a->payload.varz.iindex != b->payload.varz.iindex)
+        return false;
+    return same_computation(get_var_def(a->payload.varz), get_var_def(b->payload.varz));
+}
+
+/// Primops are hash-consed but their operands aren't: two computations over different variables holding the same value are still the same
+static bool same_computation(const Node* a, const Node* b) {
+    if (a == b)
+        return true;
+    if (!a || !b || !is_pure_computation(a) || !is_pure_computation(b))
+        return false;
+    PrimOp pa = a->payload.prim_op;
+    PrimOp pb = b->payload.prim_op;
+    if (pa.op != pb.op || pa.operands.count != pb.operands.count || pa.type_arguments.count != pb.type_arguments.count)
+        return false;
+    for (size_t i = 0; i < pa.type_arguments.count; i++) {
+        if (pa.type_arguments.nodes[i] != pb.type_arguments.nodes[i])
+            return false;
+    }
+    for (size_t i = 0; i < pa.operands.count; i++) {
+        if (!same_value(pa.operands.nodes[i], pb.operands.nodes[i]))
+            return false;
+    }
+    return true;
+}
+
+static struct List* computed_values = NULL;
+static bool found_redundancy = false;
+
+static void search_for_redundancy(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    const Node* computation = get_let_computation(n);
+    if (computation) {
+        for (size_t i = 0; i < entries_count_list(computed_values); i++) {
+            if (same_computation(read_list(const Node*, computed_values)[i], computation))
+                found_redundancy = true;
+        }
+        append_list(const Node*, computed_values, computation);
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_no_redundancy(Module* mod) {
+    found_redundancy = false;
+    computed_values = new_list(const Node*);
+    Visitor v = {.visit_node_fn = search_for_redundancy};
+    visit_function_by_name(&v, mod, "f");
+    size_t computed = entries_count_list(computed_values);
+    destroy_list(computed_values);
+    return !found_redundancy && computed > 0;
+}
+
+// Constant propagation (sccp1): k is always 4, so only bb1 is ever taken and f returns a + 4
+
+static bool found_branches = false;
+static Nodes returned_values = { 0 };
+
+static void search_for_branches(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    if (n->tag == Branch_TAG || n->tag == Switch_TAG || n->tag == If_TAG || n->tag == Match_TAG)
+        found_branches = true;
+    if (n->tag == Return_TAG)
+        returned_values = n->payload.fn_ret.args;
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_no_branches(Module* mod) {
+    found_branches = false;
+    returned_values = (Nodes) { 0 };
+    Visitor v = {.visit_node_fn = search_for_branches};
+    visit_function_by_name(&v, mod, "f");
+    if (found_branches || returned_values.count != 1 || returned_values.nodes[0]->tag != Variablez_TAG)
+        return false;
+    const Node* def = get_var_def(returned_values.nodes[0]->payload.varz);
+    if (!def || def->tag != PrimOp_TAG || def->payload.prim_op.op != add_op)
+        return false;
+    Nodes operands = def->payload.prim_op.operands;
+    return is_literal(operands.nodes[0], 4) || is_literal(operands.nodes[1], 4);
+}
+
+// Loop-invariant code motion (licm1): k * 4 (and the offset derived from it in f) doesn't depend on the loop
+
+static bool is_loop_invariant(const Node* n) {
+    switch (n->tag) {
+        case IntLiteral_TAG: return true;
+        case Param_TAG: return n->payload.param.abs && n->payload.param.abs->tag == Function_TAG;
+        case Variablez_TAG: {
+            const Node* def = get_var_def(n->payload.varz);
+            if (!def || !is_pure_computation(def))
+                return false;
+            Nodes operands = def->payload.prim_op.operands;
+            for (size_t i = 0; i < operands.count; i++) {
+                if (!is_loop_invariant(operands.nodes[i]))
+                    return false;
+            }
+            return true;
+        }
+        default: return false;
+    }
+}
+
+static bool inside_basic_block = false;
+static size_t hoisted_invariants = 0;
+static bool found_loop_invariants = false;
+
+static void search_for_loop_invariants(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    // the only basic blocks in the tests are the loops and the blocks inside them
+    const Node* computation = get_let_computation(n);
+    if (computation) {
+        bool invariant = true;
+        Nodes operands = computation->payload.prim_op.operands;
+        for (size_t i = 0; i < operands.count; i++)
+            invariant &= is_loop_invariant(operands.nodes[i]);
+        if (invariant && inside_basic_block)
+            found_loop_invariants = true;
+        else if (invariant)
+            hoisted_invariants++;
+    }
+
+    bool was_inside = inside_basic_block;
+    inside_basic_block |= n->tag == BasicBlock_TAG;
+    visit_node_operands(v, NcDeclaration, n);
+    inside_basic_block = was_inside;
+}
+
+static bool check_hoisted_in(Module* mod, String fn, size_t expected) {
+    inside_basic_block = false;
+    hoisted_invariants = 0;
+    found_loop_invariants = false;
+    Visitor v = {.visit_node_fn = search_for_loop_invariants};
+    visit_function_by_name(&v, mod, fn);
+    return !found_loop_invariants && hoisted_invariants == expected;
+}
+
+static bool check_hoisted(Module* mod) {
+    return check_hoisted_in(mod, "f", 2) && check_hoisted_in(mod, "g", 1);
+}
+
+// Unrolling (unroll1): the loop runs exactly four times, adding up k * i
+
+static bool found_loops = false;
+static bool found_last_iteration = false;
+
+static void search_for_loops(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    // lowering the loop to blocks would leave jumps behind
+    if (n->tag == Loop_TAG || n->tag == Jump_TAG)
+        found_loops = true;
+    const Node* computation = get_let_computation(n);
+    if (computation && computation->payload.prim_op.op == mul_op && is_literal(computation->payload.prim_op.operands.nodes[1], 3))
+        found_last_iteration = true;
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_unrolled(Module* mod) {
+    found_loops = false;
+    found_last_iteration = false;
+    Visitor v = {.visit_node_fn = search_for_loops};
+    visit_function_by_name(&v, mod, "f");
+    return !found_loops && found_last_iteration;
+}
+
+// Argument specialization (specialize1): helper gets called with a literal scale twice, and with a varying one once
+
+static const Node* specialized_fn = NULL;
+static bool found_constant_args = false;
+static size_t specialized_calls = 0;
+
+static void search_for_constant_args(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    if (n->tag == Call_TAG) {
+        Nodes args = n->payload.call.args;
+        for (size_t i = 0; i < args.count; i++) {
+            if (args.nodes[i]->tag == IntLiteral_TAG)
+                found_constant_args = true;
+        }
+        const Node* callee = n->payload.call.callee;
+        if (callee->tag == FnAddr_TAG && callee->payload.fn_addr.fn != specialized_fn && args.count < specialized_fn->payload.fun.params.count)
+            specialized_calls++;
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_specialized(Module* mod) {
+    specialized_fn = get_declaration(mod, "helper");
+    if (!specialized_fn)
+        return false;
+    found_constant_args = false;
+    specialized_calls = 0;
+    Visitor v = {.visit_node_fn = search_for_constant_args};
+    visit_function_by_name(&v, mod, "f");
+    return !found_constant_args && specialized_calls == 2;
+}
+
+// Uniformity (uniformity1): scale and offset only ever see uniform values
+
+static bool is_varying(const Type* t) {
+    return t->tag == QualifiedType_TAG && !t->payload.qualified_type.is_uniform;
+}
+
+static bool has_uniform_interface(Module* mod, String name) {
+    const Node* fn = get_declaration(mod, name);
+    if (!fn || fn->tag != Function_TAG)
+        return false;
+    for (size_t j = 0; j < fn->payload.fun.params.count; j++) {
+        if (is_varying(fn->payload.fun.params.nodes[j]->type))
+            return false;
+    }
+    for (size_t j = 0; j < fn->payload.fun.return_types.count; j++) {
+        if (is_varying(fn->payload.fun.return_types.nodes[j]))
+            return false;
+    }
+    return true;
+}
+
+static bool check_uniform(Module* mod) {
+    return has_uniform_interface(mod, "scale") && has_uniform_interface(mod, "offset");
+}
+
+// Generic pointers (generic_ptrs1): every pointer read and write get is a global one in disguise
+
+static bool found_generic_accesses = false;
+
+static void search_for_generic_accesses(Visitor* v, const Node* n) {
+    if (n->tag == PrimOp_TAG && (n->payload.prim_op.op == load_op || n->payload.prim_op.op == store_op)) {
+        const Type* t = strip_qualifier(first(n->payload.prim_op.operands)->type);
+        if (t->tag == PtrType_TAG && t->payload.ptr_type.address_space == AsGeneric)
+            found_generic_accesses = true;
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool takes_global_ptr(Module* mod, String name) {
+    const Node* fn = get_declaration(mod, name);
+    if (!fn || fn->tag != Function_TAG || fn->payload.fun.params.count == 0)
+        return false;
+    const Type* t = strip_qualifier(first(fn->payload.fun.params)->type);
+    return t->tag == PtrType_TAG && t->payload.ptr_type.address_space == AsGlobal;
+}
+
+static bool check_concrete_ptrs(Module* mod) {
+    found_generic_accesses = false;
+    Visitor v = {.visit_node_fn = search_for_generic_accesses};
+    visit_module(&v, mod);
+    return !found_generic_accesses && takes_global_ptr(mod, "read") && takes_global_ptr(mod, "write");
+}
+
+// Tail call trimming (stack1): count forwards an argument it never reads to itself
+
+static struct List* tail_called_fns = NULL;
+static const Node* searched_param = NULL;
+static bool found_param_use = false;
+
+static void search_for_tail_calls(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    if (n->tag == TailCall_TAG && n->payload.tail_call.target->tag == FnAddr_TAG)
+        append_list(const Node*, tail_called_fns, n->payload.tail_call.target->payload.fn_addr.fn);
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static void search_for_param_use(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    if (n == searched_param)
+        found_param_use = true;
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool has_dead_params(const Node* fn) {
+    for (size_t j = 0; j < fn->payload.fun.params.count; j++) {
+        Visitor v = {.visit_node_fn = search_for_param_use};
+        searched_param = fn->payload.fun.params.nodes[j];
+        found_param_use = false;
+        visit_function(&v, fn);
+        if (!found_param_use)
+            return true;
+    }
+    return false;
+}
+
+static bool check_trimmed_tail_calls(Module* mod) {
+    tail_called_fns = new_list(const Node*);
+    Nodes decls = get_module_declarations(mod);
+    for (size_t i = 0; i < decls.count; i++) {
+        Visitor v = {.visit_node_fn = search_for_tail_calls};
+        visit_function(&v, decls.nodes[i]);
+    }
+    const Node* count = get_declaration(mod, "count");
+    bool found_count = false;
+    bool found_dead_params = false;
+    for (size_t i = 0; i < entries_count_list(tail_called_fns); i++) {
+        const Node* fn = read_list(const Node*, tail_called_fns)[i];
+        found_count |= fn == count;
+        found_dead_params |= has_dead_params(fn);
+    }
+    destroy_list(tail_called_fns);
+    return found_count && !found_dead_params;
+}
+
+// Dispatcher fall-through (dispatch1): start only ever continues into collatz
+
+static struct List* dispatched_fns = NULL;
+static bool found_fall_through = false;
+
+static void search_for_dispatched_calls(Visitor* v, const Node* n) {
+    if (n->tag == Call_TAG && n->payload.call.callee->tag == FnAddr_TAG) {
+        const Node* fn = n->payload.call.callee->payload.fn_addr.fn;
+        if (lookup_annotation(fn, "FnId")) {
+            // the same function getting called from another function's case means it's being fallen through into
+            for (size_t i = 0; i < entries_count_list(dispatched_fns); i++) {
+                if (read_list(const Node*, dispatched_fns)[i] == fn)
+                    found_fall_through = true;
+            }
+            append_list(const Node*, dispatched_fns, fn);
+        }
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static bool check_fall_through(Module* mod) {
+    found_fall_through = false;
+    dispatched_fns = new_list(const Node*);
+    Visitor v = {.visit_node_fn = search_for_dispatched_calls};
+    visit_function_by_name(&v, mod, "top_dispatcher");
+    destroy_list(dispatched_fns);
+    return found_fall_through;
+}
+
+// Spilling (spill1)
+
+static int max_spill_words = -1;
+static size_t spill_words = 0;
+static size_t spill_pushes = 0;
+
+static size_t get_spilled_size(const Type* t) {
+    switch (t->tag) {
+        case Bool_TAG: return 1;
+        case Int_TAG: return int_size_in_bytes(t->payload.int_type.width);
+        case Float_TAG: return float_size_in_bytes(t->payload.float_type.width);
+        case PtrType_TAG: return 8;
+        default: return 4;
+    }
+}
+
+static void count_spills(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    // pops mirror the pushes, so counting one side is enough to measure the stack traffic
+    if (n->tag == PrimOp_TAG && n->payload.prim_op.op == push_stack_op) {
+        const Type* t = first(n->payload.prim_op.type_arguments);
+        spill_pushes++;
+        spill_words += (get_spilled_size(t) + 3) / 4;
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static void parse_max_spill_words(char** args) {
+    max_spill_words = atoi(args[0]);
+}
+
+static bool check_spills(Module* mod) {
+    spill_words = 0;
+    spill_pushes = 0;
+    visited_blocks = new_list(const Node*);
+    Visitor v = {.visit_node_fn = count_spills};
+    visit_module(&v, mod);
+    destroy_list(visited_blocks);
+    info_print("Spilling pushes %zu values for a total of %zu words\n", spill_pushes, spill_words);
+    return spill_words <= (size_t) max_spill_words;
+}
+
+// Stack frames (frames1, frames2)
+
+typedef struct {
+    String fn;
+    int size;
+} ExpectedFrameSize;
+
+static struct List* expected_frame_sizes = NULL;
+static int found_frame_size = -1;
+
+static void search_for_frame_size(Visitor* v, const Node* n) {
+    if (is_visited(n))
+        return;
+    // lower_alloca bumps the stack size past the frame with set_stack_size(add(stack_ptr_before_alloca, frame size))
+    if (n->tag == PrimOp_TAG && n->payload.prim_op.op == set_stack_size_op) {
+        const Node* size = first(n->payload.prim_op.operands);
+        const Node* def = size->tag == Variablez_TAG ? get_var_def(size->payload.varz) : NULL;
+        if (def && def->tag == PrimOp_TAG && def->payload.prim_op.op == add_op) {
+            const IntLiteral* lit = resolve_to_int_literal(def->payload.prim_op.operands.nodes[1]);
+            if (lit)
+                found_frame_size = (int) get_int_literal_value(*lit, false);
+        }
+    }
+
+    visit_node_operands(v, NcDeclaration, n);
+}
+
+static void parse_expected_frame_size(char** args) {
+    if (!expected_frame_sizes)
+        expected_frame_sizes = new_list(ExpectedFrameSize);
+    ExpectedFrameSize expected = { args[0], atoi(args[1]) };
+    append_list(ExpectedFrameSize, expected_frame_sizes, expected);
+}
+
+static bool check_frame_sizes(Module* mod) {
+    bool ok = true;
+    for (size_t i = 0; i < entries_count_list(expected_frame_sizes); i++) {
+        ExpectedFrameSize expected = read_list(ExpectedFrameSize, expected_frame_sizes)[i];
+        found_frame_size = -1;
+        Visitor v = {.visit_node_fn = search_for_frame_size};
+        visit_function_by_name(&v, mod, expected.fn);
+        if (found_frame_size != expected.size) {
+            error_print("The stack frame of '%s' is %d bytes, expected %d.\n", expected.fn, found_frame_size, expected.size);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+typedef struct {
+    String flag;
+    String pass_name;
+    bool (*check)(Module* mod);
+    String failure_message;
+    /// How many values follow the flag on the command line, handed over to parse_args
+    int args_count;
+    void (*parse_args)(char** args);
+    bool enabled;
+    bool checked;
+} Expectation;
+
+static Expectation expectations[] = {
+    // what the mem2reg tests check for when given nothing else to expect
+    { "--expect-no-memops", "opt_mem2reg", check_no_memops, "Expected no more memory primops in the output." },
+    { "--expect-memops", "opt_mem2reg", check_memops, "Expected memory primops in the output." },
+    { "--expect-inlined", "opt_inline", check_inlined, "Expected f to carry the bodies of add1 and scale instead of calling them." },
+    { "--expect-no-redundancy", "opt_gvn", check_no_redundancy, "Expected (a + b) * 2 to be computed only once." },
+    { "--expect-no-branches", "opt_sccp", check_no_branches, "Expected the branches on k to be decided and f to return a + 4." },
+    { "--expect-hoisted", "opt_licm", check_hoisted, "Expected k * 4 and the values derived from it to be computed before the loops start." },
+    { "--expect-unrolled", "opt_unroll", check_unrolled, "Expected the loop to be replaced by its four iterations." },
+    { "--expect-specialized", "opt_specialize_args", check_specialized, "Expected the calls passing a literal scale to go to a clone of helper that doesn't take it." },
+    { "--expect-uniform", "opt_uniformity", check_uniform, "Expected the params and return values of scale and offset to be proven uniform." },
+    { "--expect-concrete-ptrs", "opt_generic_ptrs", check_concrete_ptrs, "Expected read and write to take global pointers, and no access to go through a generic one." },
+    { "--expect-trimmed-tail-calls", "opt_stack", check_trimmed_tail_calls, "Expected the recursive tail calls to count to stop passing the argument it never reads." },
+    { "--expect-fall-through", "lower_tailcalls", check_fall_through, "Expected the top dispatcher to run the only successor of a function directly." },
+    { "--expect-frame-size", "lower_alloca", check_frame_sizes, "Expected the stack frames to have the sizes given on the command line.", 2, parse_expected_frame_size },
+    { "--max-spill-words", "lift_indirect_targets", check_spills, "Expected the continuations to spill no more words than given on the command line.", 1, parse_max_spill_words },
+};
+
+#define EXPECTATIONS_COUNT (sizeof(expectations) / sizeof(expectations[0]))
+
 static void after_pass(void* uptr, String pass_name, Module* mod) {
-    if (strcmp(pass_name, "opt_mem2reg") == 0) {
-        Visitor v = {.visit_node_fn = search_for_memstuff};
-        visit_module(&v, mod);
-        if (expect_memstuff != found_memstuff) {
-            error_print("Expected ");
-            if (!expect_memstuff)
-                error_print("no more ");
-            error_print("memory primops in the output.\n");
+    bool pending = false;
+    for (size_t i = 0; i < EXPECTATIONS_COUNT; i++) {
+        Expectation* expectation = &expectations[i];
+        if (!expectation->enabled || expectation->checked)
+            continue;
+        if (strcmp(pass_name, expectation->pass_name) != 0) {
+            pending = true;
+            continue;
+        }
+        expectation->checked = true;
+        if (!expectation->check(mod)) {
+            error_print("%s\n", expectation->failure_message);
             dump_module(mod);
             exit(-1);
         }
+    }
+
+    if (!pending) {
         dump_module(mod);
         exit(0);
     }
@@ -51,17 +620,33 @@ static void after_pass(void* uptr, String pass_name, Module* mod) {
 
 static void cli_parse_oracle_args(int* pargc, char** argv) {
     int argc = *pargc;
+    bool expected_anything = false;
 
     for (int i = 1; i < argc; i++) {
         if (argv[i] == NULL)
             continue;
-        else if (strcmp(argv[i], "--expect-memops") == 0) {
+        for (size_t j = 0; j < EXPECTATIONS_COUNT; j++) {
+            Expectation* expectation = &expectations[j];
+            if (strcmp(argv[i], expectation->flag) != 0)
+                continue;
             argv[i] = NULL;
-            expect_memstuff = true;
-            continue;
+            if (i + expectation->args_count >= argc) {
+                error_print("Missing arguments for %s\n", expectation->flag);
+                exit(-1);
+            }
+            if (expectation->parse_args)
+                expectation->parse_args(&argv[i + 1]);
+            for (int k = 0; k < expectation->args_count; k++)
+                argv[++i] = NULL;
+            expectation->enabled = true;
+            expected_anything = true;
+            break;
         }
     }
 
+    if (!expected_anything)
+        expectations[0].enabled = true;
+
     cli_pack_remaining_args(pargc, argv);
 }
 
@@ -72,4 +657,4 @@ static void hook(DriverConfig* args, int* pargc, char** argv) {
 
 #define HOOK_STUFF hook(&args, &argc, argv);
 
-#include "../../src/driver/slim.c"
\ No newline at end of file
+#include "../../src/driver/slim.c"
@@ -0,0 +1,15 @@
+# Compiles the same kernel with every scheduler policy, each of them has to change the generated code
+set(HASHES "")
+foreach(P IN LISTS POLICIES)
+    execute_process(COMMAND ${COMPILER} ${SRC}/test/scheduler_policies.slim --entry-point main --scheduler-policy ${P} -o ${DST}/scheduler_${P}.spv COMMAND_ERROR_IS_FATAL ANY COMMAND_ECHO STDOUT)
+    file(SHA256 ${DST}/scheduler_${P}.spv HASH)
+    list(APPEND HASHES ${HASH})
+endforeach()
+
+set(DISTINCT_HASHES ${HASHES})
+list(REMOVE_DUPLICATES DISTINCT_HASHES)
+list(LENGTH HASHES COUNT)
+list(LENGTH DISTINCT_HASHES DISTINCT_COUNT)
+if (NOT COUNT EQUAL DISTINCT_COUNT)
+    message(FATAL_ERROR "Some scheduler policies generated the same code: ${POLICIES} hash to ${HASHES}")
+endif ()
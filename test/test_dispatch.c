@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "c_backend_test.h"
+
+// Runs tail calls through the top dispatcher that lower_tailcalls generates, using what comes out of the C backend with a
+// single lane. step0 and step1 can only ever call one function, so with fall-through dispatch they run in the same trip
+// around the dispatcher's loop as whatever came before them. Capping those trips with max_top_iterations tells the two
+// apart: without fall-throughs the dispatcher gives up before the calls are done, with them it gets to print the result.
+
+static const char* source =
+    "fn step0 varying u32(varying u32 x, varying u32 n) { return (step1(x * u32 3 + u32 1, n)); }\n"
+    "fn step1 varying u32(varying u32 x, varying u32 n) { return (step2(x + u32 7, n)); }\n"
+    "fn step2 varying u32(varying u32 x, varying u32 n) {\n"
+    "  if (n == u32 0) { return (x); }\n"
+    "  return (step0(x, n - u32 1));\n"
+    "}\n"
+    "\n"
+    "@EntryPoint(\"Compute\") @WorkgroupSize(SUBGROUP_SIZE, 1, 1) fn run() {\n"
+    "  debug_printf(\"%u\\n\", step0(u32 1, u32 20));\n"
+    "  return ();\n"
+    "}\n";
+
+static uint32_t expected_result() {
+    uint32_t x = 1;
+    for (int i = 0; i <= 20; i++)
+        x = x * 3 + 1 + 7;
+    return x;
+}
+
+enum {
+    /// Every call and every return costs a trip without fall-throughs, 128 in total. The calls to step1 and step2 are
+    /// free with them, which leaves 85.
+    MaxTopIterations = 100,
+};
+
+/// Goes in front of the generated code, there is only ever one lane
+static const char* prelude =
+    "#define SUBGROUP_SIZE 1\n"
+    "#include <stdint.h>\n"
+    "#include <stdbool.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "static const uint32_t SubgroupLocalInvocationId = 0;\n"
+    "static const uint32_t SubgroupId = 0;\n"
+    "\n"
+    "void __shady_subgroup_barrier(void) {}\n"
+    "uint32_t __shady_subgroup_shuffle(uint32_t value, uint32_t lane) { return value; }\n"
+    "bool __shady_subgroup_elect_first(void) { return true; }\n"
+    "uint32_t __shady_subgroup_broadcast_first(uint32_t value) { return value; }\n"
+    "uint64_t __shady_subgroup_ballot(bool value) { return value; }\n"
+    "\n";
+
+static const char* harness =
+    "\n"
+    "int main() {\n"
+    "    run();\n"
+    "    return 0;\n"
+    "}\n";
+
+typedef struct {
+    String name;
+    bool fall_through_dispatch;
+    int max_top_iterations;
+    /// whether the dispatcher should get to the end before giving up
+    bool finishes;
+} Configuration;
+
+static const Configuration configurations[] = {
+    { "without fall-throughs", false, 0, true },
+    { "with fall-throughs", true, 0, true },
+    { "without fall-throughs, capped", false, MaxTopIterations, false },
+    { "with fall-throughs, capped", true, MaxTopIterations, true },
+};
+#define CONFIGURATIONS_COUNT (sizeof(configurations) / sizeof(configurations[0]))
+
+static bool compile_and_run(String compiler, size_t i) {
+    Configuration configuration = configurations[i];
+    info_print("Dispatching %s\n", configuration.name);
+    CompilerConfig config = default_compiler_config();
+    config.optimisations.fall_through_dispatch = configuration.fall_through_dispatch;
+    config.shader_diagnostics.max_top_iterations = configuration.max_top_iterations;
+    // the prelude only does 32-bit subgroup operations, on a single lane
+    config.lower.emulate_subgroup_ops = true;
+    config.lower.emulate_subgroup_ops_extended_types = true;
+    config.specialization.subgroup_size = 1;
+
+    Module* m = NULL;
+    CHECK(driver_load_source_file(&config, SrcSlim, strlen(source), source, "dispatch", &m) == NoError, return false);
+    char name[64];
+    sprintf(name, "test_dispatch_%d", (int) i);
+    CHarness program = { .prelude = prelude, .harness = harness, .capture_output = true };
+    CHECK(compile_module_to_c_and_run(compiler, &config, m, &program, name), return false);
+
+    char filename[80];
+    sprintf(filename, "%s.txt", name);
+    FILE* f = fopen(filename, "rb");
+    CHECK(f, return false);
+    unsigned printed;
+    bool finished = fscanf(f, "%u", &printed) == 1;
+    fclose(f);
+    if (finished != configuration.finishes) {
+        error_print("Dispatching %s %s\n", configuration.name, finished ? "should have given up" : "didn't finish");
+        return false;
+    }
+    if (finished && printed != expected_result()) {
+        error_print("Dispatching %s printed %u, expected %u\n", configuration.name, printed, expected_result());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_dispatch <c compiler>\n"); exit(-1));
+    for (size_t i = 0; i < CONFIGURATIONS_COUNT; i++)
+        CHECK(compile_and_run(argv[1], i), exit(-1));
+    return 0;
+}
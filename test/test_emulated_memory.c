@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+
+#include "c_backend_test.h"
+
+// Round-trips a struct through emulated private and shared memory, with and without coalesced accesses.
+// Subgroup memory needs builtins the C backend does not have.
+// Checks what comes out of the C backend, and that coalescing makes the generated loads and stores smaller.
+
+static const char* source =
+    "type Payload = struct {\n"
+    "    u64 big;\n"
+    "    i32 negative;\n"
+    "    f32 f;\n"
+    "    bool flag;\n"
+    "    u8 small;\n"
+    "    [u32; 3] arr;\n"
+    "    f64 d;\n"
+    "};\n"
+    "\n"
+    "var private Payload private_payload;\n"
+    "var shared Payload shared_payload;\n"
+    "\n"
+    "@Exported fn store_private(varying Payload p) { private_payload = p; return (); }\n"
+    "@Exported fn load_private varying Payload() { return (private_payload); }\n"
+    "@Exported fn store_shared(varying Payload p) { shared_payload = p; return (); }\n"
+    "@Exported fn load_shared varying Payload() { return (shared_payload); }\n";
+
+static const char* harness =
+    "\n"
+    "static int check(const char* as, Payload in, Payload out) {\n"
+    "    if (in.big == out.big && in.negative == out.negative && in.f == out.f && in.flag == out.flag && in.small == out.small && in.d == out.d\n"
+    "        && in.arr.arr[0] == out.arr.arr[0] && in.arr.arr[1] == out.arr.arr[1] && in.arr.arr[2] == out.arr.arr[2])\n"
+    "        return 0;\n"
+    "    printf(\"%s memory mangled the payload\\n\", as);\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "int main() {\n"
+    "    generated_init();\n"
+    "    for (unsigned i = 0; i < 64; i++) {\n"
+    "        Payload in = { 0x123456789ABCDEFull * (i + 1), -(int) i * 1000, 1.5f * i, (i % 3) == 0, (unsigned char) (i * 7), { { i, i * 31, ~i } }, 0.25 * i };\n"
+    "        store_private(in);\n"
+    "        store_shared(in);\n"
+    "        if (check(\"private\", in, load_private()) || check(\"shared\", in, load_shared()))\n"
+    "            return 1;\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n";
+
+static size_t count_instructions(const Node* body) {
+    size_t count = 0;
+    while (body->tag == Let_TAG) {
+        count++;
+        body = get_abstraction_body(body->payload.let.tail);
+    }
+    return count;
+}
+
+static void count_generated_instructions(size_t* count, String pass_name, Module* mod) {
+    if (strcmp(pass_name, "lower_physical_ptrs") != 0)
+        return;
+    Nodes decls = get_module_declarations(mod);
+    for (size_t i = 0; i < decls.count; i++) {
+        const Node* decl = decls.nodes[i];
+        if (decl->tag != Function_TAG || !decl->payload.fun.body || strncmp(get_abstraction_name(decl), "generated_", 10) != 0)
+            continue;
+        *count += count_instructions(decl->payload.fun.body);
+    }
+}
+
+static bool compile_and_run(String compiler, bool coalesce, size_t* instructions_count) {
+    CompilerConfig config = default_compiler_config();
+    config.dynamic_scheduling = false;
+    config.optimisations.coalesce_emulated_memory = coalesce;
+    config.hooks.after_pass.fn = (void (*)(void*, String, Module*)) count_generated_instructions;
+    config.hooks.after_pass.uptr = instructions_count;
+
+    Module* m = NULL;
+    CHECK(driver_load_source_file(&config, SrcSlim, strlen(source), source, "emulated_memory", &m) == NoError, return false);
+    CHarness program = { .harness = harness };
+    return compile_module_to_c_and_run(compiler, &config, m, &program, coalesce ? "test_emulated_memory_coalesced" : "test_emulated_memory");
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_emulated_memory <c compiler>\n"); exit(-1));
+    size_t field_by_field = 0;
+    size_t coalesced = 0;
+    CHECK(compile_and_run(argv[1], false, &field_by_field), exit(-1));
+    CHECK(compile_and_run(argv[1], true, &coalesced), exit(-1));
+    info_print("Generated loads and stores: %d instructions field by field, %d coalesced\n", (int) field_by_field, (int) coalesced);
+    CHECK(coalesced < field_by_field, exit(-1));
+    return 0;
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+#include "growy.h"
+
+#define CHECK(x, failure_handler) { if (!(x)) { error_print(#x " failed\n"); failure_handler; } }
+
+// Every rule in fold_rules.json gets written down before and after it applies, both get folded while they're parsed,
+// and must come out the same. Cases without an `after` must not fold into a literal.
+
+typedef struct {
+    String rule;
+    String type;
+    String before;
+    String after;
+} FoldCase;
+
+static const FoldCase cases[] = {
+    { "commute_literal", "u32", "add(u32 5, x)", "add(x, u32 5)" },
+    { "commute_literal", "bool", "eq(true, b)", "eq(b, true)" },
+    { "mirror_lt", "bool", "lt(u32 5, x)", "gt(x, u32 5)" },
+    { "mirror_lte", "bool", "lte(u32 5, x)", "gte(x, u32 5)" },
+    { "mirror_gt", "bool", "gt(f32 1.5, f)", "lt(f, f32 1.5)" },
+    { "mirror_gte", "bool", "gte(u32 5, x)", "lte(x, u32 5)" },
+
+    { "add_zero", "u32", "add(x, u32 0)", "x" },
+    { "add_zero", "u32", "add(u32 0, x)", "x" },
+    { "sub_zero", "u32", "sub(x, u32 0)", "x" },
+    { "zero_sub", "i32", "sub(i32 0, i)", "neg(i)" },
+    { "sub_self", "u32", "sub(x, x)", "u32 0" },
+    { "mul_zero", "u32", "mul(u32 0, x)", "u32 0" },
+    { "mul_one", "u32", "mul(x, u32 1)", "x" },
+    { "div_one", "i32", "div(i, i32 1)", "i" },
+
+    { "reassociate_constants", "u32", "add(add(x, u32 3), u32 4)", "add(x, u32 7)" },
+    { "reassociate_constants", "u32", "mul(u32 3, mul(x, u32 5))", "mul(x, u32 15)" },
+    { "reassociate_constants", "u32", "and(and(x, u32 12), u32 10)", "and(x, u32 8)" },
+    { "reassociate_constants", "u32", "or(or(x, u32 12), u32 10)", "or(x, u32 14)" },
+    { "reassociate_constants", "u32", "xor(xor(x, u32 3), u32 5)", "xor(x, u32 6)" },
+
+    { "mul_pow2", "u32", "mul(x, u32 8)", "lshift(x, u32 3)" },
+    { "mul_pow2", "i32", "mul(i32 4, i)", "lshift(i, i32 2)" },
+    { "div_pow2", "u32", "div(x, u32 16)", "rshift_logical(x, u32 4)" },
+    { "mod_pow2", "u32", "mod(x, u32 8)", "and(x, u32 7)" },
+
+    { "double_neg", "f32", "neg(neg(f))", "f" },
+    { "double_not", "u32", "not(not(x))", "x" },
+
+    { "not_lt", "bool", "not(lt(x, y))", "gte(x, y)" },
+    { "not_lte", "bool", "not(lte(x, y))", "gt(x, y)" },
+    { "not_gt", "bool", "not(gt(i, i32 7))", "lte(i, i32 7)" },
+    { "not_gte", "bool", "not(gte(x, y))", "lt(x, y)" },
+    { "not_eq", "bool", "not(eq(x, y))", "neq(x, y)" },
+    { "not_neq", "bool", "not(neq(x, y))", "eq(x, y)" },
+    { "compare_self_true", "bool", "lte(x, x)", "true" },
+    { "compare_self_false", "bool", "neq(i, i)", "false" },
+
+    { "and_true", "bool", "and(b, true)", "b" },
+    { "and_false", "bool", "and(false, b)", "false" },
+    { "or_true", "bool", "or(b, true)", "true" },
+    { "or_false", "bool", "or(b, false)", "b" },
+    { "xor_false", "bool", "xor(b, false)", "b" },
+    { "xor_true", "bool", "xor(b, true)", "not(b)" },
+    { "idempotent", "u32", "and(x, x)", "x" },
+    { "idempotent", "f32", "max(f, f)", "f" },
+    { "xor_self", "u32", "xor(x, x)", "u32 0" },
+    { "xor_self", "bool", "xor(b, b)", "false" },
+    { "eq_true", "bool", "eq(b, true)", "b" },
+    { "eq_false", "bool", "neq(b, true)", "not(b)" },
+
+    { "select_true", "u32", "select(true, x, y)", "x" },
+    { "select_false", "u32", "select(false, x, y)", "y" },
+    { "select_same", "u32", "select(b, x, x)", "x" },
+    { "select_bool", "bool", "select(b, true, false)", "b" },
+    { "select_not_bool", "bool", "select(b, false, true)", "not(b)" },
+    { "select_not", "u32", "select(not(b), x, y)", "select(b, y, x)" },
+
+    { "identity_cast", "u32", "convert[u32](x)", "x" },
+    { "identity_cast", "u32", "reinterpret[u32](x)", "x" },
+    { "reinterpret_chain", "u32", "reinterpret[u32](reinterpret[f32](i))", "reinterpret[u32](i)" },
+    { "convert_round_trip", "u32", "convert[u32](convert[u64](x))", "x" },
+    { "convert_round_trip", "f32", "convert[f32](convert[f64](f))", "f" },
+
+    // folding literals has to stay within their width
+    { "constant", "u8", "add(u8 200, u8 100)", "u8 44" },
+    { "constant", "u16", "mul(u16 300, u16 300)", "u16 24464" },
+    { "constant", "u8", "not(u8 0)", "u8 255" },
+    { "constant", "i16", "neg(i16 1)", "i16 65535" },
+    { "constant", "u8", "lshift(u8 3, u8 7)", "u8 128" },
+    { "constant", "u8", "lshift(u8 1, u8 8)", NULL },
+    { "constant", "u32", "rshift_logical(u32 1, u32 40)", NULL },
+    { "constant", "i8", "rshift_arithm(i8 128, i8 7)", "i8 255" },
+    { "constant", "i32", "div(i32 4294967289, i32 2)", NULL },
+    { "constant", "u32", "div(u32 4294967289, u32 2)", "u32 2147483644" },
+    { "constant", "u8", "convert[u8](f32 -1.0)", "u8 255" },
+};
+#define CASES_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+static const char* params = "varying u32 x, varying u32 y, varying i32 i, varying f32 f, varying bool b";
+
+static char* build_source() {
+    Growy* g = new_growy();
+    for (size_t i = 0; i < CASES_COUNT; i++) {
+        growy_append_formatted(g, "fn before_%d varying %s(%s) { return (%s); }\n", (int) i, cases[i].type, params, cases[i].before);
+        if (cases[i].after)
+            growy_append_formatted(g, "fn after_%d varying %s(%s) { return (%s); }\n", (int) i, cases[i].type, params, cases[i].after);
+    }
+    growy_append_bytes(g, 1, "\0");
+    return growy_deconstruct(g);
+}
+
+static const Node* get_returned_value(const Node* fn) {
+    const Node* body = get_abstraction_body(fn);
+    while (body->tag == Let_TAG)
+        body = get_abstraction_body(get_let_tail(body));
+    assert(body->tag == Return_TAG && body->payload.fn_ret.args.count == 1);
+    return first(body->payload.fn_ret.args);
+}
+
+/// Variables bound to quotes are just whatever got quoted
+static const Node* skip_quotes(const Node* value) {
+    while (value->tag == Variablez_TAG) {
+        const Node* def = value->payload.varz.instruction;
+        if (!def || def->tag != PrimOp_TAG || def->payload.prim_op.op != quote_op)
+            break;
+        value = def->payload.prim_op.operands.nodes[value->payload.varz.iindex];
+    }
+    return value;
+}
+
+/// The same thing computed the same way, with both functions' parameters lined up
+static bool is_same_value(const Node* a, const Node* b, Nodes a_params, Nodes b_params) {
+    a = skip_quotes(a);
+    b = skip_quotes(b);
+    if (a == b)
+        return true;
+    for (size_t i = 0; i < a_params.count; i++)
+        if (a == a_params.nodes[i])
+            return b == b_params.nodes[i];
+    if (a->tag != Variablez_TAG || b->tag != Variablez_TAG || a->payload.varz.iindex != b->payload.varz.iindex)
+        return false;
+    const Node* a_def = a->payload.varz.instruction;
+    const Node* b_def = b->payload.varz.instruction;
+    if (a_def->tag != PrimOp_TAG || b_def->tag != PrimOp_TAG)
+        return false;
+    PrimOp a_op = a_def->payload.prim_op;
+    PrimOp b_op = b_def->payload.prim_op;
+    if (a_op.op != b_op.op || a_op.type_arguments.nodes != b_op.type_arguments.nodes || a_op.operands.count != b_op.operands.count)
+        return false;
+    for (size_t i = 0; i < a_op.operands.count; i++)
+        if (!is_same_value(a_op.operands.nodes[i], b_op.operands.nodes[i], a_params, b_params))
+            return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    CompilerConfig config = default_compiler_config();
+    char* source = build_source();
+    Module* m;
+    CHECK(driver_load_source_file(&config, SrcSlim, strlen(source), source, "fold", &m) == NoError, exit(-1));
+    free(source);
+
+    int failures = 0;
+    for (size_t i = 0; i < CASES_COUNT; i++) {
+        const Node* before = get_declaration(m, format_string_interned(get_module_arena(m), "before_%d", (int) i));
+        CHECK(before, exit(-1));
+        if (!cases[i].after) {
+            if (!resolve_to_int_literal(get_returned_value(before)))
+                continue;
+            error_print("%s: '%s' should not have been folded:\n", cases[i].rule, cases[i].before);
+            log_module(ERROR, &config, m);
+            failures++;
+            continue;
+        }
+        const Node* after = get_declaration(m, format_string_interned(get_module_arena(m), "after_%d", (int) i));
+        CHECK(after, exit(-1));
+        if (is_same_value(get_returned_value(before), get_returned_value(after), get_abstraction_params(before), get_abstraction_params(after)))
+            continue;
+        error_print("%s: '%s' did not fold into '%s', but into:\n", cases[i].rule, cases[i].before, cases[i].after);
+        log_module(ERROR, &config, m);
+        failures++;
+    }
+    destroy_ir_arena(get_module_arena(m));
+    if (failures)
+        error_print("%d out of %d folds went wrong\n", failures, (int) CASES_COUNT);
+    return failures != 0;
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "c_backend_test.h"
+
+// Lowers 64-bit integer arithmetic to pairs of 32-bit words, then checks what comes out of the C backend against
+// native int64_t on every pair of edge values. Every test function takes its operands and gives its result back as halves.
+
+typedef enum {
+    /// both operands are whole 64-bit values
+    FullOperands,
+    /// the operands are extended from 32 bits, which lets the lowering skip the high halves
+    ExtendedOperands,
+    /// the second operand is a literal
+    ConstantOperand,
+} Form;
+
+typedef enum {
+    Arithm,
+    Compare,
+    Unary,
+    /// to a narrower integer and back
+    Narrow,
+    /// from a narrower integer
+    Widen,
+    /// to a double and back to its bits
+    ToDouble,
+    /// from a double, passed as its bits
+    FromDouble,
+    /// to a float and back to its bits
+    ToFloat,
+    /// from a float, passed as its bits
+    FromFloat,
+} Kind;
+
+typedef struct {
+    String name;
+    Kind kind;
+    Op op;
+    bool is_signed;
+    /// for Narrow and Widen
+    IntSizes narrow_width;
+    /// C expression of the expected result, in terms of a and b (uint64_t), sa and sb (int64_t), da (a as a double) and fa (its low half as a float)
+    String reference;
+    /// C condition for the inputs the result is defined for
+    String guard;
+} OpTest;
+
+static const OpTest op_tests[] = {
+    { "add", Arithm, add_op, false, 0, "a + b", "1" },
+    { "sadd", Arithm, add_op, true, 0, "a + b", "1" },
+    { "sub", Arithm, sub_op, false, 0, "a - b", "1" },
+    { "ssub", Arithm, sub_op, true, 0, "a - b", "1" },
+    { "mul", Arithm, mul_op, false, 0, "a * b", "1" },
+    { "smul", Arithm, mul_op, true, 0, "a * b", "1" },
+    { "udiv", Arithm, div_op, false, 0, "a / b", "b != 0" },
+    { "umod", Arithm, mod_op, false, 0, "a % b", "b != 0" },
+    { "sdiv", Arithm, div_op, true, 0, "(uint64_t) (sa / sb)", "sb != 0 && !(sa == INT64_MIN && sb == -1)" },
+    { "smod", Arithm, mod_op, true, 0, "(uint64_t) (sa % sb)", "sb != 0 && !(sa == INT64_MIN && sb == -1)" },
+    { "and", Arithm, and_op, false, 0, "a & b", "1" },
+    { "or", Arithm, or_op, false, 0, "a | b", "1" },
+    { "xor", Arithm, xor_op, false, 0, "a ^ b", "1" },
+    { "lshift", Arithm, lshift_op, false, 0, "a << b", "b < 64" },
+    { "rshift_logical", Arithm, rshift_logical_op, false, 0, "a >> b", "b < 64" },
+    { "rshift_arithm", Arithm, rshift_arithm_op, true, 0, "(uint64_t) (sa >> b)", "b < 64" },
+    { "umin", Arithm, min_op, false, 0, "a < b ? a : b", "1" },
+    { "umax", Arithm, max_op, false, 0, "a > b ? a : b", "1" },
+    { "smin", Arithm, min_op, true, 0, "sa < sb ? a : b", "1" },
+    { "smax", Arithm, max_op, true, 0, "sa > sb ? a : b", "1" },
+    { "eq", Compare, eq_op, false, 0, "a == b", "1" },
+    { "neq", Compare, neq_op, false, 0, "a != b", "1" },
+    { "ult", Compare, lt_op, false, 0, "a < b", "1" },
+    { "ulte", Compare, lte_op, false, 0, "a <= b", "1" },
+    { "ugt", Compare, gt_op, false, 0, "a > b", "1" },
+    { "ugte", Compare, gte_op, false, 0, "a >= b", "1" },
+    { "slt", Compare, lt_op, true, 0, "sa < sb", "1" },
+    { "slte", Compare, lte_op, true, 0, "sa <= sb", "1" },
+    { "sgt", Compare, gt_op, true, 0, "sa > sb", "1" },
+    { "sgte", Compare, gte_op, true, 0, "sa >= sb", "1" },
+    { "sneg", Unary, neg_op, true, 0, "0 - a", "1" },
+    { "unot", Unary, not_op, false, 0, "~a", "1" },
+    { "sabs", Unary, abs_op, true, 0, "sa < 0 ? 0 - a : a", "1" },
+    { "narrow_i8", Narrow, convert_op, true, IntTy8, "(uint64_t) (int64_t) (int8_t) a", "1" },
+    { "narrow_i16", Narrow, convert_op, true, IntTy16, "(uint64_t) (int64_t) (int16_t) a", "1" },
+    { "narrow_i32", Narrow, convert_op, true, IntTy32, "(uint64_t) (int64_t) (int32_t) a", "1" },
+    { "narrow_u8", Narrow, convert_op, false, IntTy8, "(uint64_t) (uint8_t) a", "1" },
+    { "narrow_u16", Narrow, convert_op, false, IntTy16, "(uint64_t) (uint16_t) a", "1" },
+    { "narrow_u32", Narrow, convert_op, false, IntTy32, "(uint64_t) (uint32_t) a", "1" },
+    { "widen_i8", Widen, convert_op, true, IntTy8, "(uint64_t) (int64_t) (int8_t) a", "1" },
+    { "widen_i16", Widen, convert_op, true, IntTy16, "(uint64_t) (int64_t) (int16_t) a", "1" },
+    { "widen_i32", Widen, convert_op, true, IntTy32, "(uint64_t) (int64_t) (int32_t) a", "1" },
+    { "widen_u8", Widen, convert_op, false, IntTy8, "(uint64_t) (uint8_t) a", "1" },
+    { "widen_u16", Widen, convert_op, false, IntTy16, "(uint64_t) (uint16_t) a", "1" },
+    { "widen_u32", Widen, convert_op, false, IntTy32, "(uint64_t) (uint32_t) a", "1" },
+    { "utof", ToDouble, convert_op, false, 0, "bits((double) a)", "1" },
+    { "stof", ToDouble, convert_op, true, 0, "bits((double) sa)", "1" },
+    { "ftou", FromDouble, convert_op, false, 0, "(uint64_t) da", "da > -1.0 && da < 18446744073709551616.0" },
+    { "ftos", FromDouble, convert_op, true, 0, "(uint64_t) (int64_t) da", "da > -9223372036854775809.0 && da < 9223372036854775808.0" },
+    { "utof32", ToFloat, convert_op, false, 0, "fbits((float) a)", "1" },
+    { "stof32", ToFloat, convert_op, true, 0, "fbits((float) sa)", "1" },
+    { "f32tou", FromFloat, convert_op, false, 0, "(uint64_t) fa", "fa > -1.0f && fa < 18446744073709551616.0f" },
+    { "f32tos", FromFloat, convert_op, true, 0, "(uint64_t) (int64_t) fa", "fa >= -9223372036854775808.0f && fa < 9223372036854775808.0f" },
+};
+#define OP_TESTS_COUNT (sizeof(op_tests) / sizeof(op_tests[0]))
+
+static const uint64_t edge_values[] = {
+    0, 1, 2, 3, 5, 7, 10, 0x7F, 0x80, 0xFF, 0x7FFF, 0x8000,
+    0x7FFFFFFF, 0x80000000, 0x80000001, 0xFFFFFFFE, 0xFFFFFFFF, 0x100000000, 0x100000001, 0x1FFFFFFFF,
+    0xFFFF000000000000, 0x0000FFFF00000000, 0xFFFFFFFF00000000, 0x123456789ABCDEF0, 0xFEDCBA9876543210, 0x00000001DEADBEEF,
+    0x3FFFFFFFFFFFFFFF, 0x4000000000000000, 0x7FFFFFFFFFFFFFFF, 0x8000000000000000, 0x8000000000000001,
+    0xFFFFFFFFFFFFFFFF, 0xFFFFFFFFFFFFFFFE, 0xFFFFFFFFFFFFFFF9, 0xFFFFFFFF80000000, 0xFFFFFFFF7FFFFFFF,
+    31, 32, 33, 63,
+    // halfway between two floats, with and without a bit past the low half's top 8 to break the tie
+    0x0000010000010000, 0x0000010000010001, 0xFFFFFEFFFFFF0000, 0xFFFFFEFFFFFEFFFF,
+};
+#define EDGE_VALUES_COUNT (sizeof(edge_values) / sizeof(edge_values[0]))
+
+static const double edge_doubles[] = {
+    0.0, -0.0, 0.5, -0.5, 1.0, -1.0, 1.75, -1.75, 2147483647.5, -2147483648.75, 4294967295.0, 4294967296.0,
+    4294967296.5, -4294967297.25, 123456789012.875, -123456789012.875, 1e18, -1e18, 9.2e18, 1.8e19,
+    9223372036854775808.0, -9223372036854775808.0, 4503599627370497.0, -4503599627370497.0,
+};
+#define EDGE_DOUBLES_COUNT (sizeof(edge_doubles) / sizeof(edge_doubles[0]))
+
+static const float edge_floats[] = {
+    0.0f, -0.0f, 0.5f, -0.5f, 1.0f, -1.0f, -5.0f, -123.0f, 1.75f, -1.75f, 16777216.0f, -16777218.0f,
+    2147483520.0f, -2147483648.0f, 4294967040.0f, -4294967040.0f, 4294967296.0f, -4294967296.0f, 1e10f, -1e10f,
+    1e18f, -1e18f, 9.2e18f, 1.8e19f, 9223372036854775808.0f, -9223372036854775808.0f,
+};
+#define EDGE_FLOATS_COUNT (sizeof(edge_floats) / sizeof(edge_floats[0]))
+
+/// literal second operands: powers of two for the shortcuts in division, and the shifts around and at a word
+static const uint64_t constants[] = { 1, 2, 3, 16, 31, 32, 33, 63, 0xFFFFFFFF, 0x10000000000, 0x8000000000000000, 0xFFFFFFFFFFFFFFFF };
+#define CONSTANTS_COUNT (sizeof(constants) / sizeof(constants[0]))
+
+static Nodes exported(IrArena* a) {
+    return singleton(annotation(a, (Annotation) { .name = "Exported" }));
+}
+
+static const Node* varying_param(IrArena* a, const Type* t, String name) {
+    return param(a, qualified_type(a, (QualifiedType) { .type = t, .is_uniform = false }), name);
+}
+
+static const Type* get_unqualified(const Type* t) {
+    return t->tag == QualifiedType_TAG ? t->payload.qualified_type.type : t;
+}
+
+static const Node* gen_op(IrArena* a, BodyBuilder* bb, Op op, Nodes type_arguments, Nodes operands) {
+    return first(bind_instruction(bb, prim_op_helper(a, op, type_arguments, operands)));
+}
+
+static const Node* gen_convert(IrArena* a, BodyBuilder* bb, const Type* t, const Node* value) {
+    return gen_op(a, bb, convert_op, singleton(t), singleton(value));
+}
+
+static const Node* gen_reinterpret(IrArena* a, BodyBuilder* bb, const Type* t, const Node* value) {
+    return gen_op(a, bb, reinterpret_op, singleton(t), singleton(value));
+}
+
+static const Node* gen_join(IrArena* a, BodyBuilder* bb, const Node* lo, const Node* hi) {
+    const Node* shifted = gen_op(a, bb, lshift_op, empty(a), mk_nodes(a, gen_convert(a, bb, uint64_type(a), hi), uint64_literal(a, 32)));
+    return gen_op(a, bb, or_op, empty(a), mk_nodes(a, shifted, gen_convert(a, bb, uint64_type(a), lo)));
+}
+
+static const Node* gen_operand(IrArena* a, BodyBuilder* bb, Form form, bool is_signed, const Node* lo, const Node* hi) {
+    const Type* t = int_type(a, (Int) { .width = IntTy64, .is_signed = is_signed });
+    if (form != ExtendedOperands)
+        return gen_convert(a, bb, t, gen_join(a, bb, lo, hi));
+    if (is_signed)
+        return gen_convert(a, bb, t, gen_reinterpret(a, bb, int32_type(a), lo));
+    return gen_convert(a, bb, t, lo);
+}
+
+/// Everything is built so the result ends up in a u64, which then goes back as the half asked for
+static void build_test(Module* m, const OpTest* test, Form form, const uint64_t* constant, String name) {
+    IrArena* a = get_module_arena(m);
+    Nodes params = mk_nodes(a, varying_param(a, uint32_type(a), "a_lo"), varying_param(a, uint32_type(a), "a_hi"), varying_param(a, uint32_type(a), "b_lo"), varying_param(a, uint32_type(a), "b_hi"), varying_param(a, bool_type(a), "hi"));
+    Node* fn = function(m, params, name, exported(a), singleton(qualified_type(a, (QualifiedType) { .type = uint32_type(a), .is_uniform = false })));
+    BodyBuilder* bb = begin_body(a);
+
+    bool is_signed = test->is_signed;
+    const Type* t = int_type(a, (Int) { .width = IntTy64, .is_signed = is_signed });
+    const Node* x = gen_operand(a, bb, form, is_signed, params.nodes[0], params.nodes[1]);
+    const Node* y = constant ? int_literal(a, (IntLiteral) { .width = IntTy64, .is_signed = is_signed, .value = *constant }) : gen_operand(a, bb, form, is_signed, params.nodes[2], params.nodes[3]);
+    const Node* result = NULL;
+    switch (test->kind) {
+        case Arithm: result = gen_op(a, bb, test->op, empty(a), mk_nodes(a, x, y)); break;
+        case Compare: {
+            const Node* condition = gen_op(a, bb, test->op, empty(a), mk_nodes(a, x, y));
+            result = gen_op(a, bb, select_op, empty(a), mk_nodes(a, condition, uint64_literal(a, 1), uint64_literal(a, 0)));
+            break;
+        }
+        case Unary: result = gen_op(a, bb, test->op, empty(a), singleton(x)); break;
+        case Narrow: result = gen_convert(a, bb, t, gen_convert(a, bb, int_type(a, (Int) { .width = test->narrow_width, .is_signed = is_signed }), x)); break;
+        case Widen: {
+            const Node* narrow = gen_reinterpret(a, bb, int_type(a, (Int) { .width = IntTy32, .is_signed = is_signed }), params.nodes[0]);
+            if (test->narrow_width != IntTy32)
+                narrow = gen_convert(a, bb, int_type(a, (Int) { .width = test->narrow_width, .is_signed = is_signed }), narrow);
+            result = gen_convert(a, bb, t, narrow);
+            break;
+        }
+        case ToDouble: result = gen_reinterpret(a, bb, uint64_type(a), gen_convert(a, bb, fp64_type(a), x)); break;
+        case FromDouble: result = gen_convert(a, bb, t, gen_reinterpret(a, bb, fp64_type(a), gen_join(a, bb, params.nodes[0], params.nodes[1]))); break;
+        case ToFloat: result = gen_reinterpret(a, bb, uint32_type(a), gen_convert(a, bb, fp32_type(a), x)); break;
+        case FromFloat: result = gen_convert(a, bb, t, gen_reinterpret(a, bb, fp32_type(a), params.nodes[0])); break;
+    }
+    if (get_unqualified(result->type) != uint64_type(a))
+        result = gen_convert(a, bb, uint64_type(a), result);
+    const Node* lo = gen_convert(a, bb, uint32_type(a), result);
+    const Node* hi = gen_convert(a, bb, uint32_type(a), gen_op(a, bb, rshift_logical_op, empty(a), mk_nodes(a, result, uint64_literal(a, 32))));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fn, .args = singleton(gen_op(a, bb, select_op, empty(a), mk_nodes(a, params.nodes[4], hi, lo))) }));
+}
+
+static bool takes_constants(const OpTest* test) {
+    if (test->kind != Arithm)
+        return false;
+    switch (test->op) {
+        case add_op:
+        case mul_op:
+        case div_op:
+        case mod_op:
+        case lshift_op:
+        case rshift_logical_op:
+        case rshift_arithm_op: return true;
+        default: return false;
+    }
+}
+
+static bool takes_second_operand(const OpTest* test) {
+    return test->kind == Arithm || test->kind == Compare;
+}
+
+static void emit_harness(FILE* f) {
+    fprintf(f, "\n#include <stdio.h>\n#include <stdint.h>\n\n");
+    fprintf(f, "static const uint64_t edge_values[] = {");
+    for (size_t i = 0; i < EDGE_VALUES_COUNT; i++)
+        fprintf(f, " 0x%llxull,", (unsigned long long) edge_values[i]);
+    fprintf(f, " };\n");
+    fprintf(f, "static const double edge_doubles_values[] = {");
+    for (size_t i = 0; i < EDGE_DOUBLES_COUNT; i++)
+        fprintf(f, " %.17g,", edge_doubles[i]);
+    fprintf(f, " };\n");
+    fprintf(f, "static uint64_t edge_doubles[%d];\n", (int) EDGE_DOUBLES_COUNT);
+    fprintf(f, "static const float edge_floats_values[] = {");
+    for (size_t i = 0; i < EDGE_FLOATS_COUNT; i++)
+        fprintf(f, " %.9g,", edge_floats[i]);
+    fprintf(f, " };\n");
+    fprintf(f, "static uint64_t edge_floats[%d];\n\n", (int) EDGE_FLOATS_COUNT);
+    fprintf(f, "static uint64_t bits(double d) { uint64_t u; memcpy(&u, &d, sizeof(u)); return u; }\n");
+    fprintf(f, "static uint64_t fbits(float d) { uint32_t u; memcpy(&u, &d, sizeof(u)); return u; }\n\n");
+    fprintf(f, "static int check(const char* name, uint32_t (*fn)(uint32_t, uint32_t, uint32_t, uint32_t, bool), uint64_t a, uint64_t b, uint64_t expected) {\n"
+               "    uint32_t a_lo = (uint32_t) a, a_hi = (uint32_t) (a >> 32), b_lo = (uint32_t) b, b_hi = (uint32_t) (b >> 32);\n"
+               "    uint64_t got = fn(a_lo, a_hi, b_lo, b_hi, false) | ((uint64_t) fn(a_lo, a_hi, b_lo, b_hi, true) << 32);\n"
+               "    if (got == expected)\n"
+               "        return 0;\n"
+               "    printf(\"%%s(0x%%llx, 0x%%llx) gave 0x%%llx, expected 0x%%llx\\n\", name, (unsigned long long) a, (unsigned long long) b, (unsigned long long) got, (unsigned long long) expected);\n"
+               "    return 1;\n"
+               "}\n\n");
+}
+
+/// Checks one test function against the reference on every input it is defined for
+static void emit_check(FILE* f, const OpTest* test, Form form, const uint64_t* constant, String name) {
+    String inputs = "edge_values";
+    int inputs_count = (int) EDGE_VALUES_COUNT;
+    if (test->kind == FromDouble) {
+        inputs = "edge_doubles";
+        inputs_count = (int) EDGE_DOUBLES_COUNT;
+    } else if (test->kind == FromFloat) {
+        inputs = "edge_floats";
+        inputs_count = (int) EDGE_FLOATS_COUNT;
+    }
+    fprintf(f, "static int check_%s() {\n", name);
+    fprintf(f, "    int failures = 0;\n");
+    fprintf(f, "    for (int i = 0; i < %d; i++)\n", inputs_count);
+    fprintf(f, "        for (int j = 0; j < %d; j++) {\n", takes_second_operand(test) && !constant ? (int) EDGE_VALUES_COUNT : 1);
+    fprintf(f, "            uint64_t a = %s[i], b = ", inputs);
+    if (constant)
+        fprintf(f, "0x%llxull;\n", (unsigned long long) *constant);
+    else
+        fprintf(f, "edge_values[j];\n");
+    if (form == ExtendedOperands) {
+        String extend = test->is_signed ? "(uint64_t) (int64_t) (int32_t)" : "(uint64_t) (uint32_t)";
+        fprintf(f, "            a = %s a;\n", extend);
+        fprintf(f, "            b = %s b;\n", extend);
+    }
+    fprintf(f, "            int64_t sa = (int64_t) a, sb = (int64_t) b;\n");
+    fprintf(f, "            double da;\n");
+    fprintf(f, "            memcpy(&da, &a, sizeof(da));\n");
+    fprintf(f, "            float fa;\n");
+    fprintf(f, "            uint32_t a_lo = (uint32_t) a;\n");
+    fprintf(f, "            memcpy(&fa, &a_lo, sizeof(fa));\n");
+    fprintf(f, "            (void) sa; (void) sb; (void) da; (void) fa;\n");
+    fprintf(f, "            if (%s)\n", test->guard);
+    fprintf(f, "                failures += check(\"%s\", %s, a, b, %s);\n", name, name, test->reference);
+    fprintf(f, "        }\n");
+    fprintf(f, "    return failures;\n");
+    fprintf(f, "}\n\n");
+}
+
+typedef void (*TestCallback)(void* uptr, const OpTest* test, Form form, const uint64_t* constant, String name);
+
+static void for_each_test(IrArena* a, TestCallback callback, void* uptr) {
+    for (size_t i = 0; i < OP_TESTS_COUNT; i++) {
+        const OpTest* test = &op_tests[i];
+        callback(uptr, test, FullOperands, NULL, test->name);
+        if (takes_second_operand(test))
+            callback(uptr, test, ExtendedOperands, NULL, format_string_interned(a, "%s_ext", test->name));
+        if (takes_constants(test))
+            for (size_t j = 0; j < CONSTANTS_COUNT; j++)
+                callback(uptr, test, ConstantOperand, &constants[j], format_string_interned(a, "%s_k%d", test->name, (int) j));
+    }
+}
+
+static void build_callback(Module* m, const OpTest* test, Form form, const uint64_t* constant, String name) {
+    build_test(m, test, form, constant, name);
+}
+
+static void check_callback(FILE* f, const OpTest* test, Form form, const uint64_t* constant, String name) {
+    emit_check(f, test, form, constant, name);
+}
+
+static void call_callback(FILE* f, const OpTest* test, Form form, const uint64_t* constant, String name) {
+    fprintf(f, "    failures += check_%s();\n", name);
+}
+
+/// Everything after the generated code: the reference checks and a main running them
+static void emit_program(IrArena* a, FILE* f) {
+    emit_harness(f);
+    for_each_test(a, (TestCallback) check_callback, f);
+    fprintf(f, "int main() {\n");
+    fprintf(f, "    generated_init();\n");
+    fprintf(f, "    for (int i = 0; i < %d; i++)\n", (int) EDGE_DOUBLES_COUNT);
+    fprintf(f, "        edge_doubles[i] = bits(edge_doubles_values[i]);\n");
+    fprintf(f, "    for (int i = 0; i < %d; i++)\n", (int) EDGE_FLOATS_COUNT);
+    fprintf(f, "        edge_floats[i] = fbits(edge_floats_values[i]);\n");
+    fprintf(f, "    int failures = 0;\n");
+    for_each_test(a, (TestCallback) call_callback, f);
+    fprintf(f, "    if (failures)\n");
+    fprintf(f, "        printf(\"%%d failures\\n\", failures);\n");
+    fprintf(f, "    return failures != 0;\n");
+    fprintf(f, "}\n");
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_int64 <c compiler>\n"); exit(-1));
+    CompilerConfig config = default_compiler_config();
+    config.dynamic_scheduling = false;
+    config.lower.int64 = true;
+
+    IrArena* initial_arena = new_ir_arena(default_arena_config(&config.target));
+    Module* m = new_module(initial_arena, "int64");
+    for_each_test(initial_arena, (TestCallback) build_callback, m);
+    CHarness harness = { .prelude = "#include <string.h>\n", .emit_harness = (void (*)(void*, FILE*)) emit_program, .uptr = initial_arena, .compiler_flags = "-lm" };
+    CHECK(compile_module_to_c_and_run(argv[1], &config, m, &harness, "test_int64_generated"), exit(-1));
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "c_backend_test.h"
+
+// Runs memcpy and memset through a matrix of sizes, offsets and address spaces, then checks what comes out of the C backend
+// against the same operations done on plain arrays. Constant sizes go through the unrolled and looped lowerings,
+// the others through the loop, and whole-buffer copies through the typed one.
+
+enum {
+    BufferWords = 64,
+    Steps = 256,
+};
+
+static const AddressSpace address_spaces[] = { AsPrivate, AsShared, AsGlobal };
+static const char* address_space_names[] = { "private", "shared", "global" };
+#define ADDRESS_SPACES_COUNT (sizeof(address_spaces) / sizeof(address_spaces[0]))
+
+/// a bit of everything: nothing at all, a single word, a few, a bit more than the unrolling limit and the whole buffer
+static const uint32_t constant_sizes[] = { 0, 4, 12, 36, 68, 100, 4 * BufferWords };
+#define CONSTANT_SIZES_COUNT (sizeof(constant_sizes) / sizeof(constant_sizes[0]))
+
+static uint32_t rng_state = 0x3E3C0DE5;
+
+static uint32_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+typedef struct {
+    Module* m;
+    IrArena* a;
+    const Node* buffers[ADDRESS_SPACES_COUNT];
+} Builder;
+
+static Nodes exported(IrArena* a) {
+    return singleton(annotation(a, (Annotation) { .name = "Exported" }));
+}
+
+static const Node* varying_u32(IrArena* a, String name) {
+    return param(a, qualified_type(a, (QualifiedType) { .type = uint32_type(a), .is_uniform = false }), name);
+}
+
+static const Node* word_ptr(Builder* b, BodyBuilder* bb, size_t as, const Node* offset) {
+    IrArena* a = b->a;
+    return first(bind_instruction(bb, prim_op_helper(a, lea_op, empty(a), mk_nodes(a, ref_decl_helper(a, b->buffers[as]), uint32_literal(a, 0), offset))));
+}
+
+static void finish_fn(Node* fn, BodyBuilder* bb, Nodes results) {
+    fn->payload.fun.body = finish_body(bb, fn_ret(fn->arena, (Return) { .fn = fn, .args = results }));
+}
+
+static void build_accessors(Builder* b, size_t as) {
+    IrArena* a = b->a;
+    const Node* index = varying_u32(a, "index");
+    const Node* value = varying_u32(a, "value");
+    Node* write = function(b->m, mk_nodes(a, index, value), format_string_interned(a, "write_%s", address_space_names[as]), exported(a), empty(a));
+    BodyBuilder* bb = begin_body(a);
+    bind_instruction(bb, prim_op_helper(a, store_op, empty(a), mk_nodes(a, word_ptr(b, bb, as, index), value)));
+    finish_fn(write, bb, empty(a));
+
+    index = varying_u32(a, "index");
+    Node* read = function(b->m, singleton(index), format_string_interned(a, "read_%s", address_space_names[as]), exported(a), singleton(qualified_type(a, (QualifiedType) { .type = uint32_type(a), .is_uniform = false })));
+    bb = begin_body(a);
+    finish_fn(read, bb, bind_instruction(bb, prim_op_helper(a, load_op, empty(a), singleton(word_ptr(b, bb, as, index)))));
+}
+
+/// size is NULL when it is to be passed at runtime
+static void build_copy(Builder* b, size_t dst_as, size_t src_as, const uint32_t* size) {
+    IrArena* a = b->a;
+    const Node* dst_offset = varying_u32(a, "dst_offset");
+    const Node* src_offset = varying_u32(a, "src_offset");
+    const Node* dynamic_size = varying_u32(a, "size");
+    String name = size ? format_string_interned(a, "copy_%s_%s_%d", address_space_names[dst_as], address_space_names[src_as], (int) *size) : format_string_interned(a, "copy_%s_%s", address_space_names[dst_as], address_space_names[src_as]);
+    Node* fn = function(b->m, size ? mk_nodes(a, dst_offset, src_offset) : mk_nodes(a, dst_offset, src_offset, dynamic_size), name, exported(a), empty(a));
+    BodyBuilder* bb = begin_body(a);
+    bind_instruction(bb, prim_op_helper(a, memcpy_op, empty(a), mk_nodes(a, word_ptr(b, bb, dst_as, dst_offset), word_ptr(b, bb, src_as, src_offset), size ? uint64_literal(a, *size) : dynamic_size)));
+    finish_fn(fn, bb, empty(a));
+}
+
+/// Same as build_copy, but in global memory and through pointers to 64-bit words, with offsets to match
+static void build_wide_copy(Builder* b, const uint32_t* size) {
+    IrArena* a = b->a;
+    size_t as = 2;
+    assert(address_spaces[as] == AsGlobal);
+    const Node* offsets[] = { varying_u32(a, "dst_offset"), varying_u32(a, "src_offset") };
+    const Node* dynamic_size = varying_u32(a, "size");
+    String name = size ? format_string_interned(a, "copy_wide_%d", (int) *size) : "copy_wide";
+    Node* fn = function(b->m, size ? mk_nodes(a, offsets[0], offsets[1]) : mk_nodes(a, offsets[0], offsets[1], dynamic_size), name, exported(a), empty(a));
+    BodyBuilder* bb = begin_body(a);
+    const Type* wide_t = ptr_type(a, (PtrType) { .address_space = AsGlobal, .pointed_type = arr_type(a, (ArrType) { .element_type = uint64_type(a), .size = uint32_literal(a, BufferWords / 2) }) });
+    const Node* wide_buffer = first(bind_instruction(bb, prim_op_helper(a, reinterpret_op, singleton(wide_t), singleton(ref_decl_helper(a, b->buffers[as])))));
+    const Node* ptrs[2];
+    for (size_t i = 0; i < 2; i++)
+        ptrs[i] = first(bind_instruction(bb, prim_op_helper(a, lea_op, empty(a), mk_nodes(a, wide_buffer, uint32_literal(a, 0), offsets[i]))));
+    bind_instruction(bb, prim_op_helper(a, memcpy_op, empty(a), mk_nodes(a, ptrs[0], ptrs[1], size ? uint64_literal(a, *size) : dynamic_size)));
+    finish_fn(fn, bb, empty(a));
+}
+
+/// Both sides point to the whole buffer, which makes it a copy of one value
+static void build_copy_all(Builder* b, size_t dst_as, size_t src_as) {
+    IrArena* a = b->a;
+    Node* fn = function(b->m, empty(a), format_string_interned(a, "copy_all_%s_%s", address_space_names[dst_as], address_space_names[src_as]), exported(a), empty(a));
+    BodyBuilder* bb = begin_body(a);
+    bind_instruction(bb, prim_op_helper(a, memcpy_op, empty(a), mk_nodes(a, ref_decl_helper(a, b->buffers[dst_as]), ref_decl_helper(a, b->buffers[src_as]), uint64_literal(a, BufferWords * 4))));
+    finish_fn(fn, bb, empty(a));
+}
+
+static void build_set(Builder* b, size_t as, const uint32_t* size) {
+    IrArena* a = b->a;
+    const Node* offset = varying_u32(a, "offset");
+    const Node* value = param(a, qualified_type(a, (QualifiedType) { .type = uint8_type(a), .is_uniform = false }), "value");
+    const Node* dynamic_size = varying_u32(a, "size");
+    String name = size ? format_string_interned(a, "set_%s_%d", address_space_names[as], (int) *size) : format_string_interned(a, "set_%s", address_space_names[as]);
+    Node* fn = function(b->m, size ? mk_nodes(a, offset, value) : mk_nodes(a, offset, value, dynamic_size), name, exported(a), empty(a));
+    BodyBuilder* bb = begin_body(a);
+    bind_instruction(bb, prim_op_helper(a, memset_op, empty(a), mk_nodes(a, word_ptr(b, bb, as, offset), value, size ? uint64_literal(a, *size) : dynamic_size)));
+    finish_fn(fn, bb, empty(a));
+}
+
+static void build_module(Module* m) {
+    Builder b = { .m = m, .a = get_module_arena(m) };
+    IrArena* a = b.a;
+    for (size_t as = 0; as < ADDRESS_SPACES_COUNT; as++) {
+        b.buffers[as] = global_var(m, empty(a), arr_type(a, (ArrType) { .element_type = uint32_type(a), .size = uint32_literal(a, BufferWords) }), format_string_interned(a, "buffer_%s", address_space_names[as]), address_spaces[as]);
+        build_accessors(&b, as);
+        build_set(&b, as, NULL);
+        for (size_t i = 0; i < CONSTANT_SIZES_COUNT; i++)
+            build_set(&b, as, &constant_sizes[i]);
+    }
+    build_wide_copy(&b, NULL);
+    for (size_t i = 0; i < CONSTANT_SIZES_COUNT; i++)
+        build_wide_copy(&b, &constant_sizes[i]);
+    for (size_t dst = 0; dst < ADDRESS_SPACES_COUNT; dst++) {
+        for (size_t src = 0; src < ADDRESS_SPACES_COUNT; src++) {
+            if (dst != src)
+                build_copy_all(&b, dst, src);
+            build_copy(&b, dst, src, NULL);
+            for (size_t i = 0; i < CONSTANT_SIZES_COUNT; i++)
+                build_copy(&b, dst, src, &constant_sizes[i]);
+        }
+    }
+}
+
+static bool overlaps(uint32_t a, uint32_t b, uint32_t words) {
+    return a < b + words && b < a + words;
+}
+
+static void emit_steps(void* uptr, FILE* f) {
+    fprintf(f, "\nstatic uint32_t reference[%d][%d];\n", (int) ADDRESS_SPACES_COUNT, BufferWords);
+    fprintf(f, "static uint32_t (*read_fns[])(uint32_t) = { ");
+    for (size_t as = 0; as < ADDRESS_SPACES_COUNT; as++)
+        fprintf(f, "read_%s, ", address_space_names[as]);
+    fprintf(f, "};\n\n");
+    fprintf(f, "static int check(int step, const char* what) {\n"
+               "    for (int as = 0; as < %d; as++)\n"
+               "        for (int i = 0; i < %d; i++)\n"
+               "            if (read_fns[as](i) != reference[as][i]) {\n"
+               "                printf(\"after step %%d (%%s): word %%d of buffer %%d is %%x, expected %%x\\n\", step, what, i, as, read_fns[as](i), reference[as][i]);\n"
+               "                return 1;\n"
+               "            }\n"
+               "    return 0;\n"
+               "}\n\n", (int) ADDRESS_SPACES_COUNT, BufferWords);
+    fprintf(f, "int main() {\n");
+    fprintf(f, "    generated_init();\n");
+    for (size_t as = 0; as < ADDRESS_SPACES_COUNT; as++)
+        fprintf(f, "    for (uint32_t i = 0; i < %d; i++) { reference[%d][i] = i * 0x9E3779B9u + %d; write_%s(i, reference[%d][i]); }\n", BufferWords, (int) as, (int) as, address_space_names[as], (int) as);
+    fprintf(f, "    if (check(-1, \"init\")) return 1;\n");
+
+    for (int step = 0; step < Steps; step++) {
+        size_t dst = rng() % ADDRESS_SPACES_COUNT;
+        size_t src = rng() % ADDRESS_SPACES_COUNT;
+        bool dynamic = rng() % 2 == 0;
+        uint32_t size = dynamic ? 4 * (rng() % (BufferWords / 2 + 1)) : constant_sizes[rng() % CONSTANT_SIZES_COUNT];
+        uint32_t words = size / 4;
+        char size_arg[32] = "";
+        char size_suffix[32] = "";
+        if (dynamic)
+            sprintf(size_arg, ", %u", size);
+        else
+            sprintf(size_suffix, "_%u", size);
+        switch (rng() % 4) {
+            case 0: {
+                // memcpy doesn't do overlapping ranges
+                if (dst == src && 2 * words > BufferWords)
+                    src = (dst + 1) % ADDRESS_SPACES_COUNT;
+                uint32_t src_offset, dst_offset;
+                do {
+                    src_offset = rng() % (BufferWords - words + 1);
+                    dst_offset = rng() % (BufferWords - words + 1);
+                } while (dst == src && overlaps(src_offset, dst_offset, words));
+                fprintf(f, "    copy_%s_%s%s(%u, %u%s);\n", address_space_names[dst], address_space_names[src], size_suffix, dst_offset, src_offset, size_arg);
+                fprintf(f, "    memcpy(&reference[%d][%u], &reference[%d][%u], %u);\n", (int) dst, dst_offset, (int) src, src_offset, size);
+                fprintf(f, "    if (check(%d, \"copy_%s_%s%s(%u, %u%s)\")) return 1;\n", step, address_space_names[dst], address_space_names[src], size_suffix, dst_offset, src_offset, size_arg);
+                break;
+            }
+            case 1: {
+                uint32_t offset = rng() % (BufferWords - words + 1);
+                uint8_t value = rng();
+                fprintf(f, "    set_%s%s(%u, %u%s);\n", address_space_names[dst], size_suffix, offset, value, size_arg);
+                fprintf(f, "    memset(&reference[%d][%u], %u, %u);\n", (int) dst, offset, value, size);
+                fprintf(f, "    if (check(%d, \"set_%s%s(%u, %u%s)\")) return 1;\n", step, address_space_names[dst], size_suffix, offset, value, size_arg);
+                break;
+            }
+            case 2: {
+                if (dst == src)
+                    src = (dst + 1) % ADDRESS_SPACES_COUNT;
+                fprintf(f, "    copy_all_%s_%s();\n", address_space_names[dst], address_space_names[src]);
+                fprintf(f, "    memcpy(&reference[%d], &reference[%d], sizeof(reference[0]));\n", (int) dst, (int) src);
+                fprintf(f, "    if (check(%d, \"copy_all_%s_%s\")) return 1;\n", step, address_space_names[dst], address_space_names[src]);
+                break;
+            }
+            case 3: {
+                // offsets are in 64-bit words there
+                if (2 * words > BufferWords)
+                    words = size = 0;
+                uint32_t src_offset, dst_offset;
+                do {
+                    src_offset = rng() % ((BufferWords - words) / 2 + 1);
+                    dst_offset = rng() % ((BufferWords - words) / 2 + 1);
+                } while (overlaps(src_offset * 2, dst_offset * 2, words));
+                if (dynamic)
+                    sprintf(size_arg, ", %u", size);
+                else
+                    sprintf(size_suffix, "_%u", size);
+                fprintf(f, "    copy_wide%s(%u, %u%s);\n", size_suffix, dst_offset, src_offset, size_arg);
+                fprintf(f, "    memcpy(&reference[2][%u], &reference[2][%u], %u);\n", dst_offset * 2, src_offset * 2, size);
+                fprintf(f, "    if (check(%d, \"copy_wide%s(%u, %u%s)\")) return 1;\n", step, size_suffix, dst_offset, src_offset, size_arg);
+                break;
+            }
+        }
+    }
+    fprintf(f, "    return 0;\n}\n");
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_memcpy <c compiler>\n"); exit(-1));
+    CompilerConfig config = default_compiler_config();
+    config.dynamic_scheduling = false;
+
+    IrArena* initial_arena = new_ir_arena(default_arena_config(&config.target));
+    Module* m = new_module(initial_arena, "memcpy");
+    build_module(m);
+    CHarness harness = { .prelude = "#include <string.h>\n", .emit_harness = emit_steps };
+    CHECK(compile_module_to_c_and_run(argv[1], &config, m, &harness, "test_memcpy_generated"), exit(-1));
+    return 0;
+}
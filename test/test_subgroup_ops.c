@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+#include "growy.h"
+#include "util.h"
+
+#include "c_backend_test.h"
+
+// Emulates reductions, scans and shuffles on all sorts of types, then runs what comes out of the C backend with one thread
+// per lane and checks every lane's result against the same operations done on plain arrays.
+// The C backend has no subgroups, the harness brings its own barrier and shuffle.
+
+typedef struct {
+    String name;
+    /// of the emulation, to tell the generated files apart
+    String suffix;
+    size_t subgroup_size;
+    bool native_shuffles;
+} Configuration;
+
+static const Configuration configurations[] = {
+    { "linear, through subgroup memory", "linear_scratchpad", 8, false },
+    { "log-step, through subgroup memory", "log_scratchpad", 32, false },
+    { "log-step, with native shuffles", "log_shuffles", 8, true },
+    { "linear, with native shuffles", "linear_shuffles", 6, true },
+    { "single lane", "single_lane", 1, false },
+};
+#define CONFIGURATIONS_COUNT (sizeof(configurations) / sizeof(configurations[0]))
+
+typedef enum {
+    Arithmetic = 0x1,
+    Bitwise = 0x2,
+} OpKind;
+
+typedef struct {
+    String primop;
+    /// what the reference does to combine two values, NULL for shuffles
+    String combine;
+    OpKind kind;
+} TestedOp;
+
+static const TestedOp ops[] = {
+    { "subgroup_reduce_sum", "add", Arithmetic },
+    { "subgroup_reduce_min", "min", Arithmetic },
+    { "subgroup_reduce_max", "max", Arithmetic },
+    { "subgroup_reduce_and", "and", Bitwise },
+    { "subgroup_reduce_or", "or", Bitwise },
+    { "subgroup_reduce_xor", "xor", Bitwise },
+    { "subgroup_scan_inclusive_sum", "add", Arithmetic },
+    { "subgroup_scan_exclusive_sum", "add", Arithmetic },
+    { "subgroup_shuffle", NULL, Arithmetic | Bitwise },
+};
+#define OPS_COUNT (sizeof(ops) / sizeof(ops[0]))
+
+typedef struct {
+    String slim;
+    String c;
+    OpKind kinds;
+} TestedType;
+
+static const TestedType types[] = {
+    { "u32", "uint32_t", Arithmetic | Bitwise },
+    { "i32", "int32_t", Arithmetic | Bitwise },
+    { "u64", "uint64_t", Arithmetic | Bitwise },
+    { "u16", "uint16_t", Arithmetic | Bitwise },
+    { "f32", "float", Arithmetic },
+    { "Pair", "Pair", Arithmetic | Bitwise },
+};
+#define TYPES_COUNT (sizeof(types) / sizeof(types[0]))
+
+static bool is_tested(size_t op, size_t t) {
+    return (ops[op].kind & types[t].kinds) != 0;
+}
+
+static String test_name(size_t op, size_t t) {
+    return format_string_new("%s_%s", ops[op].primop, types[t].slim);
+}
+
+static char* build_source() {
+    Growy* g = new_growy();
+    growy_append_formatted(g, "type Pair = struct { u32 a; u64 b; };\n\n");
+    for (size_t op = 0; op < OPS_COUNT; op++) {
+        for (size_t t = 0; t < TYPES_COUNT; t++) {
+            if (!is_tested(op, t))
+                continue;
+            String name = test_name(op, t);
+            String args = ops[op].combine ? "x" : "x, lane";
+            growy_append_formatted(g, "@Exported fn test_%s varying %s(varying %s x, varying u32 lane) { return (%s(%s)); }\n", name, types[t].slim, types[t].slim, ops[op].primop, args);
+            free((void*) name);
+        }
+    }
+    growy_append_bytes(g, 1, "\0");
+    return growy_deconstruct(g);
+}
+
+/// Goes in front of the generated code, which uses these
+static const char* prelude =
+    "#include <pthread.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "static _Thread_local uint32_t SubgroupLocalInvocationId;\n"
+    "static const uint32_t SubgroupId = 0;\n"
+    "static pthread_barrier_t barrier;\n"
+    "static uint32_t shuffled[SUBGROUP_SIZE];\n"
+    "\n"
+    "void __shady_subgroup_barrier(void) { pthread_barrier_wait(&barrier); }\n"
+    "\n"
+    "uint32_t __shady_subgroup_shuffle(uint32_t value, uint32_t lane) {\n"
+    "    shuffled[SubgroupLocalInvocationId] = value;\n"
+    "    pthread_barrier_wait(&barrier);\n"
+    "    uint32_t result = shuffled[lane];\n"
+    "    pthread_barrier_wait(&barrier);\n"
+    "    return result;\n"
+    "}\n"
+    "\n";
+
+/// The inputs are small enough for float sums to be exact and for signed ones not to overflow
+static const char* reference =
+    "\n"
+    "static uint32_t lane_of(uint32_t i) { return (i * 5 + 3) % SUBGROUP_SIZE; }\n"
+    "\n"
+    "static uint32_t in_u32(uint32_t i) { return i * 0x9E3779B9u + 7; }\n"
+    "static int32_t in_i32(uint32_t i) { return (int32_t) (i * 37 % 101) - 50; }\n"
+    "static uint64_t in_u64(uint32_t i) { return i * 0x9E3779B97F4A7C15ull + 0xFFFFFFFFull; }\n"
+    "static uint16_t in_u16(uint32_t i) { return (uint16_t) (i * 40503u + 11); }\n"
+    "static float in_f32(uint32_t i) { return (float) (i * 13 % 7) - 2.5f; }\n"
+    "static Pair in_Pair(uint32_t i) { return (Pair) { in_u32(i), in_u64(i + 1) }; }\n"
+    "\n"
+    "#define SCALAR(T, t) \\\n"
+    "static T zero_##t() { return 0; } \\\n"
+    "static T add_##t(T x, T y) { return (T) (x + y); } \\\n"
+    "static T min_##t(T x, T y) { return x < y ? x : y; } \\\n"
+    "static T max_##t(T x, T y) { return x > y ? x : y; } \\\n"
+    "static int eq_##t(T x, T y) { return x == y; }\n"
+    "#define BITWISE(T, t) \\\n"
+    "static T and_##t(T x, T y) { return x & y; } \\\n"
+    "static T or_##t(T x, T y) { return x | y; } \\\n"
+    "static T xor_##t(T x, T y) { return x ^ y; }\n"
+    "SCALAR(uint32_t, u32) BITWISE(uint32_t, u32)\n"
+    "SCALAR(int32_t, i32) BITWISE(int32_t, i32)\n"
+    "SCALAR(uint64_t, u64) BITWISE(uint64_t, u64)\n"
+    "SCALAR(uint16_t, u16) BITWISE(uint16_t, u16)\n"
+    "SCALAR(float, f32)\n"
+    "\n"
+    "#define PAIRWISE(op) static Pair op##_Pair(Pair x, Pair y) { return (Pair) { op##_u32(x.a, y.a), op##_u64(x.b, y.b) }; }\n"
+    "static Pair zero_Pair() { return (Pair) { 0, 0 }; }\n"
+    "PAIRWISE(add) PAIRWISE(min) PAIRWISE(max) PAIRWISE(and) PAIRWISE(or) PAIRWISE(xor)\n"
+    "static int eq_Pair(Pair x, Pair y) { return x.a == y.a && x.b == y.b; }\n"
+    "\n";
+
+/// Every lane calls every test, in the same order, the emulation needs the whole subgroup to show up
+static void emit_harness(void* uptr, FILE* f) {
+    fputs(reference, f);
+    for (size_t op = 0; op < OPS_COUNT; op++)
+        for (size_t t = 0; t < TYPES_COUNT; t++)
+            if (is_tested(op, t)) {
+                String name = test_name(op, t);
+                fprintf(f, "static %s results_%s[SUBGROUP_SIZE];\n", types[t].c, name);
+                free((void*) name);
+            }
+
+    fprintf(f, "\nstatic void* run_lane(void* arg) {\n");
+    fprintf(f, "    uint32_t i = (uint32_t) (uintptr_t) arg;\n");
+    fprintf(f, "    SubgroupLocalInvocationId = i;\n");
+    for (size_t op = 0; op < OPS_COUNT; op++)
+        for (size_t t = 0; t < TYPES_COUNT; t++)
+            if (is_tested(op, t)) {
+                String name = test_name(op, t);
+                fprintf(f, "    results_%s[i] = test_%s(in_%s(i), lane_of(i));\n", name, name, types[t].slim);
+                free((void*) name);
+            }
+    fprintf(f, "    return NULL;\n");
+    fprintf(f, "}\n\n");
+
+    fprintf(f, "int main() {\n");
+    fprintf(f, "    generated_init();\n");
+    fprintf(f, "    pthread_barrier_init(&barrier, NULL, SUBGROUP_SIZE);\n");
+    fprintf(f, "    pthread_t lanes[SUBGROUP_SIZE];\n");
+    fprintf(f, "    for (uint32_t i = 0; i < SUBGROUP_SIZE; i++)\n");
+    fprintf(f, "        pthread_create(&lanes[i], NULL, run_lane, (void*) (uintptr_t) i);\n");
+    fprintf(f, "    for (uint32_t i = 0; i < SUBGROUP_SIZE; i++)\n");
+    fprintf(f, "        pthread_join(lanes[i], NULL);\n");
+    fprintf(f, "    int failures = 0;\n");
+    for (size_t op = 0; op < OPS_COUNT; op++) {
+        for (size_t t = 0; t < TYPES_COUNT; t++) {
+            if (!is_tested(op, t))
+                continue;
+            String name = test_name(op, t);
+            String ty = types[t].slim;
+            String combine = ops[op].combine;
+            fprintf(f, "    for (uint32_t i = 0; i < SUBGROUP_SIZE; i++) {\n");
+            if (!combine)
+                fprintf(f, "        %s expected = in_%s(lane_of(i));\n", types[t].c, ty);
+            else {
+                // reductions see every lane, inclusive scans the ones up to theirs and exclusive ones those before it
+                String bound = strstr(ops[op].primop, "reduce") ? "SUBGROUP_SIZE" : strstr(ops[op].primop, "inclusive") ? "i + 1" : "i";
+                bool from_zero = strstr(ops[op].primop, "scan");
+                fprintf(f, "        %s expected = %s_%s(%s);\n", types[t].c, from_zero ? "zero" : "in", ty, from_zero ? "" : "0");
+                fprintf(f, "        for (uint32_t j = %d; j < %s; j++)\n", from_zero ? 0 : 1, bound);
+                fprintf(f, "            expected = %s_%s(expected, in_%s(j));\n", combine, ty, ty);
+            }
+            fprintf(f, "        if (!eq_%s(results_%s[i], expected)) {\n", ty, name);
+            fprintf(f, "            printf(\"%s: lane %%d got the wrong result\\n\", (int) i);\n", name);
+            fprintf(f, "            failures++;\n");
+            fprintf(f, "        }\n");
+            fprintf(f, "    }\n");
+            free((void*) name);
+        }
+    }
+    fprintf(f, "    if (failures)\n");
+    fprintf(f, "        printf(\"%%d failures\\n\", failures);\n");
+    fprintf(f, "    return failures != 0;\n");
+    fprintf(f, "}\n");
+}
+
+static bool compile_and_run(String compiler, const char* source, Configuration configuration) {
+    info_print("Emulating subgroup ops: %s\n", configuration.name);
+    CompilerConfig config = default_compiler_config();
+    config.dynamic_scheduling = false;
+    config.lower.emulate_subgroup_ops = true;
+    config.lower.native_subgroup_shuffles = configuration.native_shuffles;
+    // the harness only shuffles 32-bit words
+    config.lower.emulate_subgroup_ops_extended_types = true;
+    config.specialization.subgroup_size = configuration.subgroup_size;
+
+    Module* m = NULL;
+    CHECK(driver_load_source_file(&config, SrcSlim, strlen(source), source, "subgroup_ops", &m) == NoError, return false);
+    char* sized_prelude = format_string_new("#define SUBGROUP_SIZE %d\n%s", (int) configuration.subgroup_size, prelude);
+    CHarness harness = { .prelude = sized_prelude, .emit_harness = emit_harness, .compiler_flags = "-pthread" };
+    char name[64];
+    sprintf(name, "test_subgroup_ops_%s", configuration.suffix);
+    bool ok = compile_module_to_c_and_run(compiler, &config, m, &harness, name);
+    free(sized_prelude);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_subgroup_ops <c compiler>\n"); exit(-1));
+    char* source = build_source();
+    for (size_t i = 0; i < CONFIGURATIONS_COUNT; i++)
+        CHECK(compile_and_run(argv[1], source, configurations[i]), exit(-1));
+    free(source);
+    return 0;
+}
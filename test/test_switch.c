@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shady/ir.h"
+#include "shady/driver.h"
+
+#include "log.h"
+#include "portability.h"
+
+#include "c_backend_test.h"
+
+// Builds switches on randomised sets of keys of every integer width, then checks what comes out of the C backend against
+// the keys, once with the lowering in lower_switch_btree and once with the switches left to the backend.
+
+enum {
+    CaseSets = 32,
+    MaxCases = 64,
+    Targets = 6,
+    RandomProbes = 16,
+    DefaultValue = 0xDEAD,
+};
+
+/// Keys are kept zero-extended from their width, like IntLiteral values
+typedef struct {
+    IntSizes width;
+    bool is_signed;
+    size_t count;
+    uint64_t keys[MaxCases];
+    uint32_t values[MaxCases];
+} CaseSet;
+
+static uint32_t rng_state = 0x5EED5EED;
+
+static uint32_t rng() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint64_t rng64() {
+    uint64_t hi = rng();
+    return hi << 32 | rng();
+}
+
+static uint64_t get_key_mask(const CaseSet* set) {
+    switch (set->width) {
+        case IntTy8: return UINT8_MAX;
+        case IntTy16: return UINT16_MAX;
+        case IntTy32: return UINT32_MAX;
+        case IntTy64: return UINT64_MAX;
+    }
+    SHADY_UNREACHABLE;
+}
+
+static bool has_key(const CaseSet* set, uint64_t key) {
+    for (size_t i = 0; i < set->count; i++)
+        if (set->keys[i] == key)
+            return true;
+    return false;
+}
+
+/// Mixes dense runs, runs going to the same place, small clumps and lone far away keys so every strategy gets picked
+static void generate_case_set(CaseSet* set, IntSizes width) {
+    set->width = width;
+    set->is_signed = rng() % 2 == 0;
+    set->count = 0;
+    uint64_t mask = get_key_mask(set);
+    uint64_t base = rng() % 4 == 0 ? rng64() : rng() % 64;
+    size_t runs = 1 + rng() % 5;
+    for (size_t run = 0; run < runs; run++) {
+        uint64_t key = rng() % 3 == 0 ? rng64() : base + rng() % 256;
+        size_t length = 1 + rng() % 20;
+        uint64_t stride = rng() % 3 == 0 ? 1 + rng() % 6 : 1;
+        uint32_t value = 100 + rng() % Targets;
+        bool shared_target = rng() % 2 == 0;
+        for (size_t i = 0; i < length && set->count < MaxCases; i++, key += stride) {
+            key &= mask;
+            if (has_key(set, key))
+                continue;
+            set->keys[set->count] = key;
+            set->values[set->count] = shared_target ? value : 100 + rng() % Targets;
+            set->count++;
+        }
+    }
+}
+
+/// A dense run of 64-bit keys up to the largest one, the lowering has to stop right there.
+/// Up to three targets get a bit test, more than that a table.
+static void generate_top_case_set(CaseSet* set, bool is_signed, uint32_t targets) {
+    set->width = IntTy64;
+    set->is_signed = is_signed;
+    set->count = 0;
+    uint64_t max = is_signed ? INT64_MAX : UINT64_MAX;
+    for (uint64_t key = max - 11; key <= max - 1; key++) {
+        set->keys[set->count] = key;
+        set->values[set->count++] = 100 + key % targets;
+    }
+    set->keys[set->count] = max;
+    set->values[set->count++] = 100 + max % targets;
+}
+
+static uint32_t lookup(const CaseSet* set, uint64_t key) {
+    for (size_t i = 0; i < set->count; i++)
+        if (set->keys[i] == key)
+            return set->values[i];
+    return DefaultValue;
+}
+
+static void build_switch_fn(Module* m, const CaseSet* set, String name) {
+    IrArena* a = get_module_arena(m);
+    const Type* t = qualified_type(a, (QualifiedType) { .type = uint32_type(a), .is_uniform = false });
+    const Type* inspectee_t = qualified_type(a, (QualifiedType) { .type = int_type(a, (Int) { .width = set->width, .is_signed = set->is_signed }), .is_uniform = false });
+    const Node* x = param(a, inspectee_t, "x");
+    // we don't want lower_cf_instrs to get rid of the match before we get to see it
+    Nodes annotations = mk_nodes(a, annotation(a, (Annotation) { .name = "Exported" }), annotation(a, (Annotation) { .name = "Structured" }));
+    Node* fn = function(m, singleton(x), name, annotations, singleton(t));
+
+    LARRAY(const Node*, literals, set->count);
+    LARRAY(const Node*, cases, set->count);
+    for (size_t i = 0; i < set->count; i++) {
+        literals[i] = int_literal(a, (IntLiteral) { .width = set->width, .is_signed = set->is_signed, .value = set->keys[i] });
+        cases[i] = case_(a, empty(a), yield(a, (Yield) { .args = singleton(uint32_literal(a, set->values[i])) }));
+    }
+
+    BodyBuilder* bb = begin_body(a);
+    Nodes results = bind_instruction(bb, match_instr(a, (Match) {
+        .yield_types = singleton(uint32_type(a)),
+        .inspect = x,
+        .literals = nodes(a, set->count, literals),
+        .cases = nodes(a, set->count, cases),
+        .default_case = case_(a, empty(a), yield(a, (Yield) { .args = singleton(uint32_literal(a, DefaultValue)) })),
+    }));
+    fn->payload.fun.body = finish_body(bb, fn_ret(a, (Return) { .fn = fn, .args = results }));
+}
+
+/// The keys themselves, their neighbours, the extremes and a few random values
+static size_t generate_probes(const CaseSet* set, uint64_t* probes) {
+    uint64_t mask = get_key_mask(set);
+    size_t count = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        probes[count++] = set->keys[i];
+        probes[count++] = (set->keys[i] - 1) & mask;
+        probes[count++] = (set->keys[i] + 1) & mask;
+    }
+    probes[count++] = 0;
+    probes[count++] = mask;
+    for (size_t i = 0; i < RandomProbes; i++)
+        probes[count++] = rng64() & mask;
+    return count;
+}
+
+typedef struct {
+    const CaseSet* sets;
+    uint64_t* const* probes;
+    const size_t* probes_counts;
+} Probes;
+
+static void emit_harness(const Probes* p, FILE* f) {
+    fprintf(f, "\nint main() {\n");
+    for (size_t i = 0; i < CaseSets; i++) {
+        for (size_t j = 0; j < p->probes_counts[i]; j++) {
+            uint64_t probe = p->probes[i][j];
+            // converting the bit pattern to the parameter's type keeps the bits that matter
+            char arg[48];
+            sprintf(arg, "%lluull", (unsigned long long) probe);
+            fprintf(f, "    if (switch_%d(%s) != %uu) { printf(\"switch_%d(%s) = %%u, expected %u\\n\", switch_%d(%s)); return 1; }\n", (int) i, arg, lookup(&p->sets[i], probe), (int) i, arg, lookup(&p->sets[i], probe), (int) i, arg);
+        }
+    }
+    fprintf(f, "    return 0;\n}\n");
+}
+
+static bool compile_and_run(String compiler, bool native_switches, const Probes* p) {
+    CompilerConfig config = default_compiler_config();
+    config.dynamic_scheduling = false;
+    config.lower.native_switches = native_switches;
+
+    IrArena* initial_arena = new_ir_arena(default_arena_config(&config.target));
+    Module* m = new_module(initial_arena, "switches");
+    for (size_t i = 0; i < CaseSets; i++) {
+        char fn_name[32];
+        sprintf(fn_name, "switch_%d", (int) i);
+        build_switch_fn(m, &p->sets[i], string(initial_arena, fn_name));
+    }
+    CHarness harness = { .emit_harness = (void (*)(void*, FILE*)) emit_harness, .uptr = (void*) p };
+    return compile_module_to_c_and_run(compiler, &config, m, &harness, native_switches ? "test_switch_native" : "test_switch_lowered");
+}
+
+int main(int argc, char** argv) {
+    CHECK(argc == 2, error_print("Usage: test_switch <c compiler>\n"); exit(-1));
+    CaseSet sets[CaseSets];
+    uint64_t* probes[CaseSets];
+    size_t probes_counts[CaseSets];
+    static const IntSizes widths[] = { IntTy8, IntTy16, IntTy32, IntTy64 };
+    for (size_t i = 0; i < CaseSets; i++) {
+        if (i < 4)
+            generate_top_case_set(&sets[i], i % 2 == 1, i < 2 ? 2 : 4);
+        else
+            generate_case_set(&sets[i], widths[i % 4]);
+        probes[i] = malloc(sizeof(uint64_t) * (MaxCases * 3 + 2 + RandomProbes));
+        probes_counts[i] = generate_probes(&sets[i], probes[i]);
+    }
+
+    Probes p = { sets, probes, probes_counts };
+    bool ok = compile_and_run(argv[1], false, &p);
+    ok &= compile_and_run(argv[1], true, &p);
+
+    for (size_t i = 0; i < CaseSets; i++)
+        free(probes[i]);
+    return ok ? 0 : 1;
+}